@@ -0,0 +1,580 @@
+// ネットワークストレージ（SMB/NFS）の遅さを再現するLD_PRELOAD用ライブラリ（テスト専用）
+//
+// 使い方:
+//   export LATENCY_SHIM_PREFIXES=/data/in:/data/out LATENCY_SHIM_LATENCY_MS=2
+//   LD_PRELOAD=./liblatency_shim.so ./SnappyMaker ...
+//
+// 環境変数:
+//   LATENCY_SHIM_PREFIXES       対象のパスの先頭（':'区切り、必須）
+//   LATENCY_SHIM_LATENCY_MS     1操作あたりの遅延（open, read, write, unlink, stat など）
+//   LATENCY_SHIM_LIST_MS        opendirの遅延（既定はLATENCY_SHIM_LATENCY_MS）
+//   LATENCY_SHIM_JITTER_MS      遅延に加える指数分布のばらつき（平均）
+//   LATENCY_SHIM_BANDWIDTH_MBPS read/write（pread/pwriteを含む）の帯域上限（プロセス全体で共有、0なら無制限）
+//   LATENCY_SHIM_ERROR_RATE     open/read/write/pread/pwrite/unlink/renameがEIOで失敗する確率（0〜1）
+//   LATENCY_SHIM_VERBOSE        1なら設定を標準エラーに出力
+
+// 標準ヘッダーのインライン版（_FORTIFY_SOURCE）とぶつからないようにする
+#undef _FORTIFY_SOURCE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// stat系はヘッダーのバージョンによって宣言が異なるため、構造体は前方宣言だけで扱う
+struct stat;
+struct stat64;
+struct statx;
+
+namespace
+{
+
+struct Settings
+{
+    std::vector<std::string> prefixes;
+    double latencyMs = 0;
+    double listMs = 0;
+    double jitterMs = 0;
+    double bandwidthMBps = 0;
+    double errorRate = 0;
+};
+
+double envDouble(const char *name, double fallback)
+{
+    const char *value = std::getenv(name);
+    return value && *value ? std::atof(value) : fallback;
+}
+
+const Settings &settings()
+{
+    static const Settings instance = []
+    {
+        Settings s;
+        if (const char *prefixes = std::getenv("LATENCY_SHIM_PREFIXES"))
+        {
+            std::string list = prefixes;
+            size_t start = 0;
+            while (start <= list.size())
+            {
+                size_t end = list.find(':', start);
+                if (end == std::string::npos)
+                    end = list.size();
+                std::string prefix = list.substr(start, end - start);
+                while (prefix.size() > 1 && prefix.back() == '/')
+                    prefix.pop_back();
+                if (!prefix.empty())
+                    s.prefixes.push_back(prefix);
+                start = end + 1;
+            }
+        }
+        s.latencyMs = envDouble("LATENCY_SHIM_LATENCY_MS", 0);
+        s.listMs = envDouble("LATENCY_SHIM_LIST_MS", s.latencyMs);
+        s.jitterMs = envDouble("LATENCY_SHIM_JITTER_MS", 0);
+        s.bandwidthMBps = envDouble("LATENCY_SHIM_BANDWIDTH_MBPS", 0);
+        s.errorRate = envDouble("LATENCY_SHIM_ERROR_RATE", 0);
+        if (envDouble("LATENCY_SHIM_VERBOSE", 0) > 0)
+        {
+            std::fprintf(stderr, "latency_shim: %zu prefix(es), latency %.2f ms, list %.2f ms, jitter %.2f ms, "
+                                 "bandwidth %.1f MB/s, error rate %.4f\n",
+                         s.prefixes.size(), s.latencyMs, s.listMs, s.jitterMs, s.bandwidthMBps, s.errorRate);
+        }
+        return s;
+    }();
+    return instance;
+}
+
+// 対象のファイルディスクリプタ（open時に登録し、close時に外す）
+const int maxTrackedFd = 1 << 16;
+std::atomic<bool> trackedFds[maxTrackedFd];
+
+bool isTracked(int fd)
+{
+    return fd >= 0 && fd < maxTrackedFd && trackedFds[fd].load(std::memory_order_relaxed);
+}
+
+void setTracked(int fd, bool tracked)
+{
+    if (fd >= 0 && fd < maxTrackedFd)
+        trackedFds[fd].store(tracked, std::memory_order_relaxed);
+}
+
+// パスが対象の先頭に一致するか（相対パスはカレントディレクトリから解決する）
+bool matches(const char *path)
+{
+    const Settings &s = settings();
+    if (!path || s.prefixes.empty())
+        return false;
+    std::string full = path;
+    if (path[0] != '/')
+    {
+        char cwd[4096];
+        if (!getcwd(cwd, sizeof(cwd)))
+            return false;
+        full = std::string(cwd) + "/" + path;
+    }
+    for (const auto &prefix : s.prefixes)
+    {
+        if (full.compare(0, prefix.size(), prefix) == 0 &&
+            (full.size() == prefix.size() || full[prefix.size()] == '/' || prefix == "/"))
+            return true;
+    }
+    return false;
+}
+
+std::mt19937 &rng()
+{
+    thread_local std::mt19937 generator(std::random_device{}());
+    return generator;
+}
+
+void sleepMs(double ms)
+{
+    if (ms > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(static_cast<int64_t>(ms * 1000)));
+}
+
+// 1操作分の遅延（ばらつきは指数分布）
+void delay(double baseMs)
+{
+    double ms = baseMs;
+    const Settings &s = settings();
+    if (s.jitterMs > 0)
+        ms += std::exponential_distribution<double>(1.0 / s.jitterMs)(rng());
+    sleepMs(ms);
+}
+
+// 帯域上限（プロセス全体で一本の回線を共有するとみなす）
+void transfer(size_t bytes)
+{
+    const Settings &s = settings();
+    if (s.bandwidthMBps <= 0 || bytes == 0)
+        return;
+    using Clock = std::chrono::steady_clock;
+    static std::mutex mutex;
+    static Clock::time_point nextFree;
+    auto duration = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(bytes / (s.bandwidthMBps * 1048576.0)));
+    Clock::time_point done;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        nextFree = std::max(nextFree, Clock::now()) + duration;
+        done = nextFree;
+    }
+    std::this_thread::sleep_until(done);
+}
+
+// エラーを発生させるか
+bool injectError()
+{
+    double rate = settings().errorRate;
+    if (rate <= 0 || std::uniform_real_distribution<double>(0.0, 1.0)(rng()) >= rate)
+        return false;
+    errno = EIO;
+    return true;
+}
+
+template <typename Function>
+Function real(const char *name)
+{
+    return reinterpret_cast<Function>(dlsym(RTLD_NEXT, name));
+}
+
+// openの第3引数はO_CREAT/O_TMPFILEのときだけ渡される
+bool needsMode(int flags)
+{
+#ifdef O_TMPFILE
+    return (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE;
+#else
+    return (flags & O_CREAT) != 0;
+#endif
+}
+
+using OpenFunction = int (*)(const char *, int, ...);
+using OpenatFunction = int (*)(int, const char *, int, ...);
+using FopenFunction = FILE *(*)(const char *, const char *);
+
+int openCommon(OpenFunction function, const char *path, int flags, mode_t mode)
+{
+    if (!matches(path))
+        return function(path, flags, mode);
+    delay(settings().latencyMs);
+    if (injectError())
+        return -1;
+    int fd = function(path, flags, mode);
+    setTracked(fd, fd >= 0);
+    return fd;
+}
+
+int openatCommon(OpenatFunction function, int dirfd, const char *path, int flags, mode_t mode)
+{
+    // 相対パスはカレントディレクトリ基準のときだけ判定する
+    bool target = path && (path[0] == '/' || dirfd == AT_FDCWD) && matches(path);
+    if (!target)
+        return function(dirfd, path, flags, mode);
+    delay(settings().latencyMs);
+    if (injectError())
+        return -1;
+    int fd = function(dirfd, path, flags, mode);
+    setTracked(fd, fd >= 0);
+    return fd;
+}
+
+FILE *fopenCommon(FopenFunction function, const char *path, const char *modeString)
+{
+    if (!matches(path))
+        return function(path, modeString);
+    delay(settings().latencyMs);
+    if (injectError())
+        return nullptr;
+    FILE *file = function(path, modeString);
+    if (file)
+        setTracked(fileno(file), true);
+    return file;
+}
+
+// パスだけを受け取る操作（stat系、unlinkなど）
+template <typename Function, typename... Args>
+int pathCall(Function function, bool errors, const char *path, Args... args)
+{
+    if (matches(path))
+    {
+        delay(settings().latencyMs);
+        if (errors && injectError())
+            return -1;
+    }
+    return function(path, args...);
+}
+
+// pread/pwrite とその64ビット版の共通部分
+template <typename Offset>
+ssize_t preadCommon(ssize_t (*function)(int, void *, size_t, Offset), int fd, void *buffer, size_t count, Offset offset)
+{
+    if (!isTracked(fd))
+        return function(fd, buffer, count, offset);
+    delay(settings().latencyMs);
+    if (injectError())
+        return -1;
+    ssize_t n = function(fd, buffer, count, offset);
+    if (n > 0)
+        transfer(static_cast<size_t>(n));
+    return n;
+}
+
+template <typename Offset>
+ssize_t pwriteCommon(ssize_t (*function)(int, const void *, size_t, Offset), int fd, const void *buffer, size_t count,
+                     Offset offset)
+{
+    if (!isTracked(fd))
+        return function(fd, buffer, count, offset);
+    delay(settings().latencyMs);
+    if (injectError())
+        return -1;
+    transfer(count);
+    return function(fd, buffer, count, offset);
+}
+
+} // namespace
+
+extern "C"
+{
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    if (needsMode(flags))
+    {
+        va_list args;
+        va_start(args, flags);
+        mode = static_cast<mode_t>(va_arg(args, int));
+        va_end(args);
+    }
+    static auto function = real<OpenFunction>("open");
+    return openCommon(function, path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    if (needsMode(flags))
+    {
+        va_list args;
+        va_start(args, flags);
+        mode = static_cast<mode_t>(va_arg(args, int));
+        va_end(args);
+    }
+    static auto function = real<OpenFunction>("open64");
+    return openCommon(function, path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    if (needsMode(flags))
+    {
+        va_list args;
+        va_start(args, flags);
+        mode = static_cast<mode_t>(va_arg(args, int));
+        va_end(args);
+    }
+    static auto function = real<OpenatFunction>("openat");
+    return openatCommon(function, dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    if (needsMode(flags))
+    {
+        va_list args;
+        va_start(args, flags);
+        mode = static_cast<mode_t>(va_arg(args, int));
+        va_end(args);
+    }
+    static auto function = real<OpenatFunction>("openat64");
+    return openatCommon(function, dirfd, path, flags, mode);
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+    static auto function = real<FopenFunction>("fopen");
+    return fopenCommon(function, path, mode);
+}
+
+FILE *fopen64(const char *path, const char *mode)
+{
+    static auto function = real<FopenFunction>("fopen64");
+    return fopenCommon(function, path, mode);
+}
+
+int close(int fd)
+{
+    static auto function = real<int (*)(int)>("close");
+    setTracked(fd, false);
+    return function(fd);
+}
+
+int fclose(FILE *file)
+{
+    static auto function = real<int (*)(FILE *)>("fclose");
+    if (file)
+        setTracked(fileno(file), false);
+    return function(file);
+}
+
+ssize_t read(int fd, void *buffer, size_t count)
+{
+    static auto function = real<ssize_t (*)(int, void *, size_t)>("read");
+    if (!isTracked(fd))
+        return function(fd, buffer, count);
+    delay(settings().latencyMs);
+    if (injectError())
+        return -1;
+    ssize_t n = function(fd, buffer, count);
+    if (n > 0)
+        transfer(static_cast<size_t>(n));
+    return n;
+}
+
+ssize_t write(int fd, const void *buffer, size_t count)
+{
+    static auto function = real<ssize_t (*)(int, const void *, size_t)>("write");
+    if (!isTracked(fd))
+        return function(fd, buffer, count);
+    delay(settings().latencyMs);
+    if (injectError())
+        return -1;
+    transfer(count);
+    return function(fd, buffer, count);
+}
+
+// libstdc++のストリームは大きな書き込みにwritevを使う
+ssize_t readv(int fd, const struct iovec *iov, int count)
+{
+    static auto function = real<ssize_t (*)(int, const struct iovec *, int)>("readv");
+    if (!isTracked(fd))
+        return function(fd, iov, count);
+    delay(settings().latencyMs);
+    if (injectError())
+        return -1;
+    ssize_t n = function(fd, iov, count);
+    if (n > 0)
+        transfer(static_cast<size_t>(n));
+    return n;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int count)
+{
+    static auto function = real<ssize_t (*)(int, const struct iovec *, int)>("writev");
+    if (!isTracked(fd))
+        return function(fd, iov, count);
+    delay(settings().latencyMs);
+    if (injectError())
+        return -1;
+    size_t bytes = 0;
+    for (int i = 0; i < count; ++i)
+        bytes += iov[i].iov_len;
+    transfer(bytes);
+    return function(fd, iov, count);
+}
+
+// 位置を指定する読み書き（DirectFileSink は pwrite だけで書く）
+ssize_t pread(int fd, void *buffer, size_t count, off_t offset)
+{
+    static auto function = real<ssize_t (*)(int, void *, size_t, off_t)>("pread");
+    return preadCommon(function, fd, buffer, count, offset);
+}
+
+ssize_t pread64(int fd, void *buffer, size_t count, off64_t offset)
+{
+    static auto function = real<ssize_t (*)(int, void *, size_t, off64_t)>("pread64");
+    return preadCommon(function, fd, buffer, count, offset);
+}
+
+ssize_t pwrite(int fd, const void *buffer, size_t count, off_t offset)
+{
+    static auto function = real<ssize_t (*)(int, const void *, size_t, off_t)>("pwrite");
+    return pwriteCommon(function, fd, buffer, count, offset);
+}
+
+ssize_t pwrite64(int fd, const void *buffer, size_t count, off64_t offset)
+{
+    static auto function = real<ssize_t (*)(int, const void *, size_t, off64_t)>("pwrite64");
+    return pwriteCommon(function, fd, buffer, count, offset);
+}
+
+// stdioの読み書きはglibc内部でreadを呼ぶため、ここで遅延を加える
+size_t fread(void *buffer, size_t size, size_t count, FILE *file)
+{
+    static auto function = real<size_t (*)(void *, size_t, size_t, FILE *)>("fread");
+    if (!isTracked(fileno(file)))
+        return function(buffer, size, count, file);
+    delay(settings().latencyMs);
+    size_t n = function(buffer, size, count, file);
+    transfer(n * size);
+    return n;
+}
+
+size_t fwrite(const void *buffer, size_t size, size_t count, FILE *file)
+{
+    static auto function = real<size_t (*)(const void *, size_t, size_t, FILE *)>("fwrite");
+    if (!isTracked(fileno(file)))
+        return function(buffer, size, count, file);
+    delay(settings().latencyMs);
+    transfer(size * count);
+    return function(buffer, size, count, file);
+}
+
+int unlink(const char *path)
+{
+    static auto function = real<int (*)(const char *)>("unlink");
+    return pathCall(function, true, path);
+}
+
+int remove(const char *path)
+{
+    static auto function = real<int (*)(const char *)>("remove");
+    return pathCall(function, true, path);
+}
+
+int rename(const char *from, const char *to)
+{
+    static auto function = real<int (*)(const char *, const char *)>("rename");
+    if (matches(from) || matches(to))
+    {
+        delay(settings().latencyMs);
+        if (injectError())
+            return -1;
+    }
+    return function(from, to);
+}
+
+int stat(const char *path, struct stat *buffer)
+{
+    static auto function = real<int (*)(const char *, struct stat *)>("stat");
+    return pathCall(function, false, path, buffer);
+}
+
+int lstat(const char *path, struct stat *buffer)
+{
+    static auto function = real<int (*)(const char *, struct stat *)>("lstat");
+    return pathCall(function, false, path, buffer);
+}
+
+int stat64(const char *path, struct stat64 *buffer)
+{
+    static auto function = real<int (*)(const char *, struct stat64 *)>("stat64");
+    return pathCall(function, false, path, buffer);
+}
+
+int lstat64(const char *path, struct stat64 *buffer)
+{
+    static auto function = real<int (*)(const char *, struct stat64 *)>("lstat64");
+    return pathCall(function, false, path, buffer);
+}
+
+// glibc 2.33より前はstat系がこれらの関数を経由する
+int __xstat(int version, const char *path, struct stat *buffer)
+{
+    static auto function = real<int (*)(int, const char *, struct stat *)>("__xstat");
+    if (matches(path))
+        delay(settings().latencyMs);
+    return function(version, path, buffer);
+}
+
+int __lxstat(int version, const char *path, struct stat *buffer)
+{
+    static auto function = real<int (*)(int, const char *, struct stat *)>("__lxstat");
+    if (matches(path))
+        delay(settings().latencyMs);
+    return function(version, path, buffer);
+}
+
+int __xstat64(int version, const char *path, struct stat64 *buffer)
+{
+    static auto function = real<int (*)(int, const char *, struct stat64 *)>("__xstat64");
+    if (matches(path))
+        delay(settings().latencyMs);
+    return function(version, path, buffer);
+}
+
+int __lxstat64(int version, const char *path, struct stat64 *buffer)
+{
+    static auto function = real<int (*)(int, const char *, struct stat64 *)>("__lxstat64");
+    if (matches(path))
+        delay(settings().latencyMs);
+    return function(version, path, buffer);
+}
+
+int statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *buffer)
+{
+    static auto function = real<int (*)(int, const char *, int, unsigned int, struct statx *)>("statx");
+    if (path && (path[0] == '/' || dirfd == AT_FDCWD) && matches(path))
+        delay(settings().latencyMs);
+    return function(dirfd, path, flags, mask, buffer);
+}
+
+DIR *opendir(const char *path)
+{
+    static auto function = real<DIR *(*)(const char *)>("opendir");
+    if (matches(path))
+        delay(settings().listMs);
+    return function(path);
+}
+
+} // extern "C"
@@ -14,7 +14,55 @@
 #include <regex>
 #include <snappy.h>
 #include <queue>
+#include <deque>
+#include <list>
 #include <condition_variable>
+#include <functional>
+#include <array>
+#include <tuple>
+#include <sstream>
+#include <iomanip>
+#include <atomic>
+#include <cmath>
+#include <ctime>
+#include <cctype>
+#include <cstdio>
+#include <random>
+#include <csignal>
+#ifdef SNAPPY_MAKER_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+using socket_t = SOCKET;
+const socket_t invalidSocket = INVALID_SOCKET;
+#else
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using socket_t = int;
+const socket_t invalidSocket = -1;
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sched.h>
+#include <pthread.h>
+#endif
 
 // ファイルシステム名前空間のエイリアス
 namespace fs = std::filesystem;
@@ -27,6 +75,751 @@ std::mutex cout_mutex;
         std::cout << msg << std::endl;                \
     }
 
+// タスクの種類（種類ごとにCPUとI/Oの優先度を設定できる）
+enum class TaskClass
+{
+    Compress,   // セットの圧縮・書き出し
+    Delete,     // 元ファイルの削除
+    Recompress, // 段階圧縮の再圧縮
+    Scrub,      // アーカイブの検査
+    Count
+};
+
+const char *const taskClassNames[] = {"compress", "delete", "recompress", "scrub"};
+
+// スレッドの優先度（Linuxのnice値・SCHED_IDLE・ioprioに対応）
+struct TaskPriority
+{
+    enum IoClass
+    {
+        IoDefault = 0, // 変更しない
+        IoRealtime = 1,
+        IoBestEffort = 2,
+        IoIdle = 3,
+    };
+
+    int nice = 0;          // 0なら変更しない
+    bool idleCpu = false;  // 他に動くものがないときだけ動く（SCHED_IDLE）
+    int ioClass = IoDefault;
+    int ioLevel = 4;       // 0（高）～7（低）
+
+    // "idle", "nice:N", "io:idle", "io:be:N", "io:rt:N", "normal" をカンマで区切った指定を解釈する
+    static bool parse(const std::string &spec, TaskPriority &priority)
+    {
+        priority = TaskPriority();
+        std::stringstream stream(spec);
+        std::string token;
+        try
+        {
+            while (std::getline(stream, token, ','))
+            {
+                if (token == "normal")
+                    priority = TaskPriority();
+                else if (token == "idle")
+                    priority.idleCpu = true;
+                else if (token.compare(0, 5, "nice:") == 0)
+                    priority.nice = std::max(-20, std::min(19, std::stoi(token.substr(5))));
+                else if (token == "io:idle")
+                    priority.ioClass = IoIdle;
+                else if (token.compare(0, 6, "io:be:") == 0 || token.compare(0, 6, "io:rt:") == 0)
+                {
+                    priority.ioClass = token[3] == 'b' ? IoBestEffort : IoRealtime;
+                    priority.ioLevel = std::max(0, std::min(7, std::stoi(token.substr(6))));
+                }
+                else
+                    return false;
+            }
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+        return true;
+    }
+
+    std::string describe() const
+    {
+        std::string text = idleCpu ? "idle" : nice != 0 ? "nice " + std::to_string(nice) : "normal";
+        if (ioClass == IoIdle)
+            text += ", io idle";
+        else if (ioClass != IoDefault)
+            text += std::string(", io ") + (ioClass == IoBestEffort ? "best-effort " : "realtime ") + std::to_string(ioLevel);
+        return text;
+    }
+};
+
+// 既定では再圧縮・検査は空き時間だけ、削除は圧縮より少し低く動かす
+std::array<TaskPriority, static_cast<size_t>(TaskClass::Count)> taskPriorities = {
+    TaskPriority{},
+    TaskPriority{10, false, TaskPriority::IoBestEffort, 7},
+    TaskPriority{19, true, TaskPriority::IoIdle, 7},
+    TaskPriority{19, true, TaskPriority::IoIdle, 7},
+};
+
+// 現在のスレッドにタスクの種類の優先度を設定する
+void applyTaskPriority(TaskClass taskClass)
+{
+    const TaskPriority &priority = taskPriorities[static_cast<size_t>(taskClass)];
+#ifdef _WIN32
+    // Windowsにはnice値もI/Oクラスもないので、スレッド優先度とバックグラウンドモードに読み替える
+    if (priority.ioClass == TaskPriority::IoIdle)
+        SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    int level = priority.idleCpu || priority.nice >= 19 ? THREAD_PRIORITY_IDLE
+                : priority.nice >= 10                   ? THREAD_PRIORITY_LOWEST
+                : priority.nice > 0                     ? THREAD_PRIORITY_BELOW_NORMAL
+                : priority.nice < 0                     ? THREAD_PRIORITY_ABOVE_NORMAL
+                                                        : THREAD_PRIORITY_NORMAL;
+    if (level != THREAD_PRIORITY_NORMAL)
+        SetThreadPriority(GetCurrentThread(), level);
+#elif defined(__linux__)
+    pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+    if (priority.idleCpu)
+    {
+        sched_param param{};
+        if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+            LOG("Cannot set SCHED_IDLE for " << taskClassNames[static_cast<size_t>(taskClass)] << " thread");
+    }
+    if (priority.nice != 0 && setpriority(PRIO_PROCESS, static_cast<id_t>(tid), priority.nice) != 0)
+        LOG("Cannot set nice " << priority.nice << " for " << taskClassNames[static_cast<size_t>(taskClass)] << " thread: " << std::strerror(errno));
+    if (priority.ioClass != TaskPriority::IoDefault)
+    {
+        // ioprio_set(IOPRIO_WHO_PROCESS, tid, class << 13 | level)
+        if (syscall(SYS_ioprio_set, 1, tid, priority.ioClass << 13 | priority.ioLevel) != 0)
+            LOG("Cannot set I/O priority for " << taskClassNames[static_cast<size_t>(taskClass)] << " thread: " << std::strerror(errno));
+    }
+#else
+    if (priority.idleCpu || priority.nice > 0)
+        setpriority(PRIO_PROCESS, 0, priority.idleCpu ? 19 : priority.nice);
+#endif
+}
+
+// 圧縮処理中のセット数（バックグラウンド処理はこれが0のときだけ動く）
+std::atomic<int> activeSets(0);
+
+// フライトレコーダー：直近のイベントを固定サイズのリングに記録し、異常時にファイルへ書き出す
+// 記録はロックなし（スロットごとのシーケンス番号で書き込み中を判定）、書き出しはシグナルハンドラからも呼べる
+// スロットの中身もrelaxedのアトミックにしてあり、書き込みと重なった読み出しはデータ競合にならず、
+// シーケンス番号の再確認で捨てられる
+enum class FlightEvent : uint8_t
+{
+    Start,      // a=モード
+    Scan,       // a=セット数, b=ファイル数
+    Dispatch,   // a=ラン, b=セット
+    SetStart,   // a=ラン, b=セット
+    SetRead,    // a=ファイル数, b=TARバイト数
+    SetWritten, // a=出力バイト数, b=ミリ秒
+    SetFailed,  // a=ラン, b=セット
+    Deleted,    // a=ファイル数, b=削除キューの残り
+    QueueDepth, // a=削除キュー, b=処理中のセット数
+    Error,
+    Stall, // a=最後のイベントからの秒数
+    Dump,  // a=理由（シグナル番号、0なら要求）
+};
+
+const char *const flightEventNames[] = {"start", "scan", "dispatch", "set-start", "set-read", "set-written",
+                                        "set-failed", "deleted", "queue-depth", "error", "stall", "dump"};
+
+class FlightRecorder
+{
+public:
+    static constexpr size_t capacity = 16384; // 2のべき乗
+    static constexpr size_t textSize = 48;
+
+private:
+    static constexpr size_t textWords = textSize / sizeof(uint64_t);
+
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence{0}; // 奇数なら書き込み中、偶数ならイベント番号*2+2
+        std::atomic<int64_t> timeUs{0};
+        std::atomic<int64_t> a{0};
+        std::atomic<int64_t> b{0};
+        std::atomic<uint32_t> thread{0};
+        std::atomic<uint8_t> type{0};
+        std::atomic<uint64_t> text[textWords] = {}; // NUL終端の文字列を8バイトずつ
+    };
+
+    Slot slots[capacity];
+    std::atomic<uint64_t> next{0};
+    std::atomic<int64_t> lastEventUs{0};
+    std::atomic<uint32_t> threadCounter{0};
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    char dumpPath[1024] = "snappymaker_flight.log";
+
+    uint32_t threadNumber()
+    {
+        thread_local uint32_t number = ++threadCounter;
+        return number;
+    }
+
+    // シグナルハンドラ内でも使える整数の書式化
+    static size_t formatNumber(char *out, int64_t value)
+    {
+        char digits[24];
+        size_t n = 0;
+        bool negative = value < 0;
+        uint64_t v = negative ? static_cast<uint64_t>(-(value + 1)) + 1 : static_cast<uint64_t>(value);
+        do
+        {
+            digits[n++] = static_cast<char>('0' + v % 10);
+            v /= 10;
+        } while (v);
+        size_t length = 0;
+        if (negative)
+            out[length++] = '-';
+        while (n)
+            out[length++] = digits[--n];
+        return length;
+    }
+
+public:
+    int64_t nowUs() const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    void record(FlightEvent type, int64_t a = 0, int64_t b = 0, const char *text = nullptr)
+    {
+        uint64_t index = next.fetch_add(1, std::memory_order_relaxed);
+        Slot &slot = slots[index & (capacity - 1)];
+        slot.sequence.store(index * 2 + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        int64_t now = nowUs();
+        slot.timeUs.store(now, std::memory_order_relaxed);
+        slot.a.store(a, std::memory_order_relaxed);
+        slot.b.store(b, std::memory_order_relaxed);
+        slot.thread.store(threadNumber(), std::memory_order_relaxed);
+        slot.type.store(static_cast<uint8_t>(type), std::memory_order_relaxed);
+        uint64_t words[textWords] = {};
+        if (text)
+        {
+            char *bytes = reinterpret_cast<char *>(words);
+            for (size_t length = 0; length < textSize - 1 && text[length]; ++length)
+                bytes[length] = text[length];
+        }
+        for (size_t i = 0; i < textWords; ++i)
+            slot.text[i].store(words[i], std::memory_order_relaxed);
+        slot.sequence.store(index * 2 + 2, std::memory_order_release);
+        // 監視スレッド自身の記録は進捗とみなさない
+        if (type != FlightEvent::Stall && type != FlightEvent::Dump)
+            lastEventUs.store(now, std::memory_order_relaxed);
+    }
+
+    void record(FlightEvent type, int64_t a, int64_t b, const std::string &text)
+    {
+        record(type, a, b, text.c_str());
+    }
+
+    int64_t secondsSinceLastEvent() const
+    {
+        return (nowUs() - lastEventUs.load(std::memory_order_relaxed)) / 1000000;
+    }
+
+    void setDumpPath(const std::string &path)
+    {
+        std::snprintf(dumpPath, sizeof(dumpPath), "%s", path.c_str());
+    }
+
+    const char *path() const { return dumpPath; }
+
+    // リングを古い順に書き出す（open/write/closeのみ使用）
+    bool dump(int reason)
+    {
+#ifdef _WIN32
+        int fd = _open(dumpPath, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        int fd = open(dumpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+        if (fd < 0)
+            return false;
+
+        char line[256];
+        auto emit = [&](size_t length)
+        {
+#ifdef _WIN32
+            return _write(fd, line, static_cast<unsigned>(length)) == static_cast<int>(length);
+#else
+            return write(fd, line, length) == static_cast<ssize_t>(length);
+#endif
+        };
+        auto append = [&](size_t &length, const char *s)
+        {
+            while (*s && length < sizeof(line) - 2)
+                line[length++] = *s++;
+        };
+
+        size_t length = 0;
+        append(length, "# SnappyMaker flight recorder, reason ");
+        length += formatNumber(line + length, reason);
+        append(length, ", now_us ");
+        length += formatNumber(line + length, nowUs());
+        append(length, "\n# seq time_us thread event a b text\n");
+        emit(length);
+
+        uint64_t end = next.load(std::memory_order_acquire);
+        uint64_t begin = end > capacity ? end - capacity : 0;
+        for (uint64_t index = begin; index < end; ++index)
+        {
+            const Slot &slot = slots[index & (capacity - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != index * 2 + 2)
+                continue; // 書き込み中か上書き済み
+            int64_t timeUs = slot.timeUs.load(std::memory_order_relaxed);
+            int64_t a = slot.a.load(std::memory_order_relaxed), b = slot.b.load(std::memory_order_relaxed);
+            uint32_t thread = slot.thread.load(std::memory_order_relaxed);
+            uint8_t type = slot.type.load(std::memory_order_relaxed);
+            uint64_t words[textWords];
+            for (size_t i = 0; i < textWords; ++i)
+                words[i] = slot.text[i].load(std::memory_order_relaxed);
+            char *text = reinterpret_cast<char *>(words);
+            text[textSize - 1] = '\0';
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) != index * 2 + 2)
+                continue;
+
+            length = 0;
+            length += formatNumber(line + length, static_cast<int64_t>(index));
+            line[length++] = ' ';
+            length += formatNumber(line + length, timeUs);
+            line[length++] = ' ';
+            length += formatNumber(line + length, thread);
+            line[length++] = ' ';
+            append(length, type < sizeof(flightEventNames) / sizeof(flightEventNames[0]) ? flightEventNames[type] : "?");
+            line[length++] = ' ';
+            length += formatNumber(line + length, a);
+            line[length++] = ' ';
+            length += formatNumber(line + length, b);
+            if (text[0])
+            {
+                line[length++] = ' ';
+                append(length, text);
+            }
+            line[length++] = '\n';
+            emit(length);
+        }
+#ifdef _WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+        return true;
+    }
+};
+
+FlightRecorder flightRecorder;
+
+// 外部からの書き出し要求（SIGUSR1、制御コマンド）
+std::atomic<bool> flightDumpRequested(false);
+
+// 致命的なシグナルでリングを書き出してから既定の動作（コアダンプなど）に戻す
+// record()はスレッド番号のthread_local初期化を通るので、ハンドラからは呼ばない（理由はダンプの先頭行に残る）
+void flightFatalSignal(int signal)
+{
+    flightRecorder.dump(signal);
+    std::signal(signal, SIG_DFL);
+    std::raise(signal);
+}
+
+#ifndef _WIN32
+void flightDumpSignal(int)
+{
+    flightDumpRequested = true;
+}
+#endif
+
+// シグナルハンドラと監視スレッドを設定する
+// 監視スレッドは書き出し要求・トリガーファイル・停止（処理中なのにイベントが途絶えた状態）を1秒ごとに確認する
+void startFlightRecorder(const std::string &dumpPath, const std::string &triggerPath, int stallSeconds)
+{
+    flightRecorder.setDumpPath(dumpPath);
+
+#ifdef _WIN32
+    for (int signal : {SIGSEGV, SIGILL, SIGFPE, SIGABRT})
+        std::signal(signal, flightFatalSignal);
+#else
+    // スタックオーバーフローでもハンドラが動くよう専用のスタックを使う
+    static char alternateStack[64 * 1024];
+    stack_t stack{};
+    stack.ss_sp = alternateStack;
+    stack.ss_size = sizeof(alternateStack);
+    sigaltstack(&stack, nullptr);
+
+    struct sigaction action{};
+    action.sa_handler = flightFatalSignal;
+    action.sa_flags = SA_ONSTACK | SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    for (int signal : {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT})
+        sigaction(signal, &action, nullptr);
+
+    struct sigaction request{};
+    request.sa_handler = flightDumpSignal;
+    request.sa_flags = SA_RESTART;
+    sigemptyset(&request.sa_mask);
+    sigaction(SIGUSR1, &request, nullptr);
+#endif
+
+    std::thread([triggerPath, stallSeconds]
+                {
+                    bool stalled = false;
+                    while (true)
+                    {
+                        std::this_thread::sleep_for(std::chrono::seconds(1));
+                        std::error_code ec;
+                        bool triggered = !triggerPath.empty() && fs::exists(triggerPath, ec);
+                        if (triggered)
+                            fs::remove(triggerPath, ec);
+                        if (flightDumpRequested.exchange(false) || triggered)
+                        {
+                            flightRecorder.record(FlightEvent::Dump, 0);
+                            if (flightRecorder.dump(0))
+                                LOG("Flight recorder written to " << flightRecorder.path());
+                        }
+
+                        // 処理中のセットがあるのにイベントが途絶えたら一度だけ書き出す
+                        int64_t idle = flightRecorder.secondsSinceLastEvent();
+                        if (activeSets > 0 && idle >= stallSeconds)
+                        {
+                            if (!stalled)
+                            {
+                                stalled = true;
+                                flightRecorder.record(FlightEvent::Stall, idle, activeSets.load());
+                                flightRecorder.dump(-1);
+                                LOG("Warning: no progress for " << idle << " s with " << activeSets.load()
+                                                                << " set(s) in flight, flight recorder written to "
+                                                                << flightRecorder.path());
+                            }
+                        }
+                        else if (idle < stallSeconds)
+                        {
+                            stalled = false;
+                        }
+                    }
+                })
+        .detach();
+}
+
+// ファイルシステムの抽象化（走査、読み込み、書き込み、削除）
+// 既定はローカル、ベンチマーク用にメモリ上の実装がある
+struct VfsEntry
+{
+    std::string name;
+    bool directory = false;
+};
+
+class Vfs
+{
+public:
+    virtual ~Vfs() = default;
+    virtual bool list(const std::string &dir, std::vector<VfsEntry> &entries) = 0;
+    virtual bool readFile(const std::string &path, std::vector<char> &data) = 0;
+    virtual bool writeFile(const std::string &path, const char *data, size_t size) = 0;
+    virtual bool remove(const std::string &path) = 0;
+    virtual bool rename(const std::string &from, const std::string &to) = 0;
+    virtual bool exists(const std::string &path) = 0;
+    virtual bool createDirectories(const std::string &path) = 0;
+    // 実際のファイルシステムか（ローカル専用の処理の可否に使う）
+    virtual bool isLocal() const { return false; }
+    virtual const char *name() const = 0;
+};
+
+// ローカルファイルシステム
+class LocalVfs : public Vfs
+{
+public:
+    bool list(const std::string &dir, std::vector<VfsEntry> &entries) override
+    {
+        // 読み出しが途中で失敗したら一部だけの一覧を正常として返さない
+        // （readdirとstatの間に消えたエントリーは飛ばす。ほかのstatの失敗もそのエントリーだけ飛ばし、次の走査で拾う）
+        std::error_code ec;
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+        {
+            std::error_code entryEc;
+            fs::file_status status = it->status(entryEc);
+            if (entryEc)
+            {
+                if (entryEc != std::errc::no_such_file_or_directory)
+                    LOG("Error reading " << it->path().string() << ": " << entryEc.message());
+                continue;
+            }
+            if (fs::is_directory(status))
+                entries.push_back({it->path().filename().string(), true});
+            else if (fs::is_regular_file(status))
+                entries.push_back({it->path().filename().string(), false});
+        }
+        if (ec)
+            LOG("Error listing " << dir << ": " << ec.message());
+        return !ec;
+    }
+
+    bool readFile(const std::string &path, std::vector<char> &data) override
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            return false;
+        file.seekg(0, std::ios::end);
+        data.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0, std::ios::beg);
+        return static_cast<bool>(file.read(data.data(), data.size()));
+    }
+
+    bool writeFile(const std::string &path, const char *data, size_t size) override
+    {
+        std::ofstream file(path, std::ios::binary);
+        return file && file.write(data, size) && (file.close(), !file.fail());
+    }
+
+    // 既にないファイルは消えたものとして成功にする
+    bool remove(const std::string &path) override
+    {
+        std::error_code ec;
+        fs::remove(path, ec);
+        return !ec;
+    }
+
+    bool rename(const std::string &from, const std::string &to) override
+    {
+        std::error_code ec;
+        fs::rename(from, to, ec);
+        return !ec;
+    }
+
+    bool exists(const std::string &path) override
+    {
+        std::error_code ec;
+        return fs::exists(path, ec);
+    }
+
+    bool createDirectories(const std::string &path) override
+    {
+        std::error_code ec;
+        fs::create_directories(path, ec);
+        return !ec;
+    }
+
+    bool isLocal() const override { return true; }
+    const char *name() const override { return "local"; }
+};
+
+// 操作ごとの遅延モデル（中央値[ms]と対数正規分布のばらつき、転送帯域）
+struct VfsLatency
+{
+    double metadataMs = 0; // exists/remove/rename/作成
+    double listMs = 0;     // ディレクトリ一覧
+    double openMs = 0;     // 読み書きの開始
+    double sigma = 0;      // ばらつき（0なら一定）
+    double bandwidthMBps = 0; // 0なら転送時間なし
+
+    // 名前から遅延モデルを選ぶ（none, nfs, smb）
+    static bool parse(const std::string &name, VfsLatency &latency)
+    {
+        if (name == "none")
+            latency = VfsLatency{};
+        else if (name == "nfs")
+            latency = VfsLatency{0.8, 4.0, 1.5, 0.6, 110.0};
+        else if (name == "smb")
+            latency = VfsLatency{2.5, 12.0, 4.0, 0.8, 80.0};
+        else
+            return false;
+        return true;
+    }
+};
+
+// メモリ上のファイルシステム（CPUとスケジューリングだけを測るため）
+// 合成データで埋め、必要ならNFS/SMB相当の遅延を操作ごとに加える
+class MemoryVfs : public Vfs
+{
+private:
+    std::map<std::string, std::shared_ptr<const std::vector<char>>> files; // 正規化したパス -> 内容
+    std::set<std::string> directories;
+    std::mutex mutex;
+    VfsLatency latency;
+
+    static std::string normalize(const std::string &path)
+    {
+        std::string p = fs::path(path).lexically_normal().generic_string();
+        while (p.size() > 1 && p.back() == '/')
+            p.pop_back();
+        return p;
+    }
+
+    // 対数正規分布の遅延と転送時間だけ待つ
+    void delay(double medianMs, size_t bytes = 0) const
+    {
+        double ms = medianMs;
+        if (ms > 0 && latency.sigma > 0)
+        {
+            thread_local std::mt19937 rng(std::random_device{}());
+            std::normal_distribution<double> normal(0.0, latency.sigma);
+            ms *= std::exp(normal(rng));
+        }
+        if (latency.bandwidthMBps > 0)
+            ms += bytes / (latency.bandwidthMBps * 1048576.0) * 1000.0;
+        if (ms > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(static_cast<int64_t>(ms * 1000)));
+    }
+
+    void addParents(const std::string &path)
+    {
+        for (fs::path p = fs::path(path).parent_path(); !p.empty(); p = p.parent_path())
+        {
+            if (!directories.insert(p.generic_string()).second || p == p.parent_path())
+                break;
+        }
+    }
+
+public:
+    explicit MemoryVfs(const VfsLatency &latency = VfsLatency{}) : latency(latency) {}
+
+    // basePatternに従った名前（prefix_RR_NNNNN.tif）で合成ファイルを作る
+    // 内容は16ビット画像を模したなだらかな値にノイズを加えたもの
+    void populate(const std::string &dir, const std::string &basePattern, int runs, int filesPerRun, size_t fileSize)
+    {
+        std::string prefix = basePattern.substr(0, basePattern.find("_##_"));
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int run = 1; run <= runs; ++run)
+        {
+            for (int number = 1; number <= filesPerRun; ++number)
+            {
+                char name[32];
+                std::snprintf(name, sizeof(name), "_%02d_%05d.tif", run, number);
+                auto data = std::make_shared<std::vector<char>>(fileSize);
+                uint32_t state = static_cast<uint32_t>(run * 100003 + number) | 1;
+                for (size_t i = 0; i + 1 < fileSize; i += 2)
+                {
+                    state ^= state << 13;
+                    state ^= state >> 17;
+                    state ^= state << 5;
+                    uint16_t value = static_cast<uint16_t>(((i / 2) % 1024 + (i / 2048)) & 0x0fff) + (state & 0x0f);
+                    std::memcpy(data->data() + i, &value, sizeof(value));
+                }
+                std::string path = normalize((fs::path(dir) / (prefix + name)).string());
+                files[path] = data;
+                addParents(path);
+            }
+        }
+        directories.insert(normalize(dir));
+    }
+
+    bool list(const std::string &dir, std::vector<VfsEntry> &entries) override
+    {
+        delay(latency.listMs);
+        std::string base = normalize(dir);
+        std::string prefix = base == "/" ? base : base + "/";
+        std::lock_guard<std::mutex> lock(mutex);
+        if (directories.find(base) == directories.end())
+            return false;
+        for (auto it = files.lower_bound(prefix); it != files.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+        {
+            if (it->first.find('/', prefix.size()) == std::string::npos)
+                entries.push_back({it->first.substr(prefix.size()), false});
+        }
+        for (auto it = directories.lower_bound(prefix); it != directories.end() && it->compare(0, prefix.size(), prefix) == 0; ++it)
+        {
+            if (it->find('/', prefix.size()) == std::string::npos)
+                entries.push_back({it->substr(prefix.size()), true});
+        }
+        return true;
+    }
+
+    bool readFile(const std::string &path, std::vector<char> &data) override
+    {
+        std::shared_ptr<const std::vector<char>> content;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = files.find(normalize(path));
+            if (it == files.end())
+                return false;
+            content = it->second;
+        }
+        delay(latency.openMs, content->size());
+        data = *content;
+        return true;
+    }
+
+    bool writeFile(const std::string &path, const char *data, size_t size) override
+    {
+        delay(latency.openMs, size);
+        auto content = std::make_shared<std::vector<char>>(data, data + size);
+        std::string key = normalize(path);
+        std::lock_guard<std::mutex> lock(mutex);
+        files[key] = content;
+        addParents(key);
+        return true;
+    }
+
+    bool remove(const std::string &path) override
+    {
+        delay(latency.metadataMs);
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string key = normalize(path);
+        if (files.erase(key) > 0)
+            return true;
+        // ディレクトリは空のときだけ消す（ローカルのファイルシステムと同じく、中身があれば失敗する）
+        auto dir = directories.find(key);
+        if (dir == directories.end())
+            return true; // LocalVfsと同じく、既にないものは消えたとみなす
+        std::string prefix = key == "/" ? key : key + "/";
+        auto file = files.lower_bound(prefix);
+        auto sub = directories.lower_bound(prefix);
+        if ((file != files.end() && file->first.compare(0, prefix.size(), prefix) == 0) ||
+            (sub != directories.end() && sub->compare(0, prefix.size(), prefix) == 0))
+            return false;
+        directories.erase(dir);
+        return true;
+    }
+
+    bool rename(const std::string &from, const std::string &to) override
+    {
+        delay(latency.metadataMs);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = files.find(normalize(from));
+        if (it == files.end())
+            return false;
+        auto content = it->second;
+        files.erase(it);
+        std::string key = normalize(to);
+        files[key] = content;
+        addParents(key);
+        return true;
+    }
+
+    bool exists(const std::string &path) override
+    {
+        delay(latency.metadataMs);
+        std::string key = normalize(path);
+        std::lock_guard<std::mutex> lock(mutex);
+        return files.count(key) > 0 || directories.count(key) > 0;
+    }
+
+    bool createDirectories(const std::string &path) override
+    {
+        delay(latency.metadataMs);
+        std::string key = normalize(path);
+        std::lock_guard<std::mutex> lock(mutex);
+        directories.insert(key);
+        addParents(key);
+        return true;
+    }
+
+    const char *name() const override { return "memory"; }
+};
+
+// グローバルなファイルシステム（既定はローカル）
+std::unique_ptr<Vfs> vfs = std::make_unique<LocalVfs>();
+
+// 遅延削除の設定：元ファイルをすぐに消さず、同じディレクトリのゴミ箱（.snappy_trash/run_XX）に移し、
+// 検出器が止まっているとき、または空き容量が減ったときにまとめて消す
+struct TrashSettings
+{
+    bool enabled = false;
+    double keepSeconds = 600; // 検出器が止まっていてもこの時間は残す（誤ったアーカイブの取り消し用）
+    double idleSeconds = 60;  // 削除要求がこの時間なく、圧縮中のセットもなければ止まっているとみなす
+    double purgeFreeGB = 20;  // ゴミ箱のあるディスクの空きがこれを下回れば、保持時間に関わらず古い順に消す
+};
+
+const char *const trashDirName = ".snappy_trash";
+
+TrashSettings trashSettings;
+
 // 削除キュークラス - ファイル削除をバックグラウンドで処理
 class DeleteQueue
 {
@@ -35,6 +828,13 @@ private:
     {
         std::set<std::string> files;
         std::string firstFile; // 削除しないファイル
+        int run = 0;
+    };
+
+    struct TrashEntry
+    {
+        std::string path;
+        std::chrono::steady_clock::time_point trashed;
     };
 
     std::queue<DeleteTask> tasks;
@@ -43,624 +843,9361 @@ private:
     std::thread worker_thread;
     bool running;
 
-    // ワーカースレッド関数
-    void worker()
+    // ゴミ箱（ワーカースレッドだけが触る。adoptTrash はキュー経由ではなくロックして追加する）
+    TrashSettings trash;
+    std::deque<TrashEntry> trashed;
+    std::set<std::string> trashDirs; // 作成済みのゴミ箱ディレクトリ
+    std::set<std::string> adoptedRoots;
+    std::atomic<size_t> trashCount{0};
+    std::chrono::steady_clock::time_point lastPush = std::chrono::steady_clock::now();
+
+    // ファイルを同じディレクトリのゴミ箱に移す（名前の変更だけなので、メタデータ操作1回で済む）
+    bool moveToTrash(const std::string &filePath, int run)
+    {
+        char runDir[32];
+        std::snprintf(runDir, sizeof(runDir), "run_%02d", run);
+        fs::path source(filePath);
+        fs::path dir = source.parent_path() / trashDirName / runDir;
+        if (trashDirs.insert(dir.string()).second && !vfs->createDirectories(dir.string()))
+        {
+            trashDirs.erase(dir.string());
+            return false;
+        }
+        std::string target = (dir / source.filename()).string();
+        if (!vfs->rename(filePath, target))
+            return false;
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        // このゴミ箱に前回の残りがあれば最初の走査で引き継ぎ済み（以後の走査で二重に数えない）
+        adoptedRoots.insert(dir.parent_path().string());
+        trashed.push_back({target, std::chrono::steady_clock::now()});
+        trashCount = trashed.size();
+        return true;
+    }
+
+    static double freeGB(const std::string &path)
+    {
+        if (!vfs->isLocal())
+            return -1.0;
+        std::error_code ec;
+        auto info = fs::space(path, ec);
+        return ec ? -1.0 : info.available / 1e9;
+    }
+
+    // ゴミ箱を片付ける：空き容量が足りなければ古い順に、検出器が止まっていれば保持時間を過ぎたものを消す
+    void purgeTrash()
+    {
+        auto now = std::chrono::steady_clock::now();
+        std::vector<std::string> victims;
+        const char *reason = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (trashed.empty())
+                return;
+            double free = freeGB(trashed.front().path);
+            if (free >= 0.0 && free < trash.purgeFreeGB)
+            {
+                // 空き容量の見積もりは消したファイルの分だけ増やす（statはまとめて消した後に取り直す）
+                reason = "disk space";
+                std::error_code ec;
+                while (!trashed.empty() && free < trash.purgeFreeGB)
+                {
+                    uintmax_t size = fs::file_size(trashed.front().path, ec);
+                    free += ec ? 0.0 : size / 1e9;
+                    victims.push_back(trashed.front().path);
+                    trashed.pop_front();
+                }
+            }
+            else if (tasks.empty() && activeSets == 0 &&
+                     std::chrono::duration<double>(now - lastPush).count() >= trash.idleSeconds)
+            {
+                reason = "idle";
+                while (!trashed.empty() && std::chrono::duration<double>(now - trashed.front().trashed).count() >= trash.keepSeconds)
+                {
+                    victims.push_back(trashed.front().path);
+                    trashed.pop_front();
+                }
+            }
+            trashCount = trashed.size();
+        }
+        if (victims.empty())
+            return;
+
+        std::set<std::string> dirs;
+        size_t removed = 0;
+        for (const auto &path : victims)
+        {
+            if (vfs->remove(path))
+                ++removed;
+            else
+                LOG("Error removing file " << path);
+            dirs.insert(fs::path(path).parent_path().string());
+        }
+        // 空になったランのディレクトリも消す（まだファイルがあれば失敗するだけ）
+        for (const auto &dir : dirs)
+        {
+            if (vfs->remove(dir))
+                trashDirs.erase(dir);
+        }
+        LOG("Purged " << removed << " files from trash (" << reason << ")");
+        flightRecorder.record(FlightEvent::Deleted, static_cast<int64_t>(removed), static_cast<int64_t>(trashCount.load()), "trash purge");
+    }
+
+    // ワーカースレッド関数（停止要求後もキューが空になるまで処理する）
+    void worker()
+    {
+        applyTaskPriority(TaskClass::Delete);
+        while (true)
+        {
+            DeleteTask task;
+            size_t remaining = 0;
+
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                if (tasks.empty())
+                {
+                    // キューが空の場合は通知を待つ（1秒のタイムアウト付き）
+                    cv.wait_for(lock, std::chrono::seconds(1), [this]
+                                { return !tasks.empty() || !running; });
+                    if (!running && tasks.empty())
+                        break;
+                    if (tasks.empty())
+                    {
+                        if (trash.enabled)
+                        {
+                            lock.unlock();
+                            purgeTrash();
+                        }
+                        continue;
+                    }
+                }
+
+                task = tasks.front();
+                tasks.pop();
+                remaining = tasks.size();
+            }
+
+            // タスクを処理（ファイル削除）
+            int64_t removed = 0;
+            for (const auto &filePath : task.files)
+            {
+                // 最初のファイルは削除しない
+                if (filePath == task.firstFile)
+                {
+                    LOG("Keeping first file of set: " << fs::path(filePath).filename().string());
+                    continue;
+                }
+
+                if (trash.enabled && moveToTrash(filePath, task.run))
+                {
+                    ++removed;
+                }
+                else if (!vfs->remove(filePath))
+                {
+                    LOG("Error removing file " << filePath);
+                    flightRecorder.record(FlightEvent::Error, 0, 0, "remove " + fs::path(filePath).filename().string());
+                }
+                else
+                {
+                    ++removed;
+                }
+            }
+            flightRecorder.record(FlightEvent::Deleted, removed, static_cast<int64_t>(remaining));
+            if (trash.enabled)
+                purgeTrash();
+        }
+    }
+
+public:
+    explicit DeleteQueue(const TrashSettings &trash = TrashSettings()) : running(true), trash(trash)
+    {
+        worker_thread = std::thread(&DeleteQueue::worker, this);
+    }
+
+    ~DeleteQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            running = false;
+        }
+        cv.notify_all();
+        if (worker_thread.joinable())
+        {
+            worker_thread.join();
+        }
+    }
+
+    void push(const std::set<std::string> &files, const std::string &firstFile)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            DeleteTask task;
+            task.files = files;
+            task.firstFile = firstFile;
+            tasks.push(task);
+        }
+        cv.notify_one();
+    }
+
+    void push(const std::set<std::string> &files, int run = 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            DeleteTask task;
+            task.files = files;
+            task.run = run;
+            tasks.push(task);
+            lastPush = std::chrono::steady_clock::now();
+        }
+        cv.notify_one();
+    }
+
+    // 前回の実行で残ったゴミ箱の中身を引き継ぐ（保持時間は今から数える）
+    void adoptTrash(const std::string &dir)
+    {
+        if (!trash.enabled)
+            return;
+        std::string root = (fs::path(dir) / trashDirName).string();
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (!adoptedRoots.insert(root).second)
+                return;
+        }
+        std::vector<VfsEntry> runs;
+        if (!vfs->list(root, runs))
+            return;
+        auto now = std::chrono::steady_clock::now();
+        for (const auto &run : runs)
+        {
+            std::vector<VfsEntry> entries;
+            std::string runDir = (fs::path(root) / run.name).string();
+            if (!run.directory || !vfs->list(runDir, entries))
+                continue;
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            for (const auto &entry : entries)
+            {
+                if (!entry.directory)
+                    trashed.push_back({(fs::path(runDir) / entry.name).string(), now});
+            }
+            trashCount = trashed.size();
+        }
+        if (trashCount > 0)
+            LOG("Adopted " << trashCount.load() << " files left in trash: " << root);
+    }
+
+    size_t trashSize() const { return trashCount.load(); }
+
+    // キュー内のタスク数を取得
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        return tasks.size();
+    }
+};
+
+// グローバル削除キューインスタンス
+std::unique_ptr<DeleteQueue> deleteQueue;
+
+// 512バイトぴったりの構造体となるようにパック
+#pragma pack(push, 1)
+struct TarHeader
+{
+    char name[100];     // ファイル名
+    char mode[8];       // ファイルモード（8進数文字列）
+    char uid[8];        // オーナーのuid（8進数文字列）
+    char gid[8];        // オーナーのgid（8進数文字列）
+    char size[12];      // ファイルサイズ（8進数文字列）
+    char mtime[12];     // 修正時刻（8進数文字列）
+    char checksum[8];   // チェックサム（8進数文字列）
+    char typeflag;      // タイプフラグ ('0'または'\0'は通常のファイル、'5'はディレクトリ)
+    char linkname[100]; // リンク先
+    char magic[6];      // ターベックの識別子 ("ustar")
+    char version[2];    // バージョン
+    char uname[32];     // オーナー名
+    char gname[32];     // グループ名
+    char devmajor[8];   // デバイスメジャー番号（8進数文字列）
+    char devminor[8];   // デバイスマイナー番号（8進数文字列）
+    char prefix[155];   // パスのプレフィックス
+    char padding[12];   // パディング（合計512バイトにするため）
+};
+#pragma pack(pop)
+
+// 8進数フォーマットで数値を文字列に変換
+void octalNumber(char *dest, size_t size, long value)
+{
+    std::snprintf(dest, size, "%0*lo", static_cast<int>(size - 1), value);
+}
+
+// 圧縮コーデック（snappyは常に利用可能、zstdはビルド時に見つかった場合のみ）
+enum class Codec : uint8_t
+{
+    Snappy = 0,
+    Zstd = 1,
+};
+
+const char *codecName(Codec codec)
+{
+    switch (codec)
+    {
+    case Codec::Snappy:
+        return "snappy";
+    case Codec::Zstd:
+        return "zstd";
+    }
+    return "unknown";
+}
+
+bool codecAvailable(Codec codec)
+{
+#ifdef SNAPPY_MAKER_HAVE_ZSTD
+    return codec == Codec::Snappy || codec == Codec::Zstd;
+#else
+    return codec == Codec::Snappy;
+#endif
+}
+
+bool parseCodec(const std::string &name, Codec &codec)
+{
+    if (name == "snappy")
+        codec = Codec::Snappy;
+    else if (name == "zstd")
+        codec = Codec::Zstd;
+    else
+        return false;
+    return true;
+}
+
+// データを圧縮する（levelはzstdのみ有効）
+bool compressBuffer(Codec codec, int level, const char *data, size_t size, std::string &out)
+{
+    if (codec == Codec::Snappy)
+    {
+        snappy::Compress(data, size, &out);
+        return true;
+    }
+#ifdef SNAPPY_MAKER_HAVE_ZSTD
+    if (codec == Codec::Zstd)
+    {
+        out.resize(ZSTD_compressBound(size));
+        size_t written = ZSTD_compress(&out[0], out.size(), data, size, level);
+        if (ZSTD_isError(written))
+        {
+            LOG("zstd compression failed: " << ZSTD_getErrorName(written));
+            return false;
+        }
+        out.resize(written);
+        return true;
+    }
+#else
+    (void)level;
+#endif
+    LOG("Codec not available in this build: " << codecName(codec));
+    return false;
+}
+
+// データを展開する（rawSizeは展開後のサイズ）
+bool decompressBuffer(Codec codec, const char *data, size_t size, size_t rawSize, std::string &out)
+{
+    if (codec == Codec::Snappy)
+    {
+        size_t length = 0;
+        if (!snappy::GetUncompressedLength(data, size, &length) || length != rawSize)
+            return false;
+        return snappy::Uncompress(data, size, &out);
+    }
+#ifdef SNAPPY_MAKER_HAVE_ZSTD
+    if (codec == Codec::Zstd)
+    {
+        out.resize(rawSize);
+        size_t written = ZSTD_decompress(&out[0], rawSize, data, size);
+        return !ZSTD_isError(written) && written == rawSize;
+    }
+#endif
+    return false;
+}
+
+// 展開先を呼び出し側が用意する版（out に rawSize バイト書く）
+bool decompressInto(Codec codec, const char *data, size_t size, char *out, size_t rawSize)
+{
+    if (codec == Codec::Snappy)
+    {
+        size_t length = 0;
+        return snappy::GetUncompressedLength(data, size, &length) && length == rawSize && snappy::RawUncompress(data, size, out);
+    }
+#ifdef SNAPPY_MAKER_HAVE_ZSTD
+    if (codec == Codec::Zstd)
+    {
+        size_t written = ZSTD_decompress(out, rawSize, data, size);
+        return !ZSTD_isError(written) && written == rawSize;
+    }
+#endif
+    return false;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+// TARに入れたファイル（カタログ用）
+struct TarMember
+{
+    std::string name;
+    uint64_t offset; // TAR内のデータの位置（ヘッダーの直後）
+    uint64_t size;         // TARに入れた大きさ（変換後）
+    uint32_t crc;          // 元データのCRC32C
+    uint64_t originalSize; // 元データの大きさ
+    bool transformed = false; // 画素フィルターやマスクで変換して入れた（TARの中身は元のファイルと違う）
+};
+
+// カスタムTARアーカイブ作成クラス
+class CustomTarCreator
+{
+public:
+    // TARに入れる前にファイル内容を変換する（画素フィルター、マスク）。offset はTAR内のデータの位置
+    // 変換したら true を返す
+    using Transform = std::function<bool(const std::string &name, uint64_t offset, std::vector<char> &data)>;
+
+private:
+    std::vector<char> buffer;
+    std::vector<TarMember> memberList;
+    Transform transform;
+
+public:
+    CustomTarCreator()
+    {
+        // 初期バッファサイズを確保
+        buffer.reserve(1024 * 1024); // 1MB初期サイズ
+    }
+
+    void setTransform(Transform fn) { transform = std::move(fn); }
+
+    bool addFile(const std::string &filepath)
+    {
+        // ファイルデータを読み込む
+        std::vector<char> fileData;
+        if (!vfs->readFile(filepath, fileData))
+        {
+            LOG("Error reading file: " << filepath);
+            return false;
+        }
+
+        // ファイル名設定（パスは除外してファイル名のみ）
+        std::string filename = fs::path(filepath).filename().string();
+        uint32_t crc = crc32c(0, fileData.data(), fileData.size());
+        uint64_t originalSize = fileData.size();
+        bool transformed = transform && transform(filename, buffer.size() + sizeof(TarHeader), fileData);
+        std::streamsize fileSize = static_cast<std::streamsize>(fileData.size());
+
+        // TARヘッダーを準備
+        TarHeader header;
+        std::memset(&header, 0, sizeof(TarHeader));
+
+        std::strncpy(header.name, filename.c_str(), sizeof(header.name) - 1);
+
+        // パーミッション（644 = 読み書き+読み取り専用）
+        std::strcpy(header.mode, "000644 ");
+
+        // 所有者とグループID
+        std::strcpy(header.uid, "000000 ");
+        std::strcpy(header.gid, "000000 ");
+
+        // ファイルサイズ（8進数）
+        octalNumber(header.size, sizeof(header.size), fileSize);
+
+        // 最終更新時間（現在時刻）
+        std::time_t now = std::time(nullptr);
+        octalNumber(header.mtime, sizeof(header.mtime), now);
+
+        // ファイルタイプ（通常ファイル）
+        header.typeflag = '0';
+
+        // UStar形式指定
+        std::strcpy(header.magic, "ustar");
+        std::strcpy(header.version, "00");
+
+        // 所有者名とグループ名
+        std::strcpy(header.uname, "user");
+        std::strcpy(header.gname, "group");
+
+        // チェックサム計算 - 仮にスペースで埋める
+        std::memset(header.checksum, ' ', sizeof(header.checksum));
+
+        // ヘッダー全体の合計を計算
+        unsigned int sum = 0;
+        const unsigned char *data = reinterpret_cast<const unsigned char *>(&header);
+        for (size_t i = 0; i < sizeof(TarHeader); ++i)
+        {
+            sum += data[i];
+        }
+
+        // 8進数フォーマットでチェックサム設定
+        std::snprintf(header.checksum, sizeof(header.checksum), "%06o", sum);
+        header.checksum[6] = '\0';
+        header.checksum[7] = ' ';
+
+        // ヘッダーを追加
+        size_t currentSize = buffer.size();
+        buffer.resize(currentSize + sizeof(TarHeader));
+        std::memcpy(buffer.data() + currentSize, &header, sizeof(TarHeader));
+
+        // ファイルデータを追加
+        currentSize = buffer.size();
+        buffer.resize(currentSize + fileData.size());
+        std::memcpy(buffer.data() + currentSize, fileData.data(), fileData.size());
+        memberList.push_back({filename, currentSize, fileData.size(), crc, originalSize, transformed});
+
+        // ブロックサイズ（512バイト）に合わせてパディング
+        size_t paddingSize = (512 - (fileData.size() % 512)) % 512;
+        if (paddingSize > 0)
+        {
+            currentSize = buffer.size();
+            buffer.resize(currentSize + paddingSize, 0);
+        }
+
+        return true;
+    }
+
+    void finalize()
+    {
+        // TARファイルの終端（1024バイトのゼロブロック）
+        size_t currentSize = buffer.size();
+        buffer.resize(currentSize + 1024, 0);
+    }
+
+    std::vector<char> getBuffer()
+    {
+        finalize();
+        return buffer;
+    }
+
+    const std::vector<TarMember> &members() const { return memberList; }
+};
+
+// CRC32C（Castagnoli）をスライス8方式で計算
+uint32_t crc32c(uint32_t crc, const void *data, size_t size)
+{
+    static const auto table = []
+    {
+        std::vector<std::array<uint32_t, 256>> t(8);
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+            for (int s = 1; s < 8; ++s)
+                t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+        return t;
+    }();
+
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    while (size >= 8)
+    {
+        uint32_t lo, hi;
+        std::memcpy(&lo, p, 4);
+        std::memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+
+// アーカイブのコンテナ形式（リトルエンディアン）
+// [ヘッダー][圧縮ブロック...][ブロック索引][メタデータ][トレーラー]
+// ブロックはTARストリームを blockSize ごとに区切って個別に圧縮したもの
+#pragma pack(push, 1)
+struct ContainerHeader
+{
+    char magic[4];      // "SNPK"
+    uint8_t version;    // 形式バージョン（1）
+    uint8_t codec;      // Codec
+    uint16_t reserved;  // 予約（0）
+    uint32_t blockSize; // 展開後のブロックサイズ（最後のブロック以外）
+    uint32_t flags;     // 予約（0）
+};
+
+struct ContainerBlockEntry
+{
+    uint64_t offset;     // ファイル先頭からの位置
+    uint32_t storedSize; // 圧縮後サイズ
+    uint32_t rawSize;    // 展開後サイズ
+    uint32_t storedCrc;  // 圧縮後データのCRC32C（展開せずに検証できる）
+    uint32_t rawCrc;     // 展開後データのCRC32C
+};
+
+struct ContainerTrailer
+{
+    uint64_t indexOffset; // ブロック索引の位置
+    uint32_t blockCount;  // ブロック数
+    uint32_t metaSize;    // メタデータのバイト数（索引の直後）
+    uint32_t reserved;    // 予約（0）
+    char magic[4];        // "SNPE"
+};
+#pragma pack(pop)
+
+const uint32_t defaultBlockSize = 4 * 1024 * 1024;
+
+// コンテナのメタデータ（キーと値の組、同じキーを複数持てる）
+struct ContainerMeta
+{
+    std::vector<std::pair<std::string, std::string>> entries;
+
+    void set(const std::string &key, const std::string &value)
+    {
+        for (auto &entry : entries)
+        {
+            if (entry.first == key)
+            {
+                entry.second = value;
+                return;
+            }
+        }
+        entries.emplace_back(key, value);
+    }
+
+    std::string get(const std::string &key, const std::string &defaultValue = "") const
+    {
+        for (const auto &entry : entries)
+        {
+            if (entry.first == key)
+                return entry.second;
+        }
+        return defaultValue;
+    }
+
+    // [キー長 u16][値の長さ u32][キー][値] の並び
+    std::string serialize() const
+    {
+        std::string out;
+        for (const auto &entry : entries)
+        {
+            uint16_t keyLength = static_cast<uint16_t>(entry.first.size());
+            uint32_t valueLength = static_cast<uint32_t>(entry.second.size());
+            out.append(reinterpret_cast<const char *>(&keyLength), sizeof(keyLength));
+            out.append(reinterpret_cast<const char *>(&valueLength), sizeof(valueLength));
+            out += entry.first;
+            out += entry.second;
+        }
+        return out;
+    }
+
+    bool parse(const char *data, size_t size)
+    {
+        entries.clear();
+        size_t pos = 0;
+        while (pos < size)
+        {
+            uint16_t keyLength;
+            uint32_t valueLength;
+            if (size - pos < sizeof(keyLength) + sizeof(valueLength))
+                return false;
+            std::memcpy(&keyLength, data + pos, sizeof(keyLength));
+            std::memcpy(&valueLength, data + pos + sizeof(keyLength), sizeof(valueLength));
+            pos += sizeof(keyLength) + sizeof(valueLength);
+            if (size - pos < static_cast<size_t>(keyLength) + valueLength)
+                return false;
+            entries.emplace_back(std::string(data + pos, keyLength), std::string(data + pos + keyLength, valueLength));
+            pos += keyLength + valueLength;
+        }
+        return true;
+    }
+};
+
+// コンテナ書き込みクラス（出力先は書き込み関数で受け取る）
+class ContainerWriter
+{
+public:
+    using WriteFunction = std::function<bool(const char *, size_t)>;
+
+private:
+    Codec codec;
+    int level;
+    uint32_t blockSize;
+    WriteFunction write;
+    std::string pending; // ブロックにまだ満たない入力
+    std::string compressed;
+    std::vector<ContainerBlockEntry> index;
+    uint64_t position = 0;
+    uint64_t rawTotal = 0;
+
+    bool emit(const char *data, size_t size)
+    {
+        if (!write(data, size))
+            return false;
+        position += size;
+        return true;
+    }
+
+    bool flushBlock(const char *data, size_t size)
+    {
+        if (!compressBuffer(codec, level, data, size, compressed))
+            return false;
+        ContainerBlockEntry entry;
+        entry.offset = position;
+        entry.storedSize = static_cast<uint32_t>(compressed.size());
+        entry.rawSize = static_cast<uint32_t>(size);
+        entry.storedCrc = crc32c(0, compressed.data(), compressed.size());
+        entry.rawCrc = crc32c(0, data, size);
+        index.push_back(entry);
+        rawTotal += size;
+        return emit(compressed.data(), compressed.size());
+    }
+
+public:
+    ContainerWriter(Codec codec, int level, uint32_t blockSize, WriteFunction write)
+        : codec(codec), level(level), blockSize(blockSize), write(std::move(write))
+    {
+    }
+
+    bool begin()
+    {
+        ContainerHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "SNPK", 4);
+        header.version = 1;
+        header.codec = static_cast<uint8_t>(codec);
+        header.blockSize = blockSize;
+        return emit(reinterpret_cast<const char *>(&header), sizeof(header));
+    }
+
+    bool append(const char *data, size_t size)
+    {
+        // 満杯のブロックはコピーせずにそのまま圧縮する
+        if (pending.empty())
+        {
+            while (size >= blockSize)
+            {
+                if (!flushBlock(data, blockSize))
+                    return false;
+                data += blockSize;
+                size -= blockSize;
+            }
+            pending.assign(data, size);
+            return true;
+        }
+        while (size > 0)
+        {
+            size_t take = std::min(size, blockSize - pending.size());
+            pending.append(data, take);
+            data += take;
+            size -= take;
+            if (pending.size() == blockSize)
+            {
+                if (!flushBlock(pending.data(), pending.size()))
+                    return false;
+                pending.clear();
+            }
+        }
+        return true;
+    }
+
+    // 書きかけのブロックを書き出す（この後の blocks() はすべてのブロックを含む）
+    bool flush()
+    {
+        if (!pending.empty())
+        {
+            if (!flushBlock(pending.data(), pending.size()))
+                return false;
+            pending.clear();
+        }
+        return true;
+    }
+
+    bool finish(const ContainerMeta &meta)
+    {
+        if (!pending.empty())
+        {
+            if (!flushBlock(pending.data(), pending.size()))
+                return false;
+            pending.clear();
+        }
+
+        ContainerTrailer trailer;
+        std::memset(&trailer, 0, sizeof(trailer));
+        trailer.indexOffset = position;
+        trailer.blockCount = static_cast<uint32_t>(index.size());
+
+        std::string metaData = meta.serialize();
+        trailer.metaSize = static_cast<uint32_t>(metaData.size());
+        std::memcpy(trailer.magic, "SNPE", 4);
+
+        return emit(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(ContainerBlockEntry)) &&
+               emit(metaData.data(), metaData.size()) &&
+               emit(reinterpret_cast<const char *>(&trailer), sizeof(trailer));
+    }
+
+    uint64_t bytesWritten() const { return position; }
+    uint64_t rawBytes() const { return rawTotal; }
+    const std::vector<ContainerBlockEntry> &blocks() const { return index; }
+};
+
+// コンテナ読み込みクラス
+class ContainerReader
+{
+private:
+    std::ifstream file;
+    ContainerHeader header;
+    std::vector<ContainerBlockEntry> index;
+    ContainerMeta meta;
+    uint64_t rawTotal = 0;
+    std::string errorMessage;
+
+    bool fail(const std::string &message)
+    {
+        errorMessage = message;
+        return false;
+    }
+
+public:
+    // コンテナでないファイル（旧形式の .snappy）は false を返し、isContainer() も false になる
+    bool open(const std::string &path)
+    {
+        file.open(path, std::ios::binary);
+        if (!file)
+            return fail("cannot open " + path);
+
+        file.seekg(0, std::ios::end);
+        uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+        file.seekg(0, std::ios::beg);
+        if (fileSize < sizeof(ContainerHeader) + sizeof(ContainerTrailer) ||
+            !file.read(reinterpret_cast<char *>(&header), sizeof(header)) || std::memcmp(header.magic, "SNPK", 4) != 0)
+        {
+            header.magic[0] = 0;
+            return fail("not a container archive");
+        }
+        if (header.version != 1)
+            return fail("unsupported container version " + std::to_string(header.version));
+
+        ContainerTrailer trailer;
+        file.seekg(fileSize - sizeof(trailer));
+        if (!file.read(reinterpret_cast<char *>(&trailer), sizeof(trailer)) || std::memcmp(trailer.magic, "SNPE", 4) != 0)
+            return fail("missing trailer (truncated archive?)");
+
+        uint64_t indexBytes = static_cast<uint64_t>(trailer.blockCount) * sizeof(ContainerBlockEntry);
+        if (trailer.indexOffset + indexBytes + trailer.metaSize + sizeof(trailer) != fileSize)
+            return fail("inconsistent trailer");
+
+        index.resize(trailer.blockCount);
+        std::string metaData(trailer.metaSize, '\0');
+        file.seekg(trailer.indexOffset);
+        if (!file.read(reinterpret_cast<char *>(index.data()), indexBytes) ||
+            !file.read(&metaData[0], metaData.size()) || !meta.parse(metaData.data(), metaData.size()))
+            return fail("corrupt index or metadata");
+
+        rawTotal = 0;
+        for (const auto &entry : index)
+        {
+            if (entry.offset + entry.storedSize > trailer.indexOffset)
+                return fail("block outside of data area");
+            rawTotal += entry.rawSize;
+        }
+        return true;
+    }
+
+    bool isContainer() const { return header.magic[0] == 'S'; }
+    Codec codec() const { return static_cast<Codec>(header.codec); }
+    uint32_t blockSize() const { return header.blockSize; }
+    const std::vector<ContainerBlockEntry> &blocks() const { return index; }
+    const ContainerMeta &metadata() const { return meta; }
+    uint64_t rawSize() const { return rawTotal; }
+    const std::string &error() const { return errorMessage; }
+
+    // 圧縮されたままのブロックを読む（CRCを検証）
+    bool readStoredBlock(size_t i, std::string &stored)
+    {
+        const ContainerBlockEntry &entry = index.at(i);
+        stored.resize(entry.storedSize);
+        file.seekg(entry.offset);
+        if (!file.read(&stored[0], entry.storedSize))
+            return fail("short read in block " + std::to_string(i));
+        if (crc32c(0, stored.data(), stored.size()) != entry.storedCrc)
+            return fail("checksum mismatch in block " + std::to_string(i));
+        return true;
+    }
+
+    // ブロックを展開して読む（展開後のCRCも検証）
+    bool readBlock(size_t i, std::string &raw)
+    {
+        std::string stored;
+        if (!readStoredBlock(i, stored))
+            return false;
+        if (!decompressBuffer(codec(), stored.data(), stored.size(), index[i].rawSize, raw))
+            return fail("cannot decompress block " + std::to_string(i));
+        if (crc32c(0, raw.data(), raw.size()) != index[i].rawCrc)
+            return fail("content checksum mismatch in block " + std::to_string(i));
+        return true;
+    }
+};
+
+// アーカイブのマニフェスト：メンバーごとの名前・元のサイズ・CRC32C・TAR内の位置と、
+// そのメンバーを含む圧縮ブロックの範囲（アーカイブファイル内のバイト位置）。展開せずに中身を確かめられる
+// stored_size は画素フィルターやマスクをかけた後のTAR内の大きさ（古いマニフェストにはなく、size と同じ）
+struct ManifestEntry
+{
+    std::string name;
+    uint64_t size = 0;
+    uint32_t crc = 0;
+    uint64_t tarOffset = 0;
+    uint64_t spanOffset = 0;
+    uint64_t spanLength = 0;
+    uint64_t storedSize = 0;
+};
+
+// メンバーの位置とブロックの並びから圧縮後の範囲を求める
+std::vector<ManifestEntry> buildManifest(const std::vector<TarMember> &members, const std::vector<ContainerBlockEntry> &blocks)
+{
+    std::vector<ManifestEntry> manifest;
+    size_t block = 0;
+    uint64_t blockStart = 0; // 展開後の位置
+    for (const auto &member : members)
+    {
+        ManifestEntry entry;
+        entry.name = member.name;
+        entry.size = member.originalSize;
+        entry.storedSize = member.size;
+        entry.crc = member.crc;
+        entry.tarOffset = member.offset;
+        // メンバーはTAR内で昇順なので、ブロックは前から順に進めればよい
+        while (block < blocks.size() && blockStart + blocks[block].rawSize <= member.offset)
+            blockStart += blocks[block++].rawSize;
+        if (block < blocks.size())
+        {
+            size_t last = block;
+            uint64_t lastStart = blockStart;
+            while (last + 1 < blocks.size() && lastStart + blocks[last].rawSize < member.offset + member.size)
+                lastStart += blocks[last++].rawSize;
+            entry.spanOffset = blocks[block].offset;
+            entry.spanLength = blocks[last].offset + blocks[last].storedSize - blocks[block].offset;
+        }
+        manifest.push_back(entry);
+    }
+    return manifest;
+}
+
+std::string formatManifest(const std::vector<ManifestEntry> &manifest)
+{
+    std::ostringstream out;
+    out << "# name\tsize\tcrc32c\ttar_offset\tspan_offset\tspan_length\tstored_size\n";
+    for (const auto &entry : manifest)
+    {
+        char crc[9];
+        std::snprintf(crc, sizeof(crc), "%08x", entry.crc);
+        out << entry.name << '\t' << entry.size << '\t' << crc << '\t' << entry.tarOffset << '\t' << entry.spanOffset << '\t'
+            << entry.spanLength << '\t' << entry.storedSize << '\n';
+    }
+    return out.str();
+}
+
+bool parseManifest(const std::string &text, std::vector<ManifestEntry> &manifest)
+{
+    manifest.clear();
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, '\t'))
+            fields.push_back(field);
+        if (fields.size() != 6 && fields.size() != 7)
+            return false;
+        ManifestEntry entry;
+        try
+        {
+            entry.name = fields[0];
+            entry.size = std::stoull(fields[1]);
+            entry.crc = static_cast<uint32_t>(std::stoul(fields[2], nullptr, 16));
+            entry.tarOffset = std::stoull(fields[3]);
+            entry.spanOffset = std::stoull(fields[4]);
+            entry.spanLength = std::stoull(fields[5]);
+            entry.storedSize = fields.size() == 7 ? std::stoull(fields[6]) : entry.size;
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+        manifest.push_back(entry);
+    }
+    return true;
+}
+
+// 書き直したアーカイブのブロックに合わせてマニフェストの圧縮後の範囲を更新する
+std::string rebaseManifest(const std::string &text, const std::vector<ContainerBlockEntry> &blocks)
+{
+    std::vector<ManifestEntry> manifest;
+    if (!parseManifest(text, manifest))
+        return "";
+    std::vector<TarMember> members;
+    for (const auto &entry : manifest)
+        members.push_back({entry.name, entry.tarOffset, entry.storedSize, entry.crc, entry.size});
+    return formatManifest(buildManifest(members, blocks));
+}
+
+// アーカイブ（フッターのメタデータ）またはサイドカー（.manifest）からマニフェストを読む
+bool loadManifest(const std::string &path, std::vector<ManifestEntry> &manifest, std::string &text, std::string &error)
+{
+    if (fs::path(path).extension() == ".manifest")
+    {
+        std::ifstream in(path, std::ios::binary);
+        text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        if (!in.eof() && !in)
+        {
+            error = "cannot read " + path;
+            return false;
+        }
+    }
+    else
+    {
+        ContainerReader reader;
+        if (!reader.open(path))
+        {
+            error = reader.error();
+            return false;
+        }
+        text = reader.metadata().get("manifest");
+        if (text.empty())
+        {
+            error = "no manifest (written by an older version)";
+            return false;
+        }
+    }
+    if (!parseManifest(text, manifest))
+    {
+        error = "corrupt manifest";
+        return false;
+    }
+    return true;
+}
+
+// ARCHIVE.manifest を書き出すか（--manifest-sidecar）
+bool manifestSidecar = false;
+
+// 画素データの可逆フィルター：隣の画素からの予測との差（残差）にし、必要ならバイト位置ごとに並べ替える
+// フィルター自体は大きさを変えない。静的マスク（--mask）をかけたフレームだけは画素を抜いた分だけ小さくなるので、
+// TAR には変換後の大きさで入れ、元の大きさは変換の記録（originalSize）とマニフェストに残す
+enum class Predictor
+{
+    None,
+    Left,    // 左の画素
+    Up,      // 上の画素
+    Gradient // 左 + 上 - 左上
+};
+
+struct PixelFilter
+{
+    Predictor predictor = Predictor::None;
+    bool shuffle = false; // 予測の後、各画素の同じバイト位置をまとめる
+
+    bool active() const { return predictor != Predictor::None || shuffle; }
+
+    // none, shuffle, left, up, gradient（予測には +shuffle を付けられる）
+    static bool parse(const std::string &text, PixelFilter &filter)
+    {
+        filter = PixelFilter();
+        std::string name = text;
+        const std::string suffix = "+shuffle";
+        if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+        {
+            filter.shuffle = true;
+            name.erase(name.size() - suffix.size());
+        }
+        if (name == "left")
+            filter.predictor = Predictor::Left;
+        else if (name == "up")
+            filter.predictor = Predictor::Up;
+        else if (name == "gradient")
+            filter.predictor = Predictor::Gradient;
+        else if (name == "shuffle" && !filter.shuffle)
+            filter.shuffle = true;
+        else if (name != "none" || filter.shuffle)
+            return false;
+        return true;
+    }
+
+    std::string describe() const
+    {
+        static const char *names[] = {"", "left", "up", "gradient"};
+        std::string name = names[static_cast<int>(predictor)];
+        if (shuffle)
+            name += name.empty() ? "shuffle" : "+shuffle";
+        return name.empty() ? "none" : name;
+    }
+};
+
+// ランごとのフィルター（--pixel-filter=gradient+shuffle,7:none のように、RUN: を付けたものがそのランの指定）
+struct PixelFilterSettings
+{
+    PixelFilter defaultFilter;
+    std::map<int, PixelFilter> perRun;
+
+    PixelFilter forRun(int run) const
+    {
+        auto it = perRun.find(run);
+        return it != perRun.end() ? it->second : defaultFilter;
+    }
+
+    static bool parse(const std::string &text, PixelFilterSettings &settings)
+    {
+        std::stringstream stream(text);
+        std::string item;
+        while (std::getline(stream, item, ','))
+        {
+            size_t colon = item.find(':');
+            PixelFilter filter;
+            if (!PixelFilter::parse(colon == std::string::npos ? item : item.substr(colon + 1), filter))
+                return false;
+            if (colon == std::string::npos)
+            {
+                settings.defaultFilter = filter;
+                continue;
+            }
+            try
+            {
+                settings.perRun[std::stoi(item.substr(0, colon))] = filter;
+            }
+            catch (const std::exception &)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+PixelFilterSettings pixelFilters;
+
+// TIFFの画素データの位置と形
+// 対象は1枚目の画像が非圧縮・1サンプル/画素・16/32ビットで、ストリップが連続しているリトルエンディアンのTIFFのみ
+struct TiffLayout
+{
+    uint64_t pixelOffset = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t bytesPerSample = 0;
+};
+
+bool parseTiffLayout(const char *data, size_t size, TiffLayout &layout)
+{
+    auto read = [&](uint64_t at, unsigned bytes, uint64_t &value)
+    {
+        if (at + bytes > size)
+            return false;
+        uint32_t v = 0;
+        std::memcpy(&v, data + at, bytes); // リトルエンディアンのホストを前提にする（x86/ARM）
+        value = v;
+        return true;
+    };
+    // IFDエントリーの i 番目の値（SHORT か LONG）
+    auto entryValue = [&](uint64_t entry, uint64_t i, uint64_t &value)
+    {
+        uint64_t type, count, at;
+        if (!read(entry + 2, 2, type) || !read(entry + 4, 4, count) || i >= count || (type != 3 && type != 4))
+            return false;
+        unsigned unit = type == 3 ? 2 : 4;
+        if (count * unit <= 4)
+            at = entry + 8;
+        else if (!read(entry + 8, 4, at))
+            return false;
+        return read(at + i * unit, unit, value);
+    };
+
+    uint64_t ifd, entries;
+    if (size < 8 || std::memcmp(data, "II*\0", 4) != 0 || !read(4, 4, ifd) || !read(ifd, 2, entries))
+        return false;
+    uint64_t width = 0, height = 0, bits = 0, compression = 1, samples = 1, count;
+    uint64_t offsetsEntry = 0, countsEntry = 0, strips = 0;
+    for (uint64_t i = 0; i < entries; ++i)
+    {
+        uint64_t entry = ifd + 2 + i * 12, tag;
+        if (!read(entry, 2, tag) || !read(entry + 4, 4, count))
+            return false;
+        switch (tag)
+        {
+        case 256:
+            entryValue(entry, 0, width);
+            break;
+        case 257:
+            entryValue(entry, 0, height);
+            break;
+        case 258:
+            entryValue(entry, 0, bits);
+            break;
+        case 259:
+            entryValue(entry, 0, compression);
+            break;
+        case 277:
+            entryValue(entry, 0, samples);
+            break;
+        case 273:
+            offsetsEntry = entry;
+            strips = count;
+            break;
+        case 279:
+            countsEntry = entry;
+            break;
+        case 322: // タイル形式は対象外
+            return false;
+        }
+    }
+    if (width == 0 || height == 0 || (bits != 16 && bits != 32) || compression != 1 || samples != 1 || !offsetsEntry ||
+        !countsEntry || strips == 0)
+        return false;
+
+    // ストリップが隙間なく並んでいること
+    uint64_t first, next = 0, total = 0;
+    for (uint64_t i = 0; i < strips; ++i)
+    {
+        uint64_t offset, bytes;
+        if (!entryValue(offsetsEntry, i, offset) || !entryValue(countsEntry, i, bytes) || (i > 0 && offset != next))
+            return false;
+        if (i == 0)
+            first = offset;
+        next = offset + bytes;
+        total += bytes;
+    }
+    uint64_t imageBytes = width * height * (bits / 8);
+    if (total < imageBytes || first + imageBytes > size)
+        return false;
+    layout.pixelOffset = first;
+    layout.width = static_cast<uint32_t>(width);
+    layout.height = static_cast<uint32_t>(height);
+    layout.bytesPerSample = static_cast<uint32_t>(bits / 8);
+    return true;
+}
+
+// 残差の符号を最下位ビットに移す（-1, 1, -2 ... -> 1, 2, 3 ...）。小さな負の残差でも上位バイトが0になり、並べ替えが効く
+template <typename T>
+inline T zigzag(T value)
+{
+    using Signed = typename std::make_signed<T>::type;
+    return static_cast<T>(static_cast<T>(value << 1) ^ static_cast<T>(static_cast<Signed>(value) >> (sizeof(T) * 8 - 1)));
+}
+
+template <typename T>
+inline T unzigzag(T value)
+{
+    return static_cast<T>((value >> 1) ^ static_cast<T>(0 - (value & 1)));
+}
+
+// 1行分の残差を求める（行ごとの別バッファなので、コンパイラーがSIMD化できる）
+template <typename T>
+void encodeRow(const T *current, const T *above, T *out, uint32_t width, Predictor predictor)
+{
+    if (predictor == Predictor::Up && above)
+    {
+        for (uint32_t x = 0; x < width; ++x)
+            out[x] = static_cast<T>(current[x] - above[x]);
+    }
+    else if (predictor == Predictor::Gradient && above)
+    {
+        out[0] = static_cast<T>(current[0] - above[0]);
+        for (uint32_t x = 1; x < width; ++x)
+            out[x] = static_cast<T>(current[x] - current[x - 1] - above[x] + above[x - 1]);
+    }
+    else if (predictor != Predictor::Up)
+    {
+        // 左（勾配の1行目も左）
+        out[0] = current[0];
+        for (uint32_t x = 1; x < width; ++x)
+            out[x] = static_cast<T>(current[x] - current[x - 1]);
+    }
+    else
+    {
+        std::memcpy(out, current, width * sizeof(T));
+    }
+    for (uint32_t x = 0; x < width; ++x)
+        out[x] = zigzag(out[x]);
+}
+
+// 静的マスク：どのフレームでも同じ値を持つ画素（モジュール間のギャップ、不良画素）
+// 同じ値が続く画素を区間にまとめて持つ（start は左上からの画素番号、昇順）
+struct DetectorMask
+{
+    struct Segment
+    {
+        uint64_t start;
+        uint64_t length;
+        uint32_t value;
+    };
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t bytesPerSample = 0;
+    std::vector<Segment> segments;
+    uint64_t maskedPixels = 0;
+
+    bool empty() const { return segments.empty(); }
+
+    bool matches(const TiffLayout &layout) const
+    {
+        return !empty() && layout.width == width && layout.height == height && layout.bytesPerSample == bytesPerSample;
+    }
+
+    static uint32_t sampleAt(const char *pixels, uint64_t i, uint32_t bytes)
+    {
+        if (bytes == 2)
+        {
+            uint16_t v;
+            std::memcpy(&v, pixels + i * 2, 2);
+            return v;
+        }
+        uint32_t v;
+        std::memcpy(&v, pixels + i * 4, 4);
+        return v;
+    }
+
+    // このフレームでもマスクした画素がすべてマスクの値か（違えばこのフレームには使わない）
+    bool holds(const char *pixels) const
+    {
+        for (const auto &segment : segments)
+        {
+            for (uint64_t i = segment.start; i < segment.start + segment.length; ++i)
+            {
+                if (sampleAt(pixels, i, bytesPerSample) != segment.value)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    std::string toText() const
+    {
+        std::ostringstream out;
+        out << "# snappymaker mask " << width << ' ' << height << ' ' << bytesPerSample << '\n';
+        for (const auto &segment : segments)
+            out << segment.start << '\t' << segment.length << '\t' << segment.value << '\n';
+        return out.str();
+    }
+
+    static bool fromText(const std::string &text, DetectorMask &mask)
+    {
+        mask = DetectorMask();
+        std::istringstream in(text);
+        std::string line;
+        if (!std::getline(in, line) ||
+            std::sscanf(line.c_str(), "# snappymaker mask %u %u %u", &mask.width, &mask.height, &mask.bytesPerSample) != 3 ||
+            (mask.bytesPerSample != 2 && mask.bytesPerSample != 4))
+            return false;
+        uint64_t total = static_cast<uint64_t>(mask.width) * mask.height, end = 0;
+        Segment segment;
+        while (in >> segment.start >> segment.length >> segment.value)
+        {
+            // 重なりや範囲外は壊れたマスクとして扱う
+            if (segment.start < end || segment.length == 0 || segment.start + segment.length > total)
+                return false;
+            end = segment.start + segment.length;
+            mask.maskedPixels += segment.length;
+            mask.segments.push_back(segment);
+        }
+        return in.eof();
+    }
+};
+
+// フレームを見て静的マスクを学習する：最初のフレームで目印の値（既定は全ビット1 = -1 と -2）を持ち、
+// その後のフレームでも同じ値のままの画素
+class MaskLearner
+{
+private:
+    std::vector<int64_t> sentinels;
+    TiffLayout layout;
+    std::vector<uint32_t> values;
+    std::vector<uint8_t> candidate;
+    size_t frames = 0;
+
+public:
+    // 学習に使うフレームの最小数（少ないと、たまたま目印の値が続いた画素までマスクになる）
+    static constexpr size_t minFrames = 4;
+
+    explicit MaskLearner(const std::vector<int64_t> &sentinels) : sentinels(sentinels) {}
+
+    void add(const char *pixels, const TiffLayout &frameLayout)
+    {
+        uint64_t total = static_cast<uint64_t>(frameLayout.width) * frameLayout.height;
+        if (frames == 0)
+        {
+            layout = frameLayout;
+            uint32_t bits = layout.bytesPerSample == 2 ? 0xFFFFu : 0xFFFFFFFFu;
+            values.resize(total);
+            candidate.assign(total, 0);
+            for (uint64_t i = 0; i < total; ++i)
+            {
+                values[i] = DetectorMask::sampleAt(pixels, i, layout.bytesPerSample);
+                for (int64_t sentinel : sentinels)
+                    candidate[i] |= values[i] == (static_cast<uint32_t>(sentinel) & bits);
+            }
+        }
+        else if (frameLayout.width != layout.width || frameLayout.height != layout.height ||
+                 frameLayout.bytesPerSample != layout.bytesPerSample)
+        {
+            return; // 形の違うフレームは無視する
+        }
+        else
+        {
+            for (uint64_t i = 0; i < total; ++i)
+                candidate[i] &= DetectorMask::sampleAt(pixels, i, layout.bytesPerSample) == values[i];
+        }
+        ++frames;
+    }
+
+    size_t frameCount() const { return frames; }
+
+    bool enough() const { return frames >= minFrames; }
+
+    DetectorMask finish() const
+    {
+        DetectorMask mask;
+        mask.width = layout.width;
+        mask.height = layout.height;
+        mask.bytesPerSample = layout.bytesPerSample;
+        for (uint64_t i = 0; i < candidate.size(); ++i)
+        {
+            if (!candidate[i])
+                continue;
+            if (!mask.segments.empty() && mask.segments.back().start + mask.segments.back().length == i &&
+                mask.segments.back().value == values[i])
+                ++mask.segments.back().length;
+            else
+                mask.segments.push_back({i, 1, values[i]});
+            ++mask.maskedPixels;
+        }
+        return mask;
+    }
+};
+
+// マスクの区間を行ごとのフラグに展開する（行は上から順に読む）
+class MaskRows
+{
+private:
+    const DetectorMask &mask;
+    size_t segment = 0;
+    std::vector<uint8_t> flags;
+
+public:
+    explicit MaskRows(const DetectorMask &mask) : mask(mask), flags(mask.width) {}
+
+    // y 行目のフラグ（マスクした画素がない行は nullptr）
+    const uint8_t *row(uint32_t y)
+    {
+        uint64_t rowStart = static_cast<uint64_t>(y) * mask.width, rowEnd = rowStart + mask.width;
+        while (segment < mask.segments.size() && mask.segments[segment].start + mask.segments[segment].length <= rowStart)
+            ++segment;
+        if (segment == mask.segments.size() || mask.segments[segment].start >= rowEnd)
+            return nullptr;
+        std::fill(flags.begin(), flags.end(), 0);
+        for (size_t s = segment; s < mask.segments.size() && mask.segments[s].start < rowEnd; ++s)
+        {
+            uint64_t begin = std::max(mask.segments[s].start, rowStart);
+            uint64_t end = std::min(mask.segments[s].start + mask.segments[s].length, rowEnd);
+            std::fill(flags.begin() + (begin - rowStart), flags.begin() + (end - rowStart), 1);
+        }
+        return flags.data();
+    }
+};
+
+// マスクした画素の予測用の値：左隣（行頭なら上）をそのまま延ばす。
+// ギャップの縁で残差が跳ねないようにするためで、本当の値はマスクから戻す
+template <typename T>
+inline T maskFill(const T *row, const T *above, uint32_t x)
+{
+    return x > 0 ? row[x - 1] : above ? above[0] : 0;
+}
+
+// 1行分を復元する（上の行は復元済み）。上方向の項はSIMD化でき、左方向は累積和になる
+// masked の画素は残差を使わず、符号化と同じ予測用の値にする
+template <typename T>
+void decodeRow(T *row, const T *above, uint32_t width, Predictor predictor, const uint8_t *masked = nullptr)
+{
+    for (uint32_t x = 0; x < width; ++x)
+        row[x] = unzigzag(row[x]);
+    if (above && (predictor == Predictor::Up || predictor == Predictor::Gradient))
+    {
+        row[0] = static_cast<T>(row[0] + above[0]);
+        if (predictor == Predictor::Up)
+        {
+            for (uint32_t x = 1; x < width; ++x)
+                row[x] = static_cast<T>(row[x] + above[x]);
+        }
+        else
+        {
+            for (uint32_t x = 1; x < width; ++x)
+                row[x] = static_cast<T>(row[x] + above[x] - above[x - 1]);
+        }
+    }
+    bool horizontal = predictor == Predictor::Left || predictor == Predictor::Gradient;
+    if (!masked)
+    {
+        if (horizontal)
+        {
+            for (uint32_t x = 1; x < width; ++x)
+                row[x] = static_cast<T>(row[x] + row[x - 1]);
+        }
+        return;
+    }
+    for (uint32_t x = 0; x < width; ++x)
+    {
+        if (masked[x])
+            row[x] = maskFill(row, above, x);
+        else if (horizontal && x > 0)
+            row[x] = static_cast<T>(row[x] + row[x - 1]);
+    }
+}
+
+template <typename T>
+void predictPixels(char *pixels, uint32_t width, uint32_t height, Predictor predictor, bool encode,
+                   const DetectorMask *mask = nullptr)
+{
+    size_t rowBytes = static_cast<size_t>(width) * sizeof(T);
+    std::vector<T> current(width), above(width), out(width);
+    if (encode)
+    {
+        // マスクした画素を予測用の値に置き換える（抜く画素なので、元の値は残さなくてよい）
+        if (mask)
+        {
+            MaskRows rows(*mask);
+            for (uint32_t y = 0; y < height; ++y)
+            {
+                std::memcpy(current.data(), pixels + y * rowBytes, rowBytes);
+                if (const uint8_t *masked = rows.row(y))
+                {
+                    for (uint32_t x = 0; x < width; ++x)
+                    {
+                        if (masked[x])
+                            current[x] = maskFill(current.data(), y > 0 ? above.data() : nullptr, x);
+                    }
+                    std::memcpy(pixels + y * rowBytes, current.data(), rowBytes);
+                }
+                std::swap(current, above);
+            }
+        }
+        // 下の行から残差にする（上の行は元の値のまま残っている）
+        for (uint32_t y = height; y-- > 0;)
+        {
+            std::memcpy(current.data(), pixels + y * rowBytes, rowBytes);
+            if (y > 0)
+                std::memcpy(above.data(), pixels + (y - 1) * rowBytes, rowBytes);
+            encodeRow(current.data(), y > 0 ? above.data() : nullptr, out.data(), width, predictor);
+            std::memcpy(pixels + y * rowBytes, out.data(), rowBytes);
+        }
+    }
+    else
+    {
+        std::unique_ptr<MaskRows> rows(mask ? new MaskRows(*mask) : nullptr);
+        for (uint32_t y = 0; y < height; ++y)
+        {
+            std::memcpy(current.data(), pixels + y * rowBytes, rowBytes);
+            decodeRow(current.data(), y > 0 ? above.data() : nullptr, width, predictor, rows ? rows->row(y) : nullptr);
+            std::memcpy(pixels + y * rowBytes, current.data(), rowBytes);
+            std::swap(current, above);
+        }
+    }
+}
+
+// 各画素の同じバイト位置を連続させる（forward=false で元に戻す）
+// 画素の側を順に1回だけなめ、バイト位置ごとの面に書き分ける
+template <size_t Bytes>
+void shuffleBytes(char *data, size_t samples, bool forward)
+{
+    std::vector<char> copy(data, data + samples * Bytes);
+    const char *in = copy.data();
+    for (size_t i = 0; i < samples; ++i)
+    {
+        for (size_t b = 0; b < Bytes; ++b)
+        {
+            if (forward)
+                data[b * samples + i] = in[i * Bytes + b];
+            else
+                data[i * Bytes + b] = in[b * samples + i];
+        }
+    }
+}
+
+void shuffleBytes(char *data, size_t samples, size_t bytesPerSample, bool forward)
+{
+    if (bytesPerSample == 2)
+        shuffleBytes<2>(data, samples, forward);
+    else
+        shuffleBytes<4>(data, samples, forward);
+}
+
+// マスクした画素を抜いて残りを前に詰める。詰めた後の画素数を返す
+uint64_t stripMasked(char *pixels, const DetectorMask &mask)
+{
+    uint64_t bytes = mask.bytesPerSample, total = static_cast<uint64_t>(mask.width) * mask.height;
+    uint64_t read = 0, write = 0;
+    for (const auto &segment : mask.segments)
+    {
+        std::memmove(pixels + write * bytes, pixels + read * bytes, (segment.start - read) * bytes);
+        write += segment.start - read;
+        read = segment.start + segment.length;
+    }
+    std::memmove(pixels + write * bytes, pixels + read * bytes, (total - read) * bytes);
+    return write + total - read;
+}
+
+// 詰めた画素（packed）を全画素分の pixels の、マスクしていない位置に戻す
+void expandMasked(const char *packed, char *pixels, const DetectorMask &mask)
+{
+    uint64_t bytes = mask.bytesPerSample, total = static_cast<uint64_t>(mask.width) * mask.height;
+    uint64_t read = 0, write = 0;
+    for (const auto &segment : mask.segments)
+    {
+        std::memcpy(pixels + write * bytes, packed + read * bytes, (segment.start - write) * bytes);
+        read += segment.start - write;
+        write = segment.start + segment.length;
+    }
+    std::memcpy(pixels + write * bytes, packed + read * bytes, (total - write) * bytes);
+}
+
+// マスクした画素にマスクの値を入れる
+void applyMaskValues(char *pixels, const DetectorMask &mask)
+{
+    for (const auto &segment : mask.segments)
+    {
+        for (uint64_t i = segment.start; i < segment.start + segment.length; ++i)
+        {
+            if (mask.bytesPerSample == 2)
+            {
+                uint16_t v = static_cast<uint16_t>(segment.value);
+                std::memcpy(pixels + i * 2, &v, 2);
+            }
+            else
+            {
+                std::memcpy(pixels + i * 4, &segment.value, 4);
+            }
+        }
+    }
+}
+
+// 画像1枚分にフィルターをかける（大きさは変わらない。計画モードの比較用）
+void filterPixels(char *pixels, const TiffLayout &layout, const PixelFilter &filter)
+{
+    if (filter.predictor != Predictor::None)
+    {
+        if (layout.bytesPerSample == 2)
+            predictPixels<uint16_t>(pixels, layout.width, layout.height, filter.predictor, true);
+        else
+            predictPixels<uint32_t>(pixels, layout.width, layout.height, filter.predictor, true);
+    }
+    if (filter.shuffle)
+        shuffleBytes(pixels, static_cast<size_t>(layout.width) * layout.height, layout.bytesPerSample, true);
+}
+
+// フレーム1つ（ファイル全体）を変換する：予測は全画素で行い、マスクした画素を抜いてから並べ替える
+// マスクを使うと画素が抜けた分だけ短くなる
+void encodeFrame(std::vector<char> &data, const TiffLayout &layout, const PixelFilter &filter, const DetectorMask *mask)
+{
+    char *pixels = data.data() + layout.pixelOffset;
+    uint64_t samples = static_cast<uint64_t>(layout.width) * layout.height;
+    uint64_t imageBytes = samples * layout.bytesPerSample;
+    if (filter.predictor != Predictor::None)
+    {
+        if (layout.bytesPerSample == 2)
+            predictPixels<uint16_t>(pixels, layout.width, layout.height, filter.predictor, true, mask);
+        else
+            predictPixels<uint32_t>(pixels, layout.width, layout.height, filter.predictor, true, mask);
+    }
+    if (mask)
+    {
+        uint64_t kept = stripMasked(pixels, *mask);
+        uint64_t suffix = data.size() - layout.pixelOffset - imageBytes;
+        std::memmove(pixels + kept * layout.bytesPerSample, pixels + imageBytes, suffix);
+        data.resize(data.size() - (samples - kept) * layout.bytesPerSample);
+        samples = kept;
+    }
+    if (filter.shuffle)
+        shuffleBytes(data.data() + layout.pixelOffset, samples, layout.bytesPerSample, true);
+}
+
+// 変換したフレームの記録（メタデータ "pixel_filter" に1行ずつ入れる）
+struct FilteredMember
+{
+    std::string name;
+    uint64_t tarOffset = 0;    // TAR内のメンバーのデータの位置
+    TiffLayout layout;         // pixelOffset はメンバーの先頭から
+    PixelFilter filter;
+    bool masked = false;       // 静的マスクの画素を抜いたか（マスクはメタデータ "mask"）
+    uint64_t originalSize = 0; // 元のファイルの大きさ（0 はマスクのない古い記録で、保存した大きさと同じ）
+
+    uint64_t restoredSize(uint64_t storedSize) const { return originalSize ? originalSize : storedSize; }
+};
+
+std::string formatFilterRecord(const FilteredMember &member)
+{
+    std::ostringstream line;
+    line << member.name << '\t' << member.tarOffset << '\t' << member.layout.pixelOffset << '\t' << member.layout.width << '\t'
+         << member.layout.height << '\t' << member.layout.bytesPerSample << '\t' << member.filter.describe() << '\t'
+         << (member.masked ? 1 : 0) << '\t' << member.originalSize << '\n';
+    return line.str();
+}
+
+// 変換したフレームを元のファイル内容に戻す（out は record.restoredSize(storedSize) バイト）
+bool decodeFrame(const char *stored, uint64_t storedSize, const FilteredMember &record, const DetectorMask *mask, char *out)
+{
+    const TiffLayout &layout = record.layout;
+    uint64_t samples = static_cast<uint64_t>(layout.width) * layout.height;
+    uint64_t imageBytes = samples * layout.bytesPerSample;
+    if (record.masked && (!mask || !mask->matches(layout)))
+        return false;
+    uint64_t kept = record.masked ? samples - mask->maskedPixels : samples;
+    uint64_t keptBytes = kept * layout.bytesPerSample;
+    if (layout.pixelOffset + keptBytes > storedSize || storedSize - keptBytes + imageBytes != record.restoredSize(storedSize))
+        return false;
+
+    char *pixels = out + layout.pixelOffset;
+    std::memcpy(out, stored, layout.pixelOffset);
+    std::memcpy(pixels + imageBytes, stored + layout.pixelOffset + keptBytes, storedSize - layout.pixelOffset - keptBytes);
+    if (record.masked)
+    {
+        std::vector<char> packed(stored + layout.pixelOffset, stored + layout.pixelOffset + keptBytes);
+        if (record.filter.shuffle)
+            shuffleBytes(packed.data(), kept, layout.bytesPerSample, false);
+        expandMasked(packed.data(), pixels, *mask);
+    }
+    else
+    {
+        std::memcpy(pixels, stored + layout.pixelOffset, imageBytes);
+        if (record.filter.shuffle)
+            shuffleBytes(pixels, samples, layout.bytesPerSample, false);
+    }
+    if (record.filter.predictor != Predictor::None)
+    {
+        const DetectorMask *rowMask = record.masked ? mask : nullptr;
+        if (layout.bytesPerSample == 2)
+            predictPixels<uint16_t>(pixels, layout.width, layout.height, record.filter.predictor, false, rowMask);
+        else
+            predictPixels<uint32_t>(pixels, layout.width, layout.height, record.filter.predictor, false, rowMask);
+    }
+    if (record.masked)
+        applyMaskValues(pixels, *mask);
+    return true;
+}
+
+// TAR内のTIFFメンバーにその場でフィルターをかけ、記録を返す（計画モードの比較用。マスクは使わない）
+std::string filterTarMembers(char *tar, const std::vector<TarMember> &members, const PixelFilter &filter)
+{
+    std::string record;
+    for (const auto &member : members)
+    {
+        FilteredMember filtered;
+        if (!parseTiffLayout(tar + member.offset, member.size, filtered.layout))
+            continue;
+        filterPixels(tar + member.offset + filtered.layout.pixelOffset, filtered.layout, filter);
+        filtered.name = member.name;
+        filtered.tarOffset = member.offset;
+        filtered.filter = filter;
+        filtered.originalSize = member.size;
+        record += formatFilterRecord(filtered);
+    }
+    return record;
+}
+
+bool parseFilterRecord(const std::string &text, std::vector<FilteredMember> &members)
+{
+    members.clear();
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, '\t'))
+            fields.push_back(field);
+        FilteredMember member;
+        try
+        {
+            // マスクを入れる前の記録は7列（masked と originalSize がない）
+            if ((fields.size() != 7 && fields.size() != 9) || !PixelFilter::parse(fields[6], member.filter))
+                return false;
+            member.name = fields[0];
+            member.tarOffset = std::stoull(fields[1]);
+            member.layout.pixelOffset = std::stoull(fields[2]);
+            member.layout.width = static_cast<uint32_t>(std::stoul(fields[3]));
+            member.layout.height = static_cast<uint32_t>(std::stoul(fields[4]));
+            member.layout.bytesPerSample = static_cast<uint32_t>(std::stoul(fields[5]));
+            if (fields.size() == 9)
+            {
+                member.masked = fields[7] == "1";
+                member.originalSize = std::stoull(fields[8]);
+            }
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+        if (member.layout.bytesPerSample != 2 && member.layout.bytesPerSample != 4)
+            return false;
+        members.push_back(member);
+    }
+    return true;
+}
+
+// アーカイブのメタデータにあるフレームの変換の記録（展開・配信で元に戻すのに使う）
+struct FrameTransforms
+{
+    std::map<uint64_t, FilteredMember> members; // TAR内の位置 -> 記録
+    std::shared_ptr<DetectorMask> mask;
+
+    bool load(const ContainerMeta &meta, std::string &error)
+    {
+        std::vector<FilteredMember> records;
+        if (!parseFilterRecord(meta.get("pixel_filter"), records))
+        {
+            error = "corrupt pixel filter record";
+            return false;
+        }
+        for (const auto &record : records)
+            members[record.tarOffset] = record;
+        std::string maskText = meta.get("mask");
+        if (!maskText.empty())
+        {
+            mask = std::make_shared<DetectorMask>();
+            if (!DetectorMask::fromText(maskText, *mask))
+            {
+                error = "corrupt detector mask";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const FilteredMember *find(uint64_t tarOffset) const
+    {
+        auto it = members.find(tarOffset);
+        return it != members.end() ? &it->second : nullptr;
+    }
+};
+
+// ランごとの静的マスク（--mask でランの最初のセットから学習、--mask=FILE なら全ランで同じマスク）
+// 学習したマスクは DIR/[scope/]run_RR.mask に保存し、再起動しても同じマスクを使う。
+// 再帰監視ではサブディレクトリごとに別の検出器のことがあるので、(scope, run) ごとに持つ
+class DetectorMasks
+{
+private:
+    std::string dir; // 学習したマスクの保存先（固定のマスクなら空）
+    std::vector<int64_t> sentinelValues;
+    std::shared_ptr<const DetectorMask> fixed;
+    std::map<std::pair<std::string, int>, std::shared_ptr<const DetectorMask>> perRun; // (scope, run) -> マスク
+    std::mutex mutex;
+
+    std::string pathFor(const std::string &scope, int run) const
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "run_%02d.mask", run);
+        fs::path path(dir);
+        if (!scope.empty())
+            path /= scope;
+        return (path / name).string();
+    }
+
+public:
+    DetectorMasks(const std::string &dir, const std::vector<int64_t> &sentinels) : dir(dir), sentinelValues(sentinels) {}
+
+    explicit DetectorMasks(std::shared_ptr<const DetectorMask> mask) : fixed(std::move(mask)) {}
+
+    const std::vector<int64_t> &sentinels() const { return sentinelValues; }
+
+    // そのランのマスク（まだ学習していなければ nullptr。目印の画素がなかったランは空のマスク）
+    std::shared_ptr<const DetectorMask> forRun(const std::string &scope, int run)
+    {
+        if (fixed)
+            return fixed;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = perRun.find({scope, run});
+        if (it != perRun.end())
+            return it->second;
+        std::ifstream in(pathFor(scope, run), std::ios::binary);
+        if (!in)
+            return nullptr;
+        auto mask = std::make_shared<DetectorMask>();
+        if (!DetectorMask::fromText(std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()), *mask))
+        {
+            LOG("Ignoring corrupt detector mask: " << pathFor(scope, run));
+            return nullptr;
+        }
+        perRun[{scope, run}] = mask;
+        return mask;
+    }
+
+    // 学習したマスクを登録して保存する（同じランのセットが並列に学習したときは最初のものを使う）
+    void learned(const std::string &scope, int run, const DetectorMask &mask)
+    {
+        if (fixed)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!perRun.emplace(std::make_pair(scope, run), std::make_shared<DetectorMask>(mask)).second)
+            return;
+        std::error_code ec;
+        std::string path = pathFor(scope, run), tmpPath = path + ".tmp";
+        fs::create_directories(fs::path(path).parent_path(), ec);
+        {
+            std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+            out << mask.toText();
+            if (!out)
+            {
+                LOG("Error writing detector mask: " << path);
+                return;
+            }
+        }
+        fs::rename(tmpPath, path, ec);
+        uint64_t total = static_cast<uint64_t>(mask.width) * mask.height;
+        LOG("Learned detector mask for " << (scope.empty() ? "" : scope + " ") << "run " << run << ": " << mask.maskedPixels
+                                         << " of " << total << " pixels in " << mask.segments.size() << " segments");
+    }
+};
+
+std::unique_ptr<DetectorMasks> detectorMasks;
+
+// 展開したTAR全体について、大きさの変わらない変換をその場で元に戻す（計画モードの比較用）
+bool unfilterTar(std::string &tar, const std::string &record, std::string &error)
+{
+    std::vector<FilteredMember> members;
+    if (!parseFilterRecord(record, members))
+    {
+        error = "corrupt pixel filter record";
+        return false;
+    }
+    std::vector<char> restored;
+    for (const auto &member : members)
+    {
+        // 古い記録には大きさがないので、メンバーのヘッダーから読む
+        uint64_t size = member.originalSize;
+        if (size == 0 && member.tarOffset >= sizeof(TarHeader) && member.tarOffset <= tar.size())
+        {
+            const TarHeader *header = reinterpret_cast<const TarHeader *>(&tar[member.tarOffset - sizeof(TarHeader)]);
+            size = std::strtoull(std::string(header->size, sizeof(header->size)).c_str(), nullptr, 8);
+        }
+        restored.resize(size);
+        if (member.masked || member.tarOffset + size > tar.size() ||
+            !decodeFrame(&tar[member.tarOffset], size, member, nullptr, restored.data()))
+        {
+            error = "pixel filter record does not match " + member.name;
+            return false;
+        }
+        std::memcpy(&tar[member.tarOffset], restored.data(), restored.size());
+    }
+    return true;
+}
+
+// アーカイブ全体を展開する（コンテナ形式と旧形式の両方に対応）。meta にはコンテナのメタデータを返す（旧形式なら空）
+// 画素フィルターやマスクをかけたメンバーは保存したバイト列のまま（元に戻すのは FrameTransforms）
+bool readArchive(const std::string &path, std::string &tarData, std::string &error, ContainerMeta *meta = nullptr)
+{
+    ContainerReader reader;
+    if (reader.open(path))
+    {
+        if (meta)
+            *meta = reader.metadata();
+        tarData.clear();
+        tarData.reserve(reader.rawSize());
+        std::string raw;
+        for (size_t i = 0; i < reader.blocks().size(); ++i)
+        {
+            if (!reader.readBlock(i, raw))
+            {
+                error = reader.error();
+                return false;
+            }
+            tarData += raw;
+        }
+        return true;
+    }
+    if (reader.isContainer())
+    {
+        error = reader.error();
+        return false;
+    }
+
+    // 旧形式：TAR全体をsnappyで一括圧縮したもの
+    std::ifstream file(path, std::ios::binary);
+    std::string compressed((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (!file.eof() && !file)
+    {
+        error = "cannot read " + path;
+        return false;
+    }
+    if (!snappy::Uncompress(compressed.data(), compressed.size(), &tarData))
+    {
+        error = "not a valid archive";
+        return false;
+    }
+    return true;
+}
+
+// TARバッファ内のメンバーを順に処理する
+void forEachTarMember(const char *data, size_t size,
+                      const std::function<void(const std::string &, uint64_t, uint64_t)> &callback)
+{
+    size_t pos = 0;
+    while (pos + sizeof(TarHeader) <= size)
+    {
+        const TarHeader *header = reinterpret_cast<const TarHeader *>(data + pos);
+        if (header->name[0] == '\0')
+            break; // 終端ブロック
+
+        std::string name(header->name, strnlen(header->name, sizeof(header->name)));
+        uint64_t memberSize = std::strtoull(std::string(header->size, sizeof(header->size)).c_str(), nullptr, 8);
+        uint64_t dataOffset = pos + sizeof(TarHeader);
+        if (dataOffset + memberSize > size)
+            break;
+
+        callback(name, dataOffset, memberSize);
+        pos = dataOffset + ((memberSize + 511) / 512) * 512;
+    }
+}
+
+// アーカイブのメンバーをディレクトリに展開する
+bool extractArchive(const std::string &archivePath, const std::string &destDir)
+{
+    std::string tarData, error;
+    ContainerMeta meta;
+    FrameTransforms transforms;
+    if (!readArchive(archivePath, tarData, error, &meta) || !transforms.load(meta, error))
+    {
+        LOG("Error reading " << archivePath << ": " << error);
+        return false;
+    }
+
+    fs::create_directories(destDir);
+    size_t count = 0;
+    bool ok = true;
+    std::vector<char> restored;
+    forEachTarMember(tarData.data(), tarData.size(), [&](const std::string &name, uint64_t offset, uint64_t size)
+                     {
+        // 画素フィルターやマスクをかけたフレームは元のファイル内容に戻す
+        const char *data = tarData.data() + offset;
+        if (const FilteredMember *record = transforms.find(offset))
+        {
+            restored.resize(record->restoredSize(size));
+            if (!decodeFrame(data, size, *record, transforms.mask.get(), restored.data()))
+            {
+                LOG("Error restoring member: " << name);
+                ok = false;
+                return;
+            }
+            data = restored.data();
+            size = restored.size();
+        }
+        std::ofstream out(fs::path(destDir) / fs::path(name).filename(), std::ios::binary);
+        if (!out.write(data, size))
+        {
+            LOG("Error writing member: " << name);
+            ok = false;
+            return;
+        }
+        ++count; });
+
+    LOG("Extracted " << count << " files from " << fs::path(archivePath).filename().string() << " to " << destDir);
+    return ok;
+}
+
+bool syncFile(std::FILE *file);
+void syncDirectory(const fs::path &dir);
+void recordRecompressedCommit(const std::string &path, Codec codec, uint64_t bytes, uint32_t crc);
+
+// アーカイブを別コーデックで再圧縮し、検証してからアトミックに置き換える
+bool recompressArchive(const std::string &path, Codec codec, int level)
+{
+    ContainerReader reader;
+    bool container = reader.open(path);
+    if (!container && reader.isContainer())
+    {
+        LOG("Error reading " << path << ": " << reader.error());
+        return false;
+    }
+    if (container && reader.codec() == codec)
+        return true; // 再圧縮済み
+
+    std::string tmpPath = path + ".recompress.tmp";
+    uintmax_t originalSize = fs::file_size(path);
+    uint32_t sourceCrc = 0;
+    uint64_t sourceSize = 0;
+    std::FILE *out = nullptr;
+    try
+    {
+        out = std::fopen(tmpPath.c_str(), "wb");
+        if (!out)
+        {
+            LOG("Error opening output file: " << tmpPath);
+            return false;
+        }
+        uint32_t archiveCrc = 0; // 書き出すバイト列そのもののCRC32C（コミットイベント用）
+        ContainerWriter writer(codec, level, container ? reader.blockSize() : defaultBlockSize,
+                               [out, &archiveCrc](const char *data, size_t size)
+                               {
+                                   archiveCrc = crc32c(archiveCrc, data, size);
+                                   return std::fwrite(data, 1, size, out) == size; });
+
+        ContainerMeta meta = container ? reader.metadata() : ContainerMeta();
+        meta.set("codec", codecName(codec));
+        meta.set("level", std::to_string(level));
+        meta.set("tier", "cold");
+        meta.set("recompressed_from", container ? codecName(reader.codec()) : "legacy-snappy");
+
+        bool ok = writer.begin();
+        std::string raw;
+        if (container)
+        {
+            for (size_t i = 0; ok && i < reader.blocks().size(); ++i)
+            {
+                ok = reader.readBlock(i, raw);
+                if (!ok)
+                    LOG("Error reading " << path << ": " << reader.error());
+                ok = ok && writer.append(raw.data(), raw.size());
+                sourceCrc = crc32c(sourceCrc, raw.data(), raw.size());
+                sourceSize += raw.size();
+            }
+        }
+        else
+        {
+            std::string error;
+            ok = readArchive(path, raw, error);
+            if (!ok)
+                LOG("Error reading " << path << ": " << error);
+            ok = ok && writer.append(raw.data(), raw.size());
+            sourceCrc = crc32c(0, raw.data(), raw.size());
+            sourceSize = raw.size();
+        }
+        // ブロックの位置が変わるので、マニフェストの圧縮後の範囲を付け直す
+        std::string manifest = meta.get("manifest");
+        ok = ok && writer.flush();
+        if (ok && !manifest.empty())
+        {
+            manifest = rebaseManifest(manifest, writer.blocks());
+            meta.set("manifest", manifest);
+        }
+        // 置き換える前に中身をディスクに確定させる（リネームだけ先に残ると、電源断で空のアーカイブになる）
+        ok = ok && writer.finish(meta) && syncFile(out);
+        ok = std::fclose(out) == 0 && ok;
+        out = nullptr;
+        if (!ok)
+        {
+            fs::remove(tmpPath);
+            return false;
+        }
+
+        // 書き出したファイルを読み直して内容を検証
+        ContainerReader check;
+        uint32_t checkCrc = 0;
+        ok = check.open(tmpPath) && check.rawSize() == sourceSize;
+        for (size_t i = 0; ok && i < check.blocks().size(); ++i)
+        {
+            ok = check.readBlock(i, raw);
+            checkCrc = crc32c(checkCrc, raw.data(), raw.size());
+        }
+        if (!ok || checkCrc != sourceCrc)
+        {
+            LOG("Verification failed for recompressed " << path << ", keeping original");
+            fs::remove(tmpPath);
+            return false;
+        }
+
+        fs::rename(tmpPath, path);
+        syncDirectory(fs::path(path).parent_path());
+        std::string sidecarPath = path + ".manifest";
+        if (!manifest.empty() && fs::exists(sidecarPath))
+        {
+            std::ofstream sidecar(sidecarPath + ".tmp", std::ios::binary | std::ios::trunc);
+            sidecar << manifest;
+            sidecar.close();
+            if (sidecar)
+                fs::rename(sidecarPath + ".tmp", sidecarPath);
+        }
+        LOG("Recompressed " << fs::path(path).filename().string() << " with " << codecName(codec) << "-" << level
+                            << ": " << originalSize << " -> " << fs::file_size(path) << " bytes");
+        recordRecompressedCommit(path, codec, writer.bytesWritten(), archiveCrc);
+        return true;
+    }
+    catch (const std::exception &e)
+    {
+        LOG("Error recompressing " << path << ": " << e.what());
+        if (out)
+            std::fclose(out);
+        std::error_code ec;
+        fs::remove(tmpPath, ec);
+        return false;
+    }
+}
+
+// 再圧縮キュークラス - 書き込み済みアーカイブを空き時間に高圧縮率で再圧縮
+class Recompressor
+{
+private:
+    struct Task
+    {
+        std::string path;
+        std::chrono::steady_clock::time_point readyAt; // これより前には再圧縮しない
+    };
+
+    Codec codec;
+    int level;
+    std::chrono::seconds delay;
+    std::queue<Task> tasks;
+    std::mutex queue_mutex;
+    std::condition_variable cv;
+    std::vector<std::thread> workers;
+    size_t inFlight = 0;
+    bool running;
+
+    void worker()
+    {
+        applyTaskPriority(TaskClass::Recompress);
+        while (true)
+        {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                while (running)
+                {
+                    if (tasks.empty())
+                        cv.wait(lock);
+                    else if (activeSets > 0)
+                        // 圧縮中のセットがある間は手を出さない（activeSets の変化は通知されないので間隔を置いて見直す）
+                        cv.wait_for(lock, std::chrono::milliseconds(500));
+                    else if (std::chrono::steady_clock::now() < tasks.front().readyAt)
+                        cv.wait_until(lock, tasks.front().readyAt);
+                    else
+                        break;
+                }
+                if (!running)
+                    break;
+                task = tasks.front();
+                tasks.pop();
+                ++inFlight;
+            }
+            recompressArchive(task.path, codec, level);
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                --inFlight;
+            }
+            cv.notify_all();
+        }
+    }
+
+public:
+    Recompressor(Codec codec, int level, int delaySeconds, int threadCount)
+        : codec(codec), level(level), delay(delaySeconds), running(true)
+    {
+        for (int i = 0; i < threadCount; ++i)
+        {
+            workers.emplace_back(&Recompressor::worker, this);
+        }
+    }
+
+    ~Recompressor()
+    {
+        size_t remaining;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            running = false;
+            remaining = tasks.size();
+        }
+        cv.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        if (remaining > 0)
+        {
+            LOG(remaining << " archives left for recompression (run 'SnappyMaker recompress' later)");
+        }
+    }
+
+    void push(const std::string &path)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            tasks.push({path, std::chrono::steady_clock::now() + delay});
+        }
+        cv.notify_one();
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        return tasks.size();
+    }
+
+    // キューが空になるまで待つ（バッチモード終了時）
+    void drain()
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        cv.wait(lock, [this]
+                { return tasks.empty() && inFlight == 0; });
+    }
+};
+
+// グローバル再圧縮キュー（段階圧縮モードのときのみ作成）
+std::unique_ptr<Recompressor> recompressor;
+
+// ディレクトリ以下の既存アーカイブをまとめて再圧縮する
+bool recompressDirectory(const std::string &dir, Codec codec, int level, int threadCount)
+{
+    std::vector<std::string> archives;
+    for (const auto &entry : fs::recursive_directory_iterator(dir))
+    {
+        if (entry.is_regular_file() && entry.path().extension() == ".snappy")
+            archives.push_back(entry.path().string());
+    }
+    LOG("Recompressing " << archives.size() << " archives in " << dir << " with " << codecName(codec) << "-" << level);
+
+    std::atomic<size_t> nextIndex(0);
+    std::atomic<size_t> failed(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&]()
+                             {
+            applyTaskPriority(TaskClass::Recompress);
+            for (size_t i = nextIndex++; i < archives.size(); i = nextIndex++)
+            {
+                if (!recompressArchive(archives[i], codec, level))
+                    ++failed;
+            } });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    LOG("Recompression finished: " << archives.size() - failed << " ok, " << failed << " failed");
+    return failed == 0;
+}
+
+// プラットフォームに依存しない名前のハッシュ（FNV-1a）
+uint64_t hashName(const std::string &name)
+{
+    uint64_t hash = 1469598103934665603ull;
+    for (unsigned char c : name)
+    {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// 出力先の分散配置クラス - アーカイブを複数のディレクトリ（ディスク）に振り分ける
+class OutputRouter
+{
+public:
+    enum class Policy
+    {
+        RoundRobin,  // 順番に割り当て
+        LeastLoaded, // 書き込み中のアーカイブが最も少ない先
+        Hash,        // アーカイブ名のハッシュで固定
+    };
+
+private:
+    std::vector<std::string> targets;
+    Policy policy;
+    std::string manifestPath;
+    std::vector<int> depth;                       // 出力先ごとの書き込み中アーカイブ数
+    std::map<std::string, std::string> locations; // アーカイブ名 -> 出力先（配置記録）
+    size_t nextTarget = 0;
+    std::mutex mutex;
+
+public:
+    OutputRouter(const std::vector<std::string> &targetDirs, Policy policy, const std::string &manifestDir)
+        : targets(targetDirs), policy(policy), depth(targetDirs.size(), 0)
+    {
+        for (const auto &target : targets)
+        {
+            fs::create_directories(target);
+        }
+
+        // 既存の配置記録を読み込む（"アーカイブ名<TAB>出力先<TAB>サイズ<TAB>パス"）
+        fs::create_directories(manifestDir);
+        manifestPath = (fs::path(manifestDir) / "archive_locations.tsv").string();
+        std::ifstream manifest(manifestPath);
+        std::string line;
+        while (std::getline(manifest, line))
+        {
+            size_t tab = line.find('\t');
+            if (tab == std::string::npos)
+                continue;
+            size_t end = line.find('\t', tab + 1);
+            locations[line.substr(0, tab)] = line.substr(tab + 1, end == std::string::npos ? std::string::npos : end - tab - 1);
+        }
+    }
+
+    static bool parsePolicy(const std::string &name, Policy &policy)
+    {
+        if (name == "roundrobin")
+            policy = Policy::RoundRobin;
+        else if (name == "leastloaded")
+            policy = Policy::LeastLoaded;
+        else if (name == "hash")
+            policy = Policy::Hash;
+        else
+            return false;
+        return true;
+    }
+
+    const std::vector<std::string> &targetDirs() const { return targets; }
+
+    // 書き込み先を決めて書き込み中の数を増やす（終わったら release を呼ぶ）
+    size_t assign(const std::string &archiveName)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t chosen = 0;
+        switch (policy)
+        {
+        case Policy::RoundRobin:
+            chosen = nextTarget++ % targets.size();
+            break;
+        case Policy::LeastLoaded:
+            // 同数なら順番に回して偏らないようにする
+            chosen = nextTarget++ % targets.size();
+            for (size_t i = 0; i < targets.size(); ++i)
+            {
+                if (depth[i] < depth[chosen])
+                    chosen = i;
+            }
+            break;
+        case Policy::Hash:
+            chosen = hashName(archiveName) % targets.size();
+            break;
+        }
+        ++depth[chosen];
+        return chosen;
+    }
+
+    void release(size_t target)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        --depth[target];
+    }
+
+    // 書き込みが完了したアーカイブの配置を記録する
+    void record(const std::string &archiveName, size_t target, uintmax_t bytes, const std::string &archivePath)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        locations[archiveName] = targets[target];
+        std::ofstream manifest(manifestPath, std::ios::app);
+        manifest << archiveName << '\t' << targets[target] << '\t' << bytes << '\t' << archivePath << '\n';
+    }
+
+    // 既存アーカイブの出力先を探す（見つからなければ空文字列）
+    // existsは出力先ディレクトリにアーカイブがあるかを確認する関数
+    std::string locate(const std::string &archiveName, const std::function<bool(const std::string &)> &exists)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = locations.find(archiveName);
+        if (it != locations.end())
+            return it->second;
+        if (policy == Policy::Hash)
+        {
+            const std::string &target = targets[hashName(archiveName) % targets.size()];
+            return exists(target) ? target : "";
+        }
+        // 記録前に停止した場合に備えて全出力先を確認
+        for (const auto &target : targets)
+        {
+            if (exists(target))
+                return target;
+        }
+        return "";
+    }
+};
+
+// グローバル出力先ルーター（複数の出力先が指定された場合のみ作成）
+std::unique_ptr<OutputRouter> outputRouter;
+
+// 出力ディレクトリの階層構成クラス
+// 一つのディレクトリにエントリが溜まらないようにサブディレクトリへ振り分け、
+// 作成済みディレクトリと一覧をキャッシュしてNASへのメタデータ操作を減らす
+class OutputLayout
+{
+public:
+    enum class Kind
+    {
+        Flat, // outputDir/名前（従来どおり）
+        Run,  // outputDir/run_01/名前
+        Hash, // outputDir/3f/名前（名前のハッシュで分散）
+    };
+
+private:
+    Kind kind = Kind::Flat;
+    int hashBuckets = 256;
+    std::map<std::string, std::set<std::string>> listings; // ディレクトリ -> 既知のエントリ名
+    std::mutex mutex;
+
+    // キャッシュがなければディレクトリを作成して一度だけ一覧する（mutex保持中に呼ぶ）
+    std::set<std::string> &listing(const std::string &dir)
+    {
+        auto it = listings.find(dir);
+        if (it != listings.end())
+            return it->second;
+
+        std::set<std::string> &names = listings[dir];
+        std::vector<VfsEntry> entries;
+        if (!vfs->createDirectories(dir) || !vfs->list(dir, entries))
+            throw std::runtime_error("cannot list output directory " + dir);
+        for (const auto &entry : entries)
+        {
+            names.insert(entry.name);
+        }
+        return names;
+    }
+
+public:
+    static bool parseKind(const std::string &name, Kind &kind)
+    {
+        if (name == "flat")
+            kind = Kind::Flat;
+        else if (name == "run")
+            kind = Kind::Run;
+        else if (name == "hash")
+            kind = Kind::Hash;
+        else
+            return false;
+        return true;
+    }
+
+    void configure(Kind newKind, int buckets)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        kind = newKind;
+        hashBuckets = std::max(1, buckets);
+        listings.clear();
+    }
+
+    // 出力ディレクトリからの相対サブディレクトリ（Flatなら空）
+    std::string subdirectory(int run, const std::string &archiveName) const
+    {
+        char name[32];
+        switch (kind)
+        {
+        case Kind::Run:
+            std::snprintf(name, sizeof(name), "run_%02d", run);
+            return name;
+        case Kind::Hash:
+            std::snprintf(name, sizeof(name), "%02x", static_cast<unsigned>(hashName(archiveName) % hashBuckets));
+            return name;
+        case Kind::Flat:
+            break;
+        }
+        return "";
+    }
+
+    // 再帰監視のサブディレクトリ（scope）は階層の下にそのまま再現する
+    std::string directoryFor(const std::string &baseDir, int run, const std::string &scope,
+                             const std::string &archiveKey) const
+    {
+        fs::path dir(baseDir);
+        std::string sub = subdirectory(run, archiveKey);
+        if (!sub.empty())
+            dir /= sub;
+        if (!scope.empty())
+            dir /= scope;
+        return dir.string();
+    }
+
+    // ディレクトリを必要なら作成する（作成済みならファイルシステムに触れない）
+    void ensureDirectory(const std::string &dir)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        listing(dir);
+    }
+
+    // キャッシュした一覧でエントリの有無を確認する
+    bool exists(const std::string &dir, const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return listing(dir).count(name) > 0;
+    }
+
+    // このプロセスが作成したエントリをキャッシュに反映する
+    void added(const std::string &dir, const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        listing(dir).insert(name);
+    }
+};
+
+// グローバル出力階層（既定は従来どおりのフラット構成）
+OutputLayout outputLayout;
+
+// ソケットの初期化（Windowsのみ必要）
+bool initSockets()
+{
+#ifdef _WIN32
+    static bool initialized = []
+    {
+        WSADATA data;
+        return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+    }();
+    return initialized;
+#else
+    return true;
+#endif
+}
+
+void closeSocket(socket_t s)
+{
+#ifdef _WIN32
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+// "host:port" 形式を分解する（"http://" は取り除く）
+bool splitHostPort(std::string endpoint, int defaultPort, std::string &host, int &port)
+{
+    if (endpoint.rfind("http://", 0) == 0)
+        endpoint = endpoint.substr(7);
+    endpoint = endpoint.substr(0, endpoint.find('/'));
+    size_t colon = endpoint.rfind(':');
+    host = endpoint.substr(0, colon);
+    port = defaultPort;
+    if (colon != std::string::npos)
+    {
+        try
+        {
+            port = std::stoi(endpoint.substr(colon + 1));
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+    }
+    return !host.empty();
+}
+
+// TCP接続を開く（失敗時は invalidSocket）
+socket_t connectTcp(const std::string &host, int port)
+{
+    if (!initSockets())
+        return invalidSocket;
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+        return invalidSocket;
+
+    socket_t s = invalidSocket;
+    for (addrinfo *a = addresses; a; a = a->ai_next)
+    {
+        s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (s == invalidSocket)
+            continue;
+        if (connect(s, a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0)
+            break;
+        closeSocket(s);
+        s = invalidSocket;
+    }
+    freeaddrinfo(addresses);
+
+    if (s != invalidSocket)
+    {
+        int noDelay = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&noDelay), sizeof(noDelay));
+    }
+    return s;
+}
+
+bool sendAll(socket_t s, const char *data, size_t size)
+{
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    while (size > 0)
+    {
+        int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+        int sent = send(s, data, chunk, flags);
+        if (sent <= 0)
+            return false;
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+bool recvAll(socket_t s, char *data, size_t size)
+{
+    while (size > 0)
+    {
+        int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+        int received = recv(s, data, chunk, 0);
+        if (received <= 0)
+            return false;
+        data += received;
+        size -= received;
+    }
+    return true;
+}
+
+// JSONの文字列リテラルにする（制御ソケットの応答用）
+std::string jsonString(const std::string &text)
+{
+    std::string out = "\"";
+    for (unsigned char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += static_cast<char>(c);
+        }
+        else if (c < 0x20)
+        {
+            char buffer[8];
+            std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            out += buffer;
+        }
+        else
+        {
+            out += static_cast<char>(c);
+        }
+    }
+    return out + "\"";
+}
+
+// 制御ソケット（Unixドメインソケット、1行1コマンドのテキストプロトコル）
+// コマンドには1行の応答を返す。"subscribe TOPIC" したクライアントには publish() した行を配信し続ける
+// 再送に対応したトピックは "subscribe TOPIC FROM" で過去の行を送ってから配信を始める
+// 配信はノンブロッキングで、送り切れない分はクライアントごとに溜め、溜まりすぎたクライアントは切断する
+class ControlServer
+{
+public:
+    using Handler = std::function<std::string(const std::string &args)>;
+    // FROM より後の行を emit に渡し、最後に送った通し番号を cursor に返す
+    using Replay = std::function<bool(const std::string &from, const std::function<void(const std::string &)> &emit,
+                                      uint64_t &cursor, std::string &error)>;
+
+private:
+    struct Client
+    {
+        socket_t fd;
+        std::string input;
+        std::string output; // 送り切れなかった分
+        std::set<std::string> topics;
+        std::map<std::string, uint64_t> cursors; // 再送済みの通し番号（これ以下の publish は送らない）
+        bool closed = false;
+    };
+
+    static constexpr size_t maxPendingOutput = 64 * 1024 * 1024;
+
+    std::string path;
+    socket_t listenFd = invalidSocket;
+    std::map<std::string, Handler> handlers;
+    std::map<std::string, Replay> replays;
+    std::vector<std::unique_ptr<Client>> clients;
+    std::mutex mutex;
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    // 溜まっている分を送れるだけ送る（mutexを保持して呼ぶ）
+    static void flushOutput(Client &client)
+    {
+#ifndef _WIN32
+        while (!client.output.empty())
+        {
+            ssize_t sent = send(client.fd, client.output.data(), client.output.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    client.closed = true;
+                return;
+            }
+            client.output.erase(0, sent);
+        }
+#else
+        client.closed = true;
+#endif
+    }
+
+    // クライアントに1行送る（mutexを保持して呼ぶ）
+    static void sendLine(Client &client, const std::string &line)
+    {
+        if (client.closed)
+            return;
+        client.output += line;
+        client.output += '\n';
+        flushOutput(client);
+        if (client.output.size() > maxPendingOutput)
+            client.closed = true;
+    }
+
+    void handleLine(Client &client, const std::string &line)
+    {
+        std::string command = line.substr(0, line.find(' '));
+        std::string args = command.size() < line.size() ? line.substr(command.size() + 1) : "";
+        if (command.empty())
+            return;
+        if (command == "subscribe")
+        {
+            std::string topic = args.substr(0, args.find(' '));
+            std::string from = topic.size() < args.size() ? args.substr(topic.size() + 1) : "";
+            if (from.empty())
+            {
+                client.topics.insert(topic);
+                sendLine(client, "{\"subscribed\":" + jsonString(topic) + "}");
+                return;
+            }
+            auto replay = replays.find(topic);
+            if (replay == replays.end())
+            {
+                sendLine(client, "{\"error\":\"topic cannot be replayed\"}");
+                return;
+            }
+            // 再送と配信の開始は同じロックの中で行うので、その間に publish された行も取りこぼさない
+            sendLine(client, "{\"subscribed\":" + jsonString(topic) + "}");
+            uint64_t cursor = 0;
+            std::string error;
+            if (!replay->second(from, [&client](const std::string &event)
+                                { sendLine(client, event); }, cursor, error))
+            {
+                sendLine(client, "{\"error\":" + jsonString(error) + "}");
+                return;
+            }
+            client.cursors[topic] = cursor;
+            client.topics.insert(topic);
+            return;
+        }
+        auto it = handlers.find(command);
+        sendLine(client, it != handlers.end() ? it->second(args) : "{\"error\":\"unknown command\"}");
+    }
+
+    void serve()
+    {
+#ifndef _WIN32
+        while (running)
+        {
+            std::vector<pollfd> fds;
+            fds.push_back({listenFd, POLLIN, 0});
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (const auto &client : clients)
+                    fds.push_back({client->fd, static_cast<short>(client->output.empty() ? POLLIN : POLLIN | POLLOUT), 0});
+            }
+            if (poll(fds.data(), fds.size(), 500) <= 0)
+                continue;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (fds[0].revents & POLLIN)
+            {
+                socket_t fd = accept(listenFd, nullptr, nullptr);
+                if (fd != invalidSocket)
+                {
+                    clients.push_back(std::make_unique<Client>());
+                    clients.back()->fd = fd;
+                }
+            }
+            for (size_t i = 1; i < fds.size(); ++i)
+            {
+                if (!fds[i].revents)
+                    continue;
+                // pollの後にクライアントが増えても、fdsの並びは既存クライアントの先頭部分と一致する
+                Client &client = *clients[i - 1];
+                if (fds[i].revents & POLLOUT)
+                    flushOutput(client);
+                if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                    continue;
+                char buffer[1024];
+                ssize_t received = recv(client.fd, buffer, sizeof(buffer), 0);
+                if (received <= 0 || client.input.size() > 65536)
+                {
+                    client.closed = true;
+                    continue;
+                }
+                client.input.append(buffer, received);
+                size_t newline;
+                while ((newline = client.input.find('\n')) != std::string::npos)
+                {
+                    std::string line = client.input.substr(0, newline);
+                    client.input.erase(0, newline + 1);
+                    if (!line.empty() && line.back() == '\r')
+                        line.pop_back();
+                    handleLine(client, line);
+                }
+            }
+            removeClosed();
+        }
+#endif
+    }
+
+    // 切断されたクライアントを片付ける（mutexを保持して呼ぶ）
+    void removeClosed()
+    {
+        for (auto it = clients.begin(); it != clients.end();)
+        {
+            if ((*it)->closed)
+            {
+                closeSocket((*it)->fd);
+                it = clients.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+public:
+    explicit ControlServer(const std::string &path) : path(path) {}
+
+    ~ControlServer()
+    {
+        running = false;
+        if (thread.joinable())
+            thread.join();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &client : clients)
+            client->closed = true;
+        removeClosed();
+        if (listenFd != invalidSocket)
+        {
+            closeSocket(listenFd);
+            std::error_code ec;
+            fs::remove(path, ec);
+        }
+    }
+
+    // start() より前に登録すること
+    void on(const std::string &command, Handler handler)
+    {
+        handlers[command] = std::move(handler);
+    }
+
+    // topicを再送に対応させる（start() より前に登録すること）
+    void replayWith(const std::string &topic, Replay replay)
+    {
+        replays[topic] = std::move(replay);
+    }
+
+    bool start()
+    {
+#ifndef _WIN32
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path))
+        {
+            LOG("Control socket path too long: " << path);
+            return false;
+        }
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd == invalidSocket)
+            return false;
+        // 前回の実行で残ったソケットファイルを置き換える
+        unlink(path.c_str());
+        if (bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listenFd, 16) != 0)
+        {
+            LOG("Error binding control socket " << path << ": " << std::strerror(errno));
+            closeSocket(listenFd);
+            listenFd = invalidSocket;
+            return false;
+        }
+        running = true;
+        thread = std::thread(&ControlServer::serve, this);
+        LOG("Control socket listening on " << path);
+        return true;
+#else
+        LOG("Control sockets are not supported on Windows; use the status file instead");
+        return false;
+#endif
+    }
+
+    // topicを購読しているクライアントに1行配信する（seq が再送済みの範囲なら送らない）
+    void publish(const std::string &topic, const std::string &line, uint64_t seq = 0)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &client : clients)
+        {
+            if (client->closed || !client->topics.count(topic))
+                continue;
+            auto cursor = client->cursors.find(topic);
+            if (seq > 0 && cursor != client->cursors.end() && seq <= cursor->second)
+                continue;
+            sendLine(*client, line);
+        }
+    }
+};
+
+std::unique_ptr<ControlServer> controlServer;
+
+// アーカイブの検査（スクラブ）の設定
+struct ScrubSettings
+{
+    std::string stateFile;      // 検査結果の記録（空なら残さない）
+    bool full = true;           // true: 展開して内容のCRCまで確かめる、false: 圧縮ブロックのCRCだけ
+    double maxMBps = 50.0;      // 読み込み速度の上限
+    double periodHours = 168.0; // 各アーカイブをこの周期で1回ずつ検査する
+    double minAgeSeconds = 300; // 書き込み直後（再圧縮前など）のアーカイブは後回しにする
+};
+
+// 書き込み済みアーカイブを低優先度で読み直し、ビット化けや途中で切れた書き込みを見つける
+// 周期内に全アーカイブを一巡するよう読み込み速度を「総サイズ÷周期」（上限あり）に揃えるので、負荷は一定になる
+class Scrubber
+{
+private:
+    struct Record
+    {
+        std::time_t checked = 0; // 最後に検査した時刻（0は未検査）
+        uintmax_t size = 0;
+        bool ok = true;
+        std::string error;
+    };
+
+    std::vector<std::string> roots;
+    ScrubSettings settings;
+    std::map<std::string, Record> records; // パス -> 検査結果
+    std::mutex mutex;
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    // 速度制限
+    std::chrono::steady_clock::time_point paceStart;
+    uintmax_t pacedBytes = 0;
+    double pace = 0.0; // MB/s
+
+    // 今回の実行での集計
+    size_t checkedCount = 0;
+    size_t failedCount = 0;
+    uintmax_t checkedBytes = 0;
+    std::string lastFailure;
+    std::chrono::steady_clock::time_point lastSave;
+
+    void loadState()
+    {
+        std::ifstream in(settings.stateFile);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            // パス \t 検査時刻 \t サイズ \t ok|fail|unchecked \t エラー
+            std::vector<std::string> fields;
+            std::stringstream stream(line);
+            std::string field;
+            while (std::getline(stream, field, '\t'))
+                fields.push_back(field);
+            if (fields.size() < 4)
+                continue;
+            Record record;
+            try
+            {
+                record.checked = static_cast<std::time_t>(std::stoll(fields[1]));
+                record.size = static_cast<uintmax_t>(std::stoull(fields[2]));
+            }
+            catch (const std::exception &)
+            {
+                continue;
+            }
+            record.ok = fields[3] != "fail";
+            record.error = fields.size() > 4 ? fields[4] : "";
+            records[fields[0]] = record;
+        }
+    }
+
+    // mutexを保持して呼ぶ
+    void saveState()
+    {
+        if (settings.stateFile.empty())
+            return;
+        std::string temp = settings.stateFile + ".tmp";
+        {
+            std::ofstream out(temp, std::ios::trunc);
+            for (const auto &entry : records)
+            {
+                out << entry.first << '\t' << entry.second.checked << '\t' << entry.second.size << '\t'
+                    << (entry.second.checked == 0 ? "unchecked" : entry.second.ok ? "ok" : "fail") << '\t'
+                    << entry.second.error << '\n';
+            }
+            if (!out)
+                return;
+        }
+        std::error_code ec;
+        fs::rename(temp, settings.stateFile, ec);
+        lastSave = std::chrono::steady_clock::now();
+    }
+
+    // 出力ディレクトリ以下のアーカイブを列挙して記録と突き合わせる（消えたものは記録から外す）
+    void scan()
+    {
+        std::map<std::string, uintmax_t> found;
+        bool complete = true;
+        for (const auto &root : roots)
+        {
+            std::error_code ec;
+            for (fs::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec))
+            {
+                // 走査中に消えたり置き換えられたりしたアーカイブはそのエントリーだけ飛ばす
+                std::error_code entryEc;
+                if (!it->is_regular_file(entryEc) || entryEc || it->path().extension() != ".snappy")
+                    continue;
+                auto age = fs::file_time_type::clock::now() - it->last_write_time(entryEc);
+                if (entryEc || std::chrono::duration<double>(age).count() < settings.minAgeSeconds)
+                    continue;
+                uintmax_t size = it->file_size(entryEc);
+                if (!entryEc)
+                    found[it->path().string()] = size;
+            }
+            if (ec && ec != std::errc::no_such_file_or_directory)
+            {
+                LOG("Error scanning " << root << " for scrubbing: " << ec.message());
+                complete = false;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        // 走査が途中で終わったときは、見つからなかった記録を消さずに残す
+        for (auto it = records.begin(); complete && it != records.end();)
+        {
+            if (!found.count(it->first))
+                it = records.erase(it);
+            else
+                ++it;
+        }
+        uintmax_t total = 0;
+        for (const auto &entry : found)
+        {
+            Record &record = records[entry.first];
+            // 書き換えられた（再圧縮された）アーカイブは検査し直す
+            if (record.size != entry.second)
+                record.checked = 0;
+            record.size = entry.second;
+            total += entry.second;
+        }
+        // 周期内に一巡できる速度（上限あり、最低でも1 MB/s）
+        pace = std::min(settings.maxMBps, std::max(1.0, total / 1e6 / (settings.periodHours * 3600.0)));
+    }
+
+    // 速度制限：これまでに読んだ量に見合う時間まで待つ
+    void throttle(uintmax_t bytes)
+    {
+        pacedBytes += bytes;
+        double due = pacedBytes / 1e6 / pace;
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - paceStart).count();
+        if (due > elapsed)
+            std::this_thread::sleep_for(std::chrono::duration<double>(std::min(due - elapsed, 10.0)));
+    }
+
+    void worker()
+    {
+        applyTaskPriority(TaskClass::Scrub);
+        auto lastScan = std::chrono::steady_clock::time_point();
+        while (running)
+        {
+            if (std::chrono::steady_clock::now() - lastScan > std::chrono::minutes(10))
+            {
+                scan();
+                lastScan = std::chrono::steady_clock::now();
+                paceStart = lastScan;
+                pacedBytes = 0;
+            }
+
+            // 最も長く検査していない、周期を過ぎたアーカイブ
+            std::string next;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::time_t dueBefore = std::time(nullptr) - static_cast<std::time_t>(settings.periodHours * 3600.0);
+                std::time_t oldest = dueBefore;
+                for (const auto &entry : records)
+                {
+                    if (entry.second.checked <= oldest)
+                    {
+                        oldest = entry.second.checked;
+                        next = entry.first;
+                    }
+                }
+            }
+            if (next.empty())
+            {
+                for (int i = 0; i < 10 && running; ++i)
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                continue;
+            }
+            verify(next);
+        }
+    }
+
+public:
+    Scrubber(const std::vector<std::string> &roots, const ScrubSettings &settings) : roots(roots), settings(settings)
+    {
+        if (!settings.stateFile.empty())
+            loadState();
+    }
+
+    ~Scrubber()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        running = true;
+        thread = std::thread(&Scrubber::worker, this);
+    }
+
+    void stop()
+    {
+        running = false;
+        if (thread.joinable())
+            thread.join();
+        std::lock_guard<std::mutex> lock(mutex);
+        saveState();
+    }
+
+    // アーカイブを1つ検査して記録する
+    bool verify(const std::string &path)
+    {
+        std::string error;
+        uintmax_t bytes = 0;
+        ContainerReader reader;
+        if (reader.open(path))
+        {
+            std::string data;
+            for (size_t i = 0; i < reader.blocks().size() && error.empty(); ++i)
+            {
+                bool ok = settings.full ? reader.readBlock(i, data) : reader.readStoredBlock(i, data);
+                if (!ok)
+                    error = reader.error();
+                bytes += reader.blocks()[i].storedSize;
+                throttle(reader.blocks()[i].storedSize);
+            }
+        }
+        else if (reader.isContainer())
+        {
+            error = reader.error();
+        }
+        else
+        {
+            // 旧形式にはチェックサムがないので、展開できるかで確かめる
+            std::string tarData;
+            if (!readArchive(path, tarData, error))
+                error = error.empty() ? "cannot decompress" : error;
+            std::error_code ec;
+            bytes = fs::file_size(path, ec);
+            throttle(bytes);
+        }
+
+        // scan() のあとに消されたアーカイブは失敗ではない。記録から外すだけにする
+        std::error_code ec;
+        if (!error.empty() && !fs::exists(path, ec) && !ec)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            records.erase(path);
+            return true;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Record &record = records[path];
+        record.checked = std::time(nullptr);
+        record.ok = error.empty();
+        record.error = error;
+        ++checkedCount;
+        checkedBytes += bytes;
+        if (!record.ok)
+        {
+            ++failedCount;
+            lastFailure = path + ": " + error;
+            LOG("Scrub failed: " << lastFailure);
+            flightRecorder.record(FlightEvent::Error, 0, 0, "scrub " + fs::path(path).filename().string());
+            if (controlServer)
+                controlServer->publish("scrub", "{\"event\":\"scrub_failure\",\"path\":" + jsonString(path) +
+                                                    ",\"error\":" + jsonString(error) + "}");
+        }
+        if (!record.ok || std::chrono::steady_clock::now() - lastSave > std::chrono::seconds(30))
+            saveState();
+        return record.ok;
+    }
+
+    // 一巡だけ検査する（scrubモード）：周期に関係なくすべてのアーカイブを上限速度で読む
+    size_t runOnce()
+    {
+        settings.minAgeSeconds = 0;
+        scan();
+        pace = settings.maxMBps;
+        paceStart = std::chrono::steady_clock::now();
+        pacedBytes = 0;
+        std::vector<std::string> paths;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto &entry : records)
+                paths.push_back(entry.first);
+        }
+        size_t failed = 0;
+        for (const auto &path : paths)
+        {
+            if (!verify(path))
+                ++failed;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        saveState();
+        return failed;
+    }
+
+    std::string status()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t failing = 0;
+        size_t never = 0;
+        for (const auto &entry : records)
+        {
+            failing += entry.second.ok ? 0 : 1;
+            never += entry.second.checked == 0 ? 1 : 0;
+        }
+        std::ostringstream json;
+        json << std::fixed << std::setprecision(1)
+             << "{\"archives\":" << records.size()
+             << ",\"unchecked\":" << never
+             << ",\"failing\":" << failing
+             << ",\"checked\":" << checkedCount
+             << ",\"failed\":" << failedCount
+             << ",\"checked_mb\":" << checkedBytes / 1e6
+             << ",\"pace_mbps\":" << pace
+             << ",\"last_failure\":" << jsonString(lastFailure) << "}";
+        return json.str();
+    }
+};
+
+std::unique_ptr<Scrubber> scrubber;
+
+// SHA-256（S3署名用）
+class Sha256
+{
+private:
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t blockLength = 0;
+    uint64_t totalLength = 0;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void transform(const unsigned char *p)
+    {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = (uint32_t(p[i * 4]) << 24) | (uint32_t(p[i * 4 + 1]) << 16) | (uint32_t(p[i * 4 + 2]) << 8) | p[i * 4 + 3];
+        for (int i = 16; i < 64; ++i)
+        {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+public:
+    Sha256()
+    {
+        static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        std::memcpy(state, init, sizeof(state));
+    }
+
+    void update(const void *data, size_t size)
+    {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        totalLength += size;
+        while (size > 0)
+        {
+            size_t take = std::min(size, sizeof(block) - blockLength);
+            std::memcpy(block + blockLength, p, take);
+            blockLength += take;
+            p += take;
+            size -= take;
+            if (blockLength == sizeof(block))
+            {
+                transform(block);
+                blockLength = 0;
+            }
+        }
+    }
+
+    std::string digest()
+    {
+        uint64_t bits = totalLength * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (blockLength != 56)
+            update(&pad, 1);
+        unsigned char length[8];
+        for (int i = 0; i < 8; ++i)
+            length[i] = static_cast<unsigned char>(bits >> (56 - i * 8));
+        update(length, 8);
+
+        std::string out(32, '\0');
+        for (int i = 0; i < 8; ++i)
+            for (int j = 0; j < 4; ++j)
+                out[i * 4 + j] = static_cast<char>(state[i] >> (24 - j * 8));
+        return out;
+    }
+
+    static std::string hash(const void *data, size_t size)
+    {
+        Sha256 sha;
+        sha.update(data, size);
+        return sha.digest();
+    }
+};
+
+std::string hmacSha256(const std::string &key, const std::string &message)
+{
+    std::string k = key.size() > 64 ? Sha256::hash(key.data(), key.size()) : key;
+    k.resize(64, '\0');
+    std::string inner(64, '\0'), outer(64, '\0');
+    for (int i = 0; i < 64; ++i)
+    {
+        inner[i] = static_cast<char>(k[i] ^ 0x36);
+        outer[i] = static_cast<char>(k[i] ^ 0x5c);
+    }
+    inner += message;
+    outer += Sha256::hash(inner.data(), inner.size());
+    return Sha256::hash(outer.data(), outer.size());
+}
+
+std::string toHex(const std::string &bytes)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    for (unsigned char c : bytes)
+    {
+        out += digits[c >> 4];
+        out += digits[c & 15];
+    }
+    return out;
+}
+
+// RFC 3986 の非予約文字以外をエンコード（keepSlashならパス区切りは残す）
+std::string uriEncode(const std::string &value, bool keepSlash)
+{
+    std::ostringstream out;
+    for (unsigned char c : value)
+    {
+        if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (keepSlash && c == '/'))
+            out << c;
+        else
+            out << '%' << std::uppercase << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(c)
+                << std::nouppercase << std::dec;
+    }
+    return out.str();
+}
+
+struct HttpResponse
+{
+    int status = 0;
+    std::map<std::string, std::string> headers; // キーは小文字
+    std::string body;
+};
+
+// HTTP/1.1 リクエストを一つ送って応答を受け取る（接続は毎回閉じる）
+bool httpRequest(const std::string &host, int port, const std::string &method, const std::string &target,
+                 const std::vector<std::pair<std::string, std::string>> &headers, const char *body, size_t bodySize,
+                 HttpResponse &response, std::string &error)
+{
+    socket_t s = connectTcp(host, port);
+    if (s == invalidSocket)
+    {
+        error = "cannot connect to " + host + ":" + std::to_string(port);
+        return false;
+    }
+
+    std::ostringstream request;
+    request << method << " " << target << " HTTP/1.1\r\n";
+    for (const auto &header : headers)
+        request << header.first << ": " << header.second << "\r\n";
+    request << "Content-Length: " << bodySize << "\r\nConnection: close\r\n\r\n";
+    std::string head = request.str();
+
+    if (!sendAll(s, head.data(), head.size()) || (bodySize > 0 && !sendAll(s, body, bodySize)))
+    {
+        closeSocket(s);
+        error = "connection lost while sending";
+        return false;
+    }
+
+    std::string raw;
+    char buffer[65536];
+    int received;
+    while ((received = recv(s, buffer, sizeof(buffer), 0)) > 0)
+        raw.append(buffer, received);
+    closeSocket(s);
+
+    size_t headerEnd = raw.find("\r\n\r\n");
+    if (raw.compare(0, 5, "HTTP/") != 0 || headerEnd == std::string::npos)
+    {
+        error = "malformed HTTP response";
+        return false;
+    }
+    response.status = std::atoi(raw.c_str() + raw.find(' ') + 1);
+    response.headers.clear();
+    std::istringstream lines(raw.substr(0, headerEnd));
+    std::string line;
+    std::getline(lines, line);
+    while (std::getline(lines, line))
+    {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string key = line.substr(0, colon);
+        std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c)
+                       { return static_cast<char>(std::tolower(c)); });
+        std::string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(' '));
+        value.erase(value.find_last_not_of("\r ") + 1);
+        response.headers[key] = value;
+    }
+    response.body = raw.substr(headerEnd + 4);
+    return true;
+}
+
+// 出力されるアーカイブ一つ分（ブロックを追記し、最後にcommitかabortする）
+class ArchiveOutput
+{
+public:
+    virtual ~ArchiveOutput() = default;
+    virtual bool append(const char *data, size_t size) = 0;
+    virtual bool commit() = 0; // 成功したら出力は確定している
+    virtual void abort() = 0;  // 途中の出力を破棄する
+};
+
+// 出力先の抽象クラス（ローカルファイル、オブジェクトストレージなど）
+class ArchiveSink
+{
+public:
+    virtual ~ArchiveSink() = default;
+    // pathは出力ディレクトリ以下のパス（オブジェクトストレージではキーに変換する）
+    virtual std::unique_ptr<ArchiveOutput> openArchive(const std::string &path) = 0;
+    // ローカルのファイルシステムに書き込むか（ディレクトリ作成や再圧縮の可否に使う）
+    virtual bool isLocal() const { return false; }
+    // 確定したデータが残るか（残らない出力では元ファイルを削除しない）
+    virtual bool keepsData() const { return true; }
+    virtual const char *name() const = 0;
+
+    // 書き込み済みのアーカイブがあるか問い合わせる（答えられなければfalseを返し、出力ディレクトリで判定する）
+    virtual bool lookup(const std::string &path, bool &exists)
+    {
+        (void)path;
+        (void)exists;
+        return false;
+    }
+
+    // ファイルをそのまま出力する（既定ではopenArchiveを経由する）
+    virtual bool copyFile(const std::string &source, const std::string &path)
+    {
+        std::ifstream in(source, std::ios::binary);
+        std::unique_ptr<ArchiveOutput> out = openArchive(path);
+        if (!in || !out)
+            return false;
+        std::vector<char> buffer(1 << 20);
+        while (in)
+        {
+            in.read(buffer.data(), buffer.size());
+            if (in.gcount() > 0 && !out->append(buffer.data(), static_cast<size_t>(in.gcount())))
+            {
+                out->abort();
+                return false;
+            }
+        }
+        return out->commit();
+    }
+};
+
+// ローカルファイルへの出力（従来どおり std::ofstream で書く）
+class LocalFileSink : public ArchiveSink
+{
+private:
+    class Output : public ArchiveOutput
+    {
+    private:
+        std::string path;
+        std::ofstream file;
+        bool done = false;
+
+    public:
+        explicit Output(const std::string &path) : path(path), file(path, std::ios::binary) {}
+        ~Output() override
+        {
+            if (!done)
+                abort();
+        }
+        bool isOpen() const { return static_cast<bool>(file); }
+        bool append(const char *data, size_t size) override { return static_cast<bool>(file.write(data, size)); }
+        bool commit() override
+        {
+            file.close();
+            done = true;
+            return !file.fail();
+        }
+        void abort() override
+        {
+            file.close();
+            done = true;
+            std::error_code ec;
+            fs::remove(path, ec);
+        }
+    };
+
+public:
+    std::unique_ptr<ArchiveOutput> openArchive(const std::string &path) override
+    {
+        auto output = std::make_unique<Output>(path);
+        if (!output->isOpen())
+            return nullptr;
+        return output;
+    }
+
+    bool isLocal() const override { return true; }
+    const char *name() const override { return "file"; }
+
+    bool copyFile(const std::string &source, const std::string &path) override
+    {
+        return fs::copy_file(source, path, fs::copy_options::overwrite_existing);
+    }
+};
+
+#ifdef __linux__
+// O_DIRECTでページキャッシュを通さずに書く出力（Linuxのみ）
+// 4KiB境界に揃えたバッファにためて書き、最後の端数は埋めて書いた後に切り詰める
+class DirectFileSink : public ArchiveSink
+{
+private:
+    static constexpr size_t alignment = 4096;
+    static constexpr size_t bufferSize = 4 * 1024 * 1024;
+
+    class Output : public ArchiveOutput
+    {
+    private:
+        std::string path;
+        int fd = -1;
+        char *buffer = nullptr;
+        size_t used = 0;
+        uint64_t written = 0;
+        bool done = false;
+
+        bool flushBuffer(size_t size)
+        {
+            size_t offset = 0;
+            while (offset < size)
+            {
+                ssize_t n = pwrite(fd, buffer + offset, size - offset, static_cast<off_t>(written + offset));
+                if (n <= 0)
+                    return false;
+                offset += static_cast<size_t>(n);
+            }
+            return true;
+        }
+
+    public:
+        explicit Output(const std::string &path) : path(path)
+        {
+            fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+            if (fd < 0 && errno == EINVAL)
+            {
+                // tmpfsなどO_DIRECTに対応しないファイルシステム
+                fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            }
+            buffer = static_cast<char *>(std::aligned_alloc(alignment, bufferSize));
+        }
+
+        ~Output() override
+        {
+            if (!done)
+                abort();
+            std::free(buffer);
+        }
+
+        bool isOpen() const { return fd >= 0 && buffer; }
+
+        bool append(const char *data, size_t size) override
+        {
+            while (size > 0)
+            {
+                size_t chunk = std::min(size, bufferSize - used);
+                std::memcpy(buffer + used, data, chunk);
+                used += chunk;
+                data += chunk;
+                size -= chunk;
+                if (used == bufferSize)
+                {
+                    if (!flushBuffer(used))
+                        return false;
+                    written += used;
+                    used = 0;
+                }
+            }
+            return true;
+        }
+
+        bool commit() override
+        {
+            done = true;
+            size_t padded = (used + alignment - 1) / alignment * alignment;
+            std::memset(buffer + used, 0, padded - used);
+            bool ok = flushBuffer(padded) && ftruncate(fd, static_cast<off_t>(written + used)) == 0;
+            ok = close(fd) == 0 && ok;
+            fd = -1;
+            return ok;
+        }
+
+        void abort() override
+        {
+            done = true;
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+            unlink(path.c_str());
+        }
+    };
+
+public:
+    std::unique_ptr<ArchiveOutput> openArchive(const std::string &path) override
+    {
+        auto output = std::make_unique<Output>(path);
+        if (!output->isOpen())
+            return nullptr;
+        return output;
+    }
+
+    bool isLocal() const override { return true; }
+    const char *name() const override { return "direct"; }
+};
+#endif
+
+#ifndef _WIN32
+// mmapした領域にコピーして書く出力
+// 領域が足りなくなったらファイルを広げて貼り直し、確定時に実サイズへ切り詰める
+class MmapFileSink : public ArchiveSink
+{
+private:
+    class Output : public ArchiveOutput
+    {
+    private:
+        std::string path;
+        int fd = -1;
+        char *map = nullptr;
+        size_t capacity = 0;
+        size_t size = 0;
+        bool done = false;
+
+        bool unmap()
+        {
+            bool ok = true;
+            if (map)
+                ok = munmap(map, capacity) == 0;
+            map = nullptr;
+            return ok;
+        }
+
+        // 伸ばした範囲のブロックを先に確保する
+        // ftruncateだけでは疎なファイルになり、ディスクが一杯だとマップへの書き込みでSIGBUSになる
+        bool reserve(size_t from, size_t to)
+        {
+#ifdef __APPLE__
+            // posix_fallocateがないので、ゼロを書いて確保する
+            static const char zeros[64 * 1024] = {};
+            for (size_t offset = from; offset < to;)
+            {
+                ssize_t written = pwrite(fd, zeros, std::min(sizeof(zeros), to - offset), static_cast<off_t>(offset));
+                if (written <= 0)
+                {
+                    LOG("Error reserving space for " << path << ": " << std::strerror(errno));
+                    return false;
+                }
+                offset += static_cast<size_t>(written);
+            }
+            return true;
+#else
+            int error = posix_fallocate(fd, static_cast<off_t>(from), static_cast<off_t>(to - from));
+            if (error != 0)
+                LOG("Error reserving space for " << path << ": " << std::strerror(error));
+            return error == 0;
+#endif
+        }
+
+        bool grow(size_t needed)
+        {
+            size_t newCapacity = std::max<size_t>({capacity * 2, needed, 64 * 1024 * 1024});
+            if (!unmap() || !reserve(capacity, newCapacity))
+                return false;
+            void *p = mmap(nullptr, newCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED)
+                return false;
+            map = static_cast<char *>(p);
+            capacity = newCapacity;
+            return true;
+        }
+
+    public:
+        explicit Output(const std::string &path) : path(path)
+        {
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        }
+
+        ~Output() override
+        {
+            if (!done)
+                abort();
+        }
+
+        bool isOpen() const { return fd >= 0; }
+
+        bool append(const char *data, size_t length) override
+        {
+            if (size + length > capacity && !grow(size + length))
+                return false;
+            std::memcpy(map + size, data, length);
+            size += length;
+            return true;
+        }
+
+        bool commit() override
+        {
+            done = true;
+            bool ok = unmap() && ftruncate(fd, static_cast<off_t>(size)) == 0;
+            ok = close(fd) == 0 && ok;
+            fd = -1;
+            return ok;
+        }
+
+        void abort() override
+        {
+            done = true;
+            unmap();
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+            unlink(path.c_str());
+        }
+    };
+
+public:
+    std::unique_ptr<ArchiveOutput> openArchive(const std::string &path) override
+    {
+        auto output = std::make_unique<Output>(path);
+        if (!output->isOpen())
+            return nullptr;
+        return output;
+    }
+
+    bool isLocal() const override { return true; }
+    const char *name() const override { return "mmap"; }
+};
+#endif
+
+// ローカルのスプールディレクトリに書いてから確定時に出力先へ移動する出力
+// 出力先が遅い共有ストレージでも、書き込み中の不完全なファイルが見えない
+class SpoolFileSink : public ArchiveSink
+{
+private:
+    std::string spoolDir;
+    std::atomic<uint64_t> counter{0};
+
+    class Output : public ArchiveOutput
+    {
+    private:
+        std::string spoolPath;
+        std::string path;
+        std::ofstream file;
+        bool done = false;
+
+    public:
+        Output(const std::string &spoolPath, const std::string &path)
+            : spoolPath(spoolPath), path(path), file(spoolPath, std::ios::binary) {}
+        ~Output() override
+        {
+            if (!done)
+                abort();
+        }
+        bool isOpen() const { return static_cast<bool>(file); }
+        bool append(const char *data, size_t size) override { return static_cast<bool>(file.write(data, size)); }
+        bool commit() override
+        {
+            file.close();
+            if (file.fail())
+            {
+                abort();
+                return false;
+            }
+            done = true;
+            std::error_code ec;
+            fs::rename(spoolPath, path, ec);
+            if (ec)
+            {
+                // 別ボリュームならコピーしてから消す
+                ec.clear();
+                fs::copy_file(spoolPath, path, fs::copy_options::overwrite_existing, ec);
+                std::error_code ignored;
+                fs::remove(spoolPath, ignored);
+                if (ec)
+                    fs::remove(path, ignored);
+            }
+            return !ec;
+        }
+        void abort() override
+        {
+            file.close();
+            done = true;
+            std::error_code ec;
+            fs::remove(spoolPath, ec);
+        }
+    };
+
+public:
+    explicit SpoolFileSink(const std::string &spoolDir) : spoolDir(spoolDir)
+    {
+        fs::create_directories(spoolDir);
+    }
+
+    std::unique_ptr<ArchiveOutput> openArchive(const std::string &path) override
+    {
+        std::string spoolPath = (fs::path(spoolDir) / (std::to_string(counter++) + "_" + fs::path(path).filename().string() + ".spool")).string();
+        auto output = std::make_unique<Output>(spoolPath, path);
+        if (!output->isOpen())
+            return nullptr;
+        return output;
+    }
+
+    bool isLocal() const override { return true; }
+    const char *name() const override { return "spool"; }
+};
+
+// 書き込みを捨てる出力（I/Oを除いた圧縮処理のベンチマーク用）
+// データを保存しないので元ファイルは削除しない
+class NullSink : public ArchiveSink
+{
+private:
+    std::atomic<uint64_t> bytes{0};
+
+    class Output : public ArchiveOutput
+    {
+    private:
+        std::atomic<uint64_t> &bytes;
+
+    public:
+        explicit Output(std::atomic<uint64_t> &bytes) : bytes(bytes) {}
+        bool append(const char *, size_t size) override
+        {
+            bytes += size;
+            return true;
+        }
+        bool commit() override { return true; }
+        void abort() override {}
+    };
+
+public:
+    std::unique_ptr<ArchiveOutput> openArchive(const std::string &) override
+    {
+        return std::make_unique<Output>(bytes);
+    }
+
+    bool copyFile(const std::string &, const std::string &) override { return true; }
+    bool keepsData() const override { return false; }
+    const char *name() const override { return "null"; }
+};
+
+// 名前からローカル系の出力を作る（未知の名前ならnullptr）
+std::unique_ptr<ArchiveSink> makeLocalSink(const std::string &name, const std::string &spoolDir)
+{
+    if (name == "file")
+        return std::make_unique<LocalFileSink>();
+    if (name == "null")
+        return std::make_unique<NullSink>();
+    if (name == "spool")
+        return std::make_unique<SpoolFileSink>(spoolDir);
+    if (name == "direct")
+    {
+#ifdef __linux__
+        return std::make_unique<DirectFileSink>();
+#else
+        LOG("O_DIRECT output is only supported on Linux, using buffered file output");
+        return std::make_unique<LocalFileSink>();
+#endif
+    }
+    if (name == "mmap")
+    {
+#ifndef _WIN32
+        return std::make_unique<MmapFileSink>();
+#else
+        LOG("mmap output is not supported on Windows, using buffered file output");
+        return std::make_unique<LocalFileSink>();
+#endif
+    }
+    return nullptr;
+}
+
+// VFSへの出力（メモリ上のファイルシステム用）
+// 内容をためておき、確定時に一度に書き込む
+class VfsSink : public ArchiveSink
+{
+private:
+    class Output : public ArchiveOutput
+    {
+    private:
+        std::string path;
+        std::vector<char> data;
+
+    public:
+        explicit Output(const std::string &path) : path(path) {}
+        bool append(const char *bytes, size_t size) override
+        {
+            data.insert(data.end(), bytes, bytes + size);
+            return true;
+        }
+        bool commit() override { return vfs->writeFile(path, data.data(), data.size()); }
+        void abort() override { data.clear(); }
+    };
+
+public:
+    std::unique_ptr<ArchiveOutput> openArchive(const std::string &path) override
+    {
+        return std::make_unique<Output>(path);
+    }
+
+    bool copyFile(const std::string &source, const std::string &path) override
+    {
+        std::vector<char> data;
+        return vfs->readFile(source, data) && vfs->writeFile(path, data.data(), data.size());
+    }
+
+    const char *name() const override { return "vfs"; }
+};
+
+// S3互換オブジェクトストレージの設定
+struct S3Settings
+{
+    std::string host;
+    int port = 80;
+    std::string bucket;
+    std::string prefix; // キーの先頭に付ける（例: "beamtime2025/"）
+    std::string region = "us-east-1";
+    std::string accessKey;
+    std::string secretKey;
+    size_t partSize = 16 * 1024 * 1024; // 5MB以上（S3の制約）
+    int concurrency = 4;                // 同時に送るパート数
+};
+
+// 署名付きでS3 APIを呼ぶクライアント（パススタイル、AWS Signature Version 4、HTTPのみ）
+class S3Client
+{
+private:
+    S3Settings settings;
+
+    static std::string utcTimestamp(const char *format)
+    {
+        std::time_t now = std::time(nullptr);
+        std::tm tm{};
+#ifdef _WIN32
+        gmtime_s(&tm, &now);
+#else
+        gmtime_r(&now, &tm);
+#endif
+        char buffer[32];
+        std::strftime(buffer, sizeof(buffer), format, &tm);
+        return buffer;
+    }
+
+public:
+    explicit S3Client(const S3Settings &settings) : settings(settings) {}
+
+    const S3Settings &config() const { return settings; }
+
+    // queryはキーでソート済みであること
+    bool request(const std::string &method, const std::string &key,
+                 const std::vector<std::pair<std::string, std::string>> &query, const char *body, size_t bodySize,
+                 HttpResponse &response, std::string &error) const
+    {
+        std::string path = "/" + uriEncode(settings.bucket, false) + "/" + uriEncode(key, true);
+        std::string queryString;
+        for (const auto &q : query)
+        {
+            if (!queryString.empty())
+                queryString += "&";
+            queryString += uriEncode(q.first, false) + "=" + uriEncode(q.second, false);
+        }
+
+        std::string hostHeader = settings.host + (settings.port == 80 ? "" : ":" + std::to_string(settings.port));
+        std::string payloadHash = toHex(Sha256::hash(body, bodySize));
+        std::string amzDate = utcTimestamp("%Y%m%dT%H%M%SZ");
+        std::string date = amzDate.substr(0, 8);
+
+        std::string canonicalRequest = method + "\n" + path + "\n" + queryString + "\n" +
+                                       "host:" + hostHeader + "\n" +
+                                       "x-amz-content-sha256:" + payloadHash + "\n" +
+                                       "x-amz-date:" + amzDate + "\n\n" +
+                                       "host;x-amz-content-sha256;x-amz-date\n" + payloadHash;
+        std::string scope = date + "/" + settings.region + "/s3/aws4_request";
+        std::string stringToSign = "AWS4-HMAC-SHA256\n" + amzDate + "\n" + scope + "\n" +
+                                   toHex(Sha256::hash(canonicalRequest.data(), canonicalRequest.size()));
+        std::string signingKey = hmacSha256(hmacSha256(hmacSha256(hmacSha256("AWS4" + settings.secretKey, date),
+                                                                   settings.region),
+                                                       "s3"),
+                                            "aws4_request");
+        std::string authorization = "AWS4-HMAC-SHA256 Credential=" + settings.accessKey + "/" + scope +
+                                    ", SignedHeaders=host;x-amz-content-sha256;x-amz-date, Signature=" +
+                                    toHex(hmacSha256(signingKey, stringToSign));
+
+        std::vector<std::pair<std::string, std::string>> headers = {
+            {"Host", hostHeader},
+            {"x-amz-content-sha256", payloadHash},
+            {"x-amz-date", amzDate},
+            {"Authorization", authorization},
+        };
+        std::string target = path + (queryString.empty() ? "" : "?" + queryString);
+
+        // 通信エラーとサーバーエラーは再試行する
+        for (int attempt = 1; attempt <= 3; ++attempt)
+        {
+            if (httpRequest(settings.host, settings.port, method, target, headers, body, bodySize, response, error))
+            {
+                if (response.status < 500)
+                    return response.status >= 200 && response.status < 300 &&
+                           response.body.find("<Error>") == std::string::npos;
+                error = "HTTP " + std::to_string(response.status);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(200 * attempt));
+        }
+        return false;
+    }
+};
+
+// XMLから最初の <tag>...</tag> の中身を取り出す
+std::string xmlValue(const std::string &xml, const std::string &tag)
+{
+    size_t start = xml.find("<" + tag + ">");
+    if (start == std::string::npos)
+        return "";
+    start += tag.size() + 2;
+    size_t end = xml.find("</" + tag + ">", start);
+    return end == std::string::npos ? "" : xml.substr(start, end - start);
+}
+
+// S3互換オブジェクトストレージへの出力
+// パートサイズに達したデータから順にマルチパートアップロードし、
+// 後続ブロックの圧縮中にも複数パートを並列に送る
+class S3Sink : public ArchiveSink
+{
+private:
+    S3Client client;
+    std::string rootDir;
+
+    // 全アーカイブで共有する送信スレッド
+    std::queue<std::function<void()>> tasks;
+    std::mutex queue_mutex;
+    std::condition_variable cv;
+    std::vector<std::thread> workers;
+    bool running = true;
+    std::set<std::string> knownKeys; // 存在を確かめたキー（queue_mutexで保護）
+
+    void worker()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                cv.wait(lock, [this]
+                        { return !tasks.empty() || !running; });
+                if (tasks.empty())
+                    break;
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+    void post(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            tasks.push(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    void remember(const std::string &key)
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        knownKeys.insert(key);
+    }
+
+    class Upload : public ArchiveOutput
+    {
+    private:
+        S3Sink &sink;
+        std::string key;
+        std::string buffer;
+        std::string uploadId;
+        int nextPart = 1;
+        std::map<int, std::string> etags;
+        int outstanding = 0;
+        bool failed = false;
+        bool done = false;
+        std::mutex mutex;
+        std::condition_variable cv;
+
+        bool startMultipart()
+        {
+            HttpResponse response;
+            std::string error;
+            if (!sink.client.request("POST", key, {{"uploads", ""}}, nullptr, 0, response, error))
+            {
+                LOG("Error starting upload of " << key << ": " << (error.empty() ? response.body : error));
+                return false;
+            }
+            uploadId = xmlValue(response.body, "UploadId");
+            return !uploadId.empty();
+        }
+
+        // パートを送信スレッドに渡す（送信中が多すぎるときは待つ）
+        bool sendPart(std::string data)
+        {
+            int partNumber = nextPart++;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]
+                        { return outstanding < sink.client.config().concurrency || failed; });
+                if (failed)
+                    return false;
+                ++outstanding;
+            }
+            auto part = std::make_shared<std::string>(std::move(data));
+            sink.post([this, part, partNumber]()
+                      {
+                HttpResponse response;
+                std::string error;
+                bool ok = sink.client.request("PUT", key, {{"partNumber", std::to_string(partNumber)}, {"uploadId", uploadId}},
+                                              part->data(), part->size(), response, error);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (ok && response.headers.count("etag"))
+                    etags[partNumber] = response.headers["etag"];
+                else
+                {
+                    LOG("Error uploading part " << partNumber << " of " << key << ": " << (error.empty() ? response.body : error));
+                    failed = true;
+                }
+                --outstanding;
+                cv.notify_all(); });
+            return true;
+        }
+
+        bool waitParts()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]
+                    { return outstanding == 0; });
+            return !failed;
+        }
+
+    public:
+        Upload(S3Sink &sink, const std::string &key) : sink(sink), key(key) {}
+
+        ~Upload() override
+        {
+            if (!done)
+                abort();
+        }
+
+        bool append(const char *data, size_t size) override
+        {
+            buffer.append(data, size);
+            size_t partSize = sink.client.config().partSize;
+            while (buffer.size() >= partSize)
+            {
+                if (uploadId.empty() && !startMultipart())
+                    return false;
+                if (!sendPart(buffer.substr(0, partSize)))
+                    return false;
+                buffer.erase(0, partSize);
+            }
+            return true;
+        }
+
+        bool commit() override
+        {
+            HttpResponse response;
+            std::string error;
+            done = true;
+
+            // パートサイズ未満なら一回のPUTで済ませる
+            if (uploadId.empty())
+            {
+                if (!sink.client.request("PUT", key, {}, buffer.data(), buffer.size(), response, error))
+                {
+                    LOG("Error uploading " << key << ": " << (error.empty() ? response.body : error));
+                    return false;
+                }
+                sink.remember(key);
+                return true;
+            }
+
+            if ((!buffer.empty() && !sendPart(std::move(buffer))) || !waitParts())
+            {
+                done = false;
+                abort();
+                return false;
+            }
+
+            std::ostringstream xml;
+            xml << "<CompleteMultipartUpload>";
+            for (const auto &etag : etags)
+                xml << "<Part><PartNumber>" << etag.first << "</PartNumber><ETag>" << etag.second << "</ETag></Part>";
+            xml << "</CompleteMultipartUpload>";
+            std::string body = xml.str();
+            if (!sink.client.request("POST", key, {{"uploadId", uploadId}}, body.data(), body.size(), response, error))
+            {
+                LOG("Error completing upload of " << key << ": " << (error.empty() ? response.body : error));
+                done = false;
+                abort();
+                return false;
+            }
+            sink.remember(key);
+            return true;
+        }
+
+        void abort() override
+        {
+            done = true;
+            waitParts();
+            if (uploadId.empty())
+                return;
+            HttpResponse response;
+            std::string error;
+            if (!sink.client.request("DELETE", key, {{"uploadId", uploadId}}, nullptr, 0, response, error))
+                LOG("Error aborting upload of " << key << ": " << (error.empty() ? response.body : error));
+            uploadId.clear();
+        }
+    };
+
+public:
+    S3Sink(const S3Settings &settings, const std::string &rootDir) : client(settings), rootDir(rootDir)
+    {
+        for (int i = 0; i < std::max(1, settings.concurrency); ++i)
+        {
+            workers.emplace_back(&S3Sink::worker, this);
+        }
+    }
+
+    ~S3Sink() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            running = false;
+        }
+        cv.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // 出力ディレクトリからの相対パスをキーにする
+    std::string keyFor(const std::string &path) const
+    {
+        std::string relative = fs::path(path).lexically_relative(rootDir).generic_string();
+        if (relative.empty() || relative.rfind("..", 0) == 0)
+            relative = fs::path(path).filename().string();
+        return client.config().prefix + relative;
+    }
+
+    std::unique_ptr<ArchiveOutput> openArchive(const std::string &path) override
+    {
+        return std::make_unique<Upload>(*this, keyFor(path));
+    }
+
+    // HEADで確かめる（あると分かったキーは覚えておき、次からは問い合わせない）
+    bool lookup(const std::string &path, bool &exists) override
+    {
+        std::string key = keyFor(path);
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (knownKeys.count(key))
+            {
+                exists = true;
+                return true;
+            }
+        }
+        HttpResponse response;
+        std::string error;
+        bool found = client.request("HEAD", key, {}, nullptr, 0, response, error);
+        if (!found && response.status != 404)
+        {
+            LOG("Error checking " << key << ": " << (error.empty() ? "HTTP " + std::to_string(response.status) : error));
+            return false;
+        }
+        exists = found;
+        if (found)
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            knownKeys.insert(key);
+        }
+        return true;
+    }
+
+    const char *name() const override { return "s3"; }
+};
+
+// ファイルをディスクまで書き出す（受信側の耐久性確認用）
+bool syncFile(std::FILE *file)
+{
+    if (std::fflush(file) != 0)
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// リネームを確定させるためにディレクトリを同期する（POSIXのみ）
+void syncDirectory(const fs::path &dir)
+{
+#ifndef _WIN32
+    int fd = open(dir.string().c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+#else
+    (void)dir;
+#endif
+}
+
+// TCPストリーミングのフレーム（リトルエンディアン）
+// 送信側: OPEN(相対パス) -> DATA... -> COMMIT/ABORT、受信側: ACK/NACK(エラーメッセージ)
+// 既にあるアーカイブへのOPENは、flagsにOpenReplaceがなければNACKする
+// QUERY(相対パス)には、アーカイブがあれば "1"、なければ "0" をペイロードにしたACKを返す
+// 一つの接続上で複数のアーカイブのフレームを交互に送れる
+#pragma pack(push, 1)
+struct StreamFrame
+{
+    uint8_t type;
+    uint8_t flags;
+    uint8_t reserved[2];
+    uint32_t archiveId;
+    uint64_t length; // 続くペイロードのバイト数
+};
+#pragma pack(pop)
+
+enum StreamFrameType : uint8_t
+{
+    FrameOpen = 1,
+    FrameData = 2,
+    FrameCommit = 3,
+    FrameAbort = 4,
+    FrameAck = 5,
+    FrameNack = 6,
+    FrameQuery = 7,
+};
+
+const uint8_t OpenReplace = 1; // OPENのflags：既にあるアーカイブを置き換える
+
+const char streamGreeting[8] = {'S', 'N', 'P', 'K', 'S', 'T', 'R', '1'};
+const uint64_t maxFramePayload = 64 * 1024 * 1024;
+
+bool sendFrame(socket_t s, uint8_t type, uint32_t archiveId, const char *data, size_t size, uint8_t flags = 0)
+{
+    StreamFrame frame{};
+    frame.type = type;
+    frame.flags = flags;
+    frame.archiveId = archiveId;
+    frame.length = size;
+    return sendAll(s, reinterpret_cast<const char *>(&frame), sizeof(frame)) && (size == 0 || sendAll(s, data, size));
+}
+
+bool recvFrame(socket_t s, StreamFrame &frame, std::string &payload)
+{
+    if (!recvAll(s, reinterpret_cast<char *>(&frame), sizeof(frame)) || frame.length > maxFramePayload)
+        return false;
+    payload.resize(static_cast<size_t>(frame.length));
+    return frame.length == 0 || recvAll(s, &payload[0], payload.size());
+}
+
+// 受信デーモンへTCPで送る出力先
+// 全セットで一つの接続を共有し、COMMITに対するACK（受信側でfsync済み）を待ってから成功を返す
+class TcpSink : public ArchiveSink
+{
+private:
+    std::string host;
+    int port;
+    std::string rootDir;
+
+    std::mutex sendMutex; // 接続状態と送信を保護
+    socket_t sock = invalidSocket;
+    uint64_t generation = 0; // 再接続のたびに増える
+    std::thread reader;
+
+    std::mutex stateMutex;
+    std::condition_variable stateCv;
+    std::map<uint32_t, int> results; // アーカイブID -> 0:待ち, 1:成功, -1:失敗
+    std::map<uint32_t, bool> found;  // QUERYのID -> アーカイブがあるか
+    std::set<std::string> knownPaths; // あると分かった相対パス（次からは問い合わせない）
+    bool broken = false;
+    uint32_t nextId = 1;
+
+    // 応答を受け取るスレッド
+    void readerLoop(socket_t s)
+    {
+        StreamFrame frame;
+        std::string payload;
+        while (recvFrame(s, frame, payload))
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            auto it = results.find(frame.archiveId);
+            if (it == results.end())
+                continue;
+            if (frame.type == FrameAck)
+            {
+                it->second = 1;
+                found[frame.archiveId] = payload == "1";
+            }
+            else
+            {
+                LOG("Receiver rejected archive " << frame.archiveId << ": " << payload);
+                it->second = -1;
+            }
+            stateCv.notify_all();
+        }
+
+        // 接続が切れたら待っているアーカイブはすべて失敗
+        std::lock_guard<std::mutex> lock(stateMutex);
+        broken = true;
+        for (auto &result : results)
+        {
+            if (result.second == 0)
+                result.second = -1;
+        }
+        stateCv.notify_all();
+    }
+
+    // 接続がなければ接続する（sendMutex保持中に呼ぶ）
+    bool ensureConnected()
+    {
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            if (sock != invalidSocket && !broken)
+                return true;
+        }
+        if (sock != invalidSocket)
+        {
+            shutdown(sock, 2);
+            if (reader.joinable())
+                reader.join();
+            closeSocket(sock);
+            sock = invalidSocket;
+        }
+
+        socket_t s = connectTcp(host, port);
+        if (s == invalidSocket || !sendAll(s, streamGreeting, sizeof(streamGreeting)))
+        {
+            if (s != invalidSocket)
+                closeSocket(s);
+            LOG("Error connecting to receiver " << host << ":" << port);
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            broken = false;
+        }
+        sock = s;
+        ++generation;
+        reader = std::thread(&TcpSink::readerLoop, this, s);
+        LOG("Connected to receiver " << host << ":" << port);
+        return true;
+    }
+
+    class Output : public ArchiveOutput
+    {
+    private:
+        TcpSink &sink;
+        uint32_t id;
+        uint64_t generation;
+        std::string buffer;
+        bool done = false;
+
+        bool send(uint8_t type, const char *data, size_t size)
+        {
+            std::lock_guard<std::mutex> lock(sink.sendMutex);
+            // 別の接続で始めたアーカイブは続けられない
+            return sink.generation == generation && sink.sock != invalidSocket &&
+                   sendFrame(sink.sock, type, id, data, size);
+        }
+
+        bool flush()
+        {
+            bool ok = buffer.empty() || send(FrameData, buffer.data(), buffer.size());
+            buffer.clear();
+            return ok;
+        }
+
+    public:
+        Output(TcpSink &sink, uint32_t id, uint64_t generation) : sink(sink), id(id), generation(generation) {}
+
+        ~Output() override
+        {
+            if (!done)
+                abort();
+            std::lock_guard<std::mutex> lock(sink.stateMutex);
+            sink.results.erase(id);
+            sink.found.erase(id);
+        }
+
+        bool append(const char *data, size_t size) override
+        {
+            buffer.append(data, size);
+            return buffer.size() < 1024 * 1024 || flush();
+        }
+
+        bool commit() override
+        {
+            done = true;
+            if (!flush() || !send(FrameCommit, nullptr, 0))
+                return false;
+            std::unique_lock<std::mutex> lock(sink.stateMutex);
+            bool answered = sink.stateCv.wait_for(lock, std::chrono::minutes(2), [this]
+                                                  { return sink.results[id] != 0; });
+            return answered && sink.results[id] == 1;
+        }
+
+        void abort() override
+        {
+            done = true;
+            send(FrameAbort, nullptr, 0);
+        }
+    };
+
+    // 受信側でのパス（出力ディレクトリからの相対パス）
+    std::string relativePath(const std::string &path) const
+    {
+        std::string relative = fs::path(path).lexically_relative(rootDir).generic_string();
+        if (relative.empty() || relative.rfind("..", 0) == 0)
+            relative = fs::path(path).filename().string();
+        return relative;
+    }
+
+public:
+    TcpSink(const std::string &host, int port, const std::string &rootDir) : host(host), port(port), rootDir(rootDir) {}
+
+    ~TcpSink() override
+    {
+        std::lock_guard<std::mutex> lock(sendMutex);
+        if (sock != invalidSocket)
+        {
+            shutdown(sock, 2);
+            if (reader.joinable())
+                reader.join();
+            closeSocket(sock);
+        }
+    }
+
+    std::unique_ptr<ArchiveOutput> openArchive(const std::string &path) override
+    {
+        std::string relative = relativePath(path);
+
+        std::lock_guard<std::mutex> lock(sendMutex);
+        if (!ensureConnected())
+            return nullptr;
+        uint32_t id;
+        {
+            std::lock_guard<std::mutex> stateLock(stateMutex);
+            id = nextId++;
+            results[id] = 0;
+        }
+        if (!sendFrame(sock, FrameOpen, id, relative.data(), relative.size()))
+            return nullptr;
+        return std::make_unique<Output>(*this, id, generation);
+    }
+
+    // 受信デーモンにQUERYで確かめる（あると分かったパスは覚えておき、次からは問い合わせない）
+    bool lookup(const std::string &path, bool &exists) override
+    {
+        std::string relative = relativePath(path);
+        uint32_t id;
+        {
+            std::lock_guard<std::mutex> lock(sendMutex);
+            {
+                std::lock_guard<std::mutex> stateLock(stateMutex);
+                if (knownPaths.count(relative))
+                {
+                    exists = true;
+                    return true;
+                }
+            }
+            if (!ensureConnected())
+                return false;
+            {
+                std::lock_guard<std::mutex> stateLock(stateMutex);
+                id = nextId++;
+                results[id] = 0;
+            }
+            if (!sendFrame(sock, FrameQuery, id, relative.data(), relative.size()))
+            {
+                std::lock_guard<std::mutex> stateLock(stateMutex);
+                results.erase(id);
+                return false;
+            }
+        }
+
+        // QUERYを知らない古い受信デーモンは答えないので、待ちすぎずに出力ディレクトリでの判定に戻る
+        std::unique_lock<std::mutex> lock(stateMutex);
+        bool answered = stateCv.wait_for(lock, std::chrono::seconds(10), [this, id]
+                                         { return results[id] != 0; });
+        bool ok = answered && results[id] == 1;
+        if (ok)
+        {
+            exists = found[id];
+            if (exists)
+                knownPaths.insert(relative);
+        }
+        else
+        {
+            LOG("Error checking " << relative << " on receiver " << host << ":" << port);
+        }
+        results.erase(id);
+        found.erase(id);
+        return ok;
+    }
+
+    const char *name() const override { return "tcp"; }
+};
+
+// 受信デーモンの確定（既にあるかの確認とリネーム）を接続の間で直列にする
+std::mutex receiverCommitMutex;
+
+// 受信デーモン：一つの接続を処理する
+// 書きかけは接続番号とアーカイブIDを付けた .part に書くので、別の接続が同じパスを開いても混ざらない
+void handleReceiverConnection(socket_t client, std::string outputDir, uint64_t connection)
+{
+    struct OpenArchive
+    {
+        std::FILE *file;
+        fs::path tmpPath;
+        fs::path finalPath;
+        bool replace;
+    };
+    std::map<uint32_t, OpenArchive> archives;
+
+    auto reply = [&](uint8_t type, uint32_t id, const std::string &message)
+    {
+        return sendFrame(client, type, id, message.data(), message.size());
+    };
+
+    // 送られてきた相対パスを出力ディレクトリ以下のパスにする（外を指すパスは拒否する）
+    auto resolve = [&](const std::string &payload, fs::path &finalPath)
+    {
+        fs::path relative = fs::path(payload).lexically_normal();
+        if (relative.empty() || relative.is_absolute() || relative.has_root_name() ||
+            relative.generic_string().rfind("..", 0) == 0)
+            return false;
+        finalPath = fs::path(outputDir) / relative;
+        return true;
+    };
+
+    char greeting[sizeof(streamGreeting)];
+    if (recvAll(client, greeting, sizeof(greeting)) && std::memcmp(greeting, streamGreeting, sizeof(greeting)) == 0)
+    {
+        StreamFrame frame;
+        std::string payload;
+        while (recvFrame(client, frame, payload))
+        {
+            auto it = archives.find(frame.archiveId);
+            if (frame.type == FrameQuery)
+            {
+                fs::path finalPath;
+                std::error_code ec;
+                if (!resolve(payload, finalPath))
+                    reply(FrameNack, frame.archiveId, "invalid path: " + payload);
+                else
+                    reply(FrameAck, frame.archiveId, fs::exists(finalPath, ec) ? "1" : "0");
+            }
+            else if (frame.type == FrameOpen)
+            {
+                // 同じIDが開いたままなら送信側の状態が壊れている。書きかけを破棄して拒否する
+                if (it != archives.end())
+                {
+                    if (it->second.file)
+                        std::fclose(it->second.file);
+                    std::error_code ec;
+                    fs::remove(it->second.tmpPath, ec);
+                    archives.erase(it);
+                    reply(FrameNack, frame.archiveId, "archive id already open");
+                    continue;
+                }
+                fs::path finalPath;
+                if (!resolve(payload, finalPath))
+                {
+                    reply(FrameNack, frame.archiveId, "invalid path: " + payload);
+                    continue;
+                }
+                // 確定済みのアーカイブは、置き換えを求められない限り上書きしない
+                bool replace = (frame.flags & OpenReplace) != 0;
+                std::error_code ec;
+                if (!replace && fs::exists(finalPath, ec))
+                {
+                    reply(FrameNack, frame.archiveId, "archive already exists: " + payload);
+                    continue;
+                }
+                fs::path tmpPath = finalPath.string() + "." + std::to_string(connection) + "-" +
+                                   std::to_string(frame.archiveId) + ".part";
+                fs::create_directories(finalPath.parent_path(), ec);
+                std::FILE *file = std::fopen(tmpPath.string().c_str(), "wb");
+                if (!file)
+                {
+                    reply(FrameNack, frame.archiveId, "cannot create " + tmpPath.string());
+                    continue;
+                }
+                archives[frame.archiveId] = {file, tmpPath, finalPath, replace};
+            }
+            else if (it == archives.end())
+            {
+                if (frame.type == FrameCommit)
+                    reply(FrameNack, frame.archiveId, "unknown archive");
+            }
+            else if (frame.type == FrameData)
+            {
+                // 書き込みに失敗したアーカイブは残りのデータを読み捨て、COMMITでNACKする
+                if (it->second.file && std::fwrite(payload.data(), 1, payload.size(), it->second.file) != payload.size())
+                {
+                    LOG("Error writing " << it->second.tmpPath.string());
+                    std::fclose(it->second.file);
+                    it->second.file = nullptr;
+                    std::error_code ec;
+                    fs::remove(it->second.tmpPath, ec);
+                }
+            }
+            else if (frame.type == FrameCommit)
+            {
+                // fsyncしてからリネームし、確定したことを返す
+                OpenArchive archive = it->second;
+                archives.erase(it);
+                bool ok = archive.file && syncFile(archive.file);
+                if (archive.file)
+                    ok = std::fclose(archive.file) == 0 && ok;
+                std::error_code ec;
+                std::string failure = "cannot store " + archive.finalPath.string();
+                if (ok)
+                {
+                    // OPENのあとに別の接続が同じパスを確定していることがある
+                    std::lock_guard<std::mutex> lock(receiverCommitMutex);
+                    if (!archive.replace && fs::exists(archive.finalPath, ec))
+                    {
+                        ok = false;
+                        failure = "archive already exists: " + archive.finalPath.string();
+                    }
+                    else
+                    {
+                        fs::rename(archive.tmpPath, archive.finalPath, ec);
+                        ok = !ec;
+                    }
+                }
+                if (ok)
+                {
+                    syncDirectory(archive.finalPath.parent_path());
+                    LOG("Received: " << archive.finalPath.string());
+                    reply(FrameAck, frame.archiveId, "");
+                }
+                else
+                {
+                    fs::remove(archive.tmpPath, ec);
+                    reply(FrameNack, frame.archiveId, failure);
+                }
+            }
+            else if (frame.type == FrameAbort)
+            {
+                if (it->second.file)
+                    std::fclose(it->second.file);
+                std::error_code ec;
+                fs::remove(it->second.tmpPath, ec);
+                archives.erase(it);
+            }
+        }
+    }
+
+    // 確定しなかったアーカイブは破棄
+    for (auto &pair : archives)
+    {
+        if (pair.second.file)
+            std::fclose(pair.second.file);
+        std::error_code ec;
+        fs::remove(pair.second.tmpPath, ec);
+    }
+    closeSocket(client);
+}
+
+// 受信デーモン：接続を待ち受ける
+// 認証はないので、既定ではループバックにだけバインドする
+bool runReceiver(const std::string &bindAddress, int port, const std::string &outputDir)
+{
+    if (!initSockets())
+        return false;
+    fs::create_directories(outputDir);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *addresses = nullptr;
+    if (getaddrinfo(bindAddress.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+    {
+        LOG("Cannot resolve bind address " << bindAddress);
+        return false;
+    }
+    socket_t server = invalidSocket;
+    for (addrinfo *a = addresses; a; a = a->ai_next)
+    {
+        server = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (server == invalidSocket)
+            continue;
+        int reuse = 1;
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&reuse), sizeof(reuse));
+        if (bind(server, a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0 && listen(server, 16) == 0)
+            break;
+        closeSocket(server);
+        server = invalidSocket;
+    }
+    freeaddrinfo(addresses);
+    if (server == invalidSocket)
+    {
+        LOG("Error listening on " << bindAddress << ":" << port);
+        return false;
+    }
+
+    LOG("Receiver listening on " << bindAddress << ":" << port << ", writing to " << outputDir);
+    uint64_t connections = 0;
+    while (true)
+    {
+        socket_t client = accept(server, nullptr, nullptr);
+        if (client == invalidSocket)
+            continue;
+        LOG("Sender connected");
+        std::thread(handleReceiverConnection, client, outputDir, ++connections).detach();
+    }
+}
+
+// グローバル出力先（既定はローカルファイル）
+std::unique_ptr<ArchiveSink> archiveSink = std::make_unique<LocalFileSink>();
+
+// ファイルセットをグループ化するための関数
+struct FileSet
+{
+    int run;
+    int setNumber;               // setNumberはファイルセットの先頭番号
+    std::set<std::string> files; // セット内のファイルパス
+    std::string firstFile;       // 最初のファイル（パターン基準）
+    std::string scope;           // 監視ディレクトリからの相対サブディレクトリ（直下なら空）
+    int splitFirst = 0;          // サブアーカイブが含むフレームの範囲（分割していなければ0）
+    int splitLast = 0;
+
+    // アーカイブのファイル名（最初のファイル名の拡張子を .snappy にしたもの）
+    std::string getArchiveName() const
+    {
+        // 先頭番号のファイルが欠けた部分セットでは、セット内で最も若いファイルを使う
+        fs::path firstFilePath(firstFile.empty() && !files.empty() ? *files.begin() : firstFile);
+        return firstFilePath.stem().string() + ".snappy";
+    }
+
+    // 複数のサブディレクトリにまたがっても一意なアーカイブの識別名
+    std::string getArchiveKey() const
+    {
+        return scope.empty() ? getArchiveName() : scope + "/" + getArchiveName();
+    }
+
+    // 出力ファイル名の生成
+    std::string getOutputPath(const std::string &outputDir) const
+    {
+        return outputDir + "/" + getArchiveName();
+    }
+};
+
+// 監視対象のサブディレクトリ管理クラス（再帰監視モード）
+// 新しいサブディレクトリは見つけ次第スコープに加え、ファイルがなくなって
+// 一定時間動きのないスコープは期限切れとして走査対象から外す
+class WatchScopes
+{
+private:
+    struct Scope
+    {
+        size_t lastCount = 0; // 前回の走査で見つかった対象ファイル数
+        std::chrono::steady_clock::time_point lastActivity;
+    };
+
+    std::string root;
+    std::regex subdirPattern; // サブディレクトリ名からラン番号を取り出す（任意）
+    bool hasSubdirPattern = false;
+    std::chrono::seconds expiry;
+    std::map<std::string, Scope> active; // 相対パス -> スコープ（""はルート）
+    struct Expired
+    {
+        size_t entries = 0; // 期限切れにしたときのエントリー数
+        std::chrono::steady_clock::time_point checked;
+    };
+    std::map<std::string, Expired> expired;
+    std::set<std::string> excluded; // 走査しないサブディレクトリ（監視ディレクトリの下にある出力先）
+#ifdef __linux__
+    int inotifyFd = -1;
+    std::map<std::string, int> watches; // 相対パス -> inotifyの監視ID
+#endif
+
+    void addWatch(const std::string &scope)
+    {
+#ifdef __linux__
+        if (inotifyFd < 0)
+            return;
+        std::string path = scope.empty() ? root : (fs::path(root) / scope).string();
+        int wd = inotify_add_watch(inotifyFd, path.c_str(), IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE);
+        if (wd >= 0)
+            watches[scope] = wd;
+#else
+        (void)scope;
+#endif
+    }
+
+    // ディレクトリ内のエントリー数（読めなければ0）
+    size_t entryCount(const std::string &scope) const
+    {
+        std::vector<VfsEntry> entries;
+        vfs->list(scope.empty() ? root : (fs::path(root) / scope).string(), entries);
+        return entries.size();
+    }
+
+    void removeWatch(const std::string &scope)
+    {
+#ifdef __linux__
+        auto it = watches.find(scope);
+        if (it != watches.end())
+        {
+            inotify_rm_watch(inotifyFd, it->second);
+            watches.erase(it);
+        }
+#else
+        (void)scope;
+#endif
+    }
+
+public:
+    WatchScopes(const std::string &rootDir, const std::string &subdirRegex, int expirySeconds)
+        : root(rootDir), expiry(expirySeconds)
+    {
+        if (!subdirRegex.empty())
+        {
+            subdirPattern = std::regex(subdirRegex);
+            hasSubdirPattern = true;
+        }
+#ifdef __linux__
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+        active[""].lastActivity = std::chrono::steady_clock::now();
+        addWatch("");
+    }
+
+    ~WatchScopes()
+    {
+#ifdef __linux__
+        if (inotifyFd >= 0)
+            close(inotifyFd);
+#endif
+    }
+
+    const std::string &rootDir() const { return root; }
+
+    // 監視ディレクトリの下にある出力先を走査対象から外す（自分の書いたアーカイブや先頭ファイルのコピーを新しいスコープとして拾わない）
+    // 出力先が監視ディレクトリそのものなら外せないので false
+    bool excludeOutput(const std::string &dir)
+    {
+        auto normal = [](const std::string &path)
+        {
+            fs::path p = fs::absolute(path).lexically_normal();
+            return p.has_filename() ? p : p.parent_path();
+        };
+        fs::path relative = normal(dir).lexically_relative(normal(root));
+        if (relative.empty() || *relative.begin() == "..")
+            return true; // 監視ディレクトリの外
+        if (relative == ".")
+            return false;
+        excluded.insert(relative.generic_string());
+        LOG("Not scanning output directory inside the watch directory: " << relative.generic_string());
+        return true;
+    }
+
+    bool isExcluded(const std::string &scope) const { return excluded.count(scope) > 0; }
+
+    // 今回走査するスコープ
+    std::vector<std::string> activeScopes() const
+    {
+        std::vector<std::string> scopes;
+        for (const auto &pair : active)
+            scopes.push_back(pair.first);
+        return scopes;
+    }
+
+    // 走査中に見つかったサブディレクトリを登録する（新しければtrue）
+    // 期限切れのスコープも、中身が増減していれば（後から作られたランのサブディレクトリなど）監視に戻す
+    bool discover(const std::string &scope)
+    {
+        if (active.count(scope))
+            return false;
+        auto now = std::chrono::steady_clock::now();
+        auto old = expired.find(scope);
+        if (old != expired.end())
+        {
+            // 見直しは期限の間隔に1回だけ（終わったランのディレクトリを毎回読まない）
+            if (now - old->second.checked < expiry)
+                return false;
+            old->second.checked = now;
+            if (entryCount(scope) == old->second.entries)
+                return false;
+            expired.erase(old);
+            LOG("Subdirectory changed, watching again: " << scope);
+        }
+        else
+        {
+            LOG("Watching new subdirectory: " << scope);
+        }
+        active[scope].lastActivity = now;
+        addWatch(scope);
+        return true;
+    }
+
+    // サブディレクトリ名のフィールドからラン番号を得る（パターン未指定・不一致ならfalse）
+    bool runFromScope(const std::string &scope, int &run) const
+    {
+        std::smatch matches;
+        if (!hasSubdirPattern || scope.empty() || !std::regex_search(scope, matches, subdirPattern) || matches.size() < 2)
+            return false;
+        try
+        {
+            run = std::stoi(matches[1].str());
+            return true;
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+    }
+
+    // 走査結果を反映し、空で動きのないスコープを期限切れにする
+    // サブディレクトリを持つスコープ（watch/2025/ など）は、その下に新しいランが作られるので期限切れにしない
+    void update(const std::map<std::string, size_t> &counts, const std::map<std::string, size_t> &subdirCounts)
+    {
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = active.begin(); it != active.end();)
+        {
+            auto found = counts.find(it->first);
+            size_t count = found == counts.end() ? 0 : found->second;
+            if (count != it->second.lastCount)
+            {
+                it->second.lastCount = count;
+                it->second.lastActivity = now;
+            }
+            auto subdirs = subdirCounts.find(it->first);
+            bool hasSubdirs = subdirs != subdirCounts.end() && subdirs->second > 0;
+            if (!it->first.empty() && count == 0 && !hasSubdirs && now - it->second.lastActivity >= expiry)
+            {
+                LOG("Subdirectory finished, no longer watched: " << it->first);
+                removeWatch(it->first);
+                expired[it->first] = {entryCount(it->first), now};
+                it = active.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    // 変更通知を待つ（inotifyが使えなければ単に待つ）。通知があればtrue
+    bool waitForChanges(int seconds)
+    {
+#ifdef __linux__
+        if (inotifyFd >= 0)
+        {
+            pollfd pfd{inotifyFd, POLLIN, 0};
+            if (poll(&pfd, 1, seconds * 1000) > 0)
+            {
+                // 通知をすべて読み捨てる（内容は次の走査で確認する）
+                char buffer[4096];
+                while (read(inotifyFd, buffer, sizeof(buffer)) > 0)
+                {
+                }
+                return true;
+            }
+            return false;
+        }
+#endif
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        return false;
+    }
+};
+
+// グローバル監視スコープ（再帰監視モードのときのみ作成）
+std::unique_ptr<WatchScopes> watchScopes;
+
+using FileSetKey = std::tuple<std::string, int, int>; // (scope, run, setNumber)
+
+// ファイル番号から所属するセットの先頭番号を計算
+int setNumberFor(int fileNumber, int setSize)
+{
+    return ((fileNumber - 1) / setSize) * setSize + 1;
+}
+
+// 一つのディレクトリを走査してセットに振り分ける（サブディレクトリはsubdirsに返す）
+size_t groupDirectory(const fs::path &dir, const std::string &scope, const std::regex &filePattern, int setSize,
+                      const WatchScopes *scopes, std::map<FileSetKey, FileSet> &fileSets,
+                      std::vector<std::string> *subdirs)
+{
+    size_t matched = 0;
+    int scopeRun = 0;
+    bool runFromScope = scopes && scopes->runFromScope(scope, scopeRun);
+
+    std::vector<VfsEntry> entries;
+    if (!vfs->list(dir.string(), entries))
+        throw std::runtime_error("cannot list " + dir.string());
+
+    for (const auto &entry : entries)
+    {
+        if (entry.directory)
+        {
+            // ゴミ箱は走査しない（前回の実行の残りは引き継いで片付ける）
+            if (entry.name == trashDirName)
+            {
+                if (deleteQueue)
+                    deleteQueue->adoptTrash(dir.string());
+                continue;
+            }
+            std::string subdir = scope.empty() ? entry.name : scope + "/" + entry.name;
+            // 監視ディレクトリの下にある出力先も走査しない
+            if (subdirs && !(scopes && scopes->isExcluded(subdir)))
+            {
+                subdirs->push_back(subdir);
+            }
+            continue;
+        }
+
+        const std::string &filename = entry.name;
+        std::smatch matches;
+
+        if (std::regex_match(filename, matches, filePattern) && matches.size() >= 3)
+        {
+            // サブディレクトリ名にラン番号がある場合はそちらを使う
+            int run = runFromScope ? scopeRun : std::stoi(matches[1].str());
+            int fileNumber = std::stoi(matches[2].str());
+            int setNumber = setNumberFor(fileNumber, setSize);
+
+            FileSetKey key(scope, run, setNumber);
+            if (fileSets.find(key) == fileSets.end())
+            {
+                // 新しいセットを作成
+                FileSet newSet;
+                newSet.run = run;
+                newSet.setNumber = setNumber;
+                newSet.scope = scope;
+                fileSets[key] = newSet;
+            }
+
+            // ファイルをセットに追加
+            fileSets[key].files.insert((dir / filename).string());
+            ++matched;
+
+            // セット内の最初のファイルを記録
+            if (fileNumber == setNumber)
+            {
+                fileSets[key].firstFile = (dir / filename).string();
+            }
+        }
+    }
+    return matched;
+}
+
+// マップからソート済みのベクターに変換
+std::vector<FileSet> sortedFileSets(const std::map<FileSetKey, FileSet> &fileSets)
+{
+    std::vector<FileSet> result;
+    for (const auto &pair : fileSets)
+    {
+        result.push_back(pair.second);
+    }
+
+    // セット番号でソート
+    std::sort(result.begin(), result.end(), [](const FileSet &a, const FileSet &b)
+              {
+        if (a.run != b.run) return a.run < b.run;
+        if (a.setNumber != b.setNumber) return a.setNumber < b.setNumber;
+        return a.scope < b.scope; });
+
+    return result;
+}
+
+// 正規表現パターン作成（例："test_(\d\d)_(\d\d\d\d\d)\.tif"）
+std::regex makeFilePattern(const std::string &basePattern)
+{
+    return std::regex(basePattern.substr(0, basePattern.find("_##_")) + "_([0-9]{2})_([0-9]{5})\\.tif");
+}
+
+// ディレクトリをスキャンし、パターンに合致するファイルをセットとしてグループ化
+std::vector<FileSet> scanAndGroupFiles(const std::string &dir, const std::string &basePattern, int setSize)
+{
+    std::map<FileSetKey, FileSet> fileSets;
+    std::regex filePattern = makeFilePattern(basePattern);
+
+    LOG("Scanning directory: " << dir);
+
+    try
+    {
+        groupDirectory(dir, "", filePattern, setSize, nullptr, fileSets, nullptr);
+    }
+    catch (const std::exception &e)
+    {
+        LOG("Error scanning directory: " << e.what());
+    }
+
+    return sortedFileSets(fileSets);
+}
+
+// 監視中のスコープをすべて走査し、新しいサブディレクトリは同じ走査の中で追加する
+std::vector<FileSet> scanAndGroupFiles(WatchScopes &scopes, const std::string &basePattern, int setSize)
+{
+    std::map<FileSetKey, FileSet> fileSets;
+    std::map<std::string, size_t> counts;
+    std::map<std::string, size_t> subdirCounts;
+    std::regex filePattern = makeFilePattern(basePattern);
+
+    LOG("Scanning directory tree: " << scopes.rootDir());
+
+    std::vector<std::string> pending = scopes.activeScopes();
+    while (!pending.empty())
+    {
+        std::string scope = pending.back();
+        pending.pop_back();
+
+        std::vector<std::string> subdirs;
+        try
+        {
+            fs::path dir = scope.empty() ? fs::path(scopes.rootDir()) : fs::path(scopes.rootDir()) / scope;
+            counts[scope] = groupDirectory(dir, scope, filePattern, setSize, &scopes, fileSets, &subdirs);
+        }
+        catch (const std::exception &e)
+        {
+            LOG("Error scanning directory: " << e.what());
+            continue;
+        }
+        subdirCounts[scope] = subdirs.size();
+        for (const auto &subdir : subdirs)
+        {
+            if (scopes.discover(subdir))
+                pending.push_back(subdir);
+        }
+    }
+
+    scopes.update(counts, subdirCounts);
+    return sortedFileSets(fileSets);
+}
+
+// セットが完全であるか確認（ファイル数がsetSize個あるか）
+bool isSetComplete(const FileSet &fileSet, int setSize)
+{
+    return fileSet.files.size() >= setSize;
+}
+
+// 既に処理済みのセットか確認（出力ファイルが存在するか）
+bool isSetProcessed(const FileSet &fileSet, const std::string &outputDir)
+{
+    std::string archiveName = fileSet.getArchiveName();
+    // ローカルでない出力先（オブジェクトストレージなど）は、答えられれば出力先に問い合わせる
+    bool exists = false;
+    if (!archiveSink->isLocal() &&
+        archiveSink->lookup(fileSet.getOutputPath(outputLayout.directoryFor(outputDir, fileSet.run, fileSet.scope,
+                                                                            fileSet.getArchiveKey())),
+                            exists))
+    {
+        return exists;
+    }
+    auto existsIn = [&](const std::string &baseDir)
+    {
+        return outputLayout.exists(outputLayout.directoryFor(baseDir, fileSet.run, fileSet.scope, fileSet.getArchiveKey()),
+                                   archiveName);
+    };
+    if (outputRouter)
+    {
+        return !outputRouter->locate(fileSet.getArchiveKey(), existsIn).empty();
+    }
+    return existsIn(outputDir);
+}
+
+// ファイル名からフレーム番号を取り出す（prefix_RR_NNNNN.tif の NNNNN、取り出せなければ-1）
+int frameNumberOf(const std::string &path)
+{
+    std::string stem = fs::path(path).stem().string();
+    size_t pos = stem.rfind('_');
+    try
+    {
+        return std::stoi(stem.substr(pos == std::string::npos ? 0 : pos + 1));
+    }
+    catch (const std::exception &)
+    {
+        return -1;
+    }
+}
+
+// セット内のフレーム番号の範囲
+void frameRange(const FileSet &fileSet, int &first, int &last)
+{
+    first = std::numeric_limits<int>::max();
+    last = -1;
+    for (const auto &path : fileSet.files)
+    {
+        int number = frameNumberOf(path);
+        first = std::min(first, number);
+        last = std::max(last, number);
+    }
+}
+
+// サブアーカイブとして処理する範囲を記録する
+void markSplit(FileSet &fileSet)
+{
+    frameRange(fileSet, fileSet.splitFirst, fileSet.splitLast);
+}
+
+// frameから始まるサブアーカイブ（アーカイブ名だけを持つセット）
+// セット内のファイル名の番号部分をframeに置き換えて名前を作る
+FileSet subArchiveAt(const FileSet &fileSet, int frame)
+{
+    FileSet sub;
+    sub.run = fileSet.run;
+    sub.setNumber = fileSet.setNumber;
+    sub.scope = fileSet.scope;
+    fs::path path(*fileSet.files.begin());
+    std::string stem = path.stem().string();
+    size_t digits = stem.size() - (stem.rfind('_') + 1);
+    std::string number = std::to_string(frame);
+    if (number.size() < digits)
+        number.insert(0, digits - number.size(), '0');
+    sub.firstFile = stem.substr(0, stem.size() - digits) + number + path.extension().string();
+    return sub;
+}
+
+// 先頭フレームの名前のアーカイブ（分割されたセットの最初のサブアーカイブ）があり、先頭側のファイルが残っていないか
+bool hasSplitHead(const FileSet &fileSet, const std::string &outputDir)
+{
+    int first, last;
+    frameRange(fileSet, first, last);
+    if (fileSet.files.empty() || first <= fileSet.setNumber)
+        return false;
+    return isSetProcessed(subArchiveAt(fileSet, fileSet.setNumber), outputDir);
+}
+
+// 出力済みのアーカイブのメタデータ（ローカルの出力先だけで読む。なければfalse）
+bool outputArchiveMeta(const FileSet &fileSet, const std::string &outputDir, ContainerMeta &meta)
+{
+    if (!archiveSink->isLocal())
+        return false;
+    std::string baseDir = outputDir;
+    if (outputRouter)
+    {
+        baseDir = outputRouter->locate(fileSet.getArchiveKey(), [&](const std::string &target)
+                                       { return outputLayout.exists(outputLayout.directoryFor(target, fileSet.run, fileSet.scope, fileSet.getArchiveKey()),
+                                                                    fileSet.getArchiveName()); });
+        if (baseDir.empty())
+            return false;
+    }
+    ContainerReader reader;
+    if (!reader.open(fileSet.getOutputPath(outputLayout.directoryFor(baseDir, fileSet.run, fileSet.scope, fileSet.getArchiveKey()))))
+        return false;
+    meta = reader.metadata();
+    return true;
+}
+
+// 出力済みのアーカイブがサブアーカイブなら、含まれる最後のフレーム番号（分割されていない・読めなければ0）
+int splitLastOf(const FileSet &fileSet, const std::string &outputDir)
+{
+    ContainerMeta meta;
+    if (!outputArchiveMeta(fileSet, outputDir, meta))
+        return 0;
+    std::string split = meta.get("split");
+    size_t dash = split.find('-');
+    return dash == std::string::npos ? 0 : std::atoi(split.c_str() + dash + 1);
+}
+
+// セット名のアーカイブが分割されたセットの先頭のサブアーカイブだった場合に、まだアーカイブされていないフレームを返す
+// 再起動時にソースが残っていると、セットは揃って見え、先頭のサブアーカイブだけで処理済みと判定されてしまう
+bool unarchivedSplitFrames(const FileSet &fileSet, int setSize, const std::string &outputDir, FileSet &rest)
+{
+    int covered = splitLastOf(fileSet, outputDir);
+    if (covered == 0 || fileSet.files.empty())
+        return false;
+    // 続くサブアーカイブをたどる
+    int setEnd = fileSet.setNumber + setSize - 1;
+    while (covered < setEnd)
+    {
+        FileSet next = subArchiveAt(fileSet, covered + 1);
+        int last = isSetProcessed(next, outputDir) ? splitLastOf(next, outputDir) : 0;
+        if (last <= covered)
+            break;
+        covered = last;
+    }
+
+    rest = FileSet();
+    rest.run = fileSet.run;
+    rest.setNumber = fileSet.setNumber;
+    rest.scope = fileSet.scope;
+    for (const auto &path : fileSet.files)
+    {
+        if (frameNumberOf(path) > covered)
+            rest.files.insert(path);
+    }
+    if (rest.files.empty())
+        return false;
+    markSplit(rest);
+    return true;
+}
+
+// アーカイブするときに読めなかったフレーム（削除せずに監視ディレクトリに残す）
+// 名前はセットのアーカイブのメタデータ "unread" に1行ずつ記録する。残ったフレームだけのセットは
+// 走査で処理済みとして扱い、数を警告・バッチの集計・背圧の状態で知らせる
+class UnreadFrames
+{
+private:
+    std::mutex mutex;
+    std::map<FileSetKey, std::set<std::string>> names; // セット -> 読めなかったファイル名
+    std::set<FileSetKey> loaded;                      // アーカイブのメタデータを確かめたセット
+    std::map<FileSetKey, size_t> reported;            // 最後に警告したときに残っていた数
+
+    size_t countLocked(const FileSetKey &key, const FileSet &fileSet)
+    {
+        auto it = names.find(key);
+        if (it == names.end())
+            return 0;
+        size_t count = 0;
+        for (const auto &path : fileSet.files)
+            count += it->second.count(fs::path(path).filename().string());
+        return count;
+    }
+
+public:
+    void record(const FileSet &fileSet, const std::set<std::string> &paths)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &set = names[FileSetKey(fileSet.scope, fileSet.run, fileSet.setNumber)];
+        for (const auto &path : paths)
+            set.insert(fs::path(path).filename().string());
+    }
+
+    // 走査で見つかったセットに残っている、読めなかったフレームの数（メモリ上の記録だけで数える）
+    size_t count(const FileSet &fileSet)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return countLocked(FileSetKey(fileSet.scope, fileSet.run, fileSet.setNumber), fileSet);
+    }
+
+    // count と同じだが、初めて見るセットはセットのアーカイブのメタデータから記録を読み、残りの数が変わったら警告する
+    size_t leftovers(const FileSet &fileSet, const std::string &outputDir)
+    {
+        FileSetKey key(fileSet.scope, fileSet.run, fileSet.setNumber);
+        bool load;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            load = loaded.insert(key).second;
+        }
+        ContainerMeta meta;
+        if (load && !fileSet.files.empty() && outputArchiveMeta(subArchiveAt(fileSet, fileSet.setNumber), outputDir, meta))
+        {
+            std::istringstream text(meta.get("unread"));
+            std::lock_guard<std::mutex> lock(mutex);
+            for (std::string name; std::getline(text, name);)
+            {
+                if (!name.empty())
+                    names[key].insert(name);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t count = countLocked(key, fileSet);
+        size_t &last = reported[key];
+        if (count > 0 && count != last)
+        {
+            LOG("Warning: " << count << " file(s) of run " << fileSet.run << ", set " << fileSet.setNumber
+                            << " could not be read when the set was archived and are still in the watch directory");
+        }
+        last = count;
+        return count;
+    }
+};
+
+UnreadFrames unreadFrames;
+
+// 再起動前に分割されたセットの残りが、セット末尾まで連続して揃っているか
+bool isSplitRemainder(const FileSet &fileSet, int setSize, const std::string &outputDir)
+{
+    int first, last;
+    frameRange(fileSet, first, last);
+    return last == fileSet.setNumber + setSize - 1 && last - first + 1 == static_cast<int>(fileSet.files.size()) &&
+           hasSplitHead(fileSet, outputDir);
+}
+
+// レイテンシ目標（SLO）に応じてセットを早めに区切る（監視モード）
+// セットが揃うのを待つと最も古い未処理フレームのアーカイブが目標に間に合わない場合、次の走査まで
+// 待てなくなった時点で連続して揃っているフレームを先にサブアーカイブとして処理し、区切りサイズを
+// その数に縮める。負荷が軽ければ倍々でsetSizeまで戻す
+class SloController
+{
+public:
+    enum class Decision
+    {
+        Wait,  // まだ処理しない
+        Whole, // 分割せずセット全体を処理する
+        Chunk, // chunkをサブアーカイブとして処理する
+    };
+
+    // 現在時刻（シミュレーターは仮想時計を渡す）
+    using Clock = std::chrono::steady_clock;
+    using ClockFunction = std::function<Clock::time_point()>;
+
+private:
+    struct Pending
+    {
+        int nextFrame = 0;                  // まだ処理に回していない最初のフレーム
+        Clock::time_point started;          // セットのフレームを最初に見た時刻
+        std::map<int, Clock::time_point> seen; // 未処理のフレームを最初に見た時刻
+        int arrived = 0;                    // startedのあとに現れたフレーム数（到着レート用）
+    };
+
+    double target;
+    double pollSeconds;
+    int effective;                // 現在の区切りサイズ
+    double secondsPerFrame = 0.0; // 処理時間の移動平均
+    double framesPerSecond = 0.0; // フレーム到着レートの移動平均
+    std::map<FileSetKey, Pending> pending;
+    std::mutex mutex;
+    ClockFunction clock;
+
+public:
+    SloController(double target, int setSize, double pollSeconds, ClockFunction clock = Clock::now)
+        : target(target), pollSeconds(pollSeconds), effective(setSize), clock(std::move(clock)) {}
+
+    int effectiveSetSize()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return effective;
+    }
+
+    void recordProcessing(size_t frames, double seconds)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        double perFrame = seconds / std::max<size_t>(frames, 1);
+        secondsPerFrame = secondsPerFrame == 0.0 ? perFrame : secondsPerFrame * 0.8 + perFrame * 0.2;
+    }
+
+    // resumedは先頭側が以前の実行でサブアーカイブ済みのとき
+    Decision plan(const FileSet &set, int setSize, bool resumed, FileSet &chunk)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = clock();
+        FileSetKey key(set.scope, set.run, set.setNumber);
+        int setEnd = set.setNumber + setSize - 1;
+
+        std::map<int, std::string> frames; // フレーム番号 -> パス
+        for (const auto &path : set.files)
+        {
+            int number = frameNumberOf(path);
+            if (number >= set.setNumber && number <= setEnd)
+                frames[number] = path;
+        }
+        if (frames.empty())
+            return Decision::Wait;
+
+        auto it = pending.find(key);
+        bool first = it == pending.end();
+        if (first)
+        {
+            if (static_cast<int>(frames.size()) >= setSize)
+                return Decision::Whole;
+            Pending fresh;
+            fresh.started = now;
+            fresh.nextFrame = resumed ? frames.begin()->first : set.setNumber;
+            it = pending.emplace(key, fresh).first;
+        }
+        Pending &p = it->second;
+        for (const auto &frame : frames)
+        {
+            // 最初に見たときにあったフレーム（再開前にアーカイブした分やたまっていた分）は到着レートに数えない
+            if (frame.first >= p.nextFrame && p.seen.emplace(frame.first, now).second && !first)
+                ++p.arrived;
+        }
+
+        // nextFrameから連続して揃っているフレーム数
+        int contiguous = 0;
+        while (frames.count(p.nextFrame + contiguous))
+            ++contiguous;
+        if (contiguous == 0)
+            return Decision::Wait;
+
+        int last = p.nextFrame + contiguous - 1;
+        double age = std::chrono::duration<double>(now - p.seen.begin()->second).count();
+        double elapsed = std::chrono::duration<double>(now - p.started).count();
+        if (elapsed >= 1.0)
+        {
+            double rate = p.arrived / elapsed;
+            framesPerSecond = framesPerSecond == 0.0 ? rate : framesPerSecond * 0.8 + rate * 0.2;
+        }
+
+        // セットが揃うまで待った場合に最も古い未処理フレームがアーカイブされるまでの予測時間
+        double fill = framesPerSecond > 0.0 ? (setEnd - last) / framesPerSecond : 0.0;
+        double whole = age + fill + secondsPerFrame * (setEnd - p.nextFrame + 1);
+        // 次の走査まで待った場合の予測時間
+        double next = age + pollSeconds + secondsPerFrame * (contiguous + 1);
+
+        int take = 0;
+        if (last == setEnd)
+            take = contiguous;
+        else if (contiguous >= effective)
+            take = effective;
+        else if (whole > target && next > target)
+        {
+            take = contiguous;
+            effective = std::max(1, contiguous);
+        }
+        if (take == 0)
+            return Decision::Wait;
+
+        chunk = FileSet();
+        chunk.run = set.run;
+        chunk.setNumber = set.setNumber;
+        chunk.scope = set.scope;
+        for (int n = p.nextFrame; n < p.nextFrame + take; ++n)
+            chunk.files.insert(frames[n]);
+        if (p.nextFrame == set.setNumber)
+            chunk.firstFile = set.firstFile;
+        chunk.splitFirst = p.nextFrame;
+        chunk.splitLast = p.nextFrame + take - 1;
+
+        p.nextFrame += take;
+        p.seen.erase(p.seen.begin(), p.seen.lower_bound(p.nextFrame));
+        if (chunk.splitLast == setEnd)
+        {
+            // セット全体でも目標の半分で済む負荷なら区切りサイズを戻す
+            if (elapsed + secondsPerFrame * setSize < target / 2.0)
+                effective = std::min(setSize, effective * 2);
+            pending.erase(it);
+        }
+        return Decision::Chunk;
+    }
+};
+
+std::unique_ptr<SloController> sloController;
+
+// フレーム -> アーカイブのカタログ
+// 圧縮側は追記のみのログ（catalog.log、1行1フレーム）に書き、検索側はログを (ラン, フレーム) 順にソートした
+// 索引（catalog.idx）をメモリマップして二分探索する。索引は作成時のログサイズを覚えていて、ログが伸びていれば作り直す
+#pragma pack(push, 1)
+struct CatalogIndexHeader
+{
+    char magic[8];          // "SNPCIDX2"
+    uint64_t logSize;       // 索引を作ったときのログのサイズ
+    uint64_t count;         // エントリー数
+    uint64_t pathCount;     // アーカイブパスの数
+};
+
+struct CatalogIndexEntry
+{
+    int32_t run;
+    int32_t frame;
+    uint32_t path;   // アーカイブパスの番号
+    uint32_t crc;    // 元データのCRC32C
+    uint64_t offset; // 展開後のTAR内のデータ位置
+    uint64_t size;   // TARに入れた大きさ（変換後）
+    uint64_t originalSize;
+    uint32_t transformed; // 1 なら画素フィルターやマスクで変換して入れた（展開・配信で元に戻す）
+};
+#pragma pack(pop)
+// 索引のレイアウト: ヘッダー, エントリー[count], パスの開始位置(uint64)[pathCount], NUL終端のパス文字列
+
+class Catalog
+{
+private:
+    std::string dir;
+    std::ofstream log;
+    std::mutex mutex;
+
+public:
+    explicit Catalog(const std::string &dir) : dir(dir)
+    {
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        log.open((fs::path(dir) / "catalog.log").string(), std::ios::app | std::ios::binary);
+        if (!log)
+            LOG("Error opening catalog log in " << dir);
+    }
+
+    // 書き込みが確定したアーカイブのメンバーを記録する（ファイル名からフレーム番号を取れないものは記録しない）
+    void record(int run, const std::string &archive, const std::vector<TarMember> &members)
+    {
+        std::ostringstream lines;
+        for (const auto &member : members)
+        {
+            int frame = frameNumberOf(member.name);
+            if (frame < 0)
+                continue;
+            char crc[9];
+            std::snprintf(crc, sizeof(crc), "%08x", member.crc);
+            lines << run << '\t' << frame << '\t' << member.offset << '\t' << member.size << '\t' << crc << '\t'
+                  << member.originalSize << '\t' << (member.transformed ? 1 : 0) << '\t' << archive << '\n';
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        log << lines.str();
+        log.flush();
+    }
+
+    // ログから索引を作り直す
+    static bool buildIndex(const std::string &dir, std::string &error)
+    {
+        std::string logPath = (fs::path(dir) / "catalog.log").string();
+        std::ifstream in(logPath, std::ios::binary);
+        if (!in)
+        {
+            error = "no catalog log in " + dir;
+            return false;
+        }
+        std::error_code ec;
+        uint64_t logSize = fs::file_size(logPath, ec);
+
+        std::vector<CatalogIndexEntry> entries;
+        std::vector<std::string> paths;
+        std::map<std::string, uint32_t> pathIds;
+        std::string line;
+        while (std::getline(in, line))
+        {
+            // 書きかけの最終行（改行なし）は次回に回す
+            if (in.eof())
+                break;
+            // 古い行には元の大きさと変換の有無がない（ラン, フレーム, 位置, 大きさ, CRC, アーカイブ）
+            std::vector<std::string> fields;
+            size_t start = 0, archiveStart = 0;
+            for (int i = 0; i < 7; ++i)
+            {
+                size_t tab = line.find('\t', start);
+                if (tab == std::string::npos)
+                    break;
+                fields.push_back(line.substr(start, tab - start));
+                start = tab + 1;
+                if (i == 4)
+                    archiveStart = start;
+            }
+            if (fields.size() < 5)
+                continue;
+            bool current = fields.size() == 7 && !fields[5].empty() &&
+                           fields[5].find_first_not_of("0123456789") == std::string::npos && (fields[6] == "0" || fields[6] == "1");
+            std::string archive = line.substr(current ? start : archiveStart);
+            CatalogIndexEntry entry;
+            try
+            {
+                entry.run = std::stoi(fields[0]);
+                entry.frame = std::stoi(fields[1]);
+                entry.offset = std::stoull(fields[2]);
+                entry.size = std::stoull(fields[3]);
+                entry.crc = static_cast<uint32_t>(std::stoul(fields[4], nullptr, 16));
+                entry.originalSize = current ? std::stoull(fields[5]) : entry.size;
+                entry.transformed = current && fields[6] == "1";
+            }
+            catch (const std::exception &)
+            {
+                continue;
+            }
+            auto it = pathIds.find(archive);
+            if (it == pathIds.end())
+            {
+                it = pathIds.emplace(archive, static_cast<uint32_t>(paths.size())).first;
+                paths.push_back(archive);
+            }
+            entry.path = it->second;
+            entries.push_back(entry);
+        }
+        // 同じフレームの記録が複数あれば（再処理など）ログの順に並ぶ（最後が最新）
+        std::stable_sort(entries.begin(), entries.end(), [](const CatalogIndexEntry &a, const CatalogIndexEntry &b)
+                         { return a.run != b.run ? a.run < b.run : a.frame < b.frame; });
+
+        CatalogIndexHeader header;
+        std::memcpy(header.magic, "SNPCIDX2", 8);
+        header.logSize = logSize;
+        header.count = entries.size();
+        header.pathCount = paths.size();
+        std::vector<uint64_t> pathOffsets;
+        uint64_t position = 0;
+        for (const auto &path : paths)
+        {
+            pathOffsets.push_back(position);
+            position += path.size() + 1;
+        }
+
+        std::string indexPath = (fs::path(dir) / "catalog.idx").string();
+        std::string tmpPath = indexPath + ".tmp";
+        {
+            std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(CatalogIndexEntry));
+            out.write(reinterpret_cast<const char *>(pathOffsets.data()), pathOffsets.size() * sizeof(uint64_t));
+            for (const auto &path : paths)
+                out.write(path.c_str(), path.size() + 1);
+            if (!out)
+            {
+                error = "cannot write " + tmpPath;
+                return false;
+            }
+        }
+        fs::rename(tmpPath, indexPath, ec);
+        if (ec)
+        {
+            error = "cannot replace " + indexPath + ": " + ec.message();
+            return false;
+        }
+        return true;
+    }
+};
+
+std::unique_ptr<Catalog> catalog;
+
+// アーカイブの書き込み完了イベントのログ（1行1イベントのJSON、追記のみ）
+// 各行には通し番号 seq が付き、制御ソケットの "subscribe commits SEQ" でその続きから再送できる
+// 購読者ごとのカーソルは "ack NAME SEQ" で保存し、"subscribe commits @NAME" で再開する
+class CommitLog
+{
+private:
+    std::string path;
+    std::string cursorPath;
+    FILE *file = nullptr;
+    std::mutex mutex;              // 採番・追記・配信の順序をそろえる
+    std::mutex endsMutex;          // 再送（制御ソケットのスレッド）からも読む
+    std::vector<uint64_t> ends;    // seq-1 番目の行の終わりのファイル内位置
+    std::mutex cursorMutex;
+    std::map<std::string, uint64_t> cursors;
+
+    void loadCursors()
+    {
+        std::ifstream in(cursorPath);
+        std::string name;
+        uint64_t seq;
+        while (in >> name >> seq)
+            cursors[name] = seq;
+    }
+
+    bool saveCursors()
+    {
+        std::string tmpPath = cursorPath + ".tmp";
+        {
+            std::ofstream out(tmpPath, std::ios::trunc);
+            for (const auto &cursor : cursors)
+                out << cursor.first << '\t' << cursor.second << '\n';
+            if (!out)
+                return false;
+        }
+        std::error_code ec;
+        fs::rename(tmpPath, cursorPath, ec);
+        return !ec;
+    }
+
+public:
+    explicit CommitLog(const std::string &path) : path(path), cursorPath(path + ".cursors")
+    {
+        std::error_code ec;
+        if (fs::path(path).has_parent_path())
+            fs::create_directories(fs::path(path).parent_path(), ec);
+        // 既存の行の位置を拾う。落ちたときの書きかけの最終行は切り捨てる
+        {
+            std::ifstream in(path, std::ios::binary);
+            std::string line;
+            uint64_t position = 0;
+            while (std::getline(in, line) && !in.eof())
+            {
+                position += line.size() + 1;
+                ends.push_back(position);
+            }
+        }
+        if (fs::exists(path, ec) && fs::file_size(path, ec) != (ends.empty() ? 0 : ends.back()))
+            fs::resize_file(path, ends.empty() ? 0 : ends.back(), ec);
+        file = std::fopen(path.c_str(), "ab");
+        if (!file)
+            LOG("Error opening commit log " << path << ": " << std::strerror(errno));
+        loadCursors();
+    }
+
+    ~CommitLog()
+    {
+        if (file)
+            std::fclose(file);
+    }
+
+private:
+    static std::string crcText(uint32_t crc)
+    {
+        char text[9];
+        std::snprintf(text, sizeof(text), "%08x", crc);
+        return text;
+    }
+
+    // seqを付けて追記し、書けたときだけ配信する（書けなかった番号は次のイベントが使う）
+    void append(const std::string &fields)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!file)
+        {
+            LOG("Commit log " << path << " is not open, event dropped");
+            return;
+        }
+        uint64_t seq, end;
+        {
+            std::lock_guard<std::mutex> endsLock(endsMutex);
+            seq = ends.size() + 1;
+            end = ends.empty() ? 0 : ends.back();
+        }
+        std::string line = "{\"seq\":" + std::to_string(seq) + fields;
+        std::string data = line + "\n";
+        if (std::fwrite(data.data(), 1, data.size(), file) != data.size() || std::fflush(file) != 0)
+        {
+            // 書きかけの行を残すと、以降の行の位置がずれる
+            LOG("Error writing commit log " << path);
+            std::clearerr(file);
+            std::error_code ec;
+            fs::resize_file(path, end, ec);
+            return;
+        }
+        syncFile(file);
+        {
+            std::lock_guard<std::mutex> endsLock(endsMutex);
+            ends.push_back(end + data.size());
+        }
+        if (controlServer)
+            controlServer->publish("commits", line, seq);
+    }
+
+public:
+
+    // 書き込みが確定したアーカイブを記録し、購読者に配信する
+    void record(const std::string &archive, int run, int firstFrame, int lastFrame, size_t files, uint64_t bytes,
+                uint64_t rawBytes, uint32_t crc)
+    {
+        std::ostringstream fields;
+        fields << ",\"event\":\"commit\",\"time\":" << std::time(nullptr) << ",\"archive\":" << jsonString(archive)
+               << ",\"run\":" << run << ",\"first_frame\":" << firstFrame << ",\"last_frame\":" << lastFrame
+               << ",\"files\":" << files << ",\"bytes\":" << bytes << ",\"raw_bytes\":" << rawBytes
+               << ",\"crc32c\":\"" << crcText(crc) << "\"}";
+        append(fields.str());
+    }
+
+    // 段階圧縮でアーカイブが書き換えられたことを記録する（commitイベントの大きさとCRCはもう合わない）
+    void recordRecompressed(const std::string &archive, const char *codec, uint64_t bytes, uint32_t crc)
+    {
+        std::ostringstream fields;
+        fields << ",\"event\":\"recompressed\",\"time\":" << std::time(nullptr) << ",\"archive\":" << jsonString(archive)
+               << ",\"codec\":\"" << codec << "\",\"bytes\":" << bytes << ",\"crc32c\":\"" << crcText(crc) << "\"}";
+        append(fields.str());
+    }
+
+    // FROM（通し番号か @名前）より後のイベントを送る。制御ソケットのスレッドから呼ばれる
+    bool replay(const std::string &from, const std::function<void(const std::string &)> &emit, uint64_t &cursor, std::string &error)
+    {
+        uint64_t after = 0;
+        if (!from.empty() && from[0] == '@')
+        {
+            // 知らない名前は最初から
+            std::lock_guard<std::mutex> lock(cursorMutex);
+            auto it = cursors.find(from.substr(1));
+            after = it != cursors.end() ? it->second : 0;
+        }
+        else
+        {
+            try
+            {
+                after = std::stoull(from);
+            }
+            catch (const std::exception &)
+            {
+                error = "expected SEQ or @NAME";
+                return false;
+            }
+        }
+
+        uint64_t begin = 0, end = 0, count;
+        {
+            std::lock_guard<std::mutex> endsLock(endsMutex);
+            count = ends.size();
+            if (after < count)
+            {
+                begin = after > 0 ? ends[after - 1] : 0;
+                end = ends[count - 1];
+            }
+        }
+        cursor = count;
+        if (begin == end)
+            return true;
+
+        std::ifstream in(path, std::ios::binary);
+        in.seekg(static_cast<std::streamoff>(begin));
+        std::string line;
+        uint64_t position = begin;
+        while (position < end && std::getline(in, line))
+        {
+            position += line.size() + 1;
+            emit(line);
+        }
+        return true;
+    }
+
+    // 購読者 NAME が SEQ まで処理したことを保存する
+    bool ack(const std::string &name, uint64_t seq)
+    {
+        std::lock_guard<std::mutex> lock(cursorMutex);
+        cursors[name] = seq;
+        return saveCursors();
+    }
+};
+
+std::unique_ptr<CommitLog> commitLog;
+
+void recordRecompressedCommit(const std::string &path, Codec codec, uint64_t bytes, uint32_t crc)
+{
+    if (commitLog)
+        commitLog->recordRecompressed(path, codecName(codec), bytes, crc);
+}
+
+// メモリマップしたカタログ索引
+class CatalogIndex
+{
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+    const CatalogIndexHeader *header = nullptr;
+    const CatalogIndexEntry *entries = nullptr;
+    const uint64_t *pathOffsets = nullptr;
+    const char *strings = nullptr;
+
+    // 256エントリーごとのキー（キャッシュに収まる大きさで、二分探索の大半をここで済ませる）
+    static const size_t fenceStride = 256;
+    std::vector<uint64_t> fences;
+
+    static uint64_t keyOf(int32_t run, int32_t frame)
+    {
+        return static_cast<uint64_t>(static_cast<uint32_t>(run) ^ 0x80000000u) << 32 | (static_cast<uint32_t>(frame) ^ 0x80000000u);
+    }
+
+    bool map(const std::string &path)
+    {
+        std::error_code ec;
+        size = static_cast<size_t>(fs::file_size(path, ec));
+        if (ec || size < sizeof(CatalogIndexHeader))
+            return false;
+#ifdef _WIN32
+        fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (fileHandle == INVALID_HANDLE_VALUE)
+            return false;
+        mapping = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        data = mapping ? static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        data = mapped == MAP_FAILED ? nullptr : static_cast<const char *>(mapped);
+#endif
+        if (!data)
+            return false;
+
+        header = reinterpret_cast<const CatalogIndexHeader *>(data);
+        uint64_t entriesEnd = sizeof(CatalogIndexHeader) + header->count * sizeof(CatalogIndexEntry);
+        uint64_t offsetsEnd = entriesEnd + header->pathCount * sizeof(uint64_t);
+        if (std::memcmp(header->magic, "SNPCIDX2", 8) != 0 || offsetsEnd > size)
+            return false;
+        entries = reinterpret_cast<const CatalogIndexEntry *>(data + sizeof(CatalogIndexHeader));
+        pathOffsets = reinterpret_cast<const uint64_t *>(data + entriesEnd);
+        strings = data + offsetsEnd;
+        fences.clear();
+        for (uint64_t i = 0; i < header->count; i += fenceStride)
+            fences.push_back(keyOf(entries[i].run, entries[i].frame));
+        return true;
+    }
+
+    void unmap()
+    {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (fileHandle != INVALID_HANDLE_VALUE)
+            CloseHandle(fileHandle);
+        mapping = nullptr;
+        fileHandle = INVALID_HANDLE_VALUE;
+#else
+        if (data)
+            munmap(const_cast<char *>(data), size);
+#endif
+        data = nullptr;
+        header = nullptr;
+        entries = nullptr;
+        pathOffsets = nullptr;
+        strings = nullptr;
+        fences.clear();
+    }
+
+    // エントリーとキーの比較（equal_range用）
+    struct Less
+    {
+        bool operator()(const CatalogIndexEntry &entry, uint64_t key) const { return keyOf(entry.run, entry.frame) < key; }
+        bool operator()(uint64_t key, const CatalogIndexEntry &entry) const { return key < keyOf(entry.run, entry.frame); }
+    };
+
+public:
+    ~CatalogIndex() { unmap(); }
+
+    // 索引を開く（ログの方が新しければ先に作り直す）。開き直してもよい
+    bool open(const std::string &dir, std::string &error)
+    {
+        unmap();
+        std::string indexPath = (fs::path(dir) / "catalog.idx").string();
+        std::error_code ec;
+        uint64_t logSize = fs::file_size(fs::path(dir) / "catalog.log", ec);
+        if (!map(indexPath) || header->logSize != logSize)
+        {
+            unmap();
+            if (!Catalog::buildIndex(dir, error))
+                return false;
+            if (!map(indexPath))
+            {
+                error = "cannot map " + indexPath;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t count() const { return header ? header->count : 0; }
+    // 索引を作ったときのログのサイズ（開いていなければ0）
+    uint64_t logSize() const { return header ? header->logSize : 0; }
+    const CatalogIndexEntry &entry(size_t i) const { return entries[i]; }
+    const char *archive(const CatalogIndexEntry &entry) const { return strings + pathOffsets[entry.path]; }
+
+    // (ラン, フレーム) に一致するエントリーの範囲
+    std::pair<const CatalogIndexEntry *, const CatalogIndexEntry *> find(int run, int frame) const
+    {
+        // 一致するエントリーは、キー未満の最後の区切りから、キーを超える最初の区切りまでの間にある
+        uint64_t key = keyOf(run, frame);
+        size_t first = std::lower_bound(fences.begin(), fences.end(), key) - fences.begin();
+        size_t last = std::upper_bound(fences.begin() + first, fences.end(), key) - fences.begin();
+        const CatalogIndexEntry *begin = entries + (first > 0 ? (first - 1) * fenceStride : 0);
+        const CatalogIndexEntry *end = entries + std::min<uint64_t>(count(), last * fenceStride);
+        return std::equal_range(begin, end, key, Less());
+    }
+};
+
+#ifndef _WIN32
+// フレーム配信サーバー（serve モード、Unixドメインソケット、1行1要求）
+// カタログでフレームのアーカイブと位置を引き、アーカイブはメモリマップして、展開したブロックを
+// 大きさの上限つきLRUで保持する。要求されたフレームの後ろは別スレッドで先読みする
+// Linux では memfd 上に展開して封印（書き込み禁止）しておき、"map" 要求にはその fd を渡す（コピーなし）
+class FrameServer
+{
+public:
+    struct Settings
+    {
+        std::string catalogDir;
+        size_t cacheBytes = 1024ull << 20;
+        int prefetch = 4;        // 要求されたフレームの後に先読みするフレーム数
+        size_t maxArchives = 64; // マップしたままにするアーカイブ数
+    };
+
+private:
+    // 展開済みのブロック（またはブロックをまたぐフレームを組み立てたもの）
+    struct Buffer
+    {
+        char *data = nullptr;
+        size_t size = 0;
+        int fd = -1;      // memfd（使えなければ -1 で heap に置く）
+        std::string heap;
+
+        ~Buffer()
+        {
+            if (fd >= 0)
+            {
+                if (data)
+                    munmap(data, size);
+                ::close(fd);
+            }
+        }
+    };
+
+    // 書き込み用の領域を確保する。fill で中身を書いた後に seal() する
+    static std::shared_ptr<Buffer> allocate(size_t size)
+    {
+        auto buffer = std::make_shared<Buffer>();
+        buffer->size = size;
+#ifdef __linux__
+        if (size > 0)
+        {
+            buffer->fd = memfd_create("snappymaker-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            void *mapped = MAP_FAILED;
+            if (buffer->fd >= 0 && ftruncate(buffer->fd, size) == 0)
+                mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->fd, 0);
+            if (mapped != MAP_FAILED)
+            {
+                buffer->data = static_cast<char *>(mapped);
+                return buffer;
+            }
+            if (buffer->fd >= 0)
+                ::close(buffer->fd);
+            buffer->fd = -1;
+        }
+#endif
+        buffer->heap.resize(size);
+        buffer->data = &buffer->heap[0];
+        return buffer;
+    }
+
+    // 書き込みを禁止し、読み取り専用でマップし直す（クライアントに渡しても書き換えられない）
+    static void seal(Buffer &buffer)
+    {
+#ifdef __linux__
+        if (buffer.fd < 0)
+            return;
+        munmap(buffer.data, buffer.size);
+        fcntl(buffer.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+        void *mapped = mmap(nullptr, buffer.size, PROT_READ, MAP_SHARED, buffer.fd, 0);
+        buffer.data = mapped == MAP_FAILED ? nullptr : static_cast<char *>(mapped);
+#else
+        (void)buffer;
+#endif
+    }
+
+    // メモリマップしたアーカイブ（索引は ContainerReader で読む）
+    struct Archive
+    {
+        ContainerReader reader;
+        const char *data = nullptr;
+        size_t size = 0;
+        FrameTransforms transforms; // 画素フィルターやマスクをかけたメンバー
+
+        ~Archive()
+        {
+            if (data)
+                munmap(const_cast<char *>(data), size);
+        }
+    };
+
+    Settings settings;
+
+    CatalogIndex index;
+    std::mutex indexMutex;
+    std::chrono::steady_clock::time_point lastReopen; // 索引を開き直した時刻（indexMutexで保護）
+
+    std::mutex archivesMutex;
+    std::list<std::pair<std::string, std::shared_ptr<Archive>>> archives; // 先頭が最近使ったもの
+
+    using BlockKey = std::pair<std::string, size_t>; // (アーカイブ, ブロック番号)
+    std::mutex cacheMutex;
+    std::condition_variable loaded;
+    std::list<std::pair<BlockKey, std::shared_ptr<Buffer>>> lru; // 先頭が最近使ったもの
+    std::map<BlockKey, decltype(lru)::iterator> cached;
+    std::set<BlockKey> loading;
+    size_t cachedBytes = 0;
+
+    std::mutex prefetchMutex;
+    std::condition_variable prefetchReady;
+    std::deque<std::pair<int, int>> prefetchQueue;
+
+    std::atomic<uint64_t> requests{0}, hits{0}, misses{0}, prefetched{0}, copied{0};
+
+    struct Location
+    {
+        std::string archive;
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        uint32_t crc = 0;
+    };
+
+    // カタログでフレームを引く。見つからなければログが伸びていないか確かめて引き直す
+    // 先読みはまだ書かれていないフレームを引くことが多いので、開き直すのはログが伸びたときだけ、
+    // それも1秒に1回まで（索引の作り直しはログ全体のソートになる）
+    bool locate(int run, int frame, Location &location, std::string &error)
+    {
+        std::lock_guard<std::mutex> lock(indexMutex);
+        for (int attempt = 0; attempt < 2; ++attempt)
+        {
+            if (attempt == 1)
+            {
+                auto now = std::chrono::steady_clock::now();
+                std::error_code ec;
+                uint64_t logSize = fs::file_size(fs::path(settings.catalogDir) / "catalog.log", ec);
+                if (ec || logSize == index.logSize() || now - lastReopen < std::chrono::seconds(1))
+                    break;
+                lastReopen = now;
+                if (!index.open(settings.catalogDir, error))
+                    return false;
+            }
+            auto range = index.find(run, frame);
+            if (range.first != range.second)
+            {
+                const CatalogIndexEntry &entry = *(range.second - 1); // 同じフレームが複数あれば最新
+                location.archive = index.archive(entry);
+                location.offset = entry.offset;
+                location.size = entry.size;
+                location.crc = entry.crc;
+                return true;
+            }
+        }
+        error = "frame not in catalog";
+        return false;
+    }
+
+    std::shared_ptr<Archive> openArchive(const std::string &path, std::string &error)
+    {
+        std::lock_guard<std::mutex> lock(archivesMutex);
+        for (auto it = archives.begin(); it != archives.end(); ++it)
+        {
+            if (it->first == path)
+            {
+                archives.splice(archives.begin(), archives, it);
+                return it->second;
+            }
+        }
+
+        auto archive = std::make_shared<Archive>();
+        if (!archive->reader.open(path))
+        {
+            error = archive->reader.isContainer() ? archive->reader.error() : "archive in the old format (run migrate first)";
+            return nullptr;
+        }
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            error = "cannot open " + path;
+            return nullptr;
+        }
+        archive->size = static_cast<size_t>(st.st_size);
+        void *mapped = mmap(nullptr, archive->size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            error = "cannot map " + path;
+            return nullptr;
+        }
+        archive->data = static_cast<const char *>(mapped);
+        if (!archive->transforms.load(archive->reader.metadata(), error))
+        {
+            error += " in " + path;
+            return nullptr;
+        }
+
+        // 置き換えられたアーカイブ（再圧縮など）も、開いたままのマップは元の内容を指し続ける
+        archives.emplace_front(path, archive);
+        if (archives.size() > settings.maxArchives)
+            archives.pop_back();
+        return archive;
+    }
+
+    // 展開済みブロックを返す（キャッシュになければ展開して入れる）
+    std::shared_ptr<Buffer> block(const std::string &path, size_t i, bool prefetch, std::string &error)
+    {
+        BlockKey key(path, i);
+        {
+            std::unique_lock<std::mutex> lock(cacheMutex);
+            while (true)
+            {
+                auto it = cached.find(key);
+                if (it != cached.end())
+                {
+                    lru.splice(lru.begin(), lru, it->second);
+                    if (!prefetch)
+                        ++hits;
+                    return it->second->second;
+                }
+                if (!loading.count(key))
+                    break;
+                // 先読みなどで展開中なら待つ
+                loaded.wait(lock);
+            }
+            loading.insert(key);
+        }
+        ++(prefetch ? prefetched : misses);
+
+        std::shared_ptr<Buffer> buffer;
+        std::shared_ptr<Archive> archive = openArchive(path, error);
+        if (archive && i < archive->reader.blocks().size())
+        {
+            const ContainerBlockEntry &entry = archive->reader.blocks()[i];
+            buffer = allocate(entry.rawSize);
+            if (!decompressInto(archive->reader.codec(), archive->data + entry.offset, entry.storedSize, buffer->data, entry.rawSize) ||
+                crc32c(0, buffer->data, entry.rawSize) != entry.rawCrc)
+            {
+                error = "corrupt block " + std::to_string(i) + " in " + path;
+                buffer.reset();
+            }
+            else
+            {
+                seal(*buffer);
+            }
+        }
+        else if (archive)
+        {
+            error = "block outside of archive";
+        }
+
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        loading.erase(key);
+        loaded.notify_all();
+        if (buffer)
+        {
+            lru.emplace_front(key, buffer);
+            cached[key] = lru.begin();
+            cachedBytes += buffer->size;
+            // 追い出してもクライアントに渡した fd やマップは有効なまま
+            while (cachedBytes > settings.cacheBytes && lru.size() > 1)
+            {
+                cachedBytes -= lru.back().second->size;
+                cached.erase(lru.back().first);
+                lru.pop_back();
+            }
+        }
+        return buffer;
+    }
+
+    void prefetchWorker()
+    {
+        while (true)
+        {
+            std::pair<int, int> key;
+            {
+                std::unique_lock<std::mutex> lock(prefetchMutex);
+                prefetchReady.wait(lock, [this]
+                                   { return !prefetchQueue.empty(); });
+                key = prefetchQueue.front();
+                prefetchQueue.pop_front();
+            }
+            Location location;
+            std::string error;
+            std::shared_ptr<Archive> archive;
+            if (!locate(key.first, key.second, location, error) || !(archive = openArchive(location.archive, error)))
+                continue;
+            uint64_t blockSize = archive->reader.blockSize();
+            for (uint64_t i = location.offset / blockSize; i <= (location.offset + std::max<uint64_t>(location.size, 1) - 1) / blockSize; ++i)
+                block(location.archive, i, true, error);
+        }
+    }
+
+public:
+    // 返すフレーム。1つのブロックに収まるときはキャッシュのブロックをそのまま指す
+    struct Frame
+    {
+        std::shared_ptr<Buffer> buffer;
+        size_t offset = 0; // buffer 内の位置
+        size_t size = 0;
+        uint32_t crc = 0;
+        std::string archive;
+    };
+
+    explicit FrameServer(const Settings &settings) : settings(settings) {}
+
+    bool start(std::string &error)
+    {
+        if (!index.open(settings.catalogDir, error))
+            return false;
+        if (settings.prefetch > 0)
+            std::thread(&FrameServer::prefetchWorker, this).detach();
+        return true;
+    }
+
+    bool get(int run, int frame, Frame &result, std::string &error)
+    {
+        ++requests;
+        Location location;
+        if (!locate(run, frame, location, error))
+            return false;
+        std::shared_ptr<Archive> archive = openArchive(location.archive, error);
+        if (!archive)
+            return false;
+
+        uint64_t blockSize = archive->reader.blockSize();
+        uint64_t first = location.offset / blockSize;
+        uint64_t last = (location.offset + std::max<uint64_t>(location.size, 1) - 1) / blockSize;
+        result.size = location.size;
+        result.crc = location.crc;
+        result.archive = location.archive;
+        const FilteredMember *record = archive->transforms.find(location.offset);
+        if (first == last && !record)
+        {
+            result.buffer = block(location.archive, first, false, error);
+            result.offset = location.offset - first * blockSize;
+            if (!result.buffer)
+            {
+                if (error.empty())
+                    error = "cannot read block " + std::to_string(first) + " of " + location.archive;
+                return false;
+            }
+            if (result.offset + result.size > result.buffer->size)
+            {
+                error = "frame outside of block";
+                return false;
+            }
+        }
+        else
+        {
+            // ブロックをまたぐフレームと画素フィルターを外すフレームは、1つの領域に組み立てる（ここだけコピーが入る）
+            // カタログの大きさは保存したバイト列のもの。マスクで抜いた画素は元に戻すときに入れる
+            std::vector<char> stored;
+            if (record)
+                stored.resize(location.size);
+            result.buffer = allocate(record ? record->restoredSize(location.size) : location.size);
+            result.offset = 0;
+            for (uint64_t i = first; i <= last; ++i)
+            {
+                std::shared_ptr<Buffer> part = block(location.archive, i, false, error);
+                if (!part)
+                {
+                    if (error.empty())
+                        error = "cannot read block " + std::to_string(i) + " of " + location.archive;
+                    return false;
+                }
+                uint64_t begin = std::max(location.offset, i * blockSize);
+                uint64_t end = std::min(location.offset + location.size, i * blockSize + part->size);
+                if (end < begin)
+                {
+                    error = "frame outside of archive";
+                    return false;
+                }
+                char *target = record ? stored.data() : result.buffer->data;
+                std::memcpy(target + (begin - location.offset), part->data + (begin - i * blockSize), end - begin);
+            }
+            if (record)
+            {
+                if (!decodeFrame(stored.data(), stored.size(), *record, archive->transforms.mask.get(), result.buffer->data))
+                {
+                    error = "pixel filter record does not match frame";
+                    return false;
+                }
+                result.size = record->restoredSize(location.size);
+            }
+            seal(*result.buffer);
+            ++copied;
+        }
+
+        if (settings.prefetch > 0)
+        {
+            std::lock_guard<std::mutex> lock(prefetchMutex);
+            for (int i = 1; i <= settings.prefetch && prefetchQueue.size() < 1024; ++i)
+                prefetchQueue.emplace_back(run, frame + i);
+            prefetchReady.notify_one();
+        }
+        return true;
+    }
+
+    std::string stats()
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        std::ostringstream out;
+        out << "{\"requests\":" << requests << ",\"hits\":" << hits << ",\"misses\":" << misses << ",\"prefetched\":" << prefetched
+            << ",\"assembled\":" << copied << ",\"cached_blocks\":" << lru.size() << ",\"cached_mb\":" << cachedBytes / 1048576.0
+            << ",\"cache_limit_mb\":" << settings.cacheBytes / 1048576.0 << "}";
+        return out.str();
+    }
+
+    // クライアント1つ分の要求を処理する
+    void serveClient(socket_t client)
+    {
+        std::string input;
+        char chunk[1024];
+        while (true)
+        {
+            size_t newline;
+            while ((newline = input.find('\n')) == std::string::npos)
+            {
+                ssize_t received = recv(client, chunk, sizeof(chunk), 0);
+                if (received <= 0 || input.size() > 65536)
+                {
+                    closeSocket(client);
+                    return;
+                }
+                input.append(chunk, received);
+            }
+            std::string line = input.substr(0, newline);
+            input.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+
+            std::istringstream request(line);
+            std::string command;
+            int run = 0, frame = 0;
+            request >> command;
+            bool ok = true;
+            if (command == "stats")
+            {
+                std::string reply = stats() + "\n";
+                ok = sendAll(client, reply.data(), reply.size());
+            }
+            else if ((command == "get" || command == "map") && (request >> run >> frame))
+            {
+                Frame result;
+                std::string error;
+                if (!get(run, frame, result, error))
+                {
+                    std::string reply = "{\"error\":" + jsonString(error) + "}\n";
+                    if (!sendAll(client, reply.data(), reply.size()))
+                        break;
+                    continue;
+                }
+                char crc[9];
+                std::snprintf(crc, sizeof(crc), "%08x", result.crc);
+                std::ostringstream header;
+                header << "{\"run\":" << run << ",\"frame\":" << frame << ",\"size\":" << result.size << ",\"crc32c\":\"" << crc
+                       << "\",\"archive\":" << jsonString(result.archive);
+                if (command == "map" && result.buffer->fd >= 0)
+                {
+                    // fd を添えて送る。クライアントは offset から size バイトをマップして読む
+                    header << ",\"offset\":" << result.offset << "}\n";
+                    ok = sendWithFd(client, header.str(), result.buffer->fd);
+                }
+                else
+                {
+                    // fd を渡せないときは、ヘッダーに続けてデータを送る
+                    header << ",\"inline\":true}\n";
+                    ok = sendAll(client, header.str().data(), header.str().size()) &&
+                         sendAll(client, result.buffer->data + result.offset, result.size);
+                }
+            }
+            else
+            {
+                std::string reply = "{\"error\":\"usage: get RUN FRAME | map RUN FRAME | stats\"}\n";
+                ok = sendAll(client, reply.data(), reply.size());
+            }
+            if (!ok)
+                break;
+        }
+        closeSocket(client);
+    }
+
+    // 1行と fd を一緒に送る（SCM_RIGHTS）
+    static bool sendWithFd(socket_t client, const std::string &line, int fd)
+    {
+        iovec io{const_cast<char *>(line.data()), line.size()};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message{};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        ssize_t sent = sendmsg(client, &message, MSG_NOSIGNAL);
+        if (sent < 0)
+            return false;
+        // 残りがあれば普通に送る（fd は最初の1バイトと一緒に届いている）
+        return static_cast<size_t>(sent) == line.size() || sendAll(client, line.data() + sent, line.size() - sent);
+    }
+};
+
+// serve モード：Unixドメインソケットで待ち受け、クライアントごとにスレッドで応答する
+bool runFrameServer(const std::string &socketPath, const FrameServer::Settings &settings)
+{
+    static FrameServer server(settings); // 終了まで待ち受け続けるので破棄しない
+    std::string error;
+    if (!server.start(error))
+    {
+        LOG("Cannot open catalog: " << error);
+        return false;
+    }
+
+    sockaddr_un address{};
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        LOG("Socket path too long: " << socketPath);
+        return false;
+    }
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    socket_t listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (listenFd == invalidSocket || bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listenFd, 16) != 0)
+    {
+        LOG("Error binding " << socketPath << ": " << std::strerror(errno));
+        return false;
+    }
+
+    LOG("Serving frames on " << socketPath << " (cache " << settings.cacheBytes / 1048576 << " MB, prefetch "
+                              << settings.prefetch << " frames)");
+    while (true)
+    {
+        socket_t client = accept(listenFd, nullptr, nullptr);
+        if (client == invalidSocket)
+            continue;
+        std::thread(&FrameServer::serveClient, &server, client).detach();
+    }
+}
+#endif
+
+// セット処理結果（バッチモードの集計用）
+struct SetResult
+{
+    size_t files = 0;          // TARに追加できたファイル数
+    size_t unreadFiles = 0;    // 読めずに監視ディレクトリに残したファイル数
+    uintmax_t inputBytes = 0;  // 圧縮前（TAR）サイズ
+    uintmax_t outputBytes = 0; // 圧縮後サイズ
+};
+
+// ファイルセットを処理する関数
+bool processFileSet(const FileSet &fileSet, const std::string &outputDir, bool deleteAfter = true,
+                    SetResult *result = nullptr)
+{
+    // 処理中のセット数を数える（バックグラウンド処理の待機判定用）
+    struct ActiveGuard
+    {
+        ActiveGuard() { ++activeSets; }
+        ~ActiveGuard() { --activeSets; }
+    } activeGuard;
+
+    try
+    {
+        // 処理開始時間を記録
+        auto startTime = std::chrono::high_resolution_clock::now();
+
+        // 既に処理済みならスキップ
+        if (isSetProcessed(fileSet, outputDir))
+        {
+            LOG("Skipping already processed set: " << fileSet.getArchiveKey());
+            return true;
+        }
+
+        LOG("Processing file set: run " << fileSet.run << ", set " << fileSet.setNumber << " with " << fileSet.files.size() << " files");
+        flightRecorder.record(FlightEvent::SetStart, fileSet.run, fileSet.setNumber, fileSet.getArchiveName());
+
+        // メモリ上でTARを作成
+        CustomTarCreator tarCreator;
+
+        // 画素フィルター（ランごとに選べる）と静的マスク。TARに入れるときにフレームごとに変換し、
+        // 元に戻すための記録をメタデータに残す。マスクを学習中のセットはマスクをかけずに学習だけする
+        PixelFilter filter = pixelFilters.forRun(fileSet.run);
+        std::shared_ptr<const DetectorMask> mask = detectorMasks ? detectorMasks->forRun(fileSet.scope, fileSet.run) : nullptr;
+        std::unique_ptr<MaskLearner> learner;
+        if (detectorMasks && !mask)
+            learner = std::make_unique<MaskLearner>(detectorMasks->sentinels());
+        std::string filterRecord;
+        bool anyMasked = false;
+        uint64_t strippedBytes = 0; // マスクで抜いたバイト数
+        if (filter.active() || detectorMasks)
+        {
+            tarCreator.setTransform([&](const std::string &name, uint64_t offset, std::vector<char> &data)
+                                    {
+                FilteredMember member;
+                if (!parseTiffLayout(data.data(), data.size(), member.layout))
+                    return false;
+                const char *pixels = data.data() + member.layout.pixelOffset;
+                if (learner)
+                    learner->add(pixels, member.layout);
+                // 学習したマスクと形が違うフレームや、マスクした画素の値が違うフレームはそのまま入れる
+                member.masked = mask && mask->matches(member.layout) && mask->holds(pixels);
+                if (!filter.active() && !member.masked)
+                    return false;
+                member.name = name;
+                member.tarOffset = offset;
+                member.filter = filter;
+                member.originalSize = data.size();
+                encodeFrame(data, member.layout, filter, member.masked ? mask.get() : nullptr);
+                strippedBytes += member.originalSize - data.size();
+                anyMasked = anyMasked || member.masked;
+                filterRecord += formatFilterRecord(member);
+                return true; });
+        }
+
+        size_t addedFiles = 0;
+        std::set<std::string> archivedFiles; // 削除してよいのはアーカイブに入ったファイルだけ
+        std::set<std::string> unreadFiles;   // 読めなかったファイル（残してメタデータに記録する）
+        for (const auto &filePath : fileSet.files)
+        {
+            if (!tarCreator.addFile(filePath))
+            {
+                LOG("Failed to add file to tar: " << filePath);
+                flightRecorder.record(FlightEvent::Error, fileSet.run, fileSet.setNumber, fs::path(filePath).filename().string());
+                unreadFiles.insert(filePath);
+                continue;
+            }
+            ++addedFiles;
+            archivedFiles.insert(filePath);
+        }
+        // 1つも読めなかったセットは空のアーカイブを書かずに失敗にする（書くと処理済みになり、残したファイルが二度と拾われない）
+        if (addedFiles == 0)
+        {
+            LOG("No file of the set could be read, not writing an archive: " << fileSet.getArchiveKey());
+            flightRecorder.record(FlightEvent::SetFailed, fileSet.run, fileSet.setNumber, "no readable files");
+            return false;
+        }
+
+        // フレームが少ないセットでは学習せず、次のセットでもう一度学習する
+        if (learner && learner->enough())
+            detectorMasks->learned(fileSet.scope, fileSet.run, learner->finish());
+        else if (learner)
+            LOG("Not enough frames to learn a detector mask (" << learner->frameCount() << " of " << MaskLearner::minFrames
+                                                               << "), storing the set unmasked");
+
+        std::vector<char> tarBuffer = tarCreator.getBuffer();
+        flightRecorder.record(FlightEvent::SetRead, static_cast<int64_t>(addedFiles), static_cast<int64_t>(tarBuffer.size()));
+
+        // 出力先を決定（複数の出力先がある場合は分散配置）
+        size_t target = 0;
+        std::string targetDir = outputDir;
+        if (outputRouter)
+        {
+            target = outputRouter->assign(fileSet.getArchiveKey());
+            targetDir = outputRouter->targetDirs()[target];
+        }
+        struct PlacementGuard
+        {
+            size_t target;
+            ~PlacementGuard()
+            {
+                if (outputRouter)
+                    outputRouter->release(target);
+            }
+        } placementGuard{target};
+        std::string archiveDir = outputLayout.directoryFor(targetDir, fileSet.run, fileSet.scope, fileSet.getArchiveKey());
+        std::string outputPath = fileSet.getOutputPath(archiveDir);
+
+        // 出力ディレクトリが存在しない場合は作成（作成済みならキャッシュで判定）
+        if (archiveSink->isLocal())
+        {
+            outputLayout.ensureDirectory(archiveDir);
+        }
+
+        // ブロックごとにSnappyで圧縮してコンテナ形式で保存
+        auto writeStart = std::chrono::steady_clock::now();
+        std::unique_ptr<ArchiveOutput> output = archiveSink->openArchive(outputPath);
+        if (!output)
+        {
+            LOG("Error opening output file: " << outputPath);
+            flightRecorder.record(FlightEvent::SetFailed, fileSet.run, fileSet.setNumber, "open failed");
+            return false;
+        }
+        uint32_t archiveCrc = 0; // 書き出すバイト列そのもののCRC32C（コミットイベント用）
+        ContainerWriter writer(Codec::Snappy, 0, defaultBlockSize, [&output, &archiveCrc](const char *data, size_t size)
+                               {
+                                   archiveCrc = crc32c(archiveCrc, data, size);
+                                   return output->append(data, size); });
+
+        ContainerMeta meta;
+        meta.set("codec", codecName(Codec::Snappy));
+        meta.set("tier", "hot");
+        meta.set("run", std::to_string(fileSet.run));
+        meta.set("set", std::to_string(fileSet.setNumber));
+        meta.set("files", std::to_string(addedFiles));
+        if (fileSet.splitFirst > 0)
+        {
+            // セットの一部だけを含むサブアーカイブ
+            meta.set("split", std::to_string(fileSet.splitFirst) + "-" + std::to_string(fileSet.splitLast));
+        }
+        if (!filterRecord.empty())
+            meta.set("pixel_filter", filterRecord);
+        if (anyMasked)
+            meta.set("mask", mask->toText()); // アーカイブだけで元に戻せるように、使ったマスクも入れる
+        if (!unreadFiles.empty())
+        {
+            std::string names;
+            for (const auto &path : unreadFiles)
+                names += fs::path(path).filename().string() + "\n";
+            meta.set("unread", names);
+        }
+
+        // フッターにマニフェストを入れるため、ブロックをすべて書き出してから範囲を求める
+        bool written = writer.begin() && writer.append(tarBuffer.data(), tarBuffer.size()) && writer.flush();
+        std::string manifest = formatManifest(buildManifest(tarCreator.members(), writer.blocks()));
+        meta.set("manifest", manifest);
+        written = written && writer.finish(meta);
+        if (!written || !output->commit())
+        {
+            LOG("Error writing output file: " << outputPath);
+            flightRecorder.record(FlightEvent::SetFailed, fileSet.run, fileSet.setNumber, "write failed");
+            output->abort();
+            return false;
+        }
+        flightRecorder.record(FlightEvent::SetWritten, static_cast<int64_t>(writer.bytesWritten()),
+                              std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - writeStart).count(),
+                              fileSet.getArchiveName());
+
+        outputLayout.added(archiveDir, fileSet.getArchiveName());
+        if (!unreadFiles.empty())
+        {
+            unreadFrames.record(fileSet, unreadFiles);
+            LOG("Warning: " << unreadFiles.size() << " file(s) of " << fileSet.getArchiveKey()
+                            << " could not be read and were kept in the watch directory");
+        }
+        if (catalog)
+        {
+            catalog->record(fileSet.run, outputPath, tarCreator.members());
+        }
+
+        // マニフェストのサイドカー（アーカイブと同じ出力先に書く）
+        if (manifestSidecar)
+        {
+            std::unique_ptr<ArchiveOutput> sidecar = archiveSink->openArchive(outputPath + ".manifest");
+            if (sidecar && sidecar->append(manifest.data(), manifest.size()) && sidecar->commit())
+            {
+                outputLayout.added(archiveDir, fileSet.getArchiveName() + ".manifest");
+            }
+            else
+            {
+                LOG("Error writing manifest: " << outputPath << ".manifest");
+                if (sidecar)
+                    sidecar->abort();
+            }
+        }
+
+        // 下流（転送・解析）向けのコミットイベント
+        if (commitLog)
+        {
+            int firstFrame, lastFrame;
+            frameRange(fileSet, firstFrame, lastFrame);
+            commitLog->record(outputPath, fileSet.run, firstFrame, lastFrame, addedFiles, writer.bytesWritten(), tarBuffer.size(),
+                              archiveCrc);
+        }
+
+        // 段階圧縮：後で空き時間に高圧縮率で再圧縮する
+        if (recompressor && archiveSink->isLocal())
+        {
+            recompressor->push(outputPath);
+        }
+
+        // 先頭ファイルを出力ディレクトリにコピー
+        if (!fileSet.firstFile.empty())
+        {
+            fs::path firstFilePath(fileSet.firstFile);
+            fs::path destPath = fs::path(archiveDir) / firstFilePath.filename();
+
+            try
+            {
+                // ファイルが存在している場合は上書き（事前の存在確認はしない）
+                if (!archiveSink->copyFile(firstFilePath.string(), destPath.string()))
+                {
+                    throw std::runtime_error("cannot write " + destPath.string());
+                }
+                outputLayout.added(archiveDir, destPath.filename().string());
+                LOG("Copied first file to output directory: " << destPath.filename().string());
+            }
+            catch (const std::exception &e)
+            {
+                LOG("Error copying first file: " << e.what());
+            }
+        }
+
+        if (outputRouter)
+        {
+            outputRouter->record(fileSet.getArchiveKey(), target, writer.bytesWritten(), outputPath);
+        }
+
+        // 元ファイルを削除 - 削除キューに追加
+        if (deleteAfter && archiveSink->keepsData())
+        {
+            // 削除タスクを削除キューに追加（TARに入ったファイルだけ。読めなかったファイルは残す）
+            deleteQueue->push(archivedFiles, fileSet.run);
+        }
+
+        // 処理終了時間と経過時間を計算
+        auto endTime = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
+
+        if (result)
+        {
+            result->files = addedFiles;
+            result->unreadFiles = unreadFiles.size();
+            result->inputBytes = tarBuffer.size() + strippedBytes;
+            result->outputBytes = writer.bytesWritten();
+        }
+
+        LOG("Created: " << fs::path(outputPath).filename().string() << " - Processing time: " << duration << " ms");
+        return true;
+    }
+    catch (const std::exception &e)
+    {
+        LOG("Error processing file set: " << e.what());
+        flightRecorder.record(FlightEvent::SetFailed, fileSet.run, fileSet.setNumber, e.what());
+        return false;
+    }
+}
+
+// 背圧：取り込みが検出器に追いついているかを取得側に知らせる（監視モード）
+// 走査のたびにバックログ・遅れ・空き容量から絞り込みレベル（0=ok, 1=slow, 2=pause, 3=stop）を決め、
+// 状態ファイル（JSON）と制御ソケットの "backpressure" 購読者に公開する
+class Backpressure
+{
+public:
+    struct Settings
+    {
+        std::string statusFile;     // 空なら書かない
+        double lagSeconds = 60.0;   // これを超える遅れで slow、4倍で pause
+        double minFreeGB = 10.0;    // これを下回る空き容量で stop、2倍で pause
+        size_t backlogFiles = 0;    // これを超えるバックログで slow、4倍で pause
+        int setSize = 100;          // 揃ったセットだけを遅れの対象にする
+    };
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    Settings settings;
+    std::string watchDir;
+    std::string outputDir;
+    struct Pending
+    {
+        size_t files = 0;                 // 前回の走査で見つかったファイル数
+        Clock::time_point changed;        // ファイル数が最後に変わった時刻
+        Clock::time_point completeSince;  // セットが揃った時刻
+        bool complete = false;
+    };
+    std::map<FileSetKey, Pending> pending; // 未処理のセット
+    std::atomic<size_t> archivedFiles{0};
+    size_t lastArchived = 0;
+    size_t lastTotal = 0;
+    Clock::time_point lastUpdate;
+    bool hasLast = false;
+    double arrivalFps = 0.0;
+    double archiveFps = 0.0;
+    int lastLevel = 0;
+    std::mutex mutex;
+    std::string current = "{}";
+
+    // 空き容量（GB、取得できなければ-1）
+    static double freeGB(const std::string &dir)
+    {
+        if (!vfs->isLocal())
+            return -1.0;
+        std::error_code ec;
+        auto info = fs::space(dir, ec);
+        return ec ? -1.0 : info.available / 1e9;
+    }
+
+    void writeStatusFile(const std::string &json)
+    {
+        // 読み手が書きかけのファイルを見ないよう、一時ファイルに書いてから置き換える
+        std::string temp = settings.statusFile + ".tmp";
+        {
+            std::ofstream out(temp, std::ios::trunc);
+            out << json << "\n";
+            if (!out)
+                return;
+        }
+        std::error_code ec;
+        fs::rename(temp, settings.statusFile, ec);
+    }
+
+public:
+    Backpressure(const Settings &settings, const std::string &watchDir, const std::string &outputDir)
+        : settings(settings), watchDir(watchDir), outputDir(outputDir) {}
+
+    void recordArchived(size_t files) { archivedFiles += files; }
+
+    // 走査結果から状態を更新して公開する
+    // 遅れはセットが揃ってからの時間で測る（検出器のペースで埋まっている途中のセットは遅れではない）。
+    // 揃わないまま遅れの閾値より長くファイルが増えないセット（中断した取得の端数など）はバックログから外す
+    void update(const std::vector<FileSet> &fileSets, const std::set<FileSetKey> &processed)
+    {
+        auto now = Clock::now();
+        size_t backlogFiles = 0;
+        size_t backlogSets = 0;
+        size_t stalledSets = 0;
+        size_t unreadFiles = 0;
+        Clock::time_point oldest = now;
+        std::map<FileSetKey, Pending> seen;
+        for (const auto &fileSet : fileSets)
+        {
+            FileSetKey key(fileSet.scope, fileSet.run, fileSet.setNumber);
+            unreadFiles += unreadFrames.count(fileSet);
+            if (processed.count(key))
+                continue;
+            auto it = pending.find(key);
+            Pending state = it != pending.end() ? it->second : Pending{0, now, now, false};
+            if (fileSet.files.size() != state.files)
+            {
+                state.files = fileSet.files.size();
+                state.changed = now;
+            }
+            if (!state.complete && isSetComplete(fileSet, settings.setSize))
+            {
+                state.complete = true;
+                state.completeSince = now;
+            }
+            seen[key] = state;
+
+            if (!state.complete && std::chrono::duration<double>(now - state.changed).count() > settings.lagSeconds)
+            {
+                ++stalledSets;
+                continue;
+            }
+            backlogFiles += fileSet.files.size();
+            ++backlogSets;
+            if (state.complete)
+                oldest = std::min(oldest, state.completeSince);
+        }
+        pending.swap(seen);
+        double lag = std::chrono::duration<double>(now - oldest).count();
+
+        // 到着レート = (バックログ + 処理済み) の増分、処理レート = 処理済みの増分
+        size_t archived = archivedFiles.load();
+        size_t total = backlogFiles + archived;
+        if (hasLast)
+        {
+            double dt = std::chrono::duration<double>(now - lastUpdate).count();
+            if (dt > 0.0)
+            {
+                double arrival = total >= lastTotal ? (total - lastTotal) / dt : 0.0;
+                double archive = (archived - lastArchived) / dt;
+                arrivalFps = arrivalFps * 0.7 + arrival * 0.3;
+                archiveFps = archiveFps * 0.7 + archive * 0.3;
+            }
+        }
+        hasLast = true;
+        lastUpdate = now;
+        lastTotal = total;
+        lastArchived = archived;
+
+        double freeWatch = freeGB(watchDir);
+        double freeOutput = freeGB(outputDir);
+        double freeMin = freeWatch < 0.0 ? freeOutput : freeOutput < 0.0 ? freeWatch : std::min(freeWatch, freeOutput);
+        bool freeKnown = freeMin >= 0.0;
+
+        int level = 0;
+        std::string reason;
+        auto raise = [&](int candidate, const char *why)
+        {
+            if (candidate > level)
+            {
+                level = candidate;
+                reason = why;
+            }
+        };
+        if (freeKnown && freeMin < settings.minFreeGB)
+            raise(3, "disk_full");
+        if (freeKnown && freeMin < settings.minFreeGB * 2)
+            raise(2, "disk_low");
+        if (lag > settings.lagSeconds * 4)
+            raise(2, "lag");
+        if (settings.backlogFiles > 0 && backlogFiles > settings.backlogFiles * 4)
+            raise(2, "backlog");
+        if (lag > settings.lagSeconds)
+            raise(1, "lag");
+        if (settings.backlogFiles > 0 && backlogFiles > settings.backlogFiles)
+            raise(1, "backlog");
+
+        static const char *const levelNames[] = {"ok", "slow", "pause", "stop"};
+        std::ostringstream json;
+        json << std::fixed << std::setprecision(1)
+             << "{\"time\":" << std::time(nullptr)
+             << ",\"level\":" << level
+             << ",\"throttle\":\"" << levelNames[level] << "\""
+             << ",\"reason\":\"" << reason << "\""
+             << ",\"backlog_files\":" << backlogFiles
+             << ",\"backlog_sets\":" << backlogSets
+             << ",\"stalled_sets\":" << stalledSets
+             << ",\"unread_files\":" << unreadFiles
+             << ",\"active_sets\":" << activeSets.load()
+             << ",\"delete_queue\":" << deleteQueue->size()
+             << ",\"trash_files\":" << deleteQueue->trashSize()
+             << ",\"lag_seconds\":" << lag
+             << ",\"arrival_fps\":" << arrivalFps
+             << ",\"archive_fps\":" << archiveFps
+             << ",\"free_watch_gb\":" << freeWatch
+             << ",\"free_output_gb\":" << freeOutput << "}";
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = json.str();
+        }
+        if (level != lastLevel)
+        {
+            LOG("Backpressure: " << levelNames[lastLevel] << " -> " << levelNames[level]
+                                 << (reason.empty() ? "" : " (" + reason + ")"));
+            lastLevel = level;
+        }
+        if (!settings.statusFile.empty())
+            writeStatusFile(json.str());
+        if (controlServer)
+            controlServer->publish("backpressure", json.str());
+    }
+
+    std::string status()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return current;
+    }
+};
+
+std::unique_ptr<Backpressure> backpressure;
+
+// 監視モードのワーカー（処理時間をレイテンシ制御と背圧に返す）
+void processMonitoredSet(FileSet fileSet, std::string outputDir, bool deleteAfter)
+{
+    applyTaskPriority(TaskClass::Compress);
+    auto start = std::chrono::steady_clock::now();
+    SetResult result;
+    if (!processFileSet(fileSet, outputDir, deleteAfter, &result) || result.files == 0)
+        return;
+    if (sloController)
+        sloController->recordProcessing(result.files, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    if (backpressure)
+        backpressure->recordArchived(result.files);
+}
+
+// メインの監視ループ
+void monitorDirectory(const std::string &watchDir, const std::string &outputDir,
+                      const std::string &basePattern, int setSize, int pollInterval,
+                      int maxThreads, bool deleteAfter, bool stopOnInterrupt)
+{
+
+    bool running = true;
+
+    LOG("Starting directory monitor on: " << watchDir);
+    LOG("Output directory: " << outputDir);
+    LOG("Set size: " << setSize << " files");
+    LOG("Poll interval: " << pollInterval << " seconds");
+    LOG("Max threads: " << maxThreads);
+
+    // 削除キューを初期化
+    deleteQueue = std::make_unique<DeleteQueue>(trashSettings);
+
+    // 出力ディレクトリがなければ作成
+    if (!vfs->createDirectories(outputDir))
+    {
+        LOG("Error creating output directory: " << outputDir);
+        return;
+    }
+
+    // スレッドプール
+    std::vector<std::thread> threads;
+
+    // Ctrl+C 処理
+    if (stopOnInterrupt)
+    {
+        std::thread interruptThread([&running]()
+                                    {
+            LOG("Press Enter to stop the monitor...");
+            std::cin.get();
+            running = false;
+            LOG("Stopping monitor..."); });
+        interruptThread.detach();
+    }
+
+    // セットを新しいスレッドで処理する（スレッド数が上限なら実行中のスレッドの終了を待つ）
+    auto dispatch = [&](const FileSet &fileSet)
+    {
+        while (threads.size() >= static_cast<size_t>(maxThreads))
+        {
+            // 完了したスレッドを削除
+            for (auto it = threads.begin(); it != threads.end();)
+            {
+                if (it->joinable())
+                {
+                    it->join();
+                    it = threads.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+
+        if (fileSet.splitFirst > 0)
+        {
+            LOG("Starting processing of set: run " << fileSet.run << ", set " << fileSet.setNumber << ", frames "
+                                                   << fileSet.splitFirst << "-" << fileSet.splitLast);
+        }
+        else
+        {
+            LOG("Starting processing of set: run " << fileSet.run << ", set " << fileSet.setNumber);
+        }
+        flightRecorder.record(FlightEvent::Dispatch, fileSet.run, fileSet.setNumber);
+        threads.emplace_back(processMonitoredSet, fileSet, outputDir, deleteAfter);
+    };
+
+    // メインループ
+    while (running)
+    {
+        try
+        {
+            // 処理済みセットを追跡
+            static std::set<FileSetKey> processedSets;
+            // 不完全セット（まだ揃っていないセット）を追跡
+            static std::set<FileSetKey> incompleteSetsSeen;
+            // このループで圧縮処理を実行したフラグ
+            bool processedAnySet = false;
+
+            // ディレクトリをスキャンしてファイルセットを取得
+            auto fileSets = watchScopes ? scanAndGroupFiles(*watchScopes, basePattern, setSize)
+                                        : scanAndGroupFiles(watchDir, basePattern, setSize);
+
+            LOG("Found " << fileSets.size() << " file sets");
+            size_t scannedFiles = 0;
+            for (const auto &fileSet : fileSets)
+                scannedFiles += fileSet.files.size();
+            flightRecorder.record(FlightEvent::Scan, static_cast<int64_t>(fileSets.size()), static_cast<int64_t>(scannedFiles));
+
+            // 各セットを処理
+            for (const auto &fileSet : fileSets)
+            {
+                FileSetKey setKey(fileSet.scope, fileSet.run, fileSet.setNumber);
+
+                // 既に処理済みならスキップ
+                if (processedSets.find(setKey) != processedSets.end())
+                {
+                    continue;
+                }
+                // 再起動前にアーカイブしたセットの、読めずに残したフレームだけが残っている
+                size_t unread = unreadFrames.leftovers(fileSet, outputDir);
+                if (unread > 0 && unread == fileSet.files.size())
+                {
+                    processedSets.insert(setKey);
+                    continue;
+                }
+
+                // レイテンシ目標：揃う前にセットの一部をサブアーカイブとして先に処理する
+                if (sloController)
+                {
+                    FileSet chunk;
+                    auto decision = sloController->plan(fileSet, setSize, hasSplitHead(fileSet, outputDir), chunk);
+                    if (decision == SloController::Decision::Chunk)
+                    {
+                        dispatch(chunk);
+                        if (chunk.splitLast == fileSet.setNumber + setSize - 1)
+                        {
+                            processedSets.insert(setKey);
+                            incompleteSetsSeen.erase(setKey);
+                        }
+                        processedAnySet = true;
+                        continue;
+                    }
+                    if (decision == SloController::Decision::Wait)
+                    {
+                        incompleteSetsSeen.insert(setKey);
+                        LOG("Set incomplete: run " << fileSet.run << ", set " << fileSet.setNumber << " (" << fileSet.files.size() << "/" << setSize << " files)");
+                        continue;
+                    }
+                }
+
+                // セットが完全であるか確認（以前に分割されたセットの残りも含む）
+                bool remainder = !isSetComplete(fileSet, setSize) && isSplitRemainder(fileSet, setSize, outputDir);
+                if (isSetComplete(fileSet, setSize) || remainder)
+                {
+                    // 既に処理済みかチェック
+                    if (isSetProcessed(fileSet, outputDir))
+                    {
+                        FileSet rest;
+                        if (unarchivedSplitFrames(fileSet, setSize, outputDir, rest))
+                        {
+                            // 再起動前に先頭側だけサブアーカイブされていた
+                            incompleteSetsSeen.erase(setKey);
+                            dispatch(rest);
+                            processedAnySet = true;
+                        }
+                        else
+                        {
+                            LOG("Set already processed: run " << fileSet.run << ", set " << fileSet.setNumber);
+                        }
+                        processedSets.insert(setKey);
+                        continue;
+                    }
+
+                    // 不完全セットリストから削除（もし以前に不完全として記録されていたなら）
+                    incompleteSetsSeen.erase(setKey);
+
+                    FileSet toProcess = fileSet;
+                    if (remainder)
+                        markSplit(toProcess);
+                    dispatch(toProcess);
+                    processedSets.insert(setKey);
+                    // 圧縮処理を実行したフラグをセット
+                    processedAnySet = true;
+                }
+                else
+                {
+                    // 不完全なセットを記録
+                    incompleteSetsSeen.insert(setKey);
+                    LOG("Set incomplete: run " << fileSet.run << ", set " << fileSet.setNumber << " (" << fileSet.files.size() << "/" << setSize << " files)");
+                }
+            }
+
+            // 完了したスレッドをクリーンアップ
+            for (auto it = threads.begin(); it != threads.end();)
+            {
+                if (it->joinable())
+                {
+                    it->join();
+                    it = threads.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+
+            // キューの状態をログに出力（オプション）
+            LOG("Delete queue size: " << deleteQueue->size());
+            flightRecorder.record(FlightEvent::QueueDepth, static_cast<int64_t>(deleteQueue->size()), activeSets.load());
+            if (backpressure)
+                backpressure->update(fileSets, processedSets);
+
+            // 圧縮処理が実行されなかった場合のみ待機を行う
+            if (!processedAnySet)
+            {
+                // 指定された間隔で待機（inotifyが使えれば新しいファイルで早めに起きる）
+                for (int i = 0; i < pollInterval && running; ++i)
+                {
+                    if (!watchScopes)
+                        std::this_thread::sleep_for(std::chrono::seconds(1));
+                    else if (watchScopes->waitForChanges(1))
+                        break;
+                }
+            }
+        }
+        catch (const std::exception &e)
+        {
+            LOG("Error in monitor loop: " << e.what());
+
+            // エラー時は待機を入れる（圧縮処理の有無に関わらず）
+            for (int i = 0; i < pollInterval && running; ++i)
+            {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+        }
+    }
+
+    // 残りのスレッドが完了するのを待つ
+    LOG("Waiting for remaining tasks to complete...");
+    for (auto &thread : threads)
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+
+    // 削除キューを解放
+    LOG("Waiting for delete queue to finish...");
+    deleteQueue.reset();
+
+    LOG("Monitor stopped.");
+}
+
+// オフラインのバッチ圧縮（ディレクトリを一度だけ走査し、全セットを最大並列で処理して終了）
+bool batchCompress(const std::string &watchDir, const std::string &outputDir,
+                   const std::string &basePattern, int setSize, int maxThreads,
+                   bool deleteAfter, bool completeOnly)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    LOG("Starting batch compression of: " << watchDir);
+    LOG("Output directory: " << outputDir);
+    LOG("Set size: " << setSize << " files");
+    LOG("Threads: " << maxThreads);
+
+    deleteQueue = std::make_unique<DeleteQueue>(trashSettings);
+
+    if (!vfs->createDirectories(outputDir))
+    {
+        LOG("Error creating output directory: " << outputDir);
+        return false;
+    }
+
+    // 入力ディレクトリのリスティングは一度だけ（再帰モードでは各サブディレクトリを一度ずつ）
+    auto fileSets = watchScopes ? scanAndGroupFiles(*watchScopes, basePattern, setSize)
+                                : scanAndGroupFiles(watchDir, basePattern, setSize);
+
+    // 出力先の存在確認は出力階層のキャッシュで行う（各ディレクトリは一度だけ列挙される）
+    // 処理計画を作成
+    std::vector<FileSet> plan;
+    size_t skippedDone = 0;
+    size_t skippedIncomplete = 0;
+    size_t partialSets = 0;
+    size_t plannedFiles = 0;
+    size_t unreadKept = 0; // 以前のバッチで読めずに残したファイル
+    for (const auto &fileSet : fileSets)
+    {
+        size_t unread = unreadFrames.leftovers(fileSet, outputDir);
+        if (unread > 0 && unread == fileSet.files.size())
+        {
+            unreadKept += unread;
+            ++skippedDone;
+            continue;
+        }
+        if (isSetProcessed(fileSet, outputDir))
+        {
+            FileSet rest;
+            if (unarchivedSplitFrames(fileSet, setSize, outputDir, rest))
+            {
+                // 先頭側だけサブアーカイブされたセット（再起動前に分割された）
+                plannedFiles += rest.files.size();
+                plan.push_back(rest);
+                continue;
+            }
+            ++skippedDone;
+            continue;
+        }
+        if (isSplitRemainder(fileSet, setSize, outputDir))
+        {
+            // 以前に分割されたセットの残り
+            FileSet remainder = fileSet;
+            markSplit(remainder);
+            plannedFiles += remainder.files.size();
+            plan.push_back(remainder);
+            continue;
+        }
+        if (!isSetComplete(fileSet, setSize))
+        {
+            // 検出器が動いていないので、末尾の欠けたセットもそのまま確定させる
+            if (completeOnly)
+            {
+                ++skippedIncomplete;
+                continue;
+            }
+            ++partialSets;
+        }
+        plannedFiles += fileSet.files.size();
+        plan.push_back(fileSet);
+    }
+
+    LOG("Planned " << plan.size() << " sets (" << plannedFiles << " files, " << partialSets << " partial), skipped "
+                   << skippedDone << " already processed, " << skippedIncomplete << " incomplete");
+    flightRecorder.record(FlightEvent::Scan, static_cast<int64_t>(plan.size()), static_cast<int64_t>(plannedFiles));
+
+    std::atomic<size_t> nextIndex(0);
+    std::atomic<size_t> setsDone(0);
+    std::atomic<size_t> setsFailed(0);
+    std::atomic<size_t> filesDone(0);     // 処理を終えたセットのファイル数（進捗とETA用、失敗したセットも含む）
+    std::atomic<size_t> filesArchived(0); // アーカイブに入ったファイル数
+    std::atomic<size_t> filesUnread(0);   // 読めずに残したファイル数
+    std::atomic<uintmax_t> bytesIn(0);
+    std::atomic<uintmax_t> bytesOut(0);
+
+    auto worker = [&]()
+    {
+        applyTaskPriority(TaskClass::Compress);
+        for (size_t i = nextIndex++; i < plan.size(); i = nextIndex++)
+        {
+            SetResult result;
+            flightRecorder.record(FlightEvent::Dispatch, plan[i].run, plan[i].setNumber);
+            if (processFileSet(plan[i], outputDir, deleteAfter, &result))
+            {
+                filesArchived += result.files;
+                filesUnread += result.unreadFiles;
+                bytesIn += result.inputBytes;
+                bytesOut += result.outputBytes;
+            }
+            else
+            {
+                ++setsFailed;
+            }
+            filesDone += plan[i].files.size();
+            ++setsDone;
+        }
+    };
+
+    // 進捗とETAの表示
+    std::mutex progressMutex;
+    std::condition_variable progressCv;
+    bool finished = false;
+    std::thread progressThread([&]()
+                               {
+        std::unique_lock<std::mutex> lock(progressMutex);
+        while (!progressCv.wait_for(lock, std::chrono::seconds(2), [&] { return finished; }))
+        {
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+            size_t done = filesDone;
+            double mbPerSec = bytesIn / 1048576.0 / std::max(elapsed, 1e-3);
+            std::string eta = "unknown";
+            if (done > 0)
+            {
+                eta = std::to_string(static_cast<long long>(elapsed / done * (plannedFiles - done))) + " s";
+            }
+            LOG("Progress: " << setsDone << "/" << plan.size() << " sets, " << done << "/" << plannedFiles
+                             << " files, " << mbPerSec << " MB/s, ETA " << eta);
+        } });
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < maxThreads; ++i)
+    {
+        threads.emplace_back(worker);
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(progressMutex);
+        finished = true;
+    }
+    progressCv.notify_all();
+    progressThread.join();
+
+    LOG("Waiting for delete queue to finish...");
+    deleteQueue.reset();
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    LOG("=== Batch Summary ===");
+    LOG("Sets processed: " << (setsDone - setsFailed) << " (" << setsFailed << " failed)");
+    LOG("Files archived: " << filesArchived << " of " << plannedFiles);
+    if (filesUnread > 0 || unreadKept > 0)
+    {
+        LOG("Files left unread in the watch directory: " << filesUnread << " from this batch, " << unreadKept
+                                                          << " from earlier runs (listed in the archive metadata \"unread\")");
+    }
+    LOG("Input: " << bytesIn / 1048576.0 << " MB, Output: " << bytesOut / 1048576.0 << " MB, Ratio: "
+                  << (bytesOut > 0 ? static_cast<double>(bytesIn) / bytesOut : 0.0));
+    LOG("Elapsed: " << elapsed << " s, Throughput: " << bytesIn / 1048576.0 / std::max(elapsed, 1e-3) << " MB/s");
+
+    return setsFailed == 0;
+}
+
+// 処理能力の計測値（プランナーが保存し、シミュレーターが読み込む）
+struct Calibration
+{
+    double frameBytes = 8.0 * 1048576.0;
+    double readMBps = 500.0;
+    double writeMBps = 500.0;
+    double compressMBps = 400.0; // 1スレッドあたり（snappy）
+    double ratio = 1.5;
+    int cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+    // key=value形式で保存する
+    bool save(const std::string &path) const
+    {
+        std::ofstream out(path);
+        out << "frame_bytes=" << frameBytes << "\n"
+            << "read_mbps=" << readMBps << "\n"
+            << "write_mbps=" << writeMBps << "\n"
+            << "compress_mbps=" << compressMBps << "\n"
+            << "ratio=" << ratio << "\n"
+            << "cores=" << cores << "\n";
+        return static_cast<bool>(out);
+    }
+
+    bool load(const std::string &path)
+    {
+        std::ifstream in(path);
+        if (!in)
+            return false;
+        std::string line;
+        while (std::getline(in, line))
+        {
+            size_t eq = line.find('=');
+            if (eq == std::string::npos)
+                continue;
+            std::string key = line.substr(0, eq);
+            double value = std::atof(line.c_str() + eq + 1);
+            if (key == "frame_bytes")
+                frameBytes = value;
+            else if (key == "read_mbps")
+                readMBps = value;
+            else if (key == "write_mbps")
+                writeMBps = value;
+            else if (key == "compress_mbps")
+                compressMBps = value;
+            else if (key == "ratio")
+                ratio = value;
+            else if (key == "cores")
+                cores = std::max(1, static_cast<int>(value));
+        }
+        return true;
+    }
+};
+
+// 容量計画の設定
+struct PlannerSettings
+{
+    std::string sampleDir;
+    std::string basePattern;
+    std::string outputDir;      // 空なら書き込み帯域は計測しない
+    int samples = 50;           // サンプルするフレーム数
+    double frameRate = 0.0;     // 検出器のフレームレート（frames/s、0なら未指定）
+    long long backlog = 0;      // 消化したい滞留フレーム数
+    int threads = 0;            // 0なら推奨値で見積もる
+    double latencyTarget = 10.0; // セットが揃うまでに許容する秒数
+    std::string calibrationOut;  // 空でなければ計測値を保存（シミュレーター用）
+};
+
+// 計測したコーデックごとの性能
+struct CodecMeasurement
+{
+    Codec codec;
+    int level;
+    double ratio;        // 圧縮率（入力/出力）
+    double compressMBps; // 1スレッドあたりの圧縮速度
+};
+
+// サンプルを計測して処理能力を見積もる
+bool runCapacityPlanner(const PlannerSettings &settings)
+{
+    const double MB = 1048576.0;
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+
+    LOG("=== Capacity Planner ===");
+    LOG("Sampling directory: " << settings.sampleDir);
+
+    // 対象ファイルを一覧し、全体から等間隔にサンプルする
+    std::vector<std::string> candidates;
+    for (const auto &fileSet : scanAndGroupFiles(settings.sampleDir, settings.basePattern, 1))
+    {
+        candidates.insert(candidates.end(), fileSet.files.begin(), fileSet.files.end());
+    }
+    if (candidates.empty())
+    {
+        LOG("No files matching " << settings.basePattern << " found in " << settings.sampleDir);
+        return false;
+    }
+    size_t sampleCount = std::min(candidates.size(), static_cast<size_t>(std::max(1, settings.samples)));
+    std::vector<std::string> sampled;
+    for (size_t i = 0; i < sampleCount; ++i)
+    {
+        sampled.push_back(candidates[i * candidates.size() / sampleCount]);
+    }
+
+    // 読み込み帯域（OSキャッシュに載っているファイルは速く見えるので注意）
+    uintmax_t sampleBytes = 0;
+    auto readStart = std::chrono::steady_clock::now();
+    for (const auto &path : sampled)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        sampleBytes += data.size();
+    }
+    double readSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - readStart).count();
+    double readMBps = sampleBytes / MB / std::max(readSeconds, 1e-6);
+    if (sampleBytes == 0)
+    {
+        // 以降の見積もりはすべてフレームサイズで割る
+        LOG("Sampled files are empty; nothing to measure");
+        return false;
+    }
+    double frameBytes = static_cast<double>(sampleBytes) / sampleCount;
+
+    LOG("Sampled " << sampleCount << " of " << candidates.size() << " frames, average frame size "
+                   << frameBytes / MB << " MB");
+    LOG("Read bandwidth: " << readMBps << " MB/s (files may already be in the OS cache)");
+
+    // サンプルからTARを作成（実際のパイプラインと同じ形）
+    CustomTarCreator tarCreator;
+    for (const auto &path : sampled)
+    {
+        tarCreator.addFile(path);
+    }
+    std::vector<char> tarBuffer = tarCreator.getBuffer();
+
+    // コーデックごとの圧縮率と速度
+    std::vector<std::pair<Codec, int>> candidatesCodecs = {{Codec::Snappy, 0}};
+    if (codecAvailable(Codec::Zstd))
+    {
+        for (int level : {1, 3, 9, 19})
+            candidatesCodecs.emplace_back(Codec::Zstd, level);
+    }
+
+    std::vector<CodecMeasurement> measurements;
+    for (const auto &candidate : candidatesCodecs)
+    {
+        std::string compressed;
+        auto start = std::chrono::steady_clock::now();
+        if (!compressBuffer(candidate.first, candidate.second, tarBuffer.data(), tarBuffer.size(), compressed))
+            continue;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        CodecMeasurement m;
+        m.codec = candidate.first;
+        m.level = candidate.second;
+        m.ratio = static_cast<double>(tarBuffer.size()) / std::max<size_t>(compressed.size(), 1);
+        m.compressMBps = tarBuffer.size() / MB / std::max(seconds, 1e-6);
+        measurements.push_back(m);
+    }
+
+    // 書き込み帯域（出力先が指定された場合のみ）
+    double writeMBps = 0.0;
+    if (!settings.outputDir.empty())
+    {
+        fs::path probe = fs::path(settings.outputDir) / ".snappymaker_write_probe";
+        try
+        {
+            fs::create_directories(settings.outputDir);
+            auto start = std::chrono::steady_clock::now();
+            {
+                std::ofstream out(probe, std::ios::binary);
+                out.write(tarBuffer.data(), tarBuffer.size());
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            writeMBps = tarBuffer.size() / MB / std::max(seconds, 1e-6);
+            fs::remove(probe);
+            LOG("Write bandwidth: " << writeMBps << " MB/s (" << settings.outputDir << ", without fsync)");
+        }
+        catch (const std::exception &e)
+        {
+            LOG("Error measuring write bandwidth: " << e.what());
+        }
+    }
+
+    // 見積もり
+    LOG("");
+    LOG("Codec        Ratio   MB/s/thread  Frames/s  Output GB/h  Drain time");
+    double bestRate = 0.0;
+    const CodecMeasurement *fastest = nullptr;
+    for (const auto &m : measurements)
     {
-        while (running)
-        {
-            DeleteTask task;
+        int threads = settings.threads > 0 ? settings.threads : static_cast<int>(cores);
+        double cpuFps = threads * m.compressMBps * MB / frameBytes;
+        double ioFps = readMBps * MB / frameBytes;
+        if (writeMBps > 0.0)
+            ioFps = std::min(ioFps, writeMBps * MB * m.ratio / frameBytes);
+        double fps = std::min(cpuFps, ioFps);
 
-            {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                if (tasks.empty())
-                {
-                    // キューが空の場合は通知を待つ（1秒のタイムアウト付き）
-                    cv.wait_for(lock, std::chrono::seconds(1), [this]
-                                { return !tasks.empty() || !running; });
-                    if (!running && tasks.empty())
-                        break;
-                    if (tasks.empty())
-                        continue;
-                }
+        double inputFps = settings.frameRate > 0.0 ? settings.frameRate : fps;
+        double outputGBh = inputFps * frameBytes / m.ratio * 3600.0 / (MB * 1024.0);
 
-                task = tasks.front();
-                tasks.pop();
-            }
+        std::string drain = "-";
+        if (settings.backlog > 0)
+        {
+            // 取得中なら余力分だけで消化する
+            double spare = fps - settings.frameRate;
+            drain = spare > 0.0 ? std::to_string(static_cast<long long>(settings.backlog / spare)) + " s" : "never";
+        }
 
-            // タスクを処理（ファイル削除）
-            for (const auto &filePath : task.files)
-            {
-                // 最初のファイルは削除しない
-                if (filePath == task.firstFile)
-                {
-                    LOG("Keeping first file of set: " << fs::path(filePath).filename().string());
-                    continue;
-                }
+        std::ostringstream name;
+        name << codecName(m.codec);
+        if (m.codec == Codec::Zstd)
+            name << "-" << m.level;
 
-                try
-                {
-                    fs::remove(filePath);
-                }
-                catch (const std::exception &e)
-                {
-                    LOG("Error removing file " << filePath << ": " << e.what());
-                }
-            }
+        std::ostringstream row;
+        row << std::left << std::setw(12) << name.str() << " " << std::fixed << std::setprecision(2)
+            << std::setw(7) << m.ratio << " " << std::setw(12) << m.compressMBps << " " << std::setw(9) << fps
+            << " " << std::setw(12) << outputGBh << " " << drain << (cpuFps > ioFps ? "  (I/O bound)" : "");
+        LOG(row.str());
+
+        if (fps > bestRate)
+        {
+            bestRate = fps;
+            fastest = &m;
         }
     }
 
-public:
-    DeleteQueue() : running(true)
+    // 画素フィルターの効果（snappy と、使えれば段階圧縮の zstd-3。バイト並べ替えだけの場合と比べる）
+    std::vector<std::string> filterNames = {"none", "shuffle", "left", "up", "gradient", "left+shuffle", "up+shuffle", "gradient+shuffle"};
+    bool withZstd = codecAvailable(Codec::Zstd);
+    LOG("");
+    LOG("Pixel filter      Ratio   Filter MB/s  Unfilter MB/s  Compress MB/s" << (withZstd ? "  zstd-3 ratio" : ""));
+    for (const auto &name : filterNames)
     {
-        worker_thread = std::thread(&DeleteQueue::worker, this);
+        PixelFilter filter;
+        PixelFilter::parse(name, filter);
+        std::string filtered(tarBuffer.begin(), tarBuffer.end());
+        auto start = std::chrono::steady_clock::now();
+        std::string record = filterTarMembers(&filtered[0], tarCreator.members(), filter);
+        double filterSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (filter.active() && record.empty())
+        {
+            LOG("No uncompressed 16/32-bit TIFF frames among the samples; pixel filters do not apply");
+            break;
+        }
+
+        std::string compressed;
+        start = std::chrono::steady_clock::now();
+        compressBuffer(Codec::Snappy, 0, filtered.data(), filtered.size(), compressed);
+        double compressSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double snappyRatio = static_cast<double>(tarBuffer.size()) / std::max<size_t>(compressed.size(), 1);
+        double zstdRatio = 0.0;
+        if (withZstd && compressBuffer(Codec::Zstd, 3, filtered.data(), filtered.size(), compressed))
+            zstdRatio = static_cast<double>(tarBuffer.size()) / std::max<size_t>(compressed.size(), 1);
+
+        std::string error;
+        start = std::chrono::steady_clock::now();
+        bool restored = unfilterTar(filtered, record, error) && std::equal(filtered.begin(), filtered.end(), tarBuffer.begin());
+        double unfilterSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::ostringstream row;
+        row << std::left << std::setw(16) << name << " " << std::fixed << std::setprecision(2) << std::setw(7)
+            << snappyRatio << " ";
+        if (filter.active())
+            row << std::setw(12) << tarBuffer.size() / MB / std::max(filterSeconds, 1e-6) << " " << std::setw(14)
+                << tarBuffer.size() / MB / std::max(unfilterSeconds, 1e-6) << " ";
+        else
+            row << std::setw(12) << "-" << " " << std::setw(14) << "-" << " ";
+        row << std::setw(14) << tarBuffer.size() / MB / std::max(compressSeconds, 1e-6);
+        if (withZstd)
+            row << " " << zstdRatio;
+        row << (restored ? "" : "  (NOT REVERSIBLE)");
+        LOG(row.str());
     }
 
-    ~DeleteQueue()
+    // 静的マスク（--mask）：サンプルから学習したマスクで抜ける画素と、left+shuffle と組み合わせたときの圧縮率
+    MaskLearner learner(detectorMasks ? detectorMasks->sentinels() : std::vector<int64_t>{-1, -2});
+    for (const auto &member : tarCreator.members())
+    {
+        TiffLayout layout;
+        if (parseTiffLayout(tarBuffer.data() + member.offset, member.size, layout))
+            learner.add(tarBuffer.data() + member.offset + layout.pixelOffset, layout);
+    }
+    if (learner.enough())
     {
+        DetectorMask mask = learner.finish();
+        uint64_t pixels = static_cast<uint64_t>(mask.width) * mask.height;
+        if (mask.empty())
         {
-            std::lock_guard<std::mutex> lock(queue_mutex);
-            running = false;
+            LOG("Static mask: no constant sentinel pixels in the samples");
         }
-        cv.notify_all();
-        if (worker_thread.joinable())
+        else
         {
-            worker_thread.join();
+            // 実際のパイプラインと同じ変換でTARを作り直す
+            PixelFilter filter;
+            PixelFilter::parse("left+shuffle", filter);
+            CustomTarCreator maskedCreator;
+            maskedCreator.setTransform([&](const std::string &, uint64_t, std::vector<char> &data)
+                                       {
+                TiffLayout layout;
+                if (!parseTiffLayout(data.data(), data.size(), layout))
+                    return false;
+                bool masked = mask.matches(layout) && mask.holds(data.data() + layout.pixelOffset);
+                encodeFrame(data, layout, filter, masked ? &mask : nullptr);
+                return true; });
+            for (const auto &path : sampled)
+                maskedCreator.addFile(path);
+            std::vector<char> maskedBuffer = maskedCreator.getBuffer();
+            std::string compressed;
+            compressBuffer(Codec::Snappy, 0, maskedBuffer.data(), maskedBuffer.size(), compressed);
+            LOG("Static mask: " << mask.maskedPixels << " of " << pixels << " pixels (" << std::fixed << std::setprecision(2)
+                                << 100.0 * mask.maskedPixels / std::max<uint64_t>(pixels, 1) << "%) in " << mask.segments.size()
+                                << " segments, snappy ratio with left+shuffle "
+                                << static_cast<double>(tarBuffer.size()) / std::max<size_t>(compressed.size(), 1));
         }
     }
 
-    void push(const std::set<std::string> &files, const std::string &firstFile)
+    if (!fastest)
     {
-        {
-            std::lock_guard<std::mutex> lock(queue_mutex);
-            DeleteTask task;
-            task.files = files;
-            task.firstFile = firstFile;
-            tasks.push(task);
-        }
-        cv.notify_one();
+        LOG("No codec could be measured.");
+        return false;
     }
 
-    void push(const std::set<std::string> &files)
+    // 推奨スレッド数：検出器レートの1.5倍の余力が出る最小スレッド数
+    const CodecMeasurement &live = measurements.front(); // 取得中はsnappyで圧縮する
+    double perThreadFps = live.compressMBps * MB / frameBytes;
+    int recommendedThreads = static_cast<int>(cores);
+    if (settings.frameRate > 0.0)
     {
+        recommendedThreads = std::max(1, static_cast<int>(std::ceil(settings.frameRate * 1.5 / perThreadFps)));
+        if (recommendedThreads > static_cast<int>(cores))
         {
-            std::lock_guard<std::mutex> lock(queue_mutex);
-            DeleteTask task;
-            task.files = files;
-            tasks.push(task);
+            LOG("Warning: " << settings.frameRate << " frames/s needs more CPU than this host has ("
+                            << cores << " cores, " << perThreadFps << " frames/s per thread)");
+            recommendedThreads = static_cast<int>(cores);
         }
-        cv.notify_one();
     }
 
-    // キュー内のタスク数を取得
-    size_t size()
+    // 推奨セットサイズ：アーカイブが64MB以上になり、かつセットが揃うまでの時間が目標以内
+    int bySize = static_cast<int>(std::ceil(64.0 * MB * live.ratio / frameBytes));
+    int recommendedSetSize = std::max(1, bySize);
+    if (settings.frameRate > 0.0)
     {
-        std::lock_guard<std::mutex> lock(queue_mutex);
-        return tasks.size();
+        int byLatency = std::max(1, static_cast<int>(settings.frameRate * settings.latencyTarget));
+        recommendedSetSize = std::min(recommendedSetSize, byLatency);
     }
-};
+    if (recommendedSetSize >= 20)
+        recommendedSetSize = recommendedSetSize / 10 * 10;
 
-// グローバル削除キューインスタンス
-std::unique_ptr<DeleteQueue> deleteQueue;
+    double memoryMB = recommendedThreads * recommendedSetSize * frameBytes * 2.0 / MB;
 
-// 512バイトぴったりの構造体となるようにパック
-#pragma pack(push, 1)
-struct TarHeader
+    LOG("");
+    LOG("Recommended threads: " << recommendedThreads);
+    LOG("Recommended set size: " << recommendedSetSize << " frames (about " << memoryMB << " MB of buffers)");
+    if (settings.frameRate > 0.0 && bestRate < settings.frameRate)
+    {
+        LOG("Warning: no codec sustains " << settings.frameRate << " frames/s on this host; the backlog will grow.");
+    }
+
+    if (!settings.calibrationOut.empty())
+    {
+        Calibration calibration;
+        calibration.frameBytes = frameBytes;
+        calibration.readMBps = readMBps;
+        if (writeMBps > 0.0)
+            calibration.writeMBps = writeMBps;
+        calibration.compressMBps = live.compressMBps;
+        calibration.ratio = live.ratio;
+        calibration.cores = static_cast<int>(cores);
+        if (!calibration.save(settings.calibrationOut))
+        {
+            LOG("Error writing calibration file: " << settings.calibrationOut);
+            return false;
+        }
+        LOG("Calibration written to " << settings.calibrationOut);
+    }
+    return true;
+}
+
+// シミュレーションの設定（1つの構成）
+struct SimulationSettings
 {
-    char name[100];     // ファイル名
-    char mode[8];       // ファイルモード（8進数文字列）
-    char uid[8];        // オーナーのuid（8進数文字列）
-    char gid[8];        // オーナーのgid（8進数文字列）
-    char size[12];      // ファイルサイズ（8進数文字列）
-    char mtime[12];     // 修正時刻（8進数文字列）
-    char checksum[8];   // チェックサム（8進数文字列）
-    char typeflag;      // タイプフラグ ('0'または'\0'は通常のファイル、'5'はディレクトリ)
-    char linkname[100]; // リンク先
-    char magic[6];      // ターベックの識別子 ("ustar")
-    char version[2];    // バージョン
-    char uname[32];     // オーナー名
-    char gname[32];     // グループ名
-    char devmajor[8];   // デバイスメジャー番号（8進数文字列）
-    char devminor[8];   // デバイスマイナー番号（8進数文字列）
-    char prefix[155];   // パスのプレフィックス
-    char padding[12];   // パディング（合計512バイトにするため）
+    Calibration calibration;
+    double frameRate = 10.0;   // 到着レート[frames/s]
+    double duration = 600.0;   // 取得時間[s]
+    int setSize = 100;
+    int threads = 4;
+    int pollInterval = 5;
+    double fsyncMs = 0.0;      // アーカイブごとのfsync時間
+    double scanUsPerFile = 2.0; // 走査のファイルあたりコスト[us]
+    double deleteMs = 0.2;     // ファイルあたりの削除コスト
+    double latencySlo = 0.0;   // レイテンシ目標[s]（0なら分割しない）
 };
-#pragma pack(pop)
 
-// 8進数フォーマットで数値を文字列に変換
-void octalNumber(char *dest, size_t size, long value)
+struct SimulationResult
 {
-    std::snprintf(dest, size, "%0*lo", static_cast<int>(size - 1), value);
-}
+    size_t sets = 0;
+    long long frames = 0;     // アーカイブしたフレーム数
+    long long leftover = 0;   // 揃わずに残ったフレーム数
+    double framesPerSecond = 0;
+    double meanLag = 0;       // セットの最後のフレーム到着から確定まで[s]
+    double p95Lag = 0;
+    double maxLag = 0;
+    long long peakBacklog = 0; // 入力ディレクトリに残るファイル数の最大
+    double peakMemoryMB = 0;
+    double drainSeconds = 0;  // 取得終了後に処理が続いた時間
+    size_t chunks = 0;        // 揃う前に先に処理したサブアーカイブの数
+    bool keepsUp = true;
+};
 
-// カスタムTARアーカイブ作成クラス
-class CustomTarCreator
+// 仮想時計とイベントキュー
+class EventSimulator
 {
 private:
-    std::vector<char> buffer;
+    struct Event
+    {
+        double time;
+        uint64_t sequence; // 同時刻のイベントは登録順
+        std::function<void()> action;
+        bool operator>(const Event &other) const
+        {
+            return time != other.time ? time > other.time : sequence > other.sequence;
+        }
+    };
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    uint64_t sequence = 0;
 
 public:
-    CustomTarCreator()
+    double now = 0.0;
+
+    void at(double time, std::function<void()> action)
     {
-        // 初期バッファサイズを確保
-        buffer.reserve(1024 * 1024); // 1MB初期サイズ
+        events.push({time, sequence++, std::move(action)});
     }
 
-    bool addFile(const std::string &filepath)
+    void run()
     {
-        std::ifstream file(filepath, std::ios::binary);
-        if (!file)
+        while (!events.empty())
         {
-            LOG("Error opening file: " << filepath);
-            return false;
+            Event event = events.top();
+            events.pop();
+            now = event.time;
+            event.action();
         }
+    }
+};
 
-        // ファイルサイズを取得
-        file.seekg(0, std::ios::end);
-        std::streamsize fileSize = file.tellg();
-        file.seekg(0, std::ios::beg);
+// 同時にservers件まで処理できる資源（ディスク、CPUコアなど）、空きを待つ要求は先着順
+class SimResource
+{
+private:
+    EventSimulator &sim;
+    int servers;
+    int busy = 0;
+    std::deque<std::pair<double, std::function<void()>>> waiting;
 
-        // ファイルデータを読み込む
-        std::vector<char> fileData(fileSize);
-        if (!file.read(fileData.data(), fileSize))
-        {
-            LOG("Error reading file: " << filepath);
-            return false;
-        }
+    void start(double seconds, std::function<void()> done)
+    {
+        ++busy;
+        sim.at(sim.now + seconds, [this, done]
+               {
+                   --busy;
+                   if (!waiting.empty())
+                   {
+                       auto next = std::move(waiting.front());
+                       waiting.pop_front();
+                       start(next.first, std::move(next.second));
+                   }
+                   done(); });
+    }
 
-        // TARヘッダーを準備
-        TarHeader header;
-        std::memset(&header, 0, sizeof(TarHeader));
+public:
+    SimResource(EventSimulator &sim, int servers) : sim(sim), servers(std::max(1, servers)) {}
 
-        // ファイル名設定（パスは除外してファイル名のみ）
-        std::string filename = fs::path(filepath).filename().string();
-        std::strncpy(header.name, filename.c_str(), sizeof(header.name) - 1);
+    void use(double seconds, std::function<void()> done)
+    {
+        if (busy < servers)
+            start(seconds, std::move(done));
+        else
+            waiting.emplace_back(seconds, std::move(done));
+    }
+};
 
-        // パーミッション（644 = 読み書き+読み取り専用）
-        std::strcpy(header.mode, "000644 ");
+// 監視ループを仮想時計の上で動かす
+// 走査→揃ったセットをスレッド数ずつ処理（全スレッドの終了を待ってから次）→何も処理しなければポーリング間隔待つ
+// セット番号と完全性の判定（setNumberFor, isSetComplete）は監視ループと同じ関数を使う。
+// latencySloを指定すると、監視ループと同じSloControllerを仮想時計で動かし、揃う前の分割もモデルに入れる。
+// 削除は1本の削除スレッドのコストとしてだけ扱い、ゴミ箱、背圧、段階圧縮、出力先の違いは含まない
+SimulationResult simulatePipeline(const SimulationSettings &s)
+{
+    const double MB = 1048576.0;
+    const Calibration &c = s.calibration;
+    EventSimulator sim;
+    SimResource readDisk(sim, 1), cpu(sim, c.cores), writeDisk(sim, 1), deleter(sim, 1);
+    std::unique_ptr<SloController> slo;
+    if (s.latencySlo > 0.0)
+    {
+        slo = std::make_unique<SloController>(s.latencySlo, s.setSize, s.pollInterval, [&sim]
+                                              { return SloController::Clock::time_point(std::chrono::duration_cast<SloController::Clock::duration>(
+                                                    std::chrono::duration<double>(sim.now))); });
+    }
 
-        // 所有者とグループID
-        std::strcpy(header.uid, "000000 ");
-        std::strcpy(header.gid, "000000 ");
+    const long long totalFrames = static_cast<long long>(std::llround(s.frameRate * s.duration));
+    auto arrivedBy = [&](double t)
+    { return std::min(totalFrames, static_cast<long long>(std::floor(t * s.frameRate + 1e-9))); };
 
-        // ファイルサイズ（8進数）
-        octalNumber(header.size, sizeof(header.size), fileSize);
+    SimulationResult result;
+    std::map<int, FileSet> pending; // 走査で見つかったがまだ揃っていないセット
+    std::deque<FileSet> ready;
+    std::vector<double> lags;
+    long long scanned = 0, deleted = 0;
+    int outstanding = 0;
+    bool processedAny = false;
+    bool backlogChecked = false;
+    double memory = 0, lastCommit = 0;
 
-        // 最終更新時間（現在時刻）
-        std::time_t now = std::time(nullptr);
-        octalNumber(header.mtime, sizeof(header.mtime), now);
+    std::function<void()> loopStart, startWave, loopEnd;
 
-        // ファイルタイプ（通常ファイル）
-        header.typeflag = '0';
+    auto processSet = [&](const FileSet &set)
+    {
+        double inputBytes = set.files.size() * c.frameBytes;
+        double outputBytes = inputBytes / c.ratio;
+        int firstFrame, lastFrame;
+        frameRange(set, firstFrame, lastFrame);
+        double lastArrival = lastFrame / s.frameRate;
+        double started = sim.now;
+        long long files = static_cast<long long>(set.files.size());
 
-        // UStar形式指定
-        std::strcpy(header.magic, "ustar");
-        std::strcpy(header.version, "00");
+        memory += inputBytes; // TARバッファ
+        result.peakMemoryMB = std::max(result.peakMemoryMB, memory / MB);
+        readDisk.use(inputBytes / (c.readMBps * MB), [&, inputBytes, outputBytes, lastArrival, started, files]
+                     { cpu.use(inputBytes / (c.compressMBps * MB), [&, inputBytes, outputBytes, lastArrival, started, files]
+                               {
+                                   memory += outputBytes;
+                                   result.peakMemoryMB = std::max(result.peakMemoryMB, memory / MB);
+                                   writeDisk.use(outputBytes / (c.writeMBps * MB) + s.fsyncMs / 1000.0,
+                                                 [&, inputBytes, outputBytes, lastArrival, started, files]
+                                                 {
+                                                     memory -= inputBytes + outputBytes;
+                                                     if (slo)
+                                                         slo->recordProcessing(static_cast<size_t>(files), sim.now - started);
+                                                     lags.push_back(sim.now - lastArrival);
+                                                     lastCommit = sim.now;
+                                                     result.frames += files;
+                                                     ++result.sets;
+                                                     deleter.use(files * s.deleteMs / 1000.0, [&, files]
+                                                                 { deleted += files; });
+                                                     if (--outstanding == 0)
+                                                         startWave();
+                                                 }); }); });
+    };
 
-        // 所有者名とグループ名
-        std::strcpy(header.uname, "user");
-        std::strcpy(header.gname, "group");
+    loopStart = [&]
+    {
+        long long arrived = arrivedBy(sim.now);
+        result.peakBacklog = std::max(result.peakBacklog, arrived - deleted);
+        if (!backlogChecked && sim.now >= s.duration)
+        {
+            // 取得終了時に入力側に溜まっている量で追いついているか判定する
+            backlogChecked = true;
+            // （ポーリング間隔分の到着と処理中・待ち中のセットは定常的に残る）
+            result.keepsUp = arrived - deleted <= s.frameRate * s.pollInterval + static_cast<double>(s.setSize) * (s.threads + 2);
+        }
+        double scanSeconds = (arrived - deleted) * s.scanUsPerFile / 1e6;
+        sim.at(sim.now + scanSeconds, [&, arrived]
+               {
+                   // 監視ループと同じセット番号の計算と完全性の判定
+                   for (long long n = scanned + 1; n <= arrived; ++n)
+                   {
+                       int setNumber = setNumberFor(static_cast<int>(n), s.setSize);
+                       FileSet &set = pending[setNumber];
+                       set.run = 1;
+                       set.setNumber = setNumber;
+                       set.files.insert(std::to_string(n));
+                   }
+                   scanned = arrived;
+                   for (auto it = pending.begin(); it != pending.end();)
+                   {
+                       // レイテンシ目標：監視ループと同じく、揃う前にセットの一部を先に処理する
+                       if (slo)
+                       {
+                           FileSet chunk;
+                           auto decision = slo->plan(it->second, s.setSize, false, chunk);
+                           if (decision == SloController::Decision::Chunk)
+                           {
+                               for (const auto &file : chunk.files)
+                                   it->second.files.erase(file);
+                               bool last = chunk.splitLast == it->second.setNumber + s.setSize - 1;
+                               ++result.chunks;
+                               ready.push_back(std::move(chunk));
+                               if (last || it->second.files.empty())
+                                   it = pending.erase(it);
+                               else
+                                   ++it;
+                               continue;
+                           }
+                           if (decision == SloController::Decision::Wait)
+                           {
+                               ++it;
+                               continue;
+                           }
+                       }
+                       if (isSetComplete(it->second, s.setSize))
+                       {
+                           ready.push_back(std::move(it->second));
+                           it = pending.erase(it);
+                       }
+                       else
+                           ++it;
+                   }
+                   processedAny = !ready.empty();
+                   startWave(); });
+    };
 
-        // チェックサム計算 - 仮にスペースで埋める
-        std::memset(header.checksum, ' ', sizeof(header.checksum));
+    startWave = [&]
+    {
+        if (ready.empty())
+        {
+            loopEnd();
+            return;
+        }
+        outstanding = static_cast<int>(std::min<size_t>(s.threads, ready.size()));
+        for (int i = 0; i < outstanding; ++i)
+        {
+            FileSet set = std::move(ready.front());
+            ready.pop_front();
+            processSet(set);
+        }
+    };
 
-        // ヘッダー全体の合計を計算
-        unsigned int sum = 0;
-        const unsigned char *data = reinterpret_cast<const unsigned char *>(&header);
-        for (size_t i = 0; i < sizeof(TarHeader); ++i)
+    loopEnd = [&]
+    {
+        // すべて到着し、揃ったセットも残っていなければ終了
+        if (scanned == totalFrames && sim.now >= s.duration)
         {
-            sum += data[i];
+            if (!backlogChecked)
+                result.keepsUp = true;
+            return;
         }
+        if (processedAny)
+            sim.at(sim.now, loopStart);
+        else
+            sim.at(sim.now + s.pollInterval, loopStart);
+    };
 
-        // 8進数フォーマットでチェックサム設定
-        std::snprintf(header.checksum, sizeof(header.checksum), "%06o", sum);
-        header.checksum[6] = '\0';
-        header.checksum[7] = ' ';
+    sim.at(0.0, loopStart);
+    sim.run();
 
-        // ヘッダーを追加
-        size_t currentSize = buffer.size();
-        buffer.resize(currentSize + sizeof(TarHeader));
-        std::memcpy(buffer.data() + currentSize, &header, sizeof(TarHeader));
+    for (const auto &pair : pending)
+        result.leftover += static_cast<long long>(pair.second.files.size());
+    if (!lags.empty())
+    {
+        std::sort(lags.begin(), lags.end());
+        double sum = 0;
+        for (double lag : lags)
+            sum += lag;
+        result.meanLag = sum / lags.size();
+        result.p95Lag = lags[std::min(lags.size() - 1, static_cast<size_t>(lags.size() * 0.95))];
+        result.maxLag = lags.back();
+    }
+    result.drainSeconds = std::max(0.0, lastCommit - s.duration);
+    result.framesPerSecond = result.frames / std::max(lastCommit, s.duration);
+    return result;
+}
 
-        // ファイルデータを追加
-        currentSize = buffer.size();
-        buffer.resize(currentSize + fileData.size());
-        std::memcpy(buffer.data() + currentSize, fileData.data(), fileData.size());
+// カンマ区切りの値の一覧（スイープ用）
+std::vector<double> parseValueList(const std::string &text)
+{
+    std::vector<double> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        if (!item.empty())
+            values.push_back(std::atof(item.c_str()));
+    }
+    return values;
+}
 
-        // ブロックサイズ（512バイト）に合わせてパディング
-        size_t paddingSize = (512 - (fileData.size() % 512)) % 512;
-        if (paddingSize > 0)
+// 構成の組み合わせをすべてシミュレーションして表にする
+void runSimulationSweep(const SimulationSettings &base, const std::vector<double> &rates,
+                        const std::vector<double> &threadCounts, const std::vector<double> &setSizes,
+                        const std::vector<double> &fsyncs)
+{
+    const Calibration &c = base.calibration;
+    LOG("=== Pipeline Simulation ===");
+    LOG("Frame " << c.frameBytes / 1048576.0 << " MB, read " << c.readMBps << " MB/s, write " << c.writeMBps
+                 << " MB/s, compress " << c.compressMBps << " MB/s/thread, ratio " << c.ratio << ", " << c.cores
+                 << " cores");
+    LOG("Acquisition " << base.duration << " s, poll " << base.pollInterval << " s"
+                        << (base.latencySlo > 0.0 ? ", latency target " + std::to_string(base.latencySlo) + " s" : ""));
+    LOG("");
+    LOG("fps      threads  set   fsync ms  out fps   mean lag  p95 lag   max lag   backlog  mem MB    drain s  ok");
+
+    auto started = std::chrono::steady_clock::now();
+    size_t runs = 0;
+    for (double rate : rates)
+        for (double threads : threadCounts)
+            for (double setSize : setSizes)
+                for (double fsync : fsyncs)
+                {
+                    SimulationSettings settings = base;
+                    settings.frameRate = rate;
+                    settings.threads = std::max(1, static_cast<int>(threads));
+                    settings.setSize = std::max(1, static_cast<int>(setSize));
+                    settings.fsyncMs = fsync;
+                    SimulationResult r = simulatePipeline(settings);
+                    ++runs;
+
+                    std::ostringstream row;
+                    row << std::left << std::fixed << std::setprecision(1) << std::setw(9) << rate << std::setw(9)
+                        << settings.threads << std::setw(6) << settings.setSize << std::setw(10) << fsync
+                        << std::setw(10) << r.framesPerSecond << std::setw(10) << r.meanLag << std::setw(10)
+                        << r.p95Lag << std::setw(10) << r.maxLag << std::setw(9) << r.peakBacklog << std::setw(10)
+                        << r.peakMemoryMB << std::setw(9) << r.drainSeconds << (r.keepsUp ? "yes" : "NO");
+                    if (r.chunks > 0)
+                        row << "  (" << r.chunks << " early chunks)";
+                    if (r.leftover > 0)
+                        row << "  (" << r.leftover << " frames in incomplete set)";
+                    LOG(row.str());
+                }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    LOG("");
+    LOG("Simulated " << runs << " configuration(s) in " << seconds << " s");
+}
+
+// コマンドライン引数（モード名と --key=value 形式のオプション）
+struct CommandLine
+{
+    std::string mode;                           // 最初の非オプション引数（例: "batch"）
+    std::vector<std::string> positional;        // モード以降の非オプション引数
+    std::map<std::string, std::string> options; // --key=value（値なしは "1"）
+
+    bool has(const std::string &key) const
+    {
+        return options.find(key) != options.end();
+    }
+
+    std::string get(const std::string &key, const std::string &defaultValue) const
+    {
+        auto it = options.find(key);
+        return it != options.end() ? it->second : defaultValue;
+    }
+
+    int getInt(const std::string &key, int defaultValue) const
+    {
+        auto it = options.find(key);
+        if (it == options.end())
+            return defaultValue;
+        try
         {
-            currentSize = buffer.size();
-            buffer.resize(currentSize + paddingSize, 0);
+            return std::stoi(it->second);
+        }
+        catch (const std::exception &)
+        {
+            std::cout << "Invalid value for --" << key << ". Using default value: " << defaultValue << std::endl;
+            return defaultValue;
+        }
+    }
+
+    double getDouble(const std::string &key, double defaultValue) const
+    {
+        auto it = options.find(key);
+        if (it == options.end())
+            return defaultValue;
+        try
+        {
+            return std::stod(it->second);
         }
+        catch (const std::exception &)
+        {
+            std::cout << "Invalid value for --" << key << ". Using default value: " << defaultValue << std::endl;
+            return defaultValue;
+        }
+    }
+};
+
+CommandLine parseCommandLine(int argc, char *argv[])
+{
+    CommandLine cmd;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) == 0)
+        {
+            size_t eq = arg.find('=');
+            if (eq == std::string::npos)
+                cmd.options[arg.substr(2)] = "1";
+            else
+                cmd.options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+        }
+        else if (cmd.mode.empty())
+        {
+            cmd.mode = arg;
+        }
+        else
+        {
+            cmd.positional.push_back(arg);
+        }
+    }
+    return cmd;
+}
+
+// 旧形式（TAR全体を1つのsnappyバッファにしたもの）を少しずつ展開するデコーダー
+// snappyの圧縮器は64 KB単位で圧縮し、それより前を参照しないので、直近の窓だけ残せば全体をメモリに載せずに展開できる
+class LegacySnappyStream
+{
+private:
+    static const size_t inputSize = 1 << 20;
+    static const size_t windowSize = 1 << 20; // 2の冪
 
-        return true;
-    }
+    std::ifstream file;
+    std::vector<char> input;
+    size_t inPos = 0;
+    size_t inEnd = 0;
+    std::vector<char> window;
+    uint64_t produced = 0;
+    uint64_t expected = 0;
+    std::string errorMessage;
 
-    void finalize()
+    bool fail(const std::string &message)
     {
-        // TARファイルの終端（1024バイトのゼロブロック）
-        size_t currentSize = buffer.size();
-        buffer.resize(currentSize + 1024, 0);
+        errorMessage = message;
+        return false;
     }
 
-    std::vector<char> getBuffer()
+    // 入力バッファに少なくともneedバイトあるようにする
+    bool fill(size_t need)
     {
-        finalize();
-        return buffer;
+        if (inEnd - inPos >= need)
+            return true;
+        std::memmove(input.data(), input.data() + inPos, inEnd - inPos);
+        inEnd -= inPos;
+        inPos = 0;
+        file.read(input.data() + inEnd, input.size() - inEnd);
+        inEnd += static_cast<size_t>(file.gcount());
+        return inEnd >= need;
     }
-};
-
-// ファイルセットをグループ化するための関数
-struct FileSet
-{
-    int run;
-    int setNumber;               // setNumberはファイルセットの先頭番号
-    std::set<std::string> files; // セット内のファイルパス
-    std::string firstFile;       // 最初のファイル（パターン基準）
 
-    // 出力ファイル名の生成
-    std::string getOutputPath(const std::string &outputDir) const
+    void emit(const char *data, size_t size, std::string &out)
     {
-        // 最初のファイルのパスからファイル名を取得
-        fs::path firstFilePath(firstFile);
-        std::string filename = firstFilePath.stem().string(); // 拡張子を除いたファイル名
-        return outputDir + "/" + filename + ".snappy";
+        out.append(data, size);
+        // 窓はリングバッファ（末尾で折り返す）
+        while (size > 0)
+        {
+            size_t at = produced & (windowSize - 1);
+            size_t chunk = std::min(size, windowSize - at);
+            std::memcpy(window.data() + at, data, chunk);
+            data += chunk;
+            size -= chunk;
+            produced += chunk;
+        }
     }
-};
-
-// ディレクトリをスキャンし、パターンに合致するファイルをセットとしてグループ化
-std::vector<FileSet> scanAndGroupFiles(const std::string &dir, const std::string &basePattern, int setSize)
-{
-    std::map<std::pair<int, int>, FileSet> fileSets; // (run, setNumber) -> FileSet
 
-    // 正規表現パターン作成（例："test_(\d\d)_(\d\d\d\d\d)\.tif"）
-    std::regex filePattern(basePattern.substr(0, basePattern.find("_##_")) +
-                           "_([0-9]{2})_([0-9]{5})\\.tif");
+    uint32_t littleEndian(size_t bytes)
+    {
+        uint32_t value = 0;
+        for (size_t i = 0; i < bytes; ++i)
+            value |= static_cast<uint32_t>(static_cast<unsigned char>(input[inPos + i])) << (8 * i);
+        inPos += bytes;
+        return value;
+    }
 
-    LOG("Scanning directory: " << dir);
+public:
+    LegacySnappyStream() : input(inputSize), window(windowSize) {}
 
-    try
+    bool open(const std::string &path)
     {
-        // ディレクトリを走査
-        for (const auto &entry : fs::directory_iterator(dir))
+        file.open(path, std::ios::binary);
+        if (!file)
+            return fail("cannot open " + path);
+        // 先頭は展開後サイズのvarint
+        for (int shift = 0; shift <= 35; shift += 7)
         {
-            if (!entry.is_regular_file())
-                continue;
+            if (!fill(1))
+                return fail("truncated header");
+            unsigned char byte = static_cast<unsigned char>(input[inPos++]);
+            expected |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return fail("corrupt header");
+    }
 
-            std::string filename = entry.path().filename().string();
-            std::smatch matches;
+    uint64_t rawSize() const { return expected; }
+    uint64_t position() const { return produced; }
+    bool finished() const { return produced == expected; }
+    const std::string &error() const { return errorMessage; }
 
-            if (std::regex_match(filename, matches, filePattern) && matches.size() >= 3)
+    // 少なくともmaxBytes（末尾ではそれ未満）をoutに展開する（要素の途中では止めないので少し超えることがある）
+    bool read(std::string &out, size_t maxBytes)
+    {
+        out.clear();
+        while (out.size() < maxBytes && produced < expected)
+        {
+            if (!fill(1))
+                return fail("truncated data at " + std::to_string(produced));
+            unsigned char tag = static_cast<unsigned char>(input[inPos++]);
+            if ((tag & 3) == 0)
             {
-                int run = std::stoi(matches[1].str());
-                int fileNumber = std::stoi(matches[2].str());
-                int setNumber = ((fileNumber - 1) / setSize) * setSize + 1; // セットの先頭番号を計算
-
-                auto key = std::make_pair(run, setNumber);
-                if (fileSets.find(key) == fileSets.end())
+                // リテラル
+                size_t length = tag >> 2;
+                if (length >= 60)
                 {
-                    // 新しいセットを作成
-                    FileSet newSet;
-                    newSet.run = run;
-                    newSet.setNumber = setNumber;
-                    fileSets[key] = newSet;
+                    size_t bytes = length - 59;
+                    if (!fill(bytes))
+                        return fail("truncated literal length");
+                    length = littleEndian(bytes);
                 }
-
-                // ファイルをセットに追加
-                fileSets[key].files.insert(entry.path().string());
-
-                // セット内の最初のファイルを記録
-                if (fileNumber == setNumber)
+                ++length;
+                if (produced + length > expected)
+                    return fail("literal past the end");
+                while (length > 0)
                 {
-                    fileSets[key].firstFile = entry.path().string();
+                    if (!fill(1))
+                        return fail("truncated literal");
+                    size_t chunk = std::min(length, inEnd - inPos);
+                    emit(input.data() + inPos, chunk, out);
+                    inPos += chunk;
+                    length -= chunk;
                 }
+                continue;
+            }
+
+            // 過去の出力のコピー
+            size_t length;
+            uint32_t offset;
+            if ((tag & 3) == 1)
+            {
+                if (!fill(1))
+                    return fail("truncated copy");
+                length = 4 + ((tag >> 2) & 7);
+                offset = static_cast<uint32_t>(tag >> 5) << 8 | static_cast<unsigned char>(input[inPos++]);
+            }
+            else
+            {
+                size_t bytes = (tag & 3) == 2 ? 2 : 4;
+                if (!fill(bytes))
+                    return fail("truncated copy");
+                length = (tag >> 2) + 1;
+                offset = littleEndian(bytes);
             }
+            if (offset == 0 || offset > produced || produced + length > expected)
+                return fail("invalid copy at " + std::to_string(produced));
+            if (offset > windowSize)
+                return fail("copy offset " + std::to_string(offset) + " beyond the streaming window");
+            // コピーは最長64バイト。offsetより短い間隔の繰り返し（重なりのあるコピー）はバッファ内で展開する
+            char buffer[64];
+            for (size_t i = 0; i < length; ++i)
+                buffer[i] = i >= offset ? buffer[i - offset] : window[(produced - offset + i) & (windowSize - 1)];
+            emit(buffer, length, out);
         }
+        if (produced == expected && fill(1))
+            return fail("trailing data after " + std::to_string(expected) + " bytes");
+        return true;
     }
-    catch (const std::exception &e)
-    {
-        LOG("Error scanning directory: " << e.what());
-    }
+};
 
-    // マップからベクターに変換
-    std::vector<FileSet> result;
-    for (const auto &pair : fileSets)
+// 少しずつ渡されるTARストリームからメンバーの位置・大きさ・CRC32Cを集める（マニフェスト用）
+class TarStreamScanner
+{
+private:
+    std::vector<TarMember> found;
+    std::string header;     // 読みかけのヘッダー
+    uint64_t position = 0;  // ストリーム内の位置
+    uint64_t remaining = 0; // 現在のメンバーの残りのデータ
+    uint64_t padding = 0;   // データの後の512バイト境界までの詰め物
+    bool ended = false;     // 終端ブロックに達した
+
+public:
+    void feed(const char *data, size_t size)
     {
-        result.push_back(pair.second);
+        while (size > 0 && !ended)
+        {
+            size_t take;
+            if (remaining > 0)
+            {
+                take = static_cast<size_t>(std::min<uint64_t>(remaining, size));
+                found.back().crc = crc32c(found.back().crc, data, take);
+                remaining -= take;
+            }
+            else if (padding > 0)
+            {
+                take = static_cast<size_t>(std::min<uint64_t>(padding, size));
+                padding -= take;
+            }
+            else
+            {
+                take = std::min(sizeof(TarHeader) - header.size(), size);
+                header.append(data, take);
+                if (header.size() == sizeof(TarHeader))
+                {
+                    const TarHeader *h = reinterpret_cast<const TarHeader *>(header.data());
+                    if (h->name[0] == '\0')
+                    {
+                        ended = true;
+                    }
+                    else
+                    {
+                        uint64_t memberSize = std::strtoull(std::string(h->size, sizeof(h->size)).c_str(), nullptr, 8);
+                        found.push_back({std::string(h->name, strnlen(h->name, sizeof(h->name))),
+                                         position + take, memberSize, 0, memberSize});
+                        remaining = memberSize;
+                        padding = (512 - memberSize % 512) % 512;
+                    }
+                    header.clear();
+                }
+            }
+            data += take;
+            size -= take;
+            position += take;
+        }
     }
 
-    // セット番号でソート
-    std::sort(result.begin(), result.end(), [](const FileSet &a, const FileSet &b)
-              {
-        if (a.run != b.run) return a.run < b.run;
-        return a.setNumber < b.setNumber; });
-
-    return result;
-}
+    // 最後のメンバーまでデータが揃っていたか
+    bool complete() const { return remaining == 0 && header.empty(); }
+    const std::vector<TarMember> &members() const { return found; }
+};
 
-// セットが完全であるか確認（ファイル数がsetSize個あるか）
-bool isSetComplete(const FileSet &fileSet, int setSize)
+// 旧形式のアーカイブ1つの移行結果
+struct MigrationResult
 {
-    return fileSet.files.size() >= setSize;
-}
+    bool ok = false;
+    bool skipped = false; // 既にコンテナ形式
+    uintmax_t inputBytes = 0;
+    uintmax_t outputBytes = 0;
+    uint64_t rawBytes = 0;
+    std::string error;
+};
 
-// 既に処理済みのセットか確認（出力ファイルが存在するか）
-bool isSetProcessed(const FileSet &fileSet, const std::string &outputDir)
+// 旧形式のアーカイブをコンテナ形式に書き換える
+// 展開と圧縮はブロック単位（メモリは一定）、書き出したファイルを読み直して内容を検証してから元のファイルと置き換える
+MigrationResult migrateLegacyArchive(const std::string &path, Codec codec, int level, std::atomic<uint64_t> &rawProgress)
 {
-    std::string outputPath = fileSet.getOutputPath(outputDir);
-    return fs::exists(outputPath);
-}
+    MigrationResult result;
+    ContainerReader probe;
+    if (probe.open(path) || probe.isContainer())
+    {
+        result.skipped = true;
+        result.ok = true;
+        return result;
+    }
 
-// ファイルセットを処理する関数
-bool processFileSet(const FileSet &fileSet, const std::string &outputDir, bool deleteAfter = true)
-{
-    try
+    std::string tmpPath = path + ".migrate.tmp";
+    std::error_code ec;
+    result.inputBytes = fs::file_size(path, ec);
+    auto modified = fs::last_write_time(path, ec);
+
+    LegacySnappyStream source;
+    if (!source.open(path))
     {
-        // 処理開始時間を記録
-        auto startTime = std::chrono::high_resolution_clock::now();
+        result.error = source.error();
+        return result;
+    }
 
-        std::string outputPath = fileSet.getOutputPath(outputDir);
+    std::FILE *out = std::fopen(tmpPath.c_str(), "wb");
+    if (!out)
+    {
+        result.error = "cannot create " + tmpPath;
+        return result;
+    }
+    ContainerWriter writer(codec, level, defaultBlockSize, [out](const char *data, size_t size)
+                           { return std::fwrite(data, 1, size, out) == size; });
+    ContainerMeta meta;
+    meta.set("codec", codecName(codec));
+    if (codec != Codec::Snappy)
+        meta.set("level", std::to_string(level));
+    meta.set("migrated_from", "legacy-snappy");
 
-        // 既に処理済みならスキップ
-        if (fs::exists(outputPath))
+    uint32_t sourceCrc = 0;
+    TarStreamScanner scanner;
+    bool ok = writer.begin();
+    std::string raw;
+    while (ok && !source.finished())
+    {
+        ok = source.read(raw, defaultBlockSize);
+        if (ok)
         {
-            LOG("Skipping already processed set: " << outputPath);
-            return true;
+            sourceCrc = crc32c(sourceCrc, raw.data(), raw.size());
+            scanner.feed(raw.data(), raw.size());
+            ok = writer.append(raw.data(), raw.size());
+            rawProgress += raw.size();
         }
+    }
+    if (!source.error().empty())
+        result.error = source.error();
 
-        LOG("Processing file set: run " << fileSet.run << ", set " << fileSet.setNumber << " with " << fileSet.files.size() << " files");
-
-        // メモリ上でTARを作成
-        CustomTarCreator tarCreator;
-        for (const auto &filePath : fileSet.files)
+    // 新しく書いたアーカイブと同じく、ラン・セット・マニフェストを入れる
+    // ランとセットは先頭メンバーの名前（prefix_RR_NNNNN.tif）から取る
+    ok = ok && writer.flush();
+    if (ok && scanner.complete() && !scanner.members().empty())
+    {
+        const std::vector<TarMember> &members = scanner.members();
+        std::string stem = fs::path(members.front().name).stem().string();
+        size_t last = stem.rfind('_');
+        size_t previous = last == std::string::npos || last == 0 ? std::string::npos : stem.rfind('_', last - 1);
+        int frame = frameNumberOf(members.front().name);
+        if (previous != std::string::npos && frame >= 0)
         {
-            if (!tarCreator.addFile(filePath))
+            try
+            {
+                meta.set("run", std::to_string(std::stoi(stem.substr(previous + 1, last - previous - 1))));
+                meta.set("set", std::to_string(frame));
+            }
+            catch (const std::exception &)
             {
-                LOG("Failed to add file to tar: " << filePath);
-                continue;
             }
         }
+        meta.set("files", std::to_string(members.size()));
+        meta.set("manifest", formatManifest(buildManifest(members, writer.blocks())));
+    }
+    ok = ok && writer.finish(meta) && syncFile(out);
+    ok = std::fclose(out) == 0 && ok;
+    if (!ok)
+    {
+        if (result.error.empty())
+            result.error = "write failed";
+        fs::remove(tmpPath, ec);
+        return result;
+    }
 
-        std::vector<char> tarBuffer = tarCreator.getBuffer();
+    // 書き出したファイルを読み直して検証
+    ContainerReader check;
+    uint32_t checkCrc = 0;
+    ok = check.open(tmpPath) && check.rawSize() == source.rawSize();
+    for (size_t i = 0; ok && i < check.blocks().size(); ++i)
+    {
+        ok = check.readBlock(i, raw);
+        checkCrc = crc32c(checkCrc, raw.data(), raw.size());
+    }
+    if (!ok || checkCrc != sourceCrc)
+    {
+        result.error = "verification failed" + (check.error().empty() ? "" : ": " + check.error());
+        fs::remove(tmpPath, ec);
+        return result;
+    }
 
-        // Snappyで圧縮
-        std::string compressedData;
-        snappy::Compress(tarBuffer.data(), tarBuffer.size(), &compressedData);
+    // 更新時刻を引き継いで（保存期間の判定などのため）、元のファイルと入れ替える
+    fs::last_write_time(tmpPath, modified, ec);
+    fs::rename(tmpPath, path, ec);
+    if (ec)
+    {
+        result.error = "cannot replace original: " + ec.message();
+        fs::remove(tmpPath, ec);
+        return result;
+    }
+    syncDirectory(fs::path(path).parent_path());
+    result.ok = true;
+    result.rawBytes = source.rawSize();
+    result.outputBytes = fs::file_size(path, ec);
+    return result;
+}
 
-        // 出力ディレクトリが存在しない場合は作成
-        fs::create_directories(fs::path(outputPath).parent_path());
+// ディレクトリ以下の旧形式アーカイブを並列に移行する
+// 進捗はジャーナル（DIR/.snappy_migrate_journal.tsv）に追記し、中断しても続きから再開できる
+bool migrateDirectory(const std::string &dir, Codec codec, int level, int threadCount, int memoryMB, bool retryFailed)
+{
+    // ワーカー1つあたりのメモリ：入力と窓（各1 MB）、展開ブロック、圧縮ブロック、検証用ブロック
+    const size_t perWorkerMB = 2 + 3 * defaultBlockSize / 1048576 + 4;
+    int memoryThreads = std::max(1, static_cast<int>(memoryMB / perWorkerMB));
+    if (threadCount > memoryThreads)
+    {
+        LOG("Limiting threads to " << memoryThreads << " to stay within " << memoryMB << " MB");
+        threadCount = memoryThreads;
+    }
 
-        // 圧縮データを保存
-        std::ofstream outFile(outputPath, std::ios::binary);
-        if (!outFile)
+    std::string journalPath = (fs::path(dir) / ".snappy_migrate_journal.tsv").string();
+    std::map<std::string, std::string> journal; // パス -> done|failed
+    {
+        std::ifstream in(journalPath);
+        std::string line;
+        while (std::getline(in, line))
         {
-            LOG("Error opening output file: " << outputPath);
-            return false;
+            size_t tab = line.find('\t');
+            size_t next = line.find('\t', tab + 1);
+            if (tab != std::string::npos)
+                journal[line.substr(tab + 1, next == std::string::npos ? std::string::npos : next - tab - 1)] = line.substr(0, tab);
         }
-        outFile.write(compressedData.data(), compressedData.size());
-        outFile.close();
+    }
 
-        // 先頭ファイルを出力ディレクトリにコピー
-        if (!fileSet.firstFile.empty())
+    // 対象の列挙（前回中断したときの一時ファイルは消す）
+    std::vector<std::string> archives;
+    size_t skippedFailed = 0;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+    {
+        if (!it->is_regular_file(ec))
+            continue;
+        std::string path = it->path().string();
+        if (path.size() > 12 && path.compare(path.size() - 12, 12, ".migrate.tmp") == 0)
         {
-            fs::path firstFilePath(fileSet.firstFile);
-            fs::path destPath = fs::path(outputDir) / firstFilePath.filename();
-
-            try
-            {
-                // ファイルが存在している場合は上書き
-                if (fs::exists(destPath))
-                {
-                    fs::remove(destPath);
-                }
-                fs::copy_file(firstFilePath, destPath, fs::copy_options::overwrite_existing);
-                LOG("Copied first file to output directory: " << destPath.filename().string());
-            }
-            catch (const std::exception &e)
-            {
-                LOG("Error copying first file: " << e.what());
-            }
+            LOG("Removing leftover " << path);
+            std::error_code removeError;
+            fs::remove(it->path(), removeError);
+            continue;
         }
-
-        // 元ファイルを削除 - 削除キューに追加
-        if (deleteAfter)
+        if (it->path().extension() != ".snappy")
+            continue;
+        auto known = journal.find(path);
+        if (known != journal.end() && known->second == "done")
+            continue;
+        if (known != journal.end() && known->second == "failed" && !retryFailed)
         {
-            // 削除タスクを削除キューに追加（すべてのファイルを削除）
-            deleteQueue->push(fileSet.files);
+            ++skippedFailed;
+            continue;
         }
+        archives.push_back(path);
+    }
+    std::sort(archives.begin(), archives.end());
+    LOG("Migrating up to " << archives.size() << " archives in " << dir << " to " << codecName(codec) << " with "
+                           << threadCount << " threads" << (skippedFailed ? ", skipping " + std::to_string(skippedFailed) + " that failed before (--retry-failed)" : ""));
 
-        // 処理終了時間と経過時間を計算
-        auto endTime = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
+    std::ofstream journalOut(journalPath, std::ios::app);
+    std::mutex journalMutex;
+    std::atomic<size_t> nextIndex(0);
+    std::atomic<size_t> converted(0);
+    std::atomic<size_t> skipped(0);
+    std::atomic<size_t> failed(0);
+    std::atomic<uint64_t> bytesIn(0);
+    std::atomic<uint64_t> bytesOut(0);
+    std::atomic<uint64_t> rawBytes(0);
+    auto startTime = std::chrono::steady_clock::now();
 
-        LOG("Created: " << fs::path(outputPath).filename().string() << " - Processing time: " << duration << " ms");
-        return true;
+    std::mutex progressMutex;
+    std::condition_variable progressCv;
+    bool finished = false;
+    std::thread progressThread([&]()
+                               {
+        std::unique_lock<std::mutex> lock(progressMutex);
+        while (!progressCv.wait_for(lock, std::chrono::seconds(2), [&] { return finished; }))
+        {
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+            size_t done = converted + skipped + failed;
+            LOG("Progress: " << done << "/" << archives.size() << " archives, " << rawBytes / 1048576.0 / std::max(elapsed, 1e-3)
+                             << " MB/s (uncompressed)");
+        } });
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&]()
+                             {
+            applyTaskPriority(TaskClass::Recompress);
+            for (size_t i = nextIndex++; i < archives.size(); i = nextIndex++)
+            {
+                MigrationResult result = migrateLegacyArchive(archives[i], codec, level, rawBytes);
+                if (result.skipped)
+                {
+                    ++skipped;
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(journalMutex);
+                if (result.ok)
+                {
+                    ++converted;
+                    bytesIn += result.inputBytes;
+                    bytesOut += result.outputBytes;
+                    journalOut << "done\t" << archives[i] << "\t" << result.inputBytes << "\t" << result.outputBytes << std::endl;
+                }
+                else
+                {
+                    ++failed;
+                    LOG("Error migrating " << archives[i] << ": " << result.error);
+                    journalOut << "failed\t" << archives[i] << "\t" << result.error << std::endl;
+                }
+            } });
     }
-    catch (const std::exception &e)
+    for (auto &thread : threads)
+        thread.join();
     {
-        LOG("Error processing file set: " << e.what());
-        return false;
+        std::lock_guard<std::mutex> lock(progressMutex);
+        finished = true;
     }
+    progressCv.notify_all();
+    progressThread.join();
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    std::cout << "\n=== Migration Summary ===" << std::endl;
+    std::cout << "Converted: " << converted << ", already in container format: " << skipped << ", failed: " << failed << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "Input: " << bytesIn / 1048576.0 << " MB, uncompressed: " << rawBytes / 1048576.0 << " MB, output: "
+              << bytesOut / 1048576.0 << " MB" << std::endl;
+    std::cout << "Elapsed: " << elapsed << " s, " << rawBytes / 1048576.0 / std::max(elapsed, 1e-3) << " MB/s uncompressed, "
+              << bytesIn / 1048576.0 / std::max(elapsed, 1e-3) << " MB/s read" << std::endl;
+    return failed == 0;
 }
 
-// メインの監視ループ
-void monitorDirectory(const std::string &watchDir, const std::string &outputDir,
-                      const std::string &basePattern, int setSize, int pollInterval,
-                      int maxThreads, bool deleteAfter, bool stopOnInterrupt)
+// コマンドラインからアーカイブ検査の設定を作る
+ScrubSettings scrubSettingsFrom(const CommandLine &cmd, const std::string &outputDir)
 {
+    ScrubSettings settings;
+    settings.stateFile = cmd.get("scrub-state", (fs::path(outputDir) / ".snappy_scrub_state.tsv").string());
+    settings.full = cmd.get("scrub-mode", "full") != "crc";
+    settings.maxMBps = std::max(0.1, cmd.getDouble("scrub-rate", settings.maxMBps));
+    settings.periodHours = std::max(0.01, cmd.getDouble("scrub-period", settings.periodHours));
+    settings.minAgeSeconds = cmd.getDouble("scrub-min-age", settings.minAgeSeconds);
+    return settings;
+}
 
-    bool running = true;
-
-    LOG("Starting directory monitor on: " << watchDir);
-    LOG("Output directory: " << outputDir);
-    LOG("Set size: " << setSize << " files");
-    LOG("Poll interval: " << pollInterval << " seconds");
-    LOG("Max threads: " << maxThreads);
-
-    // 削除キューを初期化
-    deleteQueue = std::make_unique<DeleteQueue>();
-
-    // 出力ディレクトリがなければ作成
-    try
+// 監視・バッチ以外の補助モード（対話的な設定入力は行わない）
+int runToolMode(const CommandLine &cmd, const std::string &watchDir, const std::string &outputDir,
+                const std::string &basePattern)
+{
+    if (cmd.mode == "plan")
     {
-        fs::create_directories(outputDir);
+        PlannerSettings planner;
+        planner.sampleDir = cmd.get("watch", watchDir);
+        planner.basePattern = cmd.get("pattern", basePattern);
+        planner.outputDir = cmd.get("output", "");
+        planner.samples = cmd.getInt("samples", planner.samples);
+        planner.frameRate = cmd.getDouble("fps", planner.frameRate);
+        planner.backlog = static_cast<long long>(cmd.getDouble("backlog", 0.0));
+        planner.threads = cmd.getInt("threads", planner.threads);
+        planner.latencyTarget = cmd.getDouble("latency", planner.latencyTarget);
+        planner.calibrationOut = cmd.get("calibration-out", "");
+        return runCapacityPlanner(planner) ? 0 : 2;
     }
-    catch (const std::exception &e)
+
+    if (cmd.mode == "simulate")
     {
-        LOG("Error creating output directory: " << e.what());
-        return;
-    }
+        // SnappyMaker simulate [--calibration=FILE] --fps=50 --threads=2,4,8 --set-size=50,100 ...
+        SimulationSettings base;
+        Calibration &c = base.calibration;
+        if (cmd.has("calibration") && !c.load(cmd.get("calibration", "")))
+        {
+            std::cerr << "Cannot read calibration file: " << cmd.get("calibration", "") << std::endl;
+            return 1;
+        }
+        c.frameBytes = cmd.getDouble("frame-mb", c.frameBytes / 1048576.0) * 1048576.0;
+        c.readMBps = cmd.getDouble("read-mbps", c.readMBps);
+        c.writeMBps = cmd.getDouble("write-mbps", c.writeMBps);
+        c.compressMBps = cmd.getDouble("compress-mbps", c.compressMBps);
+        c.ratio = cmd.getDouble("ratio", c.ratio);
+        c.cores = std::max(1, cmd.getInt("cores", c.cores));
+        base.duration = cmd.getDouble("duration", base.duration);
+        base.pollInterval = std::max(1, cmd.getInt("poll", base.pollInterval));
+        base.scanUsPerFile = cmd.getDouble("scan-us", base.scanUsPerFile);
+        base.deleteMs = cmd.getDouble("delete-ms", base.deleteMs);
+        base.latencySlo = cmd.getDouble("latency-slo", base.latencySlo);
 
-    // スレッドプール
-    std::vector<std::thread> threads;
+        std::vector<double> rates = parseValueList(cmd.get("fps", "10"));
+        std::vector<double> threadCounts = parseValueList(cmd.get("threads", "4"));
+        std::vector<double> setSizes = parseValueList(cmd.get("set-size", "100"));
+        std::vector<double> fsyncs = parseValueList(cmd.get("fsync-ms", "0"));
+        if (rates.empty() || threadCounts.empty() || setSizes.empty() || fsyncs.empty())
+        {
+            std::cerr << "Empty value list" << std::endl;
+            return 1;
+        }
+        // モデルはレートや帯域で割るので、0以下の値は受け付けない
+        bool positive = c.frameBytes > 0 && c.readMBps > 0 && c.writeMBps > 0 && c.compressMBps > 0 &&
+                        c.ratio > 0 && base.duration > 0;
+        for (double rate : rates)
+            positive = positive && rate > 0;
+        if (!positive)
+        {
+            std::cerr << "--fps, --duration, --frame-mb, --read-mbps, --write-mbps, --compress-mbps and --ratio must be positive" << std::endl;
+            return 1;
+        }
+        runSimulationSweep(base, rates, threadCounts, setSizes, fsyncs);
+        return 0;
+    }
 
-    // Ctrl+C 処理
-    if (stopOnInterrupt)
+    if (cmd.mode == "extract")
     {
-        std::thread interruptThread([&running]()
-                                    {
-            LOG("Press Enter to stop the monitor...");
-            std::cin.get();
-            running = false;
-            LOG("Stopping monitor..."); });
-        interruptThread.detach();
+        // SnappyMaker extract ARCHIVE... [--to=DIR]
+        if (cmd.positional.empty())
+        {
+            std::cerr << "Usage: SnappyMaker extract ARCHIVE... [--to=DIR]" << std::endl;
+            return 1;
+        }
+        bool ok = true;
+        for (const auto &archive : cmd.positional)
+        {
+            ok = extractArchive(archive, cmd.get("to", ".")) && ok;
+        }
+        return ok ? 0 : 2;
     }
 
-    // メインループ
-    while (running)
+    if (cmd.mode == "recompress")
     {
-        try
+        // SnappyMaker recompress --output=DIR [--codec=zstd] [--level=19] [--threads=N]
+        Codec codec;
+        if (!parseCodec(cmd.get("codec", "zstd"), codec) || !codecAvailable(codec))
         {
-            // 処理済みセットを追跡
-            static std::set<std::pair<int, int>> processedSets;
-            // 不完全セット（まだ揃っていないセット）を追跡
-            static std::set<std::pair<int, int>> incompleteSetsSeen;
-            // このループで圧縮処理を実行したフラグ
-            bool processedAnySet = false;
-
-            // ディレクトリをスキャンしてファイルセットを取得
-            auto fileSets = scanAndGroupFiles(watchDir, basePattern, setSize);
-
-            LOG("Found " << fileSets.size() << " file sets");
-
-            // 各セットを処理
-            for (const auto &fileSet : fileSets)
-            {
-                auto setKey = std::make_pair(fileSet.run, fileSet.setNumber);
-
-                // 既に処理済みならスキップ
-                if (processedSets.find(setKey) != processedSets.end())
-                {
-                    continue;
-                }
-
-                // セットが完全であるか確認
-                if (isSetComplete(fileSet, setSize))
-                {
-                    // 既に処理済みかチェック
-                    if (isSetProcessed(fileSet, outputDir))
-                    {
-                        LOG("Set already processed: run " << fileSet.run << ", set " << fileSet.setNumber);
-                        processedSets.insert(setKey);
-                        continue;
-                    }
+            std::cerr << "Codec not available in this build: " << cmd.get("codec", "zstd") << std::endl;
+            return 1;
+        }
+        return recompressDirectory(cmd.get("output", outputDir), codec, cmd.getInt("level", 19), cmd.getInt("threads", 1)) ? 0 : 2;
+    }
 
-                    // 不完全セットリストから削除（もし以前に不完全として記録されていたなら）
-                    incompleteSetsSeen.erase(setKey);
+    if (cmd.mode == "migrate")
+    {
+        // SnappyMaker migrate --output=DIR [--codec=snappy] [--level=N] [--threads=N] [--memory-mb=512] [--retry-failed]
+        Codec codec;
+        if (!parseCodec(cmd.get("codec", "snappy"), codec) || !codecAvailable(codec))
+        {
+            std::cerr << "Codec not available in this build: " << cmd.get("codec", "snappy") << std::endl;
+            return 1;
+        }
+        return migrateDirectory(cmd.get("output", outputDir), codec, cmd.getInt("level", 19),
+                                cmd.getInt("threads", std::max(1u, std::thread::hardware_concurrency())),
+                                cmd.getInt("memory-mb", 512), cmd.has("retry-failed"))
+                   ? 0
+                   : 2;
+    }
 
-                    // スレッド数をチェック
-                    while (threads.size() >= static_cast<size_t>(maxThreads))
-                    {
-                        // 完了したスレッドを削除
-                        for (auto it = threads.begin(); it != threads.end();)
-                        {
-                            if (it->joinable())
-                            {
-                                it->join();
-                                it = threads.erase(it);
-                            }
-                            else
-                            {
-                                ++it;
-                            }
-                        }
-                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                    }
+    if (cmd.mode == "lookup")
+    {
+        // SnappyMaker lookup [--catalog=DIR] RUN:FRAME... （"-" なら標準入力から1行に1つ）
+        std::string dir = cmd.get("catalog", "1");
+        if (dir == "1")
+            dir = (fs::path(cmd.get("output", outputDir)) / "catalog").string();
+        CatalogIndex index;
+        std::string error;
+        if (!index.open(dir, error))
+        {
+            std::cerr << "Cannot open catalog: " << error << std::endl;
+            return 1;
+        }
 
-                    // 新しいスレッドで処理
-                    LOG("Starting processing of set: run " << fileSet.run << ", set " << fileSet.setNumber);
-                    threads.emplace_back(processFileSet, fileSet, outputDir, deleteAfter);
-                    processedSets.insert(setKey);
-                    // 圧縮処理を実行したフラグをセット
-                    processedAnySet = true;
-                }
-                else
-                {
-                    // 不完全なセットを記録
-                    incompleteSetsSeen.insert(setKey);
-                    LOG("Set incomplete: run " << fileSet.run << ", set " << fileSet.setNumber << " (" << fileSet.files.size() << "/" << setSize << " files)");
-                }
+        std::vector<std::pair<int, int>> keys;
+        auto addKey = [&keys](const std::string &text)
+        {
+            size_t separator = text.find_first_of(":/ \t");
+            try
+            {
+                keys.emplace_back(std::stoi(text.substr(0, separator)), std::stoi(text.substr(separator + 1)));
+                return true;
             }
-
-            // 完了したスレッドをクリーンアップ
-            for (auto it = threads.begin(); it != threads.end();)
+            catch (const std::exception &)
             {
-                if (it->joinable())
-                {
-                    it->join();
-                    it = threads.erase(it);
-                }
-                else
-                {
-                    ++it;
-                }
+                std::cerr << "Invalid key (expected RUN:FRAME): " << text << std::endl;
+                return false;
             }
-
-            // キューの状態をログに出力（オプション）
-            LOG("Delete queue size: " << deleteQueue->size());
-
-            // 圧縮処理が実行されなかった場合のみ待機を行う
-            if (!processedAnySet)
+        };
+        for (const auto &arg : cmd.positional)
+        {
+            if (arg == "-")
             {
-                // 指定された間隔で待機
-                for (int i = 0; i < pollInterval && running; ++i)
+                std::string line;
+                while (std::getline(std::cin, line))
                 {
-                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                    if (!line.empty())
+                        addKey(line);
                 }
             }
+            else if (!addKey(arg))
+            {
+                return 1;
+            }
         }
-        catch (const std::exception &e)
+
+        // --random=N: 索引に含まれるキーをN個引いて検索速度を測る
+        int randomKeys = cmd.getInt("random", 0);
+        if (randomKeys > 0 && index.count() > 0)
         {
-            LOG("Error in monitor loop: " << e.what());
+            std::mt19937 rng(1);
+            std::uniform_int_distribution<size_t> pick(0, index.count() - 1);
+            for (int i = 0; i < randomKeys; ++i)
+            {
+                const CatalogIndexEntry &entry = index.entry(pick(rng));
+                keys.emplace_back(entry.run, entry.frame);
+            }
+        }
 
-            // エラー時は待機を入れる（圧縮処理の有無に関わらず）
-            for (int i = 0; i < pollInterval && running; ++i)
+        size_t found = 0;
+        std::ostringstream out;
+        auto start = std::chrono::steady_clock::now();
+        for (const auto &key : keys)
+        {
+            auto range = index.find(key.first, key.second);
+            if (range.first == range.second)
+                continue;
+            ++found;
+            if (randomKeys > 0)
+                continue;
+            for (auto it = range.first; it != range.second; ++it)
             {
-                std::this_thread::sleep_for(std::chrono::seconds(1));
+                char crc[9];
+                std::snprintf(crc, sizeof(crc), "%08x", it->crc);
+                out << it->run << '\t' << it->frame << '\t' << index.archive(*it) << '\t' << it->offset << '\t' << it->size
+                    << '\t' << crc << '\t' << it->originalSize << '\t' << it->transformed << '\n';
             }
         }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << out.str();
+        std::cerr << "Resolved " << found << "/" << keys.size() << " keys in " << ms << " ms ("
+                  << static_cast<long long>(keys.size() / std::max(ms, 1e-6)) << " per ms), " << index.count() << " frames in catalog" << std::endl;
+        return found == keys.size() ? 0 : 2;
     }
 
-    // 残りのスレッドが完了するのを待つ
-    LOG("Waiting for remaining tasks to complete...");
-    for (auto &thread : threads)
+    if (cmd.mode == "scrub")
     {
-        if (thread.joinable())
+        // SnappyMaker scrub --output=DIR [--scrub-mode=full|crc] [--scrub-rate=MBPS]
+        std::string dir = cmd.get("output", outputDir);
+        Scrubber checker({dir}, scrubSettingsFrom(cmd, dir));
+        size_t failed = checker.runOnce();
+        LOG("Scrub finished: " << checker.status());
+        return failed > 0 ? 2 : 0;
+    }
+
+    if (cmd.mode == "serve")
+    {
+        // SnappyMaker serve --socket=PATH [--catalog=DIR] [--cache-mb=1024] [--prefetch=4]
+#ifndef _WIN32
+        if (!cmd.has("socket"))
         {
-            thread.join();
+            std::cerr << "Usage: SnappyMaker serve --socket=PATH [--catalog=DIR] [--cache-mb=1024] [--prefetch=4]" << std::endl;
+            return 1;
         }
+        FrameServer::Settings settings;
+        settings.catalogDir = cmd.get("catalog", "1");
+        if (settings.catalogDir == "1")
+            settings.catalogDir = (fs::path(cmd.get("output", outputDir)) / "catalog").string();
+        settings.cacheBytes = static_cast<size_t>(std::max(1, cmd.getInt("cache-mb", 1024))) << 20;
+        settings.prefetch = std::max(0, cmd.getInt("prefetch", settings.prefetch));
+        return runFrameServer(cmd.get("socket", ""), settings) ? 0 : 2;
+#else
+        std::cerr << "The frame server needs Unix domain sockets and is not available on Windows" << std::endl;
+        return 1;
+#endif
     }
 
-    // 削除キューを解放
-    LOG("Waiting for delete queue to finish...");
-    deleteQueue.reset();
+    if (cmd.mode == "manifest")
+    {
+        // SnappyMaker manifest ARCHIVE... [--against=ARCHIVE|MANIFEST]
+        // 転送先のマニフェストと名前・サイズ・CRC32C を突き合わせる（圧縮後の範囲はコーデックで変わるので比べない）
+        if (cmd.positional.empty())
+        {
+            std::cerr << "Usage: SnappyMaker manifest ARCHIVE... [--against=ARCHIVE|MANIFEST]" << std::endl;
+            return 1;
+        }
+        std::vector<ManifestEntry> expected;
+        std::string expectedText, error;
+        bool compare = cmd.has("against");
+        if (compare && !loadManifest(cmd.get("against", ""), expected, expectedText, error))
+        {
+            std::cerr << cmd.get("against", "") << ": " << error << std::endl;
+            return 1;
+        }
 
-    LOG("Monitor stopped.");
+        bool ok = true;
+        for (const auto &path : cmd.positional)
+        {
+            std::vector<ManifestEntry> manifest;
+            std::string text;
+            if (!loadManifest(path, manifest, text, error))
+            {
+                std::cerr << path << ": " << error << std::endl;
+                ok = false;
+                continue;
+            }
+            if (!compare)
+            {
+                if (cmd.positional.size() > 1)
+                    std::cout << "== " << path << " ==" << std::endl;
+                std::cout << text;
+                continue;
+            }
+
+            std::map<std::string, const ManifestEntry *> byName;
+            for (const auto &entry : expected)
+                byName[entry.name] = &entry;
+            size_t mismatches = 0;
+            for (const auto &entry : manifest)
+            {
+                auto it = byName.find(entry.name);
+                if (it == byName.end())
+                {
+                    std::cout << path << ": unexpected member " << entry.name << std::endl;
+                    ++mismatches;
+                    continue;
+                }
+                if (it->second->size != entry.size || it->second->crc != entry.crc)
+                {
+                    std::cout << path << ": " << entry.name << " differs" << std::endl;
+                    ++mismatches;
+                }
+                byName.erase(it);
+            }
+            for (const auto &missing : byName)
+            {
+                std::cout << path << ": missing member " << missing.first << std::endl;
+                ++mismatches;
+            }
+            if (mismatches == 0)
+                std::cout << path << ": OK (" << manifest.size() << " members)" << std::endl;
+            ok = ok && mismatches == 0;
+        }
+        return ok ? 0 : 2;
+    }
+
+    if (cmd.mode == "receive")
+    {
+        // SnappyMaker receive --listen=PORT [--bind=ADDRESS] --output=DIR
+        return runReceiver(cmd.get("bind", "127.0.0.1"), cmd.getInt("listen", 7070), cmd.get("output", outputDir)) ? 0 : 2;
+    }
+
+    return 1;
 }
 
 int main(int argc, char *argv[])
 {
+    CommandLine cmd = parseCommandLine(argc, argv);
+
     // Default settings
     std::string watchDir = "Z:";
     std::string outputDir = "Z:";
@@ -677,49 +10214,441 @@ int main(int argc, char *argv[])
     std::cout << "Date: 2025-03-27" << std::endl;
     std::cout << "If you have any questions, please contact me at aoyagi-shungo011@g.ecc.u-tokyo.ac.jp" << std::endl;
 
-    // Get user input
+    const std::set<std::string> toolModes = {"plan", "simulate", "extract", "recompress", "receive", "scrub", "migrate", "lookup", "manifest", "serve"};
+    if (!cmd.mode.empty() && cmd.mode != "monitor" && cmd.mode != "batch" && !toolModes.count(cmd.mode))
+    {
+        std::cerr << "Unknown mode: " << cmd.mode << std::endl;
+        std::cerr << "Usage: SnappyMaker [monitor|batch|plan|simulate|extract|recompress|receive|scrub|migrate|lookup|manifest|serve] [--watch=DIR] [--output=DIR] [--pattern=PATTERN] [--set-size=N]" << std::endl;
+        return 1;
+    }
+
+    // タスクの種類ごとのCPU・I/O優先度（--priority-compress=nice:5,io:be:4 など）
+    for (size_t i = 0; i < taskPriorities.size(); ++i)
+    {
+        std::string option = std::string("priority-") + taskClassNames[i];
+        if (!cmd.has(option))
+            continue;
+        if (!TaskPriority::parse(cmd.get(option, ""), taskPriorities[i]))
+        {
+            std::cerr << "Invalid --" << option << " (expected idle, nice:N, io:idle, io:be:N or io:rt:N, comma separated)" << std::endl;
+            return 1;
+        }
+        std::cout << "Priority of " << taskClassNames[i] << " tasks: " << taskPriorities[i].describe() << std::endl;
+    }
+
+    if (toolModes.count(cmd.mode))
+    {
+        try
+        {
+            return runToolMode(cmd, watchDir, outputDir, basePattern);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Fatal error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    const bool batchMode = cmd.mode == "batch";
+
+    // Get user input (values given on the command line are not asked again)
     std::cout << "=== Snappy Composer Settings ===" << std::endl;
 
+    auto promptSetting = [&cmd](const std::string &key, const std::string &prompt, std::string &value)
+    {
+        if (cmd.has(key))
+        {
+            value = cmd.get(key, value);
+            return;
+        }
+        std::cout << prompt;
+        std::string input;
+        std::getline(std::cin, input);
+        if (!input.empty())
+        {
+            value = input;
+        }
+    };
+
     // Watch directory input
-    std::cout << "Enter directory to monitor: ";
-    std::string input;
-    std::getline(std::cin, input);
-    if (!input.empty())
+    promptSetting("watch", batchMode ? "Enter directory to compress: " : "Enter directory to monitor: ", watchDir);
+
+    // Output directory input
+    promptSetting("output", "Enter directory for output files: ", outputDir);
+
+    // File pattern input
+    promptSetting("pattern", "Enter filename pattern: ", basePattern);
+
+    // Set size input
+    std::string setSizeInput = std::to_string(setSize);
+    promptSetting("set-size", "Enter number of files per set: ", setSizeInput);
+    try
     {
-        watchDir = input;
+        setSize = std::stoi(setSizeInput);
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "Invalid input. Using default value: " << setSize << std::endl;
     }
 
-    // Output directory input
-    std::cout << "Enter directory for output files: ";
-    input.clear();
-    std::getline(std::cin, input);
-    if (!input.empty())
+    // メモリ上のファイルシステム：合成データでCPUとスケジューリングだけを測る
+    std::string vfsName = cmd.get("vfs", "local");
+    if (vfsName == "memory")
     {
-        outputDir = input;
+        VfsLatency latency;
+        if (!VfsLatency::parse(cmd.get("vfs-latency", "none"), latency))
+        {
+            std::cerr << "Unknown --vfs-latency (use none, nfs or smb)" << std::endl;
+            return 1;
+        }
+        auto memory = std::make_unique<MemoryVfs>(latency);
+        int runs = std::max(1, cmd.getInt("vfs-runs", 1));
+        int files = std::max(1, cmd.getInt("vfs-files", 100));
+        size_t fileSize = static_cast<size_t>(std::max(1, cmd.getInt("vfs-file-size", 1024))) * 1024;
+        memory->populate(watchDir, basePattern, runs, files, fileSize);
+        std::cout << "Memory filesystem: " << runs << " run(s) x " << files << " files x " << fileSize / 1024
+                  << " KB in " << watchDir << ", latency " << cmd.get("vfs-latency", "none") << std::endl;
+        vfs = std::move(memory);
+    }
+    else if (vfsName != "local")
+    {
+        std::cerr << "Unknown --vfs: " << vfsName << std::endl;
+        return 1;
     }
 
-    // File pattern input
-    std::cout << "Enter filename pattern: ";
-    input.clear();
-    std::getline(std::cin, input);
-    if (!input.empty())
+    // 再帰監視：サブディレクトリも対象にする
+    if (cmd.has("recursive"))
     {
-        basePattern = input;
+        try
+        {
+            watchScopes = std::make_unique<WatchScopes>(watchDir, cmd.get("subdir-pattern", ""), cmd.getInt("scope-expiry", 300));
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Invalid --subdir-pattern: " << e.what() << std::endl;
+            return 1;
+        }
+        std::cout << "Recursive watch: on" << std::endl;
     }
 
-    // Set size input
-    std::cout << "Enter number of files per set: ";
-    input.clear();
-    std::getline(std::cin, input);
-    if (!input.empty())
+    // 出力ディレクトリの階層構成
+    OutputLayout::Kind layout = OutputLayout::Kind::Flat;
+    if (!OutputLayout::parseKind(cmd.get("layout", "flat"), layout))
+    {
+        std::cerr << "Invalid --layout (flat, run, hash)" << std::endl;
+        return 1;
+    }
+    outputLayout.configure(layout, cmd.getInt("hash-buckets", 256));
+
+    // 複数の出力先（";"区切り）へのストライピング
+    if (cmd.has("targets"))
+    {
+        std::vector<std::string> targets;
+        std::stringstream list(cmd.get("targets", ""));
+        std::string target;
+        while (std::getline(list, target, ';'))
+        {
+            if (!target.empty())
+                targets.push_back(target);
+        }
+        OutputRouter::Policy policy = OutputRouter::Policy::RoundRobin;
+        if (targets.empty() || !OutputRouter::parsePolicy(cmd.get("placement", "roundrobin"), policy))
+        {
+            std::cerr << "Invalid --targets or --placement (roundrobin, leastloaded, hash)" << std::endl;
+            return 1;
+        }
+        std::cout << "Output targets: " << targets.size() << " (" << cmd.get("placement", "roundrobin") << ")" << std::endl;
+        try
+        {
+            outputRouter = std::make_unique<OutputRouter>(targets, policy, outputDir);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error preparing output targets: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    // 再帰監視で出力先が監視ディレクトリの下にあるときは、出力先のサブディレクトリを走査しない
+    // 監視ディレクトリそのものに出力するなら、サブディレクトリを作る階層構成（run, hash）はランのサブディレクトリと区別できない
+    if (watchScopes)
+    {
+        std::vector<std::string> outputs = outputRouter ? outputRouter->targetDirs() : std::vector<std::string>{};
+        outputs.push_back(outputDir);
+        for (const auto &dir : outputs)
+        {
+            if (!watchScopes->excludeOutput(dir) && layout != OutputLayout::Kind::Flat)
+            {
+                std::cerr << "--recursive with --layout=" << cmd.get("layout", "flat")
+                          << " needs an output directory other than the watch directory: " << dir << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    // 出力先の種類（既定はローカルファイル）
+    std::string sinkName = cmd.get("sink", "file");
+    if (sinkName == "s3")
+    {
+        // S3互換オブジェクトストレージへ直接アップロード
+        S3Settings s3;
+        const char *envAccess = std::getenv("AWS_ACCESS_KEY_ID");
+        const char *envSecret = std::getenv("AWS_SECRET_ACCESS_KEY");
+        s3.bucket = cmd.get("s3-bucket", "");
+        s3.prefix = cmd.get("s3-prefix", "");
+        s3.region = cmd.get("s3-region", s3.region);
+        s3.accessKey = cmd.get("s3-access-key", envAccess ? envAccess : "");
+        s3.secretKey = cmd.get("s3-secret-key", envSecret ? envSecret : "");
+        s3.partSize = static_cast<size_t>(std::max(5, cmd.getInt("s3-part-size", 16))) * 1024 * 1024;
+        s3.concurrency = std::max(1, cmd.getInt("s3-concurrency", s3.concurrency));
+        if (!splitHostPort(cmd.get("s3-endpoint", ""), 80, s3.host, s3.port) || s3.bucket.empty() ||
+            s3.accessKey.empty() || s3.secretKey.empty())
+        {
+            std::cerr << "--sink=s3 needs --s3-endpoint=HOST:PORT, --s3-bucket and credentials "
+                         "(--s3-access-key/--s3-secret-key or AWS_ACCESS_KEY_ID/AWS_SECRET_ACCESS_KEY)"
+                      << std::endl;
+            return 1;
+        }
+        archiveSink = std::make_unique<S3Sink>(s3, outputDir);
+        std::cout << "Output sink: s3 http://" << s3.host << ":" << s3.port << "/" << s3.bucket << "/" << s3.prefix
+                  << " (parts " << s3.partSize / 1048576 << " MB x " << s3.concurrency << ")" << std::endl;
+        if (cmd.has("tiered") || outputRouter)
+        {
+            std::cerr << "--tiered and --targets are not supported with --sink=s3" << std::endl;
+            return 1;
+        }
+    }
+    else if (sinkName == "tcp")
+    {
+        // 受信デーモンへストリーミング（SnappyMaker receive）
+        std::string host;
+        int port;
+        if (!splitHostPort(cmd.get("tcp-endpoint", ""), 7070, host, port))
+        {
+            std::cerr << "--sink=tcp needs --tcp-endpoint=HOST:PORT" << std::endl;
+            return 1;
+        }
+        if (cmd.has("tiered") || outputRouter)
+        {
+            std::cerr << "--tiered and --targets are not supported with --sink=tcp" << std::endl;
+            return 1;
+        }
+        archiveSink = std::make_unique<TcpSink>(host, port, outputDir);
+        std::cout << "Output sink: tcp " << host << ":" << port << std::endl;
+    }
+    else if (sinkName != "file")
+    {
+        // ローカル系の出力（direct, mmap, spool, null）
+        std::string spoolDir = cmd.get("spool-dir", (fs::temp_directory_path() / "snappy_spool").string());
+        archiveSink = makeLocalSink(sinkName, spoolDir);
+        if (!archiveSink)
+        {
+            std::cerr << "Unknown --sink: " << sinkName << std::endl;
+            return 1;
+        }
+        std::cout << "Output sink: " << archiveSink->name() << std::endl;
+    }
+
+    // メモリ上のファイルシステムでは出力もメモリに書く
+    if (!vfs->isLocal())
+    {
+        if (sinkName == "file")
+        {
+            archiveSink = std::make_unique<VfsSink>();
+        }
+        else if (sinkName != "null")
+        {
+            std::cerr << "--vfs=memory supports only --sink=file or --sink=null" << std::endl;
+            return 1;
+        }
+        if (cmd.has("tiered"))
+        {
+            std::cerr << "--tiered is not supported with --vfs=memory" << std::endl;
+            return 1;
+        }
+    }
+
+    // フライトレコーダー：常に記録し、致命的なシグナル・停止の検出・要求（SIGUSR1、トリガーファイル）で書き出す
+    startFlightRecorder(cmd.get("flight-dump", "snappymaker_flight.log"), cmd.get("flight-trigger", "snappymaker.dump"),
+                        std::max(10, cmd.getInt("stall-seconds", 300)));
+    flightRecorder.record(FlightEvent::Start, batchMode ? 1 : 0);
+
+    // 遅延削除：元ファイルをゴミ箱に移し、検出器が止まっているときや空き容量が減ったときにまとめて消す
+    if (cmd.has("trash"))
+    {
+        trashSettings.enabled = true;
+        trashSettings.keepSeconds = cmd.getDouble("trash-keep", trashSettings.keepSeconds);
+        trashSettings.idleSeconds = cmd.getDouble("trash-idle", trashSettings.idleSeconds);
+        trashSettings.purgeFreeGB = cmd.getDouble("trash-free-gb", trashSettings.purgeFreeGB);
+        std::cout << "Deferred deletion: keep " << trashSettings.keepSeconds << " s, purge after " << trashSettings.idleSeconds
+                  << " s idle or below " << trashSettings.purgeFreeGB << " GB free" << std::endl;
+    }
+
+    // 背圧の公開（監視モード）：バックログ・遅れ・空き容量と絞り込みレベルを状態ファイルと制御ソケットに出す
+    if (!batchMode)
+    {
+        Backpressure::Settings settings;
+        settings.statusFile = cmd.get("status-file", "");
+        settings.lagSeconds = cmd.getDouble("backpressure-lag", settings.lagSeconds);
+        settings.minFreeGB = cmd.getDouble("min-free-gb", settings.minFreeGB);
+        settings.backlogFiles = static_cast<size_t>(cmd.getInt("backpressure-backlog", setSize * maxThreads * 2));
+        settings.setSize = setSize;
+        backpressure = std::make_unique<Backpressure>(settings, watchDir, outputDir);
+    }
+    // フレーム -> アーカイブのカタログ（--catalog なら OUTPUT/catalog）
+    if (cmd.has("catalog"))
+    {
+        std::string dir = cmd.get("catalog", "1");
+        catalog = std::make_unique<Catalog>(dir == "1" ? (fs::path(outputDir) / "catalog").string() : dir);
+    }
+    // 書き込み完了イベントのログ（--commit-log なら OUTPUT/.snappy_commits.ndjson）
+    if (cmd.has("commit-log"))
+    {
+        std::string path = cmd.get("commit-log", "1");
+        commitLog = std::make_unique<CommitLog>(path == "1" ? (fs::path(outputDir) / ".snappy_commits.ndjson").string() : path);
+    }
+    // 画素フィルター（--pixel-filter=gradient+shuffle,7:none のようにランごとに指定できる）
+    if (cmd.has("pixel-filter"))
+    {
+        if (!PixelFilterSettings::parse(cmd.get("pixel-filter", ""), pixelFilters))
+        {
+            std::cerr << "Invalid --pixel-filter (expected none, shuffle, left, up or gradient, optionally +shuffle and RUN: prefixes)" << std::endl;
+            return 1;
+        }
+        std::cout << "Pixel filter: " << pixelFilters.defaultFilter.describe();
+        for (const auto &run : pixelFilters.perRun)
+            std::cout << ", run " << run.first << ": " << run.second.describe();
+        std::cout << std::endl;
+    }
+    // 静的マスク（--mask ならランごとに学習して OUTPUT/masks に保存、--mask=FILE なら全ランで固定のマスク）
+    if (cmd.has("mask"))
+    {
+        std::string value = cmd.get("mask", "1");
+        std::vector<int64_t> sentinels{-1, -2};
+        if (cmd.has("mask-values"))
+        {
+            sentinels.clear();
+            std::stringstream stream(cmd.get("mask-values", ""));
+            std::string item;
+            try
+            {
+                while (std::getline(stream, item, ','))
+                    sentinels.push_back(std::stoll(item, nullptr, 0));
+            }
+            catch (const std::exception &)
+            {
+                std::cerr << "Invalid --mask-values (expected a comma-separated list of integers)" << std::endl;
+                return 1;
+            }
+        }
+        if (value == "1" || value == "learn")
+        {
+            detectorMasks = std::make_unique<DetectorMasks>((fs::path(outputDir) / "masks").string(), sentinels);
+            std::cout << "Detector mask: learned per run" << std::endl;
+        }
+        else
+        {
+            std::ifstream in(value, std::ios::binary);
+            auto mask = std::make_shared<DetectorMask>();
+            if (!in || !DetectorMask::fromText(std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()), *mask))
+            {
+                std::cerr << "Cannot read detector mask: " << value << std::endl;
+                return 1;
+            }
+            detectorMasks = std::make_unique<DetectorMasks>(mask);
+            std::cout << "Detector mask: " << value << " (" << mask->maskedPixels << " pixels)" << std::endl;
+        }
+    }
+    // マニフェストはフッターに常に入る。--manifest-sidecar ならアーカイブの隣にも置く
+    manifestSidecar = cmd.has("manifest-sidecar");
+
+    // 書き込み済みアーカイブの定期検査（監視モード）
+    if (cmd.has("scrub") && !batchMode)
+    {
+        ScrubSettings settings = scrubSettingsFrom(cmd, outputDir);
+        scrubber = std::make_unique<Scrubber>(outputRouter ? outputRouter->targetDirs() : std::vector<std::string>{outputDir}, settings);
+        scrubber->start();
+        std::cout << "Scrubbing archives every " << settings.periodHours << " h (" << (settings.full ? "full" : "crc")
+                  << ", at most " << settings.maxMBps << " MB/s)" << std::endl;
+    }
+    if (cmd.has("control-socket"))
+    {
+        controlServer = std::make_unique<ControlServer>(cmd.get("control-socket", ""));
+        controlServer->on("status", [](const std::string &)
+                          { return backpressure ? backpressure->status() : std::string("{\"error\":\"no status in batch mode\"}"); });
+        controlServer->on("scrub", [](const std::string &)
+                          { return scrubber ? scrubber->status() : std::string("{\"error\":\"scrubber not running\"}"); });
+        controlServer->on("dump", [](const std::string &)
+                          {
+                              flightDumpRequested = true;
+                              return std::string("{\"ok\":true}"); });
+        if (commitLog)
+        {
+            controlServer->replayWith("commits", [](const std::string &from, const std::function<void(const std::string &)> &emit,
+                                                    uint64_t &cursor, std::string &error)
+                                      { return commitLog->replay(from, emit, cursor, error); });
+            controlServer->on("ack", [](const std::string &args)
+                              {
+                                  std::istringstream in(args);
+                                  std::string name;
+                                  uint64_t seq;
+                                  if (!(in >> name >> seq))
+                                      return std::string("{\"error\":\"usage: ack NAME SEQ\"}");
+                                  if (!commitLog->ack(name, seq))
+                                      return std::string("{\"error\":\"cannot save cursor\"}");
+                                  return "{\"ack\":" + jsonString(name) + ",\"seq\":" + std::to_string(seq) + "}"; });
+        }
+        controlServer->start();
+    }
+
+    // 段階圧縮：まずsnappyで書き出し、空き時間にzstdで再圧縮する
+    if (cmd.has("tiered"))
+    {
+        if (!codecAvailable(Codec::Zstd))
+        {
+            std::cerr << "Tiered compression needs zstd, which is not available in this build." << std::endl;
+            return 1;
+        }
+        int level = cmd.getInt("recompress-level", 19);
+        std::cout << "Tiered compression: zstd-" << level << " after " << cmd.getInt("recompress-delay", 60) << " s" << std::endl;
+        recompressor = std::make_unique<Recompressor>(Codec::Zstd, level, cmd.getInt("recompress-delay", 60),
+                                                      cmd.getInt("recompress-threads", 1));
+    }
+
+    if (batchMode)
     {
+        // バッチモードは検出器がいないので、全コアを使って一気に処理する
+        int batchThreads = cmd.getInt("threads", std::max(1u, std::thread::hardware_concurrency()));
+        bool completeOnly = cmd.has("complete-only");
+        bool keepSources = cmd.has("keep-sources");
+
+        std::cout << "\n=== Batch Configuration ===" << std::endl;
+        std::cout << "Source directory: " << watchDir << std::endl;
+        std::cout << "Output directory: " << outputDir << std::endl;
+        std::cout << "File pattern: " << basePattern << std::endl;
+        std::cout << "Set size: " << setSize << std::endl;
+        std::cout << "Threads: " << batchThreads << std::endl;
+        std::cout << "Partial sets: " << (completeOnly ? "skipped" : "compressed") << std::endl;
+        std::cout << "Delete sources: " << (keepSources ? "no" : "yes") << std::endl;
+        std::cout << "\nStarting batch...\n"
+                  << std::endl;
+
         try
         {
-            setSize = std::stoi(input);
+            bool ok = batchCompress(watchDir, outputDir, basePattern, setSize, batchThreads, !keepSources, completeOnly);
+            if (recompressor)
+            {
+                LOG("Waiting for recompression to finish...");
+                recompressor->drain();
+                recompressor.reset();
+            }
+            controlServer.reset();
+            return ok ? 0 : 2;
         }
         catch (const std::exception &e)
         {
-            std::cout << "Invalid input. Using default value: " << setSize << std::endl;
+            std::cerr << "Fatal error: " << e.what() << std::endl;
+            return 1;
         }
     }
 
@@ -728,12 +10657,22 @@ int main(int argc, char *argv[])
     std::cout << "Output directory: " << outputDir << std::endl;
     std::cout << "File pattern: " << basePattern << std::endl;
     std::cout << "Set size: " << setSize << std::endl;
+    // レイテンシ目標：最も古いフレームがこの秒数以内にアーカイブされるようにセットを区切る
+    double latencySlo = cmd.getDouble("latency-slo", 0.0);
+    if (latencySlo > 0.0)
+    {
+        sloController = std::make_unique<SloController>(latencySlo, setSize, pollInterval);
+        std::cout << "Latency SLO: " << latencySlo << " s" << std::endl;
+    }
     std::cout << "\nStarting monitor...\n"
               << std::endl;
 
     try
     {
         monitorDirectory(watchDir, outputDir, basePattern, setSize, pollInterval, maxThreads, deleteAfter, stopOnInterrupt);
+        recompressor.reset();
+        scrubber.reset();
+        controlServer.reset(); // 再送中のスレッドを止めてからコミットログを閉じる
     }
     catch (const std::exception &e)
     {
@@ -742,4 +10681,4 @@ int main(int argc, char *argv[])
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+# フレームカタログ（--catalog）、lookup、serve のテスト
+# ブロックをまたぐ大きさのフレームを --catalog 付きで圧縮し、lookup の結果を元データと比べる。
+# --random と存在しないキーの終了コードを確かめたあと、serve を起動して get と map で同じフレームを取り出す。
+# 使い方: catalog_test.py path/to/SnappyMaker
+import array
+import json
+import mmap
+import os
+import socket
+import sys
+
+from common import background, batch, binary_from_argv, crc32c, listening, run, wait_for, work_dir, write_files
+
+FRAMES = 8
+FRAME_SIZE = 1500 * 1000  # 4 MB のブロックをまたぐ大きさ
+SET_SIZE = 4
+BLOCK_SIZE = 4 << 20
+
+
+def lookup(binary, catalog, keys, check=True):
+    """lookup を実行して {(run, frame): [列...]} と終了コードを返す"""
+    code, output = run([binary, "lookup", "--catalog=" + catalog] + keys, check=check)
+    entries = {}
+    for line in output.splitlines():
+        fields = line.split("\t")
+        if len(fields) == 8:
+            entries.setdefault((int(fields[0]), int(fields[1])), []).append(fields[2:])
+    return code, entries
+
+
+class FrameClient:
+    def __init__(self, path):
+        self.socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.socket.settimeout(30)
+        self.socket.connect(path)
+        self.buffer = b""
+        self.fds = []
+
+    def close(self):
+        self.socket.close()
+
+    def _receive(self):
+        data, ancillary, _, _ = self.socket.recvmsg(65536, socket.CMSG_SPACE(array.array("i").itemsize))
+        if not data:
+            raise SystemExit("frame server closed the connection")
+        for level, type, payload in ancillary:
+            if level == socket.SOL_SOCKET and type == socket.SCM_RIGHTS:
+                fds = array.array("i")
+                fds.frombytes(payload[:len(payload) - len(payload) % fds.itemsize])
+                self.fds.extend(fds)
+        self.buffer += data
+
+    def request(self, line):
+        """1行送って JSON の返事を返す（inline ならデータを "data" に入れる）"""
+        self.socket.sendall(line.encode() + b"\n")
+        while b"\n" not in self.buffer:
+            self._receive()
+        header, self.buffer = self.buffer.split(b"\n", 1)
+        reply = json.loads(header)
+        if reply.get("inline"):
+            while len(self.buffer) < reply["size"]:
+                self._receive()
+            reply["data"], self.buffer = self.buffer[:reply["size"]], self.buffer[reply["size"]:]
+        return reply
+
+
+def spans_blocks(offset, size):
+    return offset // BLOCK_SIZE != (offset + size - 1) // BLOCK_SIZE
+
+
+def main():
+    binary = binary_from_argv("catalog_test.py")
+    with work_dir("catalog_test_") as work:
+        frames = {}
+        for i in range(1, FRAMES + 1):
+            frames[(5, i)] = bytes([i]) * (FRAME_SIZE // 2) + os.urandom(FRAME_SIZE - FRAME_SIZE // 2)
+        watch = os.path.join(work, "watch")
+        output = os.path.join(work, "output")
+        catalog = os.path.join(output, "catalog")
+        write_files(watch, {"test_%02d_%05d.tif" % key: data for key, data in frames.items()})
+        batch(binary, watch, output, SET_SIZE, "--catalog")
+
+        # 既知のキー：列がそれぞれ元のファイルと一致する
+        _, entries = lookup(binary, catalog, ["%d:%d" % key for key in frames])
+        spanning = None
+        for key, data in frames.items():
+            if len(entries.get(key, [])) != 1:
+                raise SystemExit("lookup %d:%d returned %d entries" % (key + (len(entries.get(key, [])),)))
+            archive, offset, size, crc, original_size, transformed = entries[key][0]
+            if not os.path.exists(archive) or os.path.dirname(os.path.abspath(archive)) != os.path.abspath(output):
+                raise SystemExit("lookup %d:%d points to an unexpected archive: %s" % (key + (archive,)))
+            if int(size) != len(data) or int(original_size) != len(data) or transformed != "0":
+                raise SystemExit("lookup %d:%d has wrong sizes or flag: %s" % (key + (entries[key][0],)))
+            if int(crc, 16) != crc32c(data):
+                raise SystemExit("lookup %d:%d has a wrong CRC32C" % key)
+            if spanning is None and spans_blocks(int(offset), int(size)):
+                spanning = key
+        if spanning is None:
+            raise SystemExit("no frame spans a block boundary")
+
+        # 存在しないキーは終了コード2、--random は索引のキーだけを引く
+        code, _ = lookup(binary, catalog, ["5:1", "5:999"], check=False)
+        if code != 2:
+            raise SystemExit("lookup of a missing key returned %d instead of 2" % code)
+        code, log = run([binary, "lookup", "--catalog=" + catalog, "--random=1000"])
+        if "Resolved 1000/1000 keys" not in log or "%d frames in catalog" % FRAMES not in log:
+            sys.stdout.write(log)
+            raise SystemExit("unexpected --random summary")
+
+        # serve：ブロックをまたぐフレームを get（データが続く）と map（fd が付く）で取り出す
+        path = os.path.join(work, "frames.sock")
+        with background([binary, "serve", "--socket=" + path, "--output=" + output, "--cache-mb=16"]):
+            wait_for(lambda: listening(path), "the frame server")
+            client = FrameClient(path)
+            try:
+                data = frames[spanning]
+                reply = client.request("get %d %d" % spanning)
+                if reply.get("data") != data or int(reply["crc32c"], 16) != crc32c(data):
+                    raise SystemExit("get %d %d returned different data: %s" % (spanning + (reply.get("error"),)))
+
+                reply = client.request("map %d %d" % spanning)
+                if "offset" in reply:
+                    if not client.fds:
+                        raise SystemExit("map reply carries no file descriptor")
+                    fd = client.fds.pop()
+                    try:
+                        with mmap.mmap(fd, 0, prot=mmap.PROT_READ) as view:
+                            mapped = view[reply["offset"]:reply["offset"] + reply["size"]]
+                    finally:
+                        os.close(fd)
+                else:
+                    mapped = reply.get("data")
+                if mapped != data:
+                    raise SystemExit("map %d %d returned different data" % spanning)
+
+                if "error" not in client.request("get 5 999"):
+                    raise SystemExit("get of a missing frame did not return an error")
+                stats = client.request("stats")
+                if stats.get("requests", 0) < 3 or stats.get("assembled", 0) < 1:
+                    raise SystemExit("unexpected stats: %s" % stats)
+            finally:
+                client.close()
+
+        print("ok: %d frames resolved from the catalog; frame %d:%d across a block boundary served by get and map" %
+              ((len(frames),) + spanning))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
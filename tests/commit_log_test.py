@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+# 書き込み完了イベント（--commit-log）と制御ソケットの購読のテスト
+# バッチで2つのイベントを記録したあと監視モードを起動し、subscribe commits SEQ で再送と新しいイベントが
+# 抜けも重複もなく続くこと、ack した名前の @NAME から再開できることを確かめる。
+# 続けて書きかけの最終行を足して再起動し、その行が切り捨てられて seq が続くことを確かめる。
+# 使い方: commit_log_test.py path/to/SnappyMaker
+import json
+import os
+import socket
+import sys
+
+from common import (PATTERN, background, batch, binary_from_argv, listening, random_frames, wait_for, work_dir,
+                    write_files)
+
+SET_SIZE = 4
+FRAME_SIZE = 100 * 1000
+
+
+class ControlClient:
+    def __init__(self, path):
+        self.socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.socket.settimeout(30)
+        self.socket.connect(path)
+        self.buffer = b""
+
+    def close(self):
+        self.socket.close()
+
+    def send(self, line):
+        self.socket.sendall(line.encode() + b"\n")
+
+    def read(self):
+        """次の1行を JSON として返す"""
+        while b"\n" not in self.buffer:
+            data = self.socket.recv(65536)
+            if not data:
+                raise SystemExit("control socket closed the connection")
+            self.buffer += data
+        line, self.buffer = self.buffer.split(b"\n", 1)
+        return json.loads(line)
+
+    def subscribe(self, start, events):
+        """subscribe commits START を送り、続く events 個のイベントの seq を返す"""
+        self.send("subscribe commits " + start)
+        reply = self.read()
+        if reply != {"subscribed": "commits"}:
+            raise SystemExit("subscribe commits %s: unexpected reply %s" % (start, reply))
+        return [self.read()["seq"] for _ in range(events)]
+
+
+def log_seqs(path):
+    with open(path, "rb") as f:
+        return [json.loads(line)["seq"] for line in f.read().splitlines()]
+
+
+def main():
+    binary = binary_from_argv("commit_log_test.py")
+    with work_dir("commit_log_test_") as work:
+        watch = os.path.join(work, "watch")
+        output = os.path.join(work, "output")
+        log = os.path.join(output, ".snappy_commits.ndjson")
+        control = os.path.join(work, "control.sock")
+        write_files(watch, random_frames(1, 2 * SET_SIZE, FRAME_SIZE))
+        batch(binary, watch, output, SET_SIZE, "--commit-log")
+        if log_seqs(log) != [1, 2]:
+            raise SystemExit("batch wrote unexpected commit events: %s" % log_seqs(log))
+
+        monitor = [binary, "--watch=" + watch, "--output=" + output, "--pattern=" + PATTERN,
+                   "--set-size=%d" % SET_SIZE, "--commit-log", "--control-socket=" + control]
+        with background(monitor):
+            wait_for(lambda: listening(control), "the control socket")
+            client = ControlClient(control)
+            try:
+                # 再送（seq 2）のあとに新しいイベント（seq 3）が続く
+                if client.subscribe("1", 1) != [2]:
+                    raise SystemExit("subscribe commits 1 did not replay seq 2")
+                write_files(watch, random_frames(1, SET_SIZE, FRAME_SIZE, first=2 * SET_SIZE + 1))
+                if client.read()["seq"] != 3:
+                    raise SystemExit("new commit was not delivered as seq 3")
+
+                client.send("ack viewer 2")
+                if client.read() != {"ack": "viewer", "seq": 2}:
+                    raise SystemExit("ack was not confirmed")
+                client.send("subscribe commits x")
+                client.read()
+                if client.read() != {"error": "expected SEQ or @NAME"}:
+                    raise SystemExit("invalid start was not rejected")
+                # 話題名と誤りはJSON文字列としてエスケープされる
+                client.send('subscribe a"b')
+                if client.read() != {"subscribed": 'a"b'}:
+                    raise SystemExit("topic was not escaped")
+            finally:
+                client.close()
+
+            resumed = ControlClient(control)
+            try:
+                if resumed.subscribe("@viewer", 1) != [3]:
+                    raise SystemExit("subscribe commits @viewer did not resume after seq 2")
+            finally:
+                resumed.close()
+
+        # 落ちたときの書きかけの行は、次の起動で切り捨てられる
+        with open(log, "ab") as f:
+            f.write(b'{"seq":4,"event":"comm')
+        with background(monitor):
+            wait_for(lambda: listening(control), "the control socket after restart")
+            if log_seqs(log) != [1, 2, 3]:
+                raise SystemExit("torn last line was not truncated: %s" % log_seqs(log))
+            client = ControlClient(control)
+            try:
+                if client.subscribe("@viewer", 1) != [3]:
+                    raise SystemExit("cursor for viewer was not kept across the restart")
+                write_files(watch, random_frames(1, SET_SIZE, FRAME_SIZE, first=3 * SET_SIZE + 1))
+                if client.read()["seq"] != 4:
+                    raise SystemExit("seq did not continue after the truncated line")
+                if client.subscribe("@unknown", 4) != [1, 2, 3, 4]:
+                    raise SystemExit("unknown cursor did not start from the beginning")
+            finally:
+                client.close()
+        if log_seqs(log) != [1, 2, 3, 4]:
+            raise SystemExit("unexpected commit log after restart: %s" % log_seqs(log))
+
+        print("ok: 4 commit events replayed and delivered live; cursor resumed and torn line truncated on restart")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
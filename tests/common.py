@@ -0,0 +1,118 @@
+# テストの共通部分（標準ライブラリのみ）
+# 各テストは "python3 tests/NAME_test.py path/to/SnappyMaker" で実行し、問題があれば SystemExit で終わる
+import contextlib
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+PATTERN = "test_##_#####.tif"
+
+
+def binary_from_argv(test_name):
+    """コマンドラインの SnappyMaker のパス（なければ使い方を出して終わる）"""
+    if len(sys.argv) != 2:
+        raise SystemExit("usage: %s SnappyMaker" % test_name)
+    return os.path.abspath(sys.argv[1])
+
+
+@contextlib.contextmanager
+def work_dir(prefix):
+    """テストごとの一時ディレクトリ（終わったら消す）"""
+    path = tempfile.mkdtemp(prefix=prefix)
+    try:
+        yield path
+    finally:
+        shutil.rmtree(path, ignore_errors=True)
+
+
+def run(args, check=True, timeout=120):
+    """コマンドを実行して (終了コード, 出力) を返す。check なら失敗したときに出力を表示して終わる"""
+    result = subprocess.run(args, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                            timeout=timeout)
+    output = result.stdout.decode(errors="replace")
+    if check and result.returncode != 0:
+        sys.stdout.write(output)
+        raise SystemExit("%s %s failed with exit code %d" % (os.path.basename(args[0]), args[1], result.returncode))
+    return result.returncode, output
+
+
+@contextlib.contextmanager
+def background(args, **options):
+    """常駐するプロセス（受信デーモンなど）を起動し、抜けるときに止める"""
+    for stream in ("stdin", "stdout", "stderr"):
+        options.setdefault(stream, subprocess.DEVNULL)
+    process = subprocess.Popen(args, **options)
+    try:
+        yield process
+    finally:
+        process.terminate()
+        process.wait()
+
+
+def wait_for(condition, what, timeout=10):
+    """condition() が真になるまで待つ（時間切れなら what を出して終わる）"""
+    deadline = time.monotonic() + timeout
+    while not condition():
+        if time.monotonic() > deadline:
+            raise SystemExit("timed out waiting for %s" % what)
+        time.sleep(0.05)
+
+
+def listening(path):
+    """UNIX ソケット path が接続を受け付けているか"""
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        return s.connect_ex(path) == 0
+
+
+def random_frames(run_number, count, size, first=1):
+    """乱数のフレーム（名前 -> 内容）"""
+    return {"test_%02d_%05d.tif" % (run_number, i): os.urandom(size) for i in range(first, first + count)}
+
+
+def write_files(directory, files):
+    """files（directory からの相対パス -> 内容）を書き出す"""
+    for name, data in files.items():
+        path = os.path.join(directory, name)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, "wb") as f:
+            f.write(data)
+
+
+def batch(binary, watch, output, set_size, *options):
+    """バッチモードで watch を圧縮する（出力を返す）"""
+    return run([binary, "batch", "--watch=" + watch, "--output=" + output, "--pattern=" + PATTERN,
+                "--set-size=%d" % set_size] + list(options))[1]
+
+
+def extract(binary, archives, destination):
+    run([binary, "extract"] + list(archives) + ["--to=" + destination])
+
+
+def check_files(directory, files, what="after extraction"):
+    """directory の下に files（相対パス -> 内容）がそのまま揃っているか確かめる"""
+    for name, data in files.items():
+        path = os.path.join(directory, name)
+        if not os.path.exists(path):
+            raise SystemExit("%s missing %s" % (name, what))
+        with open(path, "rb") as f:
+            if f.read() != data:
+                raise SystemExit("%s different %s" % (name, what))
+
+
+_CRC32C_TABLE = []
+for _n in range(256):
+    _c = _n
+    for _ in range(8):
+        _c = (_c >> 1) ^ 0x82F63B78 if _c & 1 else _c >> 1
+    _CRC32C_TABLE.append(_c)
+
+
+def crc32c(data):
+    crc = 0xFFFFFFFF
+    for b in data:
+        crc = _CRC32C_TABLE[(crc ^ b) & 0xFF] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+# コンテナ形式のラウンドトリップテスト
+# ブロックをまたぐ大きさのフレームをバッチで圧縮し、ヘッダーとトレーラー、マニフェストのCRC32C、
+# 展開した内容を元データと比べる。続けてブロックを1バイト壊し、展開が失敗して何も書かないことを確かめる。
+# 使い方: container_test.py path/to/SnappyMaker
+import glob
+import os
+import struct
+import sys
+
+from common import batch, binary_from_argv, check_files, crc32c, extract, run, work_dir, write_files
+
+FRAMES = 8
+FRAME_SIZE = 1500 * 1000  # 4 MB のブロックをまたぐ大きさ
+SET_SIZE = 4
+
+
+def main():
+    binary = binary_from_argv("container_test.py")
+    with work_dir("container_test_") as work:
+        # 同じ内容が続く部分と乱数の部分を混ぜる（どのコーデックでも圧縮できる部分とできない部分）
+        frames = {}
+        for i in range(FRAMES):
+            data = bytes([i]) * (FRAME_SIZE // 2) + os.urandom(FRAME_SIZE - FRAME_SIZE // 2)
+            frames["test_01_%05d.tif" % (i + 1)] = data
+        watch = os.path.join(work, "watch")
+        output = os.path.join(work, "output")
+        write_files(watch, frames)
+        batch(binary, watch, output, SET_SIZE)
+
+        archives = sorted(glob.glob(os.path.join(output, "*.snappy")))
+        if len(archives) != FRAMES // SET_SIZE:
+            raise SystemExit("expected %d archives, found %d" % (FRAMES // SET_SIZE, len(archives)))
+        for path in archives:
+            with open(path, "rb") as f:
+                data = f.read()
+            if data[:4] != b"SNPK" or data[-4:] != b"SNPE":
+                raise SystemExit("%s: missing container header or trailer" % path)
+            _, block_count, _, _ = struct.unpack("<QIII", data[-24:-4])
+            if block_count < 2:
+                raise SystemExit("%s: expected the set to span several blocks, got %d" % (path, block_count))
+
+            # マニフェストの大きさとCRC32Cが元のファイルと一致する
+            listed = 0
+            for line in run([binary, "manifest", path])[1].splitlines():
+                fields = line.split("\t")
+                if len(fields) < 3 or fields[0] not in frames:
+                    continue
+                original = frames[fields[0]]
+                if int(fields[1]) != len(original) or int(fields[2], 16) != crc32c(original):
+                    raise SystemExit("%s: manifest entry for %s does not match the original" % (path, fields[0]))
+                listed += 1
+            if listed != SET_SIZE:
+                raise SystemExit("%s: manifest lists %d of %d members" % (path, listed, SET_SIZE))
+
+        extracted = os.path.join(work, "extracted")
+        extract(binary, archives, extracted)
+        check_files(extracted, frames)
+
+        # 最初のブロックの中を壊すと、ブロックのCRCで検出されて何も展開されない
+        corrupt = os.path.join(work, "corrupt.snappy")
+        with open(archives[0], "rb") as f:
+            data = bytearray(f.read())
+        data[16 + 1000] ^= 0xFF
+        with open(corrupt, "wb") as f:
+            f.write(data)
+        rejected = os.path.join(work, "rejected")
+        if run([binary, "extract", corrupt, "--to=" + rejected], check=False)[0] == 0:
+            raise SystemExit("extract accepted a corrupted block")
+        if os.path.exists(rejected) and os.listdir(rejected):
+            raise SystemExit("extract wrote files from a corrupted archive")
+
+        print("ok: %d frames round-tripped through %d archive(s); corrupted block rejected" % (len(frames), len(archives)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
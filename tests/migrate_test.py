@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+# 旧形式アーカイブの移行（migrate）のラウンドトリップテスト
+# TAR全体を1つのsnappyバッファにした旧形式のアーカイブを作り、移行したアーカイブを展開して元データと比べる。
+# 圧縮データは全種類のタグ（短い・長いリテラル、1・2・4バイトのオフセットのコピー、重なりのあるコピー）を使い、
+# ストリーミング展開の窓（1 MB）を折り返す大きさにする。
+# 壊れたアーカイブは移行に失敗し、元のファイルがそのまま残ることも確かめる。
+# 使い方: migrate_test.py path/to/SnappyMaker
+import glob
+import io
+import os
+import random
+import sys
+import tarfile
+
+from common import binary_from_argv, check_files, extract, run, work_dir
+
+WINDOW = 1 << 20  # 展開側の窓の大きさ（これより遠いコピーは旧形式の圧縮器が作らない）
+
+
+def varint(n):
+    out = bytearray()
+    while True:
+        byte = n & 0x7F
+        n >>= 7
+        if not n:
+            out.append(byte)
+            return bytes(out)
+        out.append(byte | 0x80)
+
+
+def literal(data):
+    out = bytearray()
+    n = len(data) - 1
+    if n < 60:
+        out.append(n << 2)
+    else:
+        size = (n.bit_length() + 7) // 8
+        out.append((59 + size) << 2)
+        out += n.to_bytes(size, "little")
+    return bytes(out) + data
+
+
+def copy(offset, length):
+    if 4 <= length <= 11 and offset < 2048:
+        return bytes([1 | (length - 4) << 2 | (offset >> 8) << 5, offset & 0xFF])
+    if offset < 65536:
+        return bytes([2 | (length - 1) << 2]) + offset.to_bytes(2, "little")
+    return bytes([3 | (length - 1) << 2]) + offset.to_bytes(4, "little")
+
+
+def snappy_compress(data):
+    """貪欲に一致を探す簡単な圧縮器（速さより、デコーダーの全経路を通すことが目的）"""
+    out = bytearray(varint(len(data)))
+    last = {}
+    pos = 0
+    pending = 0  # まだ出していないリテラルの先頭
+    while pos + 4 <= len(data):
+        key = data[pos:pos + 4]
+        candidate = last.get(key)
+        last[key] = pos
+        if candidate is None or pos - candidate > WINDOW:
+            pos += 1
+            continue
+        if pending < pos:
+            out += literal(data[pending:pos])
+        offset = pos - candidate
+        length = 4
+        while pos + length < len(data) and data[candidate + length] == data[pos + length]:
+            length += 1
+        while length > 0:
+            chunk = min(length, 64)
+            if length - chunk in (1, 2, 3) and chunk > 4:
+                chunk = length - 4  # 最後の断片も4バイト以上にする
+            out += copy(offset, chunk)
+            pos += chunk
+            length -= chunk
+        pending = pos
+    if pending < len(data):
+        out += literal(data[pending:])
+    return bytes(out)
+
+
+def frame(rnd, index, history):
+    parts = [bytes(rnd.getrandbits(8) for _ in range(40000 + index * 1000))]
+    parts.append(bytes([index]) * 3000)  # 重なりのあるコピー（offset 1）
+    parts.append(b"gap!" * 500)  # 短い間隔の繰り返し
+    if history:
+        # 前のフレームの一部を繰り返す（遠いものは4バイトのオフセットになる）
+        source = history[rnd.randrange(len(history))]
+        start = rnd.randrange(len(source) - 5000)
+        parts.append(source[start:start + 5000])
+    parts.append(os.urandom(150000))
+    return b"".join(parts)
+
+
+def legacy_archive(path, frames):
+    buffer = io.BytesIO()
+    with tarfile.open(fileobj=buffer, mode="w", format=tarfile.USTAR_FORMAT) as tar:
+        for name, data in frames.items():
+            info = tarfile.TarInfo(name)
+            info.size = len(data)
+            tar.addfile(info, io.BytesIO(data))
+    with open(path, "wb") as f:
+        f.write(snappy_compress(buffer.getvalue()))
+
+
+def main():
+    binary = binary_from_argv("migrate_test.py")
+    with work_dir("migrate_test_") as work:
+        rnd = random.Random(94)
+        frames = {}
+        for i in range(8):
+            frames["test_03_%05d.tif" % (i + 1)] = frame(rnd, i, list(frames.values()))
+        archives = os.path.join(work, "archive")
+        os.makedirs(archives)
+        legacy = os.path.join(archives, "test_03_00001.snappy")
+        legacy_archive(legacy, frames)
+        if sum(len(data) for data in frames.values()) <= WINDOW:
+            raise SystemExit("test data does not wrap the streaming window")
+
+        # 途中で切れたアーカイブ（移行に失敗し、元のファイルは残る）
+        broken = os.path.join(archives, "sub", "test_04_00001.snappy")
+        os.makedirs(os.path.dirname(broken))
+        legacy_archive(broken, {"test_04_00001.tif": os.urandom(100000)})
+        with open(broken, "rb") as f:
+            broken_data = f.read()[:-1000]
+        with open(broken, "wb") as f:
+            f.write(broken_data)
+
+        code, log = run([binary, "migrate", "--output=" + archives, "--threads=2"], check=False, timeout=300)
+        if code == 0:
+            sys.stdout.write(log)
+            raise SystemExit("migrate reported success for a truncated archive")
+        if "Converted: 1" not in log or "failed: 1" not in log:
+            sys.stdout.write(log)
+            raise SystemExit("unexpected migration summary")
+        if open(broken, "rb").read() != broken_data:
+            raise SystemExit("the truncated archive was modified")
+        if glob.glob(os.path.join(archives, "**", "*.migrate.tmp"), recursive=True):
+            raise SystemExit("temporary files left behind")
+
+        with open(legacy, "rb") as f:
+            if f.read(4) != b"SNPK":
+                raise SystemExit("archive was not rewritten into the container format")
+        extracted = os.path.join(work, "extracted")
+        extract(binary, [legacy], extracted)
+        check_files(extracted, frames, "after migration")
+        text = run([binary, "manifest", legacy])[1]
+        if sum(name in text for name in frames) != len(frames):
+            sys.stdout.write(text)
+            raise SystemExit("migrated archive has no complete manifest")
+
+        print("ok: %d frames round-tripped through a migrated archive; truncated archive kept" % len(frames))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
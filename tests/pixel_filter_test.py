@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+# 画素フィルター（--pixel-filter）と静的マスク（--mask）のラウンドトリップテスト
+# ギャップと死んだ画素のある検出器らしいTIFFを16ビットと32ビットで作り、left+shuffle とマスクをかけて圧縮する。
+# 最初のセットで学習したマスクが次のセットで使われ、展開したファイルが元と同じになることを確かめる。
+# 続けて再帰監視で、同じラン番号でもサブディレクトリごとに別のマスクを学習することを確かめる。
+# 使い方: pixel_filter_test.py path/to/SnappyMaker
+import glob
+import math
+import os
+import random
+import struct
+import sys
+
+from common import batch, binary_from_argv, check_files, extract, run, work_dir, write_files
+
+WIDTH = 128
+FRAMES = 8
+SET_SIZE = 4
+ALTERED_FRAME = 7  # ギャップの画素を1つ変えたフレーム（マスクが成り立たないのでそのまま入る）
+
+
+def frame_pixels(bits, seed, gap_period):
+    rnd = random.Random(seed)
+    top = (1 << bits) - 1
+    pixels = []
+    for y in range(WIDTH):
+        for x in range(WIDTH):
+            if y % gap_period >= gap_period - 4 or x % gap_period >= gap_period - 2:
+                pixels.append(top)  # モジュール間のギャップ（全ビット1）
+            elif (x * 7 + y * 13) % 997 == 0:
+                pixels.append(top - 1)  # 死んだ画素
+            else:
+                lam = 40 + 300 * math.exp(-math.hypot(x - WIDTH / 2, y - WIDTH / 2) / (WIDTH / 3))
+                pixels.append(max(0, int(rnd.gauss(lam, math.sqrt(lam)))))
+    return pixels
+
+
+def tiff(bits, pixels):
+    data = struct.pack("<%d%s" % (len(pixels), "H" if bits == 16 else "I"), *pixels)
+    entries = [(256, 4, 1, WIDTH), (257, 4, 1, WIDTH), (258, 3, 1, bits), (259, 3, 1, 1), (262, 3, 1, 1),
+               (273, 4, 1, 8), (277, 3, 1, 1), (278, 4, 1, WIDTH), (279, 4, 1, len(data))]
+    out = b"II*\x00" + struct.pack("<I", 8 + len(data)) + data + struct.pack("<H", len(entries))
+    for tag, type, count, value in entries:
+        out += struct.pack("<HHI", tag, type, count)
+        out += struct.pack("<HH", value, 0) if type == 3 else struct.pack("<I", value)
+    return out + struct.pack("<I", 0)
+
+
+def run_frames(subdir, run_number, bits, gap_period):
+    """1ラン分のフレーム（watch からの相対パス -> 内容）"""
+    frames = {}
+    for i in range(1, FRAMES + 1):
+        pixels = frame_pixels(bits, run_number * 100 + i, gap_period)
+        if i == ALTERED_FRAME:
+            pixels[(WIDTH - 1) * WIDTH] = 7
+        frames[os.path.join(subdir, "test_%02d_%05d.tif" % (run_number, i))] = tiff(bits, pixels)
+    return frames
+
+
+def compress_and_check(binary, work, frames, extra_args):
+    watch = os.path.join(work, "watch")
+    output = os.path.join(work, "output")
+    write_files(watch, frames)
+    batch(binary, watch, output, SET_SIZE, "--pixel-filter=left+shuffle", "--mask", *extra_args)
+
+    archives = sorted(glob.glob(os.path.join(output, "**", "*.snappy"), recursive=True))
+    extracted = os.path.join(work, "extracted")
+    for path in archives:
+        scope = os.path.relpath(os.path.dirname(path), output)
+        extract(binary, [path], os.path.join(extracted, scope))
+    check_files(extracted, frames)
+
+    # 2番目のセットは学習したマスクで小さくなる（変えたフレームだけは元の大きさのまま）
+    stripped = 0
+    for path in archives:
+        if not path.endswith("_%05d.snappy" % (SET_SIZE + 1)):
+            continue
+        for line in run([binary, "manifest", path])[1].splitlines():
+            fields = line.split("\t")
+            if len(fields) != 7 or line.startswith("#"):
+                continue
+            frame = int(fields[0][-9:-4])
+            smaller = int(fields[6]) < int(fields[1])
+            if smaller != (frame != ALTERED_FRAME):
+                raise SystemExit("%s: unexpected stored size for %s" % (path, fields[0]))
+            stripped += smaller
+    return output, len(archives), stripped
+
+
+def main():
+    binary = binary_from_argv("pixel_filter_test.py")
+    with work_dir("pixel_filter_test_") as work:
+        # ラン1は16ビット、ラン2は32ビット
+        flat = os.path.join(work, "flat")
+        frames = run_frames("", 1, 16, 64)
+        frames.update(run_frames("", 2, 32, 64))
+        output, archives, stripped = compress_and_check(binary, flat, frames, [])
+        for mask in ("run_01.mask", "run_02.mask"):
+            if not os.path.exists(os.path.join(output, "masks", mask)):
+                raise SystemExit("learned mask %s was not saved" % mask)
+
+        # 再帰監視：ギャップの位置が違う2台の検出器が同じラン番号で書く
+        nested = os.path.join(work, "nested")
+        scoped = run_frames("a", 1, 16, 64)
+        scoped.update(run_frames("b", 1, 16, 32))
+        output, scoped_archives, scoped_stripped = compress_and_check(binary, nested, scoped, ["--recursive"])
+        masks = [open(os.path.join(output, "masks", scope, "run_01.mask"), "rb").read() for scope in ("a", "b")]
+        if masks[0] == masks[1]:
+            raise SystemExit("subdirectories with different gaps share one mask")
+
+        print("ok: %d frames round-tripped through %d archive(s), %d masked; %d scoped frames, %d masked" %
+              (len(frames), archives, stripped, len(scoped), scoped_stripped))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
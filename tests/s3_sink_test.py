@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+# --sink=s3 の往復テスト
+# s3_stand_in.py を起動してバッチを流し、アップロードされたアーカイブを展開して元データと比べる。
+# 続けて同じフレームでもう一度流し、既存アーカイブがHEADで見つかって再送されないことを確かめる。
+# 使い方: s3_sink_test.py path/to/SnappyMaker
+import glob
+import json
+import os
+import sys
+import urllib.request
+
+from common import (background, batch, binary_from_argv, check_files, extract, random_frames, wait_for, work_dir,
+                    write_files)
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+FRAMES = 16          # 12枚の完全なセット（マルチパート）と4枚の端数セット
+FRAME_SIZE = 512 * 1024
+SET_SIZE = 12
+
+
+def run_batch(binary, port, watch, output):
+    batch(binary, watch, output, SET_SIZE,
+          "--sink=s3", "--s3-endpoint=127.0.0.1:%d" % port, "--s3-bucket=archive",
+          "--s3-prefix=beamtime/", "--s3-part-size=5",
+          "--s3-access-key=test", "--s3-secret-key=testsecret")
+
+
+def stats(port):
+    with urllib.request.urlopen("http://127.0.0.1:%d/__stats__" % port) as response:
+        return json.loads(response.read())
+
+
+def main():
+    binary = binary_from_argv("s3_sink_test.py")
+    with work_dir("s3_sink_test_") as work:
+        store = os.path.join(work, "store")
+        port_file = os.path.join(work, "port")
+        with background([sys.executable, os.path.join(HERE, "s3_stand_in.py"),
+                         "--root=" + store, "--port-file=" + port_file]):
+            wait_for(lambda: os.path.exists(port_file), "the S3 stand-in")
+            with open(port_file) as f:
+                port = int(f.read())
+
+            frames = random_frames(1, FRAMES, FRAME_SIZE)
+            watch = os.path.join(work, "watch")
+            output = os.path.join(work, "output")
+
+            write_files(watch, frames)
+            run_batch(binary, port, watch, output)
+            first = stats(port)
+            if first.get("denied"):
+                raise SystemExit("stand-in rejected %d signatures" % first["denied"])
+            if not first.get("POST"):
+                raise SystemExit("no multipart upload was made: %s" % first)
+
+            archives = glob.glob(os.path.join(store, "archive", "beamtime", "**", "*.snappy"), recursive=True)
+            if not archives:
+                raise SystemExit("no archive was uploaded")
+            extracted = os.path.join(work, "extracted")
+            extract(binary, archives, extracted)
+            check_files(extracted, frames)
+
+            # 同じフレームをもう一度置く（処理済みのソースは削除されている）
+            write_files(watch, frames)
+            run_batch(binary, port, watch, output)
+            second = stats(port)
+            for method in ("PUT", "POST"):
+                if second.get(method, 0) != first.get(method, 0):
+                    raise SystemExit("rerun uploaded again: before %s, after %s" % (first, second))
+            if second.get("HEAD", 0) <= first.get("HEAD", 0):
+                raise SystemExit("rerun did not ask the store for existing archives: %s" % second)
+
+        print("ok: %d frames round-tripped through %d archive(s); rerun made %d HEAD request(s) and no uploads"
+              % (len(frames), len(archives), second.get("HEAD", 0) - first.get("HEAD", 0)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+# テスト用のS3互換サーバー（標準ライブラリのみ）
+# パススタイルのPUT/GET/HEAD/DELETEとマルチパートアップロードに対応し、
+# AWS Signature Version 4 の署名を検証する。オブジェクトは --root 以下にファイルとして置く。
+# GET /__stats__ でメソッドごとのリクエスト数を返す。
+import argparse
+import hashlib
+import hmac
+import json
+import os
+import sys
+import threading
+import uuid
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import unquote
+
+
+def sign(key, msg):
+    return hmac.new(key, msg.encode(), hashlib.sha256).digest()
+
+
+class Store:
+    def __init__(self, root, access_key, secret_key, region):
+        self.root = root
+        self.access_key = access_key
+        self.secret_key = secret_key
+        self.region = region
+        self.lock = threading.Lock()
+        self.uploads = {}  # uploadId -> {partNumber: bytes}
+        self.stats = {}
+
+    def count(self, name):
+        with self.lock:
+            self.stats[name] = self.stats.get(name, 0) + 1
+
+    def path_for(self, bucket, key):
+        return os.path.join(self.root, bucket, key)
+
+
+class Handler(BaseHTTPRequestHandler):
+    store = None
+
+    def log_message(self, format, *args):
+        pass
+
+    def reply(self, status, body=b"", headers=None):
+        self.send_response(status)
+        for name, value in (headers or {}).items():
+            self.send_header(name, value)
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("Connection", "close")
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(body)
+
+    def error(self, status, code):
+        self.reply(status, ("<Error><Code>%s</Code></Error>" % code).encode())
+
+    def verify(self, raw_path, raw_query, body):
+        store = self.store
+        auth = self.headers.get("Authorization", "")
+        if not auth.startswith("AWS4-HMAC-SHA256 "):
+            return False
+        fields = dict(part.strip().split("=", 1) for part in auth[len("AWS4-HMAC-SHA256 "):].split(","))
+        credential = fields.get("Credential", "").split("/")
+        if len(credential) != 5 or credential[0] != store.access_key:
+            return False
+        date, region = credential[1], credential[2]
+        signed = fields.get("SignedHeaders", "").split(";")
+        payload_hash = self.headers.get("x-amz-content-sha256", "")
+        if payload_hash != hashlib.sha256(body).hexdigest():
+            return False
+        canonical_headers = "".join("%s:%s\n" % (name, self.headers.get(name, "").strip()) for name in signed)
+        canonical = "\n".join([self.command, raw_path, raw_query, canonical_headers,
+                               ";".join(signed), payload_hash])
+        scope = "/".join(credential[1:])
+        to_sign = "\n".join(["AWS4-HMAC-SHA256", self.headers.get("x-amz-date", ""), scope,
+                             hashlib.sha256(canonical.encode()).hexdigest()])
+        key = sign(sign(sign(sign(("AWS4" + store.secret_key).encode(), date), region), "s3"), "aws4_request")
+        expected = hmac.new(key, to_sign.encode(), hashlib.sha256).hexdigest()
+        return hmac.compare_digest(expected, fields.get("Signature", ""))
+
+    def handle_any(self):
+        store = self.store
+        raw_path, _, raw_query = self.path.partition("?")
+        if self.command == "GET" and raw_path == "/__stats__":
+            with store.lock:
+                return self.reply(200, json.dumps(store.stats).encode())
+        length = int(self.headers.get("Content-Length", "0"))
+        body = self.rfile.read(length) if length else b""
+        if not self.verify(raw_path, raw_query, body):
+            store.count("denied")
+            return self.error(403, "SignatureDoesNotMatch")
+        store.count(self.command)
+
+        bucket, _, key = unquote(raw_path).lstrip("/").partition("/")
+        query = dict(item.partition("=")[::2] for item in raw_query.split("&") if item)
+        query = {unquote(k): unquote(v) for k, v in query.items()}
+        path = store.path_for(bucket, key)
+
+        if self.command == "POST" and "uploads" in query:
+            upload_id = uuid.uuid4().hex
+            with store.lock:
+                store.uploads[upload_id] = {}
+            return self.reply(200, ("<InitiateMultipartUploadResult><UploadId>%s</UploadId>"
+                                    "</InitiateMultipartUploadResult>" % upload_id).encode())
+        if self.command == "PUT" and "uploadId" in query:
+            with store.lock:
+                parts = store.uploads.get(query["uploadId"])
+                if parts is None:
+                    return self.error(404, "NoSuchUpload")
+                parts[int(query["partNumber"])] = body
+            return self.reply(200, headers={"ETag": '"%s"' % hashlib.md5(body).hexdigest()})
+        if self.command == "POST" and "uploadId" in query:
+            with store.lock:
+                parts = store.uploads.pop(query["uploadId"], None)
+            if parts is None:
+                return self.error(404, "NoSuchUpload")
+            for number, data in parts.items():
+                if number != max(parts) and len(data) < 5 * 1024 * 1024:
+                    return self.error(400, "EntityTooSmall")
+            return self.write(path, b"".join(parts[n] for n in sorted(parts)),
+                              b"<CompleteMultipartUploadResult/>")
+        if self.command == "DELETE" and "uploadId" in query:
+            with store.lock:
+                store.uploads.pop(query["uploadId"], None)
+            return self.reply(204)
+        if self.command == "PUT":
+            return self.write(path, body, b"")
+        if self.command in ("GET", "HEAD"):
+            if not os.path.isfile(path):
+                return self.error(404, "NoSuchKey")
+            with open(path, "rb") as f:
+                data = f.read()
+            self.send_response(200)
+            self.send_header("Content-Length", str(len(data)))
+            self.send_header("Connection", "close")
+            self.end_headers()
+            if self.command == "GET":
+                self.wfile.write(data)
+            return
+        if self.command == "DELETE":
+            if os.path.isfile(path):
+                os.remove(path)
+            return self.reply(204)
+        return self.error(405, "MethodNotAllowed")
+
+    def write(self, path, data, body):
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path + ".tmp", "wb") as f:
+            f.write(data)
+        os.replace(path + ".tmp", path)
+        return self.reply(200, body, {"ETag": '"%s"' % hashlib.md5(data).hexdigest()})
+
+    do_GET = do_PUT = do_POST = do_HEAD = do_DELETE = handle_any
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--root", required=True)
+    parser.add_argument("--port", type=int, default=0)
+    parser.add_argument("--port-file", help="write the bound port here once listening")
+    parser.add_argument("--access-key", default="test")
+    parser.add_argument("--secret-key", default="testsecret")
+    parser.add_argument("--region", default="us-east-1")
+    args = parser.parse_args()
+
+    Handler.store = Store(args.root, args.access_key, args.secret_key, args.region)
+    server = ThreadingHTTPServer(("127.0.0.1", args.port), Handler)
+    if args.port_file:
+        with open(args.port_file + ".tmp", "w") as f:
+            f.write(str(server.server_address[1]))
+        os.replace(args.port_file + ".tmp", args.port_file)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+# --sink=tcp と receive モードのループバックテスト
+# 受信デーモンを起動してバッチを流し、受信したアーカイブを展開して元データと比べる。
+# 続けて同じアーカイブIDを二度OPENしたときにNACKされ、書きかけが残らないことを確かめる。
+# 同じセットの一部を置き直して再実行すると、受信側に問い合わせて処理済みとして飛ばし、アーカイブは置き換わらないこと、
+# 既にあるアーカイブへのOPENがNACKされることを確かめる。
+# 最後にファイルサイズの上限（RLIMIT_FSIZE）を超えるアーカイブを送り、NACKされてデーモンが動き続けることを確かめる。
+# 使い方: tcp_sink_test.py path/to/SnappyMaker
+import glob
+import os
+import resource
+import signal
+import socket
+import struct
+import sys
+
+from common import (background, batch, binary_from_argv, check_files, extract, random_frames, wait_for, work_dir,
+                    write_files)
+
+FRAMES = 8
+FRAME_SIZE = 256 * 1024
+SET_SIZE = 4
+
+GREETING = b"SNPKSTR1"
+FRAME_OPEN, FRAME_DATA, FRAME_COMMIT, FRAME_ABORT, FRAME_ACK, FRAME_NACK, FRAME_QUERY = 1, 2, 3, 4, 5, 6, 7
+FILE_SIZE_LIMIT = 2 << 20  # 受信デーモンが書けるファイルの大きさ（1セットのアーカイブより大きい）
+
+
+def limit_file_size():
+    # 上限を超えた書き込みをシグナルで落とさずに EFBIG で失敗させる
+    signal.signal(signal.SIGXFSZ, signal.SIG_IGN)
+    resource.setrlimit(resource.RLIMIT_FSIZE, (FILE_SIZE_LIMIT, FILE_SIZE_LIMIT))
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def accepting(port):
+    try:
+        socket.create_connection(("127.0.0.1", port), timeout=1).close()
+        return True
+    except OSError:
+        return False
+
+
+def send_frame(s, type, archive_id, payload=b""):
+    s.sendall(struct.pack("<B3xIQ", type, archive_id, len(payload)) + payload)
+
+
+def recv_frame(s):
+    header = b""
+    while len(header) < 16:
+        chunk = s.recv(16 - len(header))
+        if not chunk:
+            raise SystemExit("receiver closed the connection")
+        header += chunk
+    type, archive_id, length = struct.unpack("<B3xIQ", header)
+    payload = b""
+    while len(payload) < length:
+        payload += s.recv(length - len(payload))
+    return type, archive_id, payload
+
+
+def request(port, frames):
+    """1つの接続でフレームを送り、最後の応答を返す"""
+    with socket.create_connection(("127.0.0.1", port), timeout=10) as s:
+        s.sendall(GREETING)
+        for frame in frames:
+            send_frame(s, *frame)
+        return recv_frame(s)
+
+
+def main():
+    binary = binary_from_argv("tcp_sink_test.py")
+    with work_dir("tcp_sink_test_") as work:
+        port = free_port()
+        received = os.path.join(work, "received")
+        with background([binary, "receive", "--listen=%d" % port, "--output=" + received], preexec_fn=limit_file_size):
+            wait_for(lambda: accepting(port), "the receiver")
+
+            frames = random_frames(1, FRAMES, FRAME_SIZE)
+            watch = os.path.join(work, "watch")
+            write_files(watch, frames)
+            batch(binary, watch, os.path.join(work, "output"), SET_SIZE,
+                  "--sink=tcp", "--tcp-endpoint=127.0.0.1:%d" % port)
+
+            archives = glob.glob(os.path.join(received, "**", "*.snappy"), recursive=True)
+            if len(archives) != FRAMES // SET_SIZE:
+                raise SystemExit("expected %d archives, received %d" % (FRAMES // SET_SIZE, len(archives)))
+            extracted = os.path.join(work, "extracted")
+            extract(binary, archives, extracted)
+            check_files(extracted, frames)
+
+            # 同じIDを二度開くと、書きかけを破棄してNACKを返す
+            with socket.create_connection(("127.0.0.1", port), timeout=10) as s:
+                s.sendall(GREETING)
+                send_frame(s, FRAME_OPEN, 7, b"dup/first.snappy")
+                send_frame(s, FRAME_DATA, 7, b"partial")
+                send_frame(s, FRAME_OPEN, 7, b"dup/second.snappy")
+                type, archive_id, message = recv_frame(s)
+                if type != FRAME_NACK or archive_id != 7:
+                    raise SystemExit("duplicate OPEN was not rejected (frame type %d)" % type)
+                send_frame(s, FRAME_COMMIT, 7)
+                type, archive_id, message = recv_frame(s)
+                if type != FRAME_NACK:
+                    raise SystemExit("COMMIT after a rejected OPEN was acknowledged")
+            leftovers = glob.glob(os.path.join(received, "dup", "*"))
+            if leftovers:
+                raise SystemExit("files left behind after a duplicate OPEN: %s" % ", ".join(leftovers))
+
+            # 同じセットの一部だけを置き直しても、受信側にあるアーカイブは置き換えない
+            first_archive = glob.glob(os.path.join(received, "**", "test_01_00001.snappy"), recursive=True)
+            if len(first_archive) != 1:
+                raise SystemExit("first archive was not received")
+            with open(first_archive[0], "rb") as f:
+                stored = f.read()
+            write_files(watch, {name: frames[name] for name in sorted(frames)[:SET_SIZE // 2]})
+            log = batch(binary, watch, os.path.join(work, "output"), SET_SIZE,
+                        "--sink=tcp", "--tcp-endpoint=127.0.0.1:%d" % port)
+            if "skipped 1 already processed" not in log:
+                sys.stdout.write(log)
+                raise SystemExit("rerun did not skip the set already on the receiver")
+            with open(first_archive[0], "rb") as f:
+                if f.read() != stored:
+                    raise SystemExit("rerun replaced the received archive")
+
+            relative = os.path.relpath(first_archive[0], received).encode()
+            type, _, answer = request(port, [(FRAME_QUERY, 9, relative)])
+            if type != FRAME_ACK or answer != b"1":
+                raise SystemExit("QUERY of a received archive answered %d %r" % (type, answer))
+            type, _, answer = request(port, [(FRAME_QUERY, 9, b"missing/test_09_00001.snappy")])
+            if type != FRAME_ACK or answer != b"0":
+                raise SystemExit("QUERY of a missing archive answered %d %r" % (type, answer))
+            type, archive_id, _ = request(port, [(FRAME_OPEN, 10, relative)])
+            if type != FRAME_NACK or archive_id != 10:
+                raise SystemExit("OPEN of an existing archive was not rejected (frame type %d)" % type)
+
+            # 途中で書き込みに失敗したアーカイブは COMMIT で NACK され、受信デーモンは落ちない
+            oversized = [(FRAME_OPEN, 8, b"large/a.snappy")]
+            oversized += [(FRAME_DATA, 8, os.urandom(1 << 20)) for _ in range(FILE_SIZE_LIMIT // (1 << 20) + 2)]
+            type, archive_id, _ = request(port, oversized + [(FRAME_COMMIT, 8)])
+            if type != FRAME_NACK or archive_id != 8:
+                raise SystemExit("archive with a failed write was not rejected (frame type %d)" % type)
+            if glob.glob(os.path.join(received, "large", "*")):
+                raise SystemExit("archive with a failed write left files behind")
+            if not accepting(port):
+                raise SystemExit("receiver stopped after a failed write")
+
+        print("ok: %d frames round-tripped through %d archive(s); rerun skipped; duplicate OPEN, existing archive "
+              "and failed write rejected" % (len(frames), len(archives)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())